@@ -23,12 +23,7 @@
 "str StringFromByte(int x) { return x:str(); }\n"
 "\n"
 "bool StringContains(str haystack, str needle) {\n"
-"\tfor int i = 0; i <= haystack:len() - needle:len(); i += 1 {\n"
-"\t\tbool match = true;\n"
-"\t\tfor int j = 0; j < needle:len(); j += 1 { if haystack[i + j] != needle[j] match = false; }\n"
-"\t\tif match { return true; }\n"
-"\t}\n"
-"\treturn false;\n"
+"\treturn needle == \"\" || StringFind(haystack, needle, 0, false) != -1;\n"
 "}\n"
 "\n"
 "str StringTrim(str string) {\n"
@@ -39,18 +34,13 @@
 "\treturn string:slice(start, end);\n"
 "}\n"
 "\n"
+"str[] StringSplit(str string, str delimiter, bool includeEmptyStrings) #extcall;\n"
+"str[] StringSplitLines(str string, bool includeEmptyStrings) #extcall;\n"
+"str[] StringSplitWhitespace(str string) #extcall;\n"
+"\n"
 "str[] StringSplitByCharacter(str string, str character, bool includeEmptyString) {\n"
 "\tassert character:len() == 1;\n"
-"\tstr[] list = new str[];\n"
-"\tint x = 0;\n"
-"\tfor int i = 0; i < string:len(); i += 1 {\n"
-"\t\tif string[i] == character {\n"
-"\t\t\tif (includeEmptyString || x != i) { list:add(string:slice(x, i)); }\n"
-"\t\t\tx = i + 1;\n"
-"\t\t}\n"
-"\t}\n"
-"\tif (includeEmptyString || x != string:len()) { list:add(string:slice(x, string:len())); }\n"
-"\treturn list;\n"
+"\treturn StringSplit(string, character, includeEmptyString);\n"
 "}\n"
 "\n"
 "tuple[str, str] StringSplitFirst(str s, str c) {\n"
@@ -68,12 +58,12 @@
 "}\n"
 "\n"
 "str StringJoin(str[] strings, str k, bool trailing) {\n"
-"\tstr c = \"\";\n"
+"\tstrbuilder c = new strbuilder;\n"
 "\tfor int i = 0; i < strings:len(); i += 1 {\n"
-"\t\tif i < strings:len() - 1 || trailing { c = c + strings[i] + k; }\n"
-"\t\telse { c = c + strings[i]; }\n"
+"\t\tc:append(strings[i]);\n"
+"\t\tif i < strings:len() - 1 || trailing { c:append(k); }\n"
 "\t}\n"
-"\treturn c;\n"
+"\treturn c:str();\n"
 "}\n"
 "\n"
 "bool StringEndsWith(str s, str x) { \n"
@@ -108,15 +98,7 @@
 "\t}\n"
 "}\n"
 "\n"
-"str StringToUpperRaw(str s) { \n"
-"\tstr t = \"\"; \n"
-"\n"
-"\tfor str c in s { \n"
-"\t\tt += CharacterToUpperRaw(c); \n"
-"\n"
-"\t} \n"
-"\treturn t; \n"
-"}\n"
+"str StringToUpperRaw(str s) #extcall;\n"
 "\n"
 "str CharacterToLowerRaw(str c) {\n"
 "\tint b = c:byte(0);\n"
@@ -129,15 +111,7 @@
 "\t}\n"
 "}\n"
 "\n"
-"str StringToLowerRaw(str s) { \n"
-"\tstr t = \"\"; \n"
-"\n"
-"\tfor str c in s { \n"
-"\t\tt += CharacterToLowerRaw(c); \n"
-"\t} \n"
-"\n"
-"\treturn t; \n"
-"}\n"
+"str StringToLowerRaw(str s) #extcall;\n"
 "\n"
 "str StringRemoveOptionalPrefix(str s, str prefix) { \n"
 "\tif StringStartsWith(s, prefix) { \n"
@@ -155,26 +129,7 @@
 "\t} \n"
 "}\n"
 "\n"
-"int StringFind(str haystack, str needle, int startAt, bool reverse) {\n"
-"\tassert needle:len() != 0;\n"
-"\tint index = startAt;\n"
-"\n"
-"\twhile index >= 0 && index < haystack:len() {\n"
-"\t\tif index + needle:len() <= haystack:len() {\n"
-"\t\t\tbool match = true;\n"
-"\n"
-"\t\t\tfor int j = 0; j < needle:len(); j += 1 { \n"
-"\t\t\t\tif haystack[index + j] != needle[j] match = false; \n"
-"\t\t\t}\n"
-"\n"
-"\t\t\tif match { return index; }\n"
-"\t\t}\n"
-"\n"
-"\t\tindex += -1 if reverse else 1;\n"
-"\t}\n"
-"\n"
-"\treturn -1;\n"
-"}\n"
+"int StringFind(str haystack, str needle, int startAt, bool reverse) #extcall;\n"
 "\n"
 "int StringFindFirst(str haystack, str needle) { return StringFind(haystack, needle, 0, false); }\n"
 "\n"
@@ -193,16 +148,17 @@
 "}\n"
 "\n"
 "tuple[str, int] StringReplaceAllWithCount(str haystack, str needle, str with) {\n"
-"\tstr result = \"\";\n"
+"\tstrbuilder result = new strbuilder;\n"
 "\tint position = 0;\n"
 "\tint count = 0;\n"
 "\twhile true {\n"
 "\t\tint index = StringFind(haystack, needle, position, false);\n"
 "\t\tif index == -1 {\n"
-"\t\t\tresult += haystack:slice(position, haystack:len());\n"
-"\t\t\treturn result, count;\n"
+"\t\t\tresult:append(haystack:slice(position, haystack:len()));\n"
+"\t\t\treturn result:str(), count;\n"
 "\t\t}\n"
-"\t\tresult += haystack:slice(position, index) + with;\n"
+"\t\tresult:append(haystack:slice(position, index));\n"
+"\t\tresult:append(with);\n"
 "\t\tposition = index + needle:len();\n"
 "\t\tcount += 1;\n"
 "\t}\n"
@@ -213,83 +169,33 @@
 "\treturn result;\n"
 "}\n"
 "\n"
-"str StringRepeat(str s, int n) { assert n >= 0; str t = \"\"; for int i = 0; i < n; i += 1 { t += s; } return t; }\n"
-"\n"
-"err[float] StringParseFloat(str s) {\n"
-"\t// TODO Overflow checking.\n"
-"\n"
-"\tbool first = true;\n"
-"\tbool negate = false;\n"
-"\tbool dot = false;\n"
-"\tfloat f = 0.0;\n"
-"\tfloat m = 0.1;\n"
-"\n"
-"\tfor str c in s {\n"
-"\t\tif c == \"-\" {\n"
-"\t\t\tif first {\n"
-"\t\t\t\tnegate = true;\n"
-"\t\t\t} else {\n"
-"\t\t\t\treturn new err[float] \"INVALID_FORMAT\";\n"
-"\t\t\t}\n"
-"\t\t} else if c == \".\" {\n"
-"\t\t\tif dot {\n"
-"\t\t\t\treturn new err[float] \"INVALID_FORMAT\";\n"
-"\t\t\t} else {\n"
-"\t\t\t\tdot = true;\n"
-"\t\t\t}\n"
-"\t\t} else if c == \"_\" {\n"
-"\t\t} else if dot {\n"
-"\t\t\tif CharacterIsDigit(c) {\n"
-"\t\t\t\tf += (c:byte(0) - \"0\":byte(0)):float() * m;\n"
-"\t\t\t\tm *= 0.1;\n"
-"\t\t\t} else {\n"
-"\t\t\t\treturn new err[float] \"INVALID_FORMAT\";\n"
-"\t\t\t}\n"
-"\t\t} else {\n"
-"\t\t\tif CharacterIsDigit(c) {\n"
-"\t\t\t\tf *= 10.0;\n"
-"\t\t\t\tf += (c:byte(0) - \"0\":byte(0)):float();\n"
-"\t\t\t} else {\n"
-"\t\t\t\treturn new err[float] \"INVALID_FORMAT\";\n"
-"\t\t\t}\n"
-"\t\t}\n"
-"\n"
-"\t\tfirst = false;\n"
-"\t}\n"
-"\n"
-"\treturn -f if negate else f;\n"
+"str StringRepeat(str s, int n) {\n"
+"\tassert n >= 0;\n"
+"\tstrbuilder t = new strbuilder;\n"
+"\tt:reserve(s:len() * n);\n"
+"\tfor int i = 0; i < n; i += 1 { t:append(s); }\n"
+"\treturn t:str();\n"
 "}\n"
 "\n"
-"err[int] StringParseInteger(str s) {\n"
-"\t// TODO Overflow checking.\n"
-"\t// TODO Hexadecimal and binary strings.\n"
+"err[float] StringParseFloat(str s) #extcall;\n"
+"err[int] StringParseInteger(str s) #extcall;\n"
 "\n"
-"\tbool negate = false;\n"
-"\tbool first = true;\n"
-"\tint i = 0;\n"
-"\n"
-"\tfor str c in s {\n"
-"\t\tif c == \"-\" {\n"
-"\t\t\tif first {\n"
-"\t\t\t\tnegate = true;\n"
-"\t\t\t} else {\n"
-"\t\t\t\treturn new err[int] \"INVALID_FORMAT\";\n"
-"\t\t\t}\n"
-"\t\t} else if c == \"_\" {\n"
-"\t\t} else {\n"
-"\t\t\tif CharacterIsDigit(c) {\n"
-"\t\t\t\ti *= 10;\n"
-"\t\t\t\ti += c:byte(0) - \"0\":byte(0);\n"
-"\t\t\t} else {\n"
-"\t\t\t\treturn new err[int] \"INVALID_FORMAT\";\n"
-"\t\t\t}\n"
-"\t\t}\n"
+"int _StringHashInternal(str s, int algorithm) #extcall;\n"
+"int StringHashCRC32(str s) { return _StringHashInternal(s, 0); }\n"
+"int StringHashCRC64(str s) { return _StringHashInternal(s, 1); }\n"
+"int StringHashFNV1a(str s) { return _StringHashInternal(s, 2); }\n"
+"int StringHashXXHash64(str s) { return _StringHashInternal(s, 3); }\n"
 "\n"
-"\t\tfirst = false;\n"
-"\t}\n"
+"// Regular expressions:\n"
 "\n"
-"\treturn -i if negate else i;\n"
-"}\n"
+"handletype Regex;\n"
+"err[Regex] RegexCompile(str pattern) #extcall;\n"
+"bool RegexMatches(Regex regex, str s) #extcall;\n"
+"str[] RegexFind(Regex regex, str s) #extcall; // The whole match followed by each group, or an empty list if there is no match.\n"
+"int[] RegexFindPositions(Regex regex, str s, int startAt) #extcall; // The start and end of the whole match and of each group.\n"
+"str[] RegexFindAll(Regex regex, str s) #extcall;\n"
+"str[] RegexSplit(Regex regex, str s) #extcall;\n"
+"str RegexReplaceAll(Regex regex, str s, str replacement) #extcall;\n"
 "\n"
 "// Miscellaneous:\n"
 "\n"
@@ -297,9 +203,36 @@
 "bool SystemRunningAsAdministrator() #extcall;\n"
 "str SystemGetHostName() #extcall;\n"
 "void SystemSleepMs(int ms) #extcall;\n"
+"int SystemGetMicroseconds() #extcall;\n"
 "void SystemExit(int exitCode) #extcall;\n"
 "int RandomInt(int min, int max) #extcall;\n"
 "\n"
+"struct HeapStatistics {\n"
+"\tint collections;\n"
+"\tint growthEvents;\n"
+"\tint pauseTotalMicroseconds;\n"
+"\tint pauseMaximumMicroseconds;\n"
+"\tint slotsAllocated;\n"
+"\tint slotsUnused;\n"
+"\tint slotsStr;\n"
+"\tint slotsConcat;\n"
+"\tint slotsStruct;\n"
+"\tint slotsList;\n"
+"\tint slotsMap;\n"
+"\tint slotsFunction;\n"
+"\tint slotsErr;\n"
+"\tint slotsAnyType;\n"
+"\tint slotsHandle;\n"
+"\tint bytesStr;\n"
+"\tint bytesStruct;\n"
+"\tint bytesList;\n"
+"\tint bytesMap;\n"
+"\tint bytesExternal;\n"
+"\tint bytesLive;\n"
+"};\n"
+"\n"
+"HeapStatistics SystemGetHeapStatistics() #extcall;\n"
+"\n"
 "str UUIDGenerate() {\n"
 "\tstr hexChars = \"0123456789abcdef\";\n"
 "\tstr result;\n"
@@ -334,6 +267,11 @@
 "err[int] FileGetSize(str path) #extcall;\n"
 "err[int] FileGetLastModificationTimeStamp(str path) #extcall;\n"
 "err[void] FileTouch(str path) { return FileAppend(path, \"\"); }\n"
+"err[int] _FileHashInternal(str path, int algorithm) #extcall;\n"
+"err[int] FileHashCRC32(str path) { return _FileHashInternal(path, 0); }\n"
+"err[int] FileHashCRC64(str path) { return _FileHashInternal(path, 1); }\n"
+"err[int] FileHashFNV1a(str path) { return _FileHashInternal(path, 2); }\n"
+"err[int] FileHashXXHash64(str path) { return _FileHashInternal(path, 3); }\n"
 "\t\t\t\t      \n"
 "err[void] _DirectoryInternalStartIteration(str path) #extcall;\n"
 "str _DirectoryInternalNextIteration() #extcall;\n"
@@ -639,13 +577,7 @@
 "\t       4 if (c & 0xF8) == 0xF0 else 0;\n"
 "}\n"
 "\n"
-"int StringUTF8Advance(str x, int i) {\n"
-"\tif i == -1 { return -1; }\n"
-"\tint c0 = x:byte(i);\n"
-"\tint length = _StringUTF8CodepointLength(c0);\n"
-"\tif length == 0 || i + length > x:len() { return -1; }\n"
-"\treturn i + length;\n"
-"}\n"
+"int StringUTF8Advance(str x, int i) #extcall;\n"
 "\n"
 "int StringUTF8Retreat(str x, int i) {\n"
 "\tif i == -1 { return -1; }\n"
@@ -659,34 +591,11 @@
 "\treturn -1;\n"
 "}\n"
 "\n"
-"int StringUTF8Count(str x) {\n"
-"\tint i = 0;\n"
-"\tint count = 0;\n"
-"\t\n"
-"\twhile i != -1 && i != x:len() { \n"
-"\t\ti = StringUTF8Advance(x, i); \n"
-"\t\tcount += 1; \n"
-"\t}\n"
-"\treturn count if i != -1 else -1;\n"
-"}\n"
-"\n"
-"int StringUTF8Decode(str x, int i) {\n"
-"\tif i == -1 { return 0xFFFD; }\n"
-"\tint c0 = x:byte(i);\n"
-"\tint length = _StringUTF8CodepointLength(c0);\n"
-"\tif length == 0 || i + length > x:len() { return 0xFFFD; }\n"
-"\tif length == 1 { return c0; }\n"
-"\tint c1 = x:byte(i + 1);\n"
-"\tif (c1 & 0xC0) != 0x80 { return 0xFFFD; }\n"
-"\tif length == 2 { return ((c0 & 0x1F) << 6) | (c1 & 0x3F); }\n"
-"\tint c2 = x:byte(i + 2);\n"
-"\tif (c2 & 0xC0) != 0x80 { return 0xFFFD; }\n"
-"\tif length == 3 { return ((c0 & 0x0F) << 12) | ((c1 & 0x3F) << 6) | (c2 & 0x3F); }\n"
-"\tint c3 = x:byte(i + 3);\n"
-"\tif (c3 & 0xC0) != 0x80 { return 0xFFFD; }\n"
-"\tif length == 4 { return ((c0 & 0x07) << 18) | ((c1 & 0x3F) << 12) | ((c2 & 0x3F) << 6) | (c3 & 0x3F); }\n"
-"\tassert false;\n"
-"}\n"
+"int StringUTF8Count(str x) #extcall;\n"
+"bool StringUTF8IsValid(str x) #extcall;\n"
+"str StringUTF8MakeValid(str x) #extcall;\n"
+"\n"
+"int StringUTF8Decode(str x, int i) #extcall;\n"
 "\n"
 "str StringUTF8Encode(int value) {\n"
 "\tif value < 0x80 {\n"
@@ -32,8 +32,8 @@ typedef struct Animation {
 } Animation;
 
 void CloseBitmapHandle(struct ExecutionContext *context, void *handleData) {
-	(void) context;
 	Bitmap *bitmap = (Bitmap *) handleData;
+	ScriptReportExternalMemory(context, -4 * (int64_t) bitmap->width * bitmap->height);
 	free(bitmap->bits);
 	free(bitmap);
 }
@@ -56,6 +56,7 @@ LIBRARY_EXPORT bool ScriptExtCreate(struct ExecutionContext *context) {
 	bitmap->width = width;
 	bitmap->height = height;
 	bitmap->bits = (uint32_t *) calloc(1, 4 * width * height);
+	ScriptReportExternalMemory(context, 4 * width * height);
 	if (!ScriptReturnHandle(context, bitmap, CloseBitmapHandle)) return false;
 	return true;
 }
@@ -115,6 +116,7 @@ LIBRARY_EXPORT bool ScriptExtCrop(struct ExecutionContext *context) {
 	}
 
 	free(bitmap->bits);
+	ScriptReportExternalMemory(context, 4 * ((int64_t) copy.width * copy.height - (int64_t) bitmap->width * bitmap->height));
 	*bitmap = copy;
 
 	return true;
@@ -162,6 +164,7 @@ LIBRARY_EXPORT bool ScriptExtLoad(struct ExecutionContext *context) {
 		bitmap->width = width;
 		bitmap->height = height;
 		bitmap->bits = (uint32_t *) data;
+		ScriptReportExternalMemory(context, 4 * (int64_t) width * height);
 		if (!ScriptReturnHandle(context, bitmap, CloseBitmapHandle)) return false;
 		if (!ScriptReturnBoxInError(context)) return false;
 	} else {
@@ -25,6 +25,7 @@ typedef struct ScriptNativeInterface {
 	bool (*ParameterString)(struct ExecutionContext *context, const void **output, size_t *outputBytes);
 	bool (*ParameterUint32)(struct ExecutionContext *context, uint32_t *output);
 	bool (*ParameterUint64)(struct ExecutionContext *context, uint64_t *output);
+	void (*ReportExternalMemory)(struct ExecutionContext *context, int64_t bytes);
 	bool (*ReturnBoxInError)(struct ExecutionContext *context);
 	bool (*ReturnDouble)(struct ExecutionContext *context, double input);
 	bool (*ReturnError)(struct ExecutionContext *context, const char *message);
@@ -74,6 +75,7 @@ extern const ScriptNativeInterface _scriptNativeInterface;
 #define ScriptParameterString(...)    (scriptNativeInterface->ParameterString   (__VA_ARGS__))
 #define ScriptParameterUint32(...)    (scriptNativeInterface->ParameterUint32   (__VA_ARGS__))
 #define ScriptParameterUint64(...)    (scriptNativeInterface->ParameterUint64   (__VA_ARGS__))
+#define ScriptReportExternalMemory(...) (scriptNativeInterface->ReportExternalMemory(__VA_ARGS__))
 #define ScriptReturnBoxInError(...)   (scriptNativeInterface->ReturnBoxInError  (__VA_ARGS__))
 #define ScriptReturnDouble(...)       (scriptNativeInterface->ReturnDouble      (__VA_ARGS__))
 #define ScriptReturnError(...)        (scriptNativeInterface->ReturnError       (__VA_ARGS__))
@@ -1,6 +1,4 @@
 // TODO New language features:
-// 	- Maps: T_FOR_EACH support. :prior_key, :next_key, :first_key, :last_key. 
-// 	- Lists: :sort, :clone, :clone_all, :insert_from
 // 	- Named optional arguments with default values.
 // 	- Multiline string literals.
 // 	- Exponent notation in numeric literals.
@@ -11,7 +9,6 @@
 // 	- Debugging.
 
 // TODO Scripting engine features:
-// 	- Storage hints for lists/maps. E.g. setting a list to doubly-linked-list mode, or a map to unordered mode.
 // 	- Implement logging for ACTION_EXECUTE: SystemShellExecute, SystemShellExecuteWithWorkingDirectory, SystemShellEvaluate.
 // 	- Saving and showing the stack trace of where T_ERR values were created in assertion failure messages.
 // 	- Win32: use the Unicode APIs for file system access. 
@@ -28,10 +25,8 @@
 // 		- MathNorm, MathArcTan2
 // 		- MathIsInfinite, MathIsNaN
 // 	- Strings:
-// 		- StringHashCRC32, StringHashCRC64, StringHashFNV1a
 // 		- StringCompareRaw, StringCompareLocale, StringToLowerLocale, StringToUpperLocale
 // 		- StringNormalizeUnicode, StringBase64Encode, StringBase64Decode, StringEscapeEncode, StringEscapeDecode
-// 		- StringUTF8IsValid, StringUTF8MakeValid (replace bad segments with replacement characters)
 // 	- Process management.
 // 	- Time and date.
 // 	- Data compression.
@@ -40,7 +35,6 @@
 // 	- Audio.
 
 // TODO Improvement of the scripting engine internals:
-// 	- Faster maps.
 // 	- Cleanup the code in External- functions and ScriptExecuteFunction using macros for common stack and heap operations.
 // 	- Cleanup the ImportData/ExecutionContext/FunctionBuilder structures and their relationships.
 // 	- Cleanup the variables/stack arrays.
@@ -61,6 +55,18 @@
 #include "modules/native_interface.h"
 
 #define FUNCTION_MAX_ARGUMENTS (20) // Also the maximum number of return values in a tuple.
+#define HEAP_COLLECTION_MINIMUM_BYTES (16 * 1024 * 1024) // Bytes allocated before a collection is started, when little is in use.
+#define STRING_SLICE_COPY_BYTES (16) // Slices shorter than this are copied rather than sharing their parent's text.
+#define STRING_SLICE_PIN_RATIO (4) // Slices are materialized if the parent is this many times larger than all of its live slices.
+#define CONCAT_COPY_BYTES (32) // Concatenations shorter than this are copied rather than building a rope.
+#define CONCAT_MAXIMUM_DEPTH (32) // See HeapEntryConcatDepth.
+#define FORMAT_MAX_ARGUMENTS (8) // Longer string interpolations are split into several T_FORMAT instructions, so that they need little stack space.
+#define MAP_TREE_THRESHOLD (64) // Maps with more entries than this switch from a sorted array to a B+tree, as if hinted with :hint_ordered().
+#define MAP_HASH_DELETED (UINT64_MAX) // The keyHash of a deleted entry in a hash map; see MapHashDelete.
+#define MAP_HASH_EXTRA (2) // The number of uint32_t after the slots in mapIndex; see MapHashExtra.
+#define MAP_NODE_CAPACITY (32) // Entries in a B+tree leaf, or children of a branch. Ordered maps with more entries than this become trees.
+#define MAP_NODE_MINIMUM (MAP_NODE_CAPACITY / 4) // Nodes other than the root are merged with a sibling when they have fewer than this.
+#define MAP_TREE_MAXIMUM_DEPTH (16) // Enough for 2^32 entries, given MAP_NODE_MINIMUM.
 
 #define EXTCALL_NO_RETURN            (1)
 #define EXTCALL_RETURN_UNMANAGED     (2)
@@ -91,6 +97,16 @@
 #define FAILURE_ASK       (1)
 #define FAILURE_STOP      (2)
 
+// How the items of a list or map are stored (HeapEntry::storage):
+#define STORAGE_DEFAULT  (0) // Lists are arrays of Values. Maps are sorted arrays, until they have more than MAP_TREE_THRESHOLD entries.
+#define STORAGE_MAP_HASH (1) // Maps are hash tables; see MapHashFind.
+#define STORAGE_MAP_ORDERED (2) // Maps are sorted arrays, until they have more than MAP_NODE_CAPACITY entries; then they are B+trees.
+#define STORAGE_LIST_BITS (3) // Lists of bools are bitsets, in 64-bit words.
+#define STORAGE_LIST_INT8 (4) // Lists of ints are arrays of int8_t, int16_t or int32_t. They are widened when an item does not fit.
+#define STORAGE_LIST_INT16 (5)
+#define STORAGE_LIST_INT32 (6)
+#define STORAGE_LIST_RING (7) // Lists are ring buffers of Values, starting at listHead, so that items can be added and removed at either end quickly.
+
 #define T_ERROR               (0)
 #define T_EOF                 (1)
 #define T_IDENTIFIER          (2)
@@ -177,13 +193,11 @@
 #define T_POP                 (102)
 #define T_BRANCH              (103)
 #define T_CONCAT              (104)
-#define T_INTERPOLATE_STR     (105)
-#define T_INTERPOLATE_BOOL    (106)
-#define T_INTERPOLATE_INT     (107)
-#define T_INTERPOLATE_FLOAT   (108)
+#define T_FORMAT              (105)
+#define T_MAP_APPEND          (106)
+#define T_MAP_BUILD           (107)
 #define T_DUP                 (109)
 #define T_SWAP                (110)
-#define T_INTERPOLATE_ILIST   (111)
 #define T_ROT3                (112)
 #define T_LIBCALL             (113)
 #define T_END_CALLBACK        (114)
@@ -246,6 +260,21 @@
 #define T_OP_BYTE             (172)
 #define T_OP_SLICE            (173)
 #define T_OP_STR              (174)
+#define T_OP_CLOSE            (175)
+#define T_OP_APPEND_STR       (176)
+#define T_OP_APPEND_INT       (177)
+#define T_OP_APPEND_FLOAT     (178)
+#define T_OP_RESERVE          (179)
+#define T_OP_BUILDER_STR      (180)
+#define T_OP_HINT_UNORDERED   (181)
+#define T_OP_HINT_ORDERED     (182)
+#define T_OP_FIRST_KEY        (183)
+#define T_OP_LAST_KEY         (184)
+#define T_OP_NEXT_KEY         (185)
+#define T_OP_PRIOR_KEY        (186)
+#define T_OP_LOWER_BOUND      (187)
+#define T_MAP_ITERATE         (188)
+#define T_MAP_ITERATE_NEXT    (189)
 
 // Keywords.
 #define T_IF                  (190)
@@ -282,6 +311,37 @@
 #define T_LIBRARY             (221)
 #define T_BREAK               (222)
 #define T_CONTINUE            (223)
+#define T_STRBUILDER          (224)
+
+// More :ops.
+#define T_OP_MERGE            (225)
+#define T_OP_KEYS             (226)
+#define T_OP_VALUES           (227)
+#define T_OP_SORT_INT         (228)
+#define T_OP_SORT_FLOAT       (229)
+#define T_OP_SORT_STR         (230)
+#define T_OP_SORT_CALLBACK    (231)
+#define T_OP_SORT_UNSTABLE_CALLBACK (232)
+#define T_OP_CLONE            (233)
+#define T_OP_CLONE_ALL        (234)
+#define T_OP_INSERT_FROM      (235)
+#define T_OP_LIST_SLICE       (236)
+#define T_OP_REVERSE          (237)
+#define T_OP_HINT_PACKED_BITS (238)
+#define T_OP_HINT_PACKED_INTS (239)
+#define T_OP_HINT_DEQUE       (240)
+#define T_OP_FIND_LAST        (241)
+#define T_OP_FIND_LAST_STR    (242)
+#define T_OP_CONTAINS         (243)
+#define T_OP_CONTAINS_STR     (244)
+#define T_OP_COUNT            (245)
+#define T_OP_COUNT_STR        (246)
+#define T_OP_SUM_INT          (247)
+#define T_OP_SUM_FLOAT        (248)
+#define T_OP_MIN_INT          (249)
+#define T_OP_MIN_FLOAT        (250)
+#define T_OP_MAX_INT          (251)
+#define T_OP_MAX_FLOAT        (252)
 
 #define STACK_READ_STRING(textVariable, bytesVariable, stackIndex) \
 	if (context->c->stackPointer < stackIndex) return -1; \
@@ -289,7 +349,8 @@
 	uint64_t _index ## stackIndex = context->c->stack[context->c->stackPointer - stackIndex].i; \
 	if (context->heapEntriesAllocated <= _index ## stackIndex) return -1; \
 	HeapEntry *_entry ## stackIndex = &context->heap[_index ## stackIndex]; \
-	if (_entry ## stackIndex->type != T_EOF && _entry ## stackIndex->type != T_STR && _entry ## stackIndex->type != T_CONCAT) return -1; \
+	if (_entry ## stackIndex->type != T_EOF && _entry ## stackIndex->type != T_STR \
+			&& _entry ## stackIndex->type != T_CONCAT && _entry ## stackIndex->type != T_OP_SLICE) return -1; \
 	const char *textVariable; \
 	size_t bytesVariable; \
 	ScriptHeapEntryToString(context, _entry ## stackIndex, &textVariable, &bytesVariable);
@@ -382,6 +443,7 @@ typedef struct FunctionBuilder {
 	bool isPersistentVariable;
 	uintptr_t globalVariableOffset;
 	struct ImportData *importData; // Only valid during script loading.
+	struct ExecutionContext *context;
 	Node *replResultType;
 } FunctionBuilder;
 
@@ -394,18 +456,70 @@ typedef struct BackTraceItem {
 
 typedef struct MapEntry {
 	Value key, value;
+
+	union {
+		uint64_t keyPrefix; // STORAGE_DEFAULT, STORAGE_MAP_ORDERED, T_MAP_STR only; see StringKeyPrefix.
+		uint64_t keyHash; // STORAGE_MAP_HASH; see MapKeyHash.
+	};
 } MapEntry;
 
+typedef struct MapSeparator {
+	Value key; // The least key in the child at the time the separator was made. It is kept alive by the garbage collector.
+	uint64_t keyPrefix;
+} MapSeparator;
+
+typedef struct MapNode {
+	uint32_t count; // The number of entries in a leaf, or children in a branch.
+	bool isLeaf;
+
+	union {
+		struct {
+			struct MapNode *previous, *next;
+			MapEntry entries[MAP_NODE_CAPACITY]; // Sorted by key.
+		};
+
+		struct {
+			struct MapNode *children[MAP_NODE_CAPACITY];
+			MapSeparator separators[MAP_NODE_CAPACITY]; // The keys in children[i] are >= separators[i]. The first is unused.
+		};
+	};
+} MapNode;
+
+typedef struct MapTreePath {
+	MapNode *branches[MAP_TREE_MAXIMUM_DEPTH]; // From the root down.
+	uint8_t children[MAP_TREE_MAXIMUM_DEPTH]; // The index of the child taken in each branch.
+	uintptr_t depth;
+	MapNode *leaf;
+	uintptr_t index;
+	bool fromCache; // The leaf was found from mapCacheLeaf, so no branches were recorded.
+} MapTreePath;
+
 typedef struct HeapEntry {
 	uint8_t type;
 	bool gcMark;
 	bool internalValuesAreManaged;
+
+	union {
+		bool isImmortal; // T_STR: Interned string literals; never collected, and the text is not owned by the entry.
+
+		struct { // T_LIST, T_MAP_INT, T_MAP_STR
+			uint8_t storage : 4; // How the items are stored; a STORAGE_ constant.
+			uint8_t shared : 1; // The storage might also be used by other entries, so it must be copied before it is modified; see HeapStorageShare.
+		};
+	};
+
 	uint32_t externalReferenceCount;
 
 	union {
 		struct { // T_STR
 			size_t bytes;
 			char *text;
+			uint64_t textHash; // Computed when first needed by HeapEntryStringHash; 0 until then.
+		};
+
+		struct { // T_STRBUILDER
+			uint32_t builderBytes, builderAllocated;
+			char *builderText;
 		};
 
 		struct { // T_STRUCT
@@ -415,13 +529,22 @@ typedef struct HeapEntry {
 
 		struct { // T_LIST
 			uint32_t length, allocated;
-			Value *list;
+			Value *list; // If the list is packed, then this is not an array of Values; see ListGet.
+			uint32_t listHead; // STORAGE_LIST_RING: the index in list of the first item.
 		};
 
 		struct { // T_MAP_INT, T_MAP_STR
-			uint32_t mapLength;
-			// TODO Cache the index of the most recently accessed entry?
-			MapEntry *mapEntries;
+			uint32_t mapLength, mapAllocated;
+
+			union {
+				MapEntry *mapEntries; // STORAGE_DEFAULT, STORAGE_MAP_ORDERED: sorted by key. STORAGE_MAP_HASH: in no particular order.
+				MapNode *mapCacheLeaf; // STORAGE_MAP_ORDERED with a tree: the most recently accessed leaf, or NULL.
+			};
+
+			union {
+				uint32_t *mapIndex; // STORAGE_MAP_HASH: 2 * mapAllocated slots, each 0 if empty or 1 + the index of an entry; then MAP_HASH_EXTRA.
+				MapNode *mapTree; // STORAGE_MAP_ORDERED: if set, the entries are in the tree rather than mapEntries, and mapAllocated counts its nodes.
+			};
 		};
 
 		struct { // Unused entry.
@@ -435,7 +558,12 @@ typedef struct HeapEntry {
 
 		struct { // T_CONCAT
 			uint32_t concat1, concat2;
-			size_t concatBytes;
+			uint32_t concatBytes, concatDepth; // Longer strings are copied instead. See HeapEntryConcatDepth.
+		};
+
+		struct { // T_OP_SLICE
+			uint32_t sliceParent, sliceBytes; // The parent is always a T_STR.
+			size_t sliceOffset;
 		};
 
 		struct { // T_ERR
@@ -492,6 +620,19 @@ typedef struct CoroutineState {
 	int returnValueType;
 } CoroutineState;
 
+typedef struct HeapStatistics {
+	// Keep in sync with the HeapStatistics struct in the base module.
+	int64_t collections;
+	int64_t growthEvents;
+	int64_t pauseTotalMicroseconds;
+	int64_t pauseMaximumMicroseconds;
+	int64_t slotsAllocated;
+	int64_t slotsUnused;
+	int64_t slotsStr, slotsConcat, slotsStruct, slotsList, slotsMap, slotsFunction, slotsErr, slotsAnyType, slotsHandle;
+	int64_t bytesStr, bytesStruct, bytesList, bytesMap, bytesExternal;
+	int64_t bytesLive;
+} HeapStatistics;
+
 typedef struct ExecutionContext {
 	Value *globalVariables;
 	bool *globalVariableIsManaged;
@@ -501,6 +642,24 @@ typedef struct ExecutionContext {
 	uintptr_t heapFirstUnusedEntry;
 	size_t heapEntriesAllocated;
 
+	uintptr_t *internedLiterals; // Open addressing hash table of heap indices; 0 is an empty slot.
+	size_t internedLiteralsAllocated;
+	size_t internedLiteralCount;
+
+	uintptr_t *sharedStorage; // Open addressing hash table of pairs: the address of storage shared by lists or maps, then how many use it; 0 is an empty slot.
+	size_t sharedStorageAllocated; // In pairs.
+	size_t sharedStorageCount;
+
+	uint64_t heapCollectionCount;
+	uint64_t heapGrowthCount;
+	uint64_t heapPauseTotalMicroseconds;
+	uint64_t heapPauseMaximumMicroseconds;
+
+	uint64_t heapLiveBytes; // Heap slots, payloads and external memory in use after the last collection.
+	uint64_t heapExternalBytes; // Memory owned by handles, as reported by native modules.
+	uint64_t heapAllocatedBytesAtCollection; // The value of allocatedBytes at the end of the last collection.
+	uint64_t heapCollectionThresholdBytes; // Start a collection once this many bytes have been allocated since the last.
+
 	FunctionBuilder *functionData; // Cleanup the relations between ExecutionContext, FunctionBuilder, Tokenizer and ImportData.
 	Node *rootNode; // Only valid during script loading.
 	char *scriptPersistFile;
@@ -513,6 +672,26 @@ typedef struct ExecutionContext {
 	uint32_t externalCoroutineCount;
 } ExecutionContext;
 
+typedef struct ListSort {
+	ExecutionContext *context;
+	uintptr_t instructionPointer; // For error messages.
+	int64_t comparator; // The function pointer, for T_OP_SORT_CALLBACK and T_OP_SORT_UNSTABLE_CALLBACK.
+	bool itemsAreManaged;
+	int result; // 1, until a call to the comparator fails; then the result of ScriptExecuteFunction, and the sort stops.
+} ListSort;
+
+typedef struct ListSortString {
+	uint64_t prefix; // From StringKeyPrefix.
+	const char *text;
+	size_t bytes;
+	Value value;
+} ListSortString;
+
+typedef struct HeapCloneTable {
+	uint64_t *slots; // Pairs of heap indices, the original then its clone, by open addressing on the original. 0 if empty.
+	uintptr_t capacity, count;
+} HeapCloneTable;
+
 typedef struct ExternalFunction {
 	const char *cName;
 	int (*callback)(ExecutionContext *context, Value *returnValue);
@@ -540,6 +719,8 @@ Node globalExpressionTypeBool = { .type = T_BOOL };
 Node globalExpressionTypeStr = { .type = T_STR };
 Node globalExpressionTypeIntList = { .type = T_LIST, .firstChild = &globalExpressionTypeInt };
 Node globalExpressionTypeErrVoid = { .type = T_ERR, .firstChild = &globalExpressionTypeVoid };
+Node globalExpressionTypeErrInt = { .type = T_ERR, .firstChild = &globalExpressionTypeInt };
+Node globalExpressionTypeErrStr = { .type = T_ERR, .firstChild = &globalExpressionTypeStr };
 
 // Global variables:
 const char *startFunction = "Start";
@@ -555,6 +736,9 @@ bool outputOverview;
 struct RNGState { uint64_t s[4]; } rngState;
 int actionBefore[ACTION_COUNT], actionFailure[ACTION_COUNT];
 bool wantCompletionConfirmation;
+bool gcStats;
+uint64_t heapLimitBytes; // 0 if there is no limit.
+uint64_t allocatedBytes; // Total number of bytes requested from AllocateResize. Used to pace the garbage collector.
 const char *engineDirectory;
 
 // Forward declarations:
@@ -563,8 +747,24 @@ Node *ParseExpression(Tokenizer *tokenizer, bool allowAssignment, uint8_t preced
 void ScriptPrintNode(Node *node, int indent);
 bool ScriptLoad(Tokenizer tokenizer, ExecutionContext *context, ImportData *importData, bool replMode);
 void ScriptFreeCoroutine(CoroutineState *c);
+int ScriptExecuteFunction(uintptr_t instructionPointer, ExecutionContext *context);
+size_t ListStorageBytes(uint8_t storage, uintptr_t count);
+Value ListGet(HeapEntry *entry, uintptr_t i);
+uint8_t ListUnpack(HeapEntry *entry);
 uintptr_t HeapAllocate(ExecutionContext *context);
+void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index);
+uintptr_t HeapInternLiteral(ExecutionContext *context, const char *text, size_t bytes);
+void HeapPrintStatistics(ExecutionContext *context);
 int StringCompareRaw(const char *s1, size_t length1, const char *s2, size_t length2);
+intptr_t StringFindRaw(const char *haystack, size_t haystackBytes, const char *needle, size_t needleBytes, uintptr_t startAt, bool reverse);
+uintptr_t HeapCreateSlice(ExecutionContext *context, uintptr_t index, size_t start, size_t end);
+size_t PrintIntegerToBuffer(char *buffer, size_t bufferBytes, int64_t i);
+size_t PrintFloatToBuffer(char *buffer, size_t bufferBytes, double f);
+const char *StringParseFloatRaw(const char *text, size_t bytes, double *output);
+uint64_t StringHash(const char *text, size_t bytes);
+void MapFreeStorage(HeapEntry *map);
+uint32_t *MapHashExtra(HeapEntry *map);
+bool HeapStorageRelease(ExecutionContext *context, HeapEntry *entry);
 int ExternalOpStringSlice(ExecutionContext *context, Value *returnValue);
 int ExternalOpCharacterToByte(ExecutionContext *context, Value *returnValue);
 int ExternalOpStringFromByte(ExecutionContext *context, Value *returnValue);
@@ -579,11 +779,13 @@ int ExternalOpStringFromByte(ExecutionContext *context, Value *returnValue);
 void *AllocateFixed(size_t bytes);
 void *AllocateResize(void *old, size_t bytes);
 int MemoryCompare(const void *a, const void *b, size_t bytes);
+const void *MemoryFindByte(const void *a, uint8_t byte, size_t bytes);
 int StringCompare(const char *a, const char *b);
 size_t StringLength(const char *a);
 void MemoryCopy(void *a, const void *b, size_t bytes);
-size_t PrintIntegerToBuffer(char *buffer, size_t bufferBytes, int64_t i); // TODO This shouldn't be in the platform layer.
-size_t PrintFloatToBuffer(char *buffer, size_t bufferBytes, double f); // TODO This shouldn't be in the platform layer.
+void MemoryMove(void *a, const void *b, size_t bytes);
+size_t PrintFloatToBufferWithPrecision(char *buffer, size_t bufferBytes, double f, int significantDigits);
+double StringToDouble(const char *text);
 void PrintDebug(const char *format, ...);
 void PrintOutput(const char *format, ...);
 void PrintOutputType(Node *node);
@@ -603,6 +805,15 @@ const char *PathToPrettyName(const char *path);
 const char *PathToBaseDirectory(const char *path);
 const char *PathScriptEngine();
 bool IsColoredOutputEnabled();
+uint64_t TimeGetMicroseconds();
+size_t CRCFoldWithCarrylessMultiply(const void *data, size_t bytes, uint64_t crc, const uint64_t *constants, uint8_t *remainder);
+bool UTF8ValidateBlocks(const void *text, size_t bytes, size_t *checkedBytes);
+uintptr_t ListSkipIntBlocks(const Value *items, uintptr_t count, int64_t x, bool last);
+uintptr_t ListCountIntBlocks(const Value *items, uintptr_t count, int64_t x, uintptr_t *checked);
+uint64_t ListSumIntBlocks(const Value *items, uintptr_t count, uintptr_t *checked);
+void ListSumFloatBlocks(const Value *items, uintptr_t count, double *lanes, uintptr_t *checked);
+int64_t ListMinMaxIntBlocks(const Value *items, uintptr_t count, bool max, int64_t result, uintptr_t *checked);
+double ListMinMaxFloatBlocks(const Value *items, uintptr_t count, bool max, double result, uintptr_t *checked);
 
 // --------------------------------- Base module.
 
@@ -622,7 +833,13 @@ char baseModuleSource[] = {
 	REGISTER(PathGetDefaultPrefix) REGISTER(PathSetDefaultPrefixToScriptSourceDirectory) REGISTER(PathToAbsolute) \
 	REGISTER(FileReadAll) REGISTER(FileWriteAll) REGISTER(FileAppend) REGISTER(FileCopy) REGISTER(FileGetSize) REGISTER(FileGetLastModificationTimeStamp) \
 	REGISTER(PersistRead) REGISTER(PersistWrite) \
-	REGISTER(RandomInt) \
+	REGISTER(RandomInt) REGISTER(StringFind) REGISTER(SystemGetMicroseconds) \
+	REGISTER(StringSplit) REGISTER(StringSplitLines) REGISTER(StringSplitWhitespace) \
+	REGISTER(StringParseInteger) REGISTER(StringParseFloat) REGISTER(_StringHashInternal) REGISTER(_FileHashInternal) \
+	REGISTER(StringUTF8Count) REGISTER(StringUTF8Advance) REGISTER(StringUTF8Decode) REGISTER(StringUTF8IsValid) REGISTER(StringUTF8MakeValid) \
+	REGISTER(StringToUpperRaw) REGISTER(StringToLowerRaw) \
+	REGISTER(RegexCompile) REGISTER(RegexMatches) REGISTER(RegexFind) REGISTER(RegexFindPositions) REGISTER(RegexFindAll) REGISTER(RegexSplit) REGISTER(RegexReplaceAll) \
+	REGISTER(SystemGetHeapStatistics) \
 	REGISTER(_DirectoryInternalStartIteration) REGISTER(_DirectoryInternalNextIteration) REGISTER(_DirectoryInternalEndIteration) \
 
 #define REGISTER(x) int External##x(ExecutionContext *context, Value *returnValue);
@@ -824,6 +1041,7 @@ Token TokenNext(Tokenizer *tokenizer) {
 			else if KEYWORD("reterr") token.type = T_RETERR;
 			else if KEYWORD("return") token.type = T_RETURN;
 			else if KEYWORD("str") token.type = T_STR;
+			else if KEYWORD("strbuilder") token.type = T_STRBUILDER;
 			else if KEYWORD("struct") token.type = T_STRUCT;
 			else if KEYWORD("true") token.type = T_TRUE;
 			else if KEYWORD("tuple") token.type = T_TUPLE;
@@ -948,6 +1166,7 @@ Node *ParseType(Tokenizer *tokenizer, bool maybe, bool allowVoid, bool allowTupl
 			|| node->token.type == T_TUPLE
 			|| node->token.type == T_ERR
 			|| node->token.type == T_ANYTYPE
+			|| node->token.type == T_STRBUILDER
 			|| node->token.type == T_IDENTIFIER) {
 		node->type = node->token.type;
 
@@ -1665,6 +1884,7 @@ Node *ParseVariableDeclarationOrExpression(Tokenizer *tokenizer, bool replMode,
 					return NULL;
 				}
 
+				Tokenizer copy = *tokenizer;
 				Token token = TokenNext(tokenizer);
 
 				if (token.type == T_ERROR) {
@@ -1673,6 +1893,10 @@ Node *ParseVariableDeclarationOrExpression(Tokenizer *tokenizer, bool replMode,
 					// Keep going...
 				} else if (token.type == T_SEMICOLON) {
 					break;
+				} else if (token.type == T_IN && allowIn) {
+					// The key and value variables of a for-in statement over a map.
+					*tokenizer = copy;
+					break;
 				} else if (token.type == T_EQUALS) {
 					group->type = T_DECL_GROUP_AND_SET;
 					*link = ParseExpression(tokenizer, false, 0);
@@ -2542,15 +2766,13 @@ bool ASTSetScopes(Tokenizer *tokenizer, ExecutionContext *context, Node *node, S
 	}
 
 	if (node->type == T_FOR_EACH) {
-		Node *placeholder;
-		placeholder = (Node *) AllocateFixed(sizeof(Node));
-		placeholder->type = T_PLACEHOLDER;
-		bool success = ScopeAddEntry(tokenizer, scope, placeholder);
-		Assert(success);
-		placeholder = (Node *) AllocateFixed(sizeof(Node));
-		placeholder->type = T_PLACEHOLDER;
-		success = ScopeAddEntry(tokenizer, scope, placeholder);
-		Assert(success);
+		// The list or map being iterated, and the position in it. Maps need two variables for the position; see T_MAP_ITERATE.
+		for (uintptr_t i = 0; i < 3; i++) {
+			Node *placeholder = (Node *) AllocateFixed(sizeof(Node));
+			placeholder->type = T_PLACEHOLDER;
+			bool success = ScopeAddEntry(tokenizer, scope, placeholder);
+			Assert(success);
+		}
 	}
 
 	if (node->type == T_IMPORT) {
@@ -2723,7 +2945,7 @@ bool ASTIsIntType(Node *node) {
 
 bool ASTIsTypeNullable(uint8_t type) {
 	return type == T_STRUCT || type == T_LIST || type == T_FUNCPTR || type == T_HANDLETYPE
-		|| type == T_MAP_INT || type == T_MAP_STR;
+		|| type == T_MAP_INT || type == T_MAP_STR || type == T_STRBUILDER;
 }
 
 bool ASTIsManagedType(Node *node) {
@@ -2779,6 +3001,27 @@ int ASTGetTypePopCount(Node *node) {
 	}
 }
 
+Node *ScopeLookupType(Tokenizer *tokenizer, Node *node) {
+	Node *lookup = ScopeLookup(tokenizer, node, false);
+
+	if (lookup && lookup->type == T_INLINE) {
+		// Types from modules imported inline (e.g. the base module) are found in the root scope of that module.
+		Scope *scope = lookup->importData->rootNode->scope;
+
+		for (uintptr_t i = 0; i < scope->entryCount; i++) {
+			Node *entry = scope->entries[i];
+
+			if ((entry->type == T_STRUCT || entry->type == T_FUNCTYPE || entry->type == T_INTTYPE || entry->type == T_HANDLETYPE)
+					&& entry->token.textBytes == node->token.textBytes
+					&& 0 == MemoryCompare(entry->token.text, node->token.text, node->token.textBytes)) {
+				return entry;
+			}
+		}
+	}
+
+	return lookup;
+}
+
 bool ASTLookupTypeIdentifiers(Tokenizer *tokenizer, Node *node) {
 	Node *child = node->firstChild;
 
@@ -2806,7 +3049,7 @@ bool ASTLookupTypeIdentifiers(Tokenizer *tokenizer, Node *node) {
 		Node *type = node->firstChild->sibling;
 
 		if (type->type == T_IDENTIFIER) {
-			Node *lookup = ScopeLookup(tokenizer, type, false);
+			Node *lookup = ScopeLookupType(tokenizer, type);
 			if (!lookup) return false;
 
 			if (lookup->type == T_FUNCTYPE || lookup->type == T_STRUCT || lookup->type == T_INTTYPE || lookup->type == T_HANDLETYPE) {
@@ -2833,7 +3076,7 @@ bool ASTLookupTypeIdentifiers(Tokenizer *tokenizer, Node *node) {
 		}
 
 		if (type && type->type == T_IDENTIFIER) {
-			Node *lookup = ScopeLookup(tokenizer, type, false);
+			Node *lookup = ScopeLookupType(tokenizer, type);
 
 			if (!lookup) {
 				return false;
@@ -2981,22 +3224,9 @@ Value ASTNumericLiteralToValue(Node *node) {
 			v.i += HexValueOf(node->token.text[i]);
 		}
 	} else if (node->expressionType == &globalExpressionTypeFloat) {
-		bool dot = false;
-		v.f = 0;
-		double m = 0.1;
-
-		for (uintptr_t i = 0; i < node->token.textBytes; i++) {
-			if (node->token.text[i] == '.') {
-				dot = true;
-			} else if (node->token.text[i] == '_') {
-			} else if (dot) {
-				v.f += (node->token.text[i] - '0') * m;
-				m /= 10;
-			} else {
-				v.f *= 10;
-				v.f += node->token.text[i] - '0';
-			}
-		}
+		const char *error = StringParseFloatRaw(node->token.text, node->token.textBytes, &v.f);
+		Assert(!error);
+		(void) error;
 	} else {
 		Assert(false);
 	}
@@ -3246,8 +3476,10 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		bool isAnyType = expressionType->type == T_ANYTYPE;
 		bool isMap = expressionType->type == T_MAP_INT || expressionType->type == T_MAP_STR;
 		bool isMapStr = expressionType->type == T_MAP_STR;
+		bool isHandle = expressionType->type == T_HANDLETYPE;
+		bool isStrBuilder = expressionType->type == T_STRBUILDER;
 
-		if (!isList && !isStr & !isFuncPtr && !isErr && !isInt && !isFloat && !isAnyType && !isMap) {
+		if (!isList && !isStr & !isFuncPtr && !isErr && !isInt && !isFloat && !isAnyType && !isMap && !isHandle && !isStrBuilder) {
 			PrintError2(tokenizer, node, "This type does not have any ':' operations.\n");
 			return false;
 		}
@@ -3255,6 +3487,7 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		Token token = node->token;
 		Node *arguments[2] = { 0 };
 		bool returnsItem = false, returnsInt = false, returnsBool = false, returnsStr = false, returnsFloat = false, simple = true;
+		bool returnsErrKey = false, returnsSelf = false;
 		uint8_t op;
 
 		if (isList && KEYWORD("resize")) arguments[0] = &globalExpressionTypeInt, op = T_OP_RESIZE;
@@ -3264,12 +3497,29 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		else if ((isList || isMap) && KEYWORD("delete")) arguments[0] = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt, op = isMapStr ? T_OP_DELETE_MAP_STR : isMap ? T_OP_DELETE_MAP_INT : T_OP_DELETE, returnsBool = isMap;
 		else if (isList && KEYWORD("find_and_delete")) arguments[0] = expressionType->firstChild, op = T_OP_FIND_AND_DELETE, returnsBool = true;
 		else if (isList && KEYWORD("find")) arguments[0] = expressionType->firstChild, op = T_OP_FIND, returnsInt = true;
+		else if (isList && KEYWORD("find_last")) arguments[0] = expressionType->firstChild, op = T_OP_FIND_LAST, returnsInt = true;
+		else if (isList && KEYWORD("contains")) arguments[0] = expressionType->firstChild, op = T_OP_CONTAINS, returnsBool = true;
+		else if (isList && KEYWORD("count")) arguments[0] = expressionType->firstChild, op = T_OP_COUNT, returnsInt = true;
 		else if (isList && KEYWORD("delete_many")) arguments[0] = &globalExpressionTypeInt, arguments[1] = &globalExpressionTypeInt, op = T_OP_DELETE_MANY;
+		else if (isList && KEYWORD("insert_from")) arguments[0] = expressionType, arguments[1] = &globalExpressionTypeInt, op = T_OP_INSERT_FROM;
+		else if ((isList || isMap) && KEYWORD("clone")) returnsSelf = true, op = T_OP_CLONE;
+		else if ((isList || isMap) && KEYWORD("clone_all")) returnsSelf = true, op = T_OP_CLONE_ALL;
+		else if (isList && KEYWORD("slice")) returnsSelf = true, arguments[0] = arguments[1] = &globalExpressionTypeInt, op = T_OP_LIST_SLICE;
+		else if (isList && KEYWORD("reverse")) op = T_OP_REVERSE;
+		else if (isList && KEYWORD("hint_deque")) op = T_OP_HINT_DEQUE;
 		else if (isList && KEYWORD("delete_last")) op = T_OP_DELETE_LAST;
 		else if ((isList || isMap) && KEYWORD("delete_all")) op = T_OP_DELETE_ALL;
 		else if (isList && KEYWORD("first")) returnsItem = true, op = T_OP_FIRST;
 		else if (isList && KEYWORD("last")) returnsItem = true, op = T_OP_LAST;
-		else if ((isList || isStr || isMap) && KEYWORD("len")) returnsInt = true, op = T_OP_LEN;
+		else if ((isList || isStr || isMap || isStrBuilder) && KEYWORD("len")) returnsInt = true, op = T_OP_LEN;
+		else if (isMap && KEYWORD("hint_unordered")) op = T_OP_HINT_UNORDERED;
+		else if (isMap && KEYWORD("hint_ordered")) op = T_OP_HINT_ORDERED;
+		else if (isMap && KEYWORD("first_key")) returnsErrKey = true, op = T_OP_FIRST_KEY;
+		else if (isMap && KEYWORD("last_key")) returnsErrKey = true, op = T_OP_LAST_KEY;
+		else if (isMap && KEYWORD("next_key")) arguments[0] = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt, returnsErrKey = true, op = T_OP_NEXT_KEY;
+		else if (isMap && KEYWORD("prior_key")) arguments[0] = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt, returnsErrKey = true, op = T_OP_PRIOR_KEY;
+		else if (isMap && KEYWORD("lower_bound")) arguments[0] = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt, returnsErrKey = true, op = T_OP_LOWER_BOUND;
+		else if (isMap && KEYWORD("merge")) arguments[0] = expressionType, op = T_OP_MERGE;
 		else if (isMap && KEYWORD("has")) arguments[0] = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt, returnsBool = true, op = isMapStr ? T_OP_HAS_STR : T_OP_HAS_INT;
 		else if (isInt && KEYWORD("float")) returnsFloat = true, op = T_OP_INT_TO_FLOAT;
 		else if (isFloat && KEYWORD("truncate")) returnsInt = true, op = T_OP_FLOAT_TRUNCATE;
@@ -3280,6 +3530,35 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		else if (isStr && KEYWORD("byte")) returnsInt = true, arguments[0] = &globalExpressionTypeInt, op = T_OP_BYTE;
 		else if (isStr && KEYWORD("slice")) returnsStr = true, arguments[0] = arguments[1] = &globalExpressionTypeInt, op = T_OP_SLICE;
 		else if (isInt && KEYWORD("str")) returnsStr = true, op = T_OP_STR;
+		else if (isHandle && KEYWORD("close")) op = T_OP_CLOSE;
+		else if (isStrBuilder && KEYWORD("reserve")) arguments[0] = &globalExpressionTypeInt, op = T_OP_RESERVE;
+		else if (isStrBuilder && KEYWORD("str")) returnsStr = true, op = T_OP_BUILDER_STR;
+
+		else if (isStrBuilder && KEYWORD("append")) {
+			Node *argument = node->firstChild->sibling->firstChild;
+
+			if (!argument || argument->sibling) {
+				PrintError2(tokenizer, node, ":append() takes exactly one argument, the str, int or float to append.\n");
+				return false;
+			}
+
+			if (!ASTSetTypes(tokenizer, node->firstChild->sibling)) return false;
+			Node *type = argument->expressionType;
+
+			if (ASTMatching(type, &globalExpressionTypeStr)) {
+				op = T_OP_APPEND_STR;
+			} else if (ASTMatching(type, &globalExpressionTypeInt) || ASTIsIntType(type)) {
+				op = T_OP_APPEND_INT;
+			} else if (ASTMatching(type, &globalExpressionTypeFloat)) {
+				op = T_OP_APPEND_FLOAT;
+			} else {
+				PrintError5(tokenizer, node, type, NULL, "Only values of type str, int and float can be appended to a string builder.\n");
+				return false;
+			}
+
+			node->expressionType = NULL;
+			simple = false;
+		}
 
 		else if (isFuncPtr && KEYWORD("async")) {
 			if (expressionType->firstChild->firstChild) {
@@ -3377,6 +3656,108 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 			simple = false;
 		}
 
+		else if (isMap && (KEYWORD("keys") || KEYWORD("values"))) {
+			if (node->firstChild->sibling->firstChild) {
+				PrintError2(tokenizer, node, "This operation does not take any arguments.\n");
+				return false;
+			}
+
+			node->expressionType = (Node *) AllocateFixed(sizeof(Node));
+			node->expressionType->type = T_LIST;
+
+			if (KEYWORD("keys")) {
+				node->expressionType->firstChild = isMapStr ? &globalExpressionTypeStr : &globalExpressionTypeInt;
+				op = T_OP_KEYS;
+			} else {
+				node->expressionType->firstChild = expressionType->firstChild;
+				op = T_OP_VALUES;
+			}
+
+			simple = false;
+		}
+
+		else if (isList && (KEYWORD("sum") || KEYWORD("min") || KEYWORD("max"))) {
+			Node *itemType = expressionType->firstChild;
+			bool isFloatList = ASTMatching(itemType, &globalExpressionTypeFloat);
+
+			if (node->firstChild->sibling->firstChild) {
+				PrintError2(tokenizer, node, "This operation does not take any arguments.\n");
+				return false;
+			}
+
+			if (!isFloatList && !ASTMatching(itemType, &globalExpressionTypeInt) && !ASTIsIntType(itemType)) {
+				PrintError5(tokenizer, node, itemType, NULL, "The '%.*s' operation can only be used with lists of int or float.\n", 
+						token.textBytes, token.text);
+				return false;
+			}
+
+			if (KEYWORD("sum")) op = isFloatList ? T_OP_SUM_FLOAT : T_OP_SUM_INT;
+			else if (KEYWORD("min")) op = isFloatList ? T_OP_MIN_FLOAT : T_OP_MIN_INT;
+			else op = isFloatList ? T_OP_MAX_FLOAT : T_OP_MAX_INT;
+			node->expressionType = itemType;
+			simple = false;
+		}
+
+		else if (isList && KEYWORD("hint_packed")) {
+			Node *itemType = expressionType->firstChild;
+
+			if (node->firstChild->sibling->firstChild) {
+				PrintError2(tokenizer, node, "This operation does not take any arguments.\n");
+				return false;
+			}
+
+			if (ASTMatching(itemType, &globalExpressionTypeBool)) {
+				op = T_OP_HINT_PACKED_BITS;
+			} else if (ASTMatching(itemType, &globalExpressionTypeInt) || ASTIsIntType(itemType)) {
+				op = T_OP_HINT_PACKED_INTS;
+			} else {
+				PrintError5(tokenizer, node, itemType, NULL, "Only lists of bool or int can be packed.\n");
+				return false;
+			}
+
+			simple = false;
+		}
+
+		else if (isList && (KEYWORD("sort") || KEYWORD("sort_unstable"))) {
+			Node *argument = node->firstChild->sibling->firstChild;
+			Node *itemType = expressionType->firstChild;
+
+			if (argument && argument->sibling) {
+				PrintError2(tokenizer, node, "This operation takes at most one argument, the comparison function.\n");
+				return false;
+			}
+
+			if (!ASTSetTypes(tokenizer, node->firstChild->sibling)) return false;
+
+			if (!argument) {
+				if (ASTMatching(itemType, &globalExpressionTypeInt) || ASTIsIntType(itemType)) {
+					op = T_OP_SORT_INT;
+				} else if (ASTMatching(itemType, &globalExpressionTypeFloat)) {
+					op = T_OP_SORT_FLOAT;
+				} else if (ASTMatching(itemType, &globalExpressionTypeStr)) {
+					op = T_OP_SORT_STR;
+				} else {
+					PrintError5(tokenizer, node, itemType, NULL, "Only lists of int, float or str can be sorted without a comparison function.\n");
+					return false;
+				}
+			} else {
+				Node *type = argument->expressionType;
+				Node *first = type && type->type == T_FUNCPTR ? type->firstChild->firstChild : NULL;
+
+				if (!first || !first->sibling || first->sibling->sibling 
+						|| !ASTMatching(first->firstChild, itemType) || !ASTMatching(first->sibling->firstChild, itemType)
+						|| !ASTMatching(type->firstChild->sibling, &globalExpressionTypeBool)) {
+					PrintError5(tokenizer, node, type, NULL, "The comparison function must take two items of the list, "
+							"and return true if the first should be sorted before the second.\n");
+					return false;
+				}
+
+				op = KEYWORD("sort") ? T_OP_SORT_CALLBACK : T_OP_SORT_UNSTABLE_CALLBACK;
+			}
+
+			simple = false;
+		}
+
 		else if (isMap && KEYWORD("get")) { 
 			if (!node->firstChild->sibling->firstChild || node->firstChild->sibling->firstChild->sibling) {
 				PrintError2(tokenizer, node, ":get() takes exactly one argument, the key.\n");
@@ -3409,8 +3790,9 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		if (op == T_OP_FIND_AND_DELETE && ASTMatching(arguments[0], &globalExpressionTypeFloat)) {
 			PrintError2(tokenizer, node, "The 'find_and_delete' operation cannot be used with floats.\n");
 			return false;
-		} else if (op == T_OP_FIND && ASTMatching(arguments[0], &globalExpressionTypeFloat)) {
-			PrintError2(tokenizer, node, "The 'find' operation cannot be used with floats.\n");
+		} else if ((op == T_OP_FIND || op == T_OP_FIND_LAST || op == T_OP_CONTAINS || op == T_OP_COUNT) 
+				&& ASTMatching(arguments[0], &globalExpressionTypeFloat)) {
+			PrintError2(tokenizer, node, "The '%.*s' operation cannot be used with floats.\n", token.textBytes, token.text);
 			return false;
 		}
 
@@ -3423,6 +3805,12 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 			op = T_OP_FIND_AND_DEL_STR;
 		} else if (op == T_OP_FIND && ASTMatching(arguments[0], &globalExpressionTypeStr)) {
 			op = T_OP_FIND_STR;
+		} else if (op == T_OP_FIND_LAST && ASTMatching(arguments[0], &globalExpressionTypeStr)) {
+			op = T_OP_FIND_LAST_STR;
+		} else if (op == T_OP_CONTAINS && ASTMatching(arguments[0], &globalExpressionTypeStr)) {
+			op = T_OP_CONTAINS_STR;
+		} else if (op == T_OP_COUNT && ASTMatching(arguments[0], &globalExpressionTypeStr)) {
+			op = T_OP_COUNT_STR;
 		}
 
 		if (simple) {
@@ -3460,7 +3848,9 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 				: returnsInt ? &globalExpressionTypeInt 
 				: returnsStr ? &globalExpressionTypeStr 
 				: returnsFloat ? &globalExpressionTypeFloat 
-				: returnsBool ? &globalExpressionTypeBool : NULL;
+				: returnsBool ? &globalExpressionTypeBool 
+				: returnsErrKey ? (isMapStr ? &globalExpressionTypeErrStr : &globalExpressionTypeErrInt) 
+				: returnsSelf ? expressionType : NULL;
 		}
 
 		node->operationType = op;
@@ -3479,7 +3869,7 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 	if (node->type == T_ROOT || node->type == T_BLOCK
 			|| node->type == T_INT || node->type == T_FLOAT || node->type == T_STR 
 			|| node->type == T_LIST || node->type == T_TUPLE || node->type == T_ERR || node->type == T_ANYTYPE
-			|| node->type == T_MAP_INT || node->type == T_MAP_STR
+			|| node->type == T_STRBUILDER || node->type == T_MAP_INT || node->type == T_MAP_STR
 			|| node->type == T_BOOL || node->type == T_VOID || node->type == T_IDENTIFIER
 			|| node->type == T_ARGUMENTS || node->type == T_ARGUMENT
 			|| node->type == T_STRUCT || node->type == T_FUNCTYPE || node->type == T_IMPORT 
@@ -3842,30 +4232,61 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 	} else if (node->type == T_FOR_EACH) {
 		Node *listType = node->firstChild->sibling->expressionType;
 		bool isStr = listType && ASTMatching(listType, &globalExpressionTypeStr);
+		bool isMap = listType && (listType->type == T_MAP_INT || listType->type == T_MAP_STR);
+		Node *declare = node->firstChild;
+		uintptr_t variableCount = declare->type == T_DECLARE_GROUP ? 2 : 1;
+
+		if (!listType || (listType->type != T_LIST && !isStr && !isMap)) {
+			PrintError5(tokenizer, node, listType, NULL, "The expression on the right of 'in' must be a list, string or map.\n");
+			return false;
+		}
 
-		if (!listType || (listType->type != T_LIST && !isStr)) {
-			PrintError5(tokenizer, node, listType, NULL, "The expression on the right of 'in' must be a list or string.\n");
+		if (declare->type == T_DECLARE_GROUP && (!isMap || declare->firstChild->sibling->sibling)) {
+			PrintError2(tokenizer, node, "Only a map can be iterated with two variables, for its keys and values.\n");
 			return false;
 		}
 
-		if (isStr) {
-			if (!ASTMatching(node->firstChild->expressionType, &globalExpressionTypeStr)) {
-				PrintError5(tokenizer, node, node->firstChild->expressionType, NULL, 
-						"The variable on the left of 'in' must be a 'str' when iterating over a string.\n");
+		if (isMap) {
+			Node *keyType = listType->type == T_MAP_STR ? &globalExpressionTypeStr : &globalExpressionTypeInt;
+			Node *keyVariable = declare->type == T_DECLARE_GROUP ? declare->firstChild : declare;
+
+			if (!ASTMatching(keyVariable->expressionType, keyType)) {
+				PrintError5(tokenizer, node, keyVariable->expressionType, keyType, 
+						"The variable on the left of 'in' must match the type of the keys in the map on the right.\n");
 				return false;
 			}
-		} else {
-			if (!ASTMatching(node->firstChild->expressionType, listType->firstChild)) {
-				PrintError5(tokenizer, node, node->firstChild->expressionType, listType->firstChild, 
-						"The variable on the left of 'in' must match the type of the items in the list on the right.\n");
+
+			if (variableCount == 2 && !ASTMatching(keyVariable->sibling->expressionType, listType->firstChild)) {
+				PrintError5(tokenizer, node, keyVariable->sibling->expressionType, listType->firstChild, 
+						"The second variable on the left of 'in' must match the type of the values in the map on the right.\n");
 				return false;
 			}
-		}
 
-		Assert(node->scope->entryCount == 3 && node->scope->variableEntryCount == 3 
-				&& node->scope->entries[1]->type == T_PLACEHOLDER && node->scope->entries[2]->type == T_PLACEHOLDER);
-		node->scope->entries[1]->expressionType = listType;
-		node->scope->entries[2]->expressionType = &globalExpressionTypeInt;
+			Assert(node->scope->entryCount == variableCount + 3 && node->scope->variableEntryCount == variableCount + 3);
+			node->scope->entries[variableCount + 0]->expressionType = listType;
+			node->scope->entries[variableCount + 1]->expressionType = keyType;
+			node->scope->entries[variableCount + 2]->expressionType = &globalExpressionTypeInt;
+		} else {
+			if (isStr) {
+				if (!ASTMatching(node->firstChild->expressionType, &globalExpressionTypeStr)) {
+					PrintError5(tokenizer, node, node->firstChild->expressionType, NULL, 
+							"The variable on the left of 'in' must be a 'str' when iterating over a string.\n");
+					return false;
+				}
+			} else {
+				if (!ASTMatching(node->firstChild->expressionType, listType->firstChild)) {
+					PrintError5(tokenizer, node, node->firstChild->expressionType, listType->firstChild, 
+							"The variable on the left of 'in' must match the type of the items in the list on the right.\n");
+					return false;
+				}
+			}
+
+			Assert(node->scope->entryCount == 4 && node->scope->variableEntryCount == 4 
+					&& node->scope->entries[1]->type == T_PLACEHOLDER && node->scope->entries[2]->type == T_PLACEHOLDER);
+			node->scope->entries[1]->expressionType = listType;
+			node->scope->entries[2]->expressionType = &globalExpressionTypeInt;
+			node->scope->entries[3]->expressionType = &globalExpressionTypeInt; // Unused.
+		}
 	} else if (node->type == T_INDEX) {
 		bool keyIsString = node->firstChild->expressionType->type == T_MAP_STR;
 
@@ -3889,9 +4310,9 @@ bool ASTSetTypes(Tokenizer *tokenizer, Node *node) {
 		}
 	} else if (node->type == T_NEW) {
 		if (node->firstChild->type != T_STRUCT && node->firstChild->type != T_LIST && node->firstChild->type != T_ERR
-				&& node->firstChild->type != T_MAP_INT && node->firstChild->type != T_MAP_STR) {
-			PrintError2(tokenizer, node, "This type is not a struct, map, list or error. "
-					"'new' is used to create new instances of structs, maps, lists and errors.\n");
+				&& node->firstChild->type != T_MAP_INT && node->firstChild->type != T_MAP_STR && node->firstChild->type != T_STRBUILDER) {
+			PrintError2(tokenizer, node, "This type is not a struct, map, list, error or string builder. "
+					"'new' is used to create new instances of structs, maps, lists, errors and string builders.\n");
 			return false;
 		}
 
@@ -4606,8 +5027,9 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 		Node *list = node->firstChild->sibling;
 		Node *body = node->firstChild->sibling->sibling;
 		bool isStr = ASTMatching(list->expressionType, &globalExpressionTypeStr);
+		bool isMap = list->expressionType->type == T_MAP_INT || list->expressionType->type == T_MAP_STR;
 
-		if (declare->type != T_DECLARE) {
+		if (declare->type != T_DECLARE && (declare->type != T_DECLARE_GROUP || !isMap)) {
 			PrintError2(tokenizer, node, "The left of a for-in statement must be a variable declaration.\n");
 			return false;
 		}
@@ -4626,6 +5048,87 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 		// Declare the iteration variable.
 		if (!FunctionBuilderRecurse(tokenizer, declare, builder, false)) return false;
 
+		if (isMap) {
+			// The map and the position in it are saved in the placeholder variables after the key (and value) variables.
+			bool hasValue = declare->type == T_DECLARE_GROUP;
+			int32_t scopeIndexMap = scopeIndexBase - (hasValue ? 2 : 1);
+			int32_t scopeIndexKey = scopeIndexMap - 1;
+			int32_t scopeIndexPosition = scopeIndexMap - 2;
+			int32_t scopeIndexValue = scopeIndexBase - 1;
+
+			// Push the map, and find its first entry.
+			if (!FunctionBuilderRecurse(tokenizer, list, builder, false)) return false;
+			FunctionBuilderAddLineNumber(builder, node);
+			uint8_t b = T_MAP_ITERATE;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			int32_t start = builder->dataBytes;
+
+			// Stack: found, value, position, key, map, ...
+			FunctionBuilderAddLineNumber(builder, node);
+			b = T_IF;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			uintptr_t writeOffset = builder->dataBytes;
+			uint32_t zero = 0;
+			FunctionBuilderAppend(builder, &zero, sizeof(zero));
+
+			// Stack: value, position, key, map, ...
+			if (hasValue) {
+				b = T_EQUALS;
+				FunctionBuilderAppend(builder, &b, sizeof(b));
+				FunctionBuilderAppend(builder, &scopeIndexValue, sizeof(scopeIndexValue));
+			} else {
+				b = T_POP;
+				FunctionBuilderAppend(builder, &b, sizeof(b));
+			}
+
+			// Stack: position, key, map, ...
+			b = T_EQUALS;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexPosition, sizeof(scopeIndexPosition));
+			b = T_DUP;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			b = T_EQUALS;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexBase, sizeof(scopeIndexBase));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexKey, sizeof(scopeIndexKey));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexMap, sizeof(scopeIndexMap));
+
+			// Output the body.
+			if (!FunctionBuilderRecurse(tokenizer, body, builder, false)) return false;
+			int32_t preIncrement = builder->dataBytes;
+
+			// Load the map, key and position, and find the next entry.
+			b = T_VARIABLE;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexMap, sizeof(scopeIndexMap));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexKey, sizeof(scopeIndexKey));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &scopeIndexPosition, sizeof(scopeIndexPosition));
+			FunctionBuilderAddLineNumber(builder, node);
+			b = T_MAP_ITERATE_NEXT;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+
+			b = T_BRANCH;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			int32_t delta = start - builder->dataBytes;
+			FunctionBuilderAppend(builder, &delta, sizeof(delta));
+			delta = builder->dataBytes - writeOffset;
+			MemoryCopy(builder->data + writeOffset, &delta, sizeof(delta));
+
+			// Pop the value, position, key and map.
+			b = T_POP;
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+
+			FunctionBuilderSetBreakContinueTargets(tokenizer, body, builder, builder->dataBytes, preIncrement);
+			return true;
+		}
+
 		// Push the starting index of 0.
 		uint8_t b = T_ZERO;
 		FunctionBuilderAppend(builder, &b, sizeof(b));
@@ -4914,6 +5417,7 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 			FunctionBuilderAppend(builder, &newType, sizeof(newType));
 			Node *item = node->firstChild;
 
+			// The entries are added without looking up their keys, and then sorted all at once.
 			while (item) {
 				b = T_DUP;
 				FunctionBuilderAppend(builder, &b, sizeof(b));
@@ -4921,11 +5425,17 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 				b = T_SWAP;
 				FunctionBuilderAppend(builder, &b, sizeof(b));
 				FunctionBuilderRecurse(tokenizer, item->firstChild, builder, false);
-				b = node->expressionType->type == T_MAP_INT ? T_EQUALS_MAP_INT : T_EQUALS_MAP_STR;
+				b = T_MAP_APPEND;
 				FunctionBuilderAppend(builder, &b, sizeof(b));
 				item = item->sibling;
 			}
 
+			if (node->firstChild) {
+				FunctionBuilderAddLineNumber(builder, node);
+				b = T_MAP_BUILD;
+				FunctionBuilderAppend(builder, &b, sizeof(b));
+			}
+
 			return true;
 		} else {
 			Assert(false);
@@ -4947,6 +5457,8 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 			fieldCount = ASTIsManagedType(node->firstChild->firstChild) ? -6 : -5;
 		} else if (node->firstChild->type == T_MAP_STR) {
 			fieldCount = ASTIsManagedType(node->firstChild->firstChild) ? -8 : -7;
+		} else if (node->firstChild->type == T_STRBUILDER) {
+			fieldCount = -9;
 		} else if (node->firstChild->type == T_STRUCT) {
 			fieldCount = FunctionBuilderCountStructureFields(tokenizer, node->firstChild);
 		} else {
@@ -5030,6 +5542,61 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 			item = item->sibling;
 		}
 
+		return true;
+	} else if (node->type == T_STR_INTERPOLATE) {
+		// The parser produces a chain of interpolations, each with the previous one as its left child.
+		// Flatten it into T_FORMAT instructions, which take the expressions from the stack,
+		// and have the literal strings between them stored in the instruction.
+		// The instruction is followed by the argument count, the first literal, and then the type and following literal for each argument.
+
+		uintptr_t expressionCount = 0;
+		for (Node *item = node; item->type == T_STR_INTERPOLATE; item = item->firstChild) expressionCount++;
+		Node **items = (Node **) AllocateResize(NULL, sizeof(Node *) * expressionCount);
+		uintptr_t position = expressionCount;
+		Node *firstLiteral = node;
+		while (firstLiteral->type == T_STR_INTERPOLATE) items[--position] = firstLiteral, firstLiteral = firstLiteral->firstChild;
+
+		for (uintptr_t start = 0; start < expressionCount; ) {
+			// After the first instruction, the previous result is passed as the first argument.
+			uintptr_t end = start + FORMAT_MAX_ARGUMENTS - (start ? 1 : 0);
+			if (end > expressionCount) end = expressionCount;
+
+			for (uintptr_t i = start; i < end; i++) {
+				if (!FunctionBuilderRecurse(tokenizer, items[i]->firstChild->sibling, builder, false)) {
+					AllocateResize(items, 0);
+					return false;
+				}
+			}
+
+			uint8_t b = T_FORMAT;
+			uint16_t argumentCount = end - start + (start ? 1 : 0);
+			uint32_t literal = start || !firstLiteral->token.textBytes ? 0 
+				: HeapInternLiteral(builder->context, firstLiteral->token.text, firstLiteral->token.textBytes);
+			FunctionBuilderAddLineNumber(builder, node);
+			FunctionBuilderAppend(builder, &b, sizeof(b));
+			FunctionBuilderAppend(builder, &argumentCount, sizeof(argumentCount));
+			FunctionBuilderAppend(builder, &literal, sizeof(literal));
+
+			if (start) {
+				b = T_STR, literal = 0;
+				FunctionBuilderAppend(builder, &b, sizeof(b));
+				FunctionBuilderAppend(builder, &literal, sizeof(literal));
+			}
+
+			for (uintptr_t i = start; i < end; i++) {
+				Node *type = items[i]->firstChild->sibling->expressionType;
+				Node *right = items[i]->firstChild->sibling->sibling;
+				b = (type->type == T_INT || ASTIsIntType(type)) ? T_INT : type->type;
+				Assert(b == T_STR || b == T_FLOAT || b == T_INT || b == T_BOOL || (b == T_LIST && type->firstChild->type == T_INT));
+				literal = !right->token.textBytes ? 0 : HeapInternLiteral(builder->context, right->token.text, right->token.textBytes);
+				FunctionBuilderAppend(builder, &b, sizeof(b));
+				FunctionBuilderAppend(builder, &literal, sizeof(literal));
+			}
+
+			start = end;
+		}
+
+		AllocateResize(items, 0);
 		return true;
 	}
 
@@ -5122,16 +5689,6 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 			: node->expressionType->type == T_STR ? T_CONCAT : node->type;
 		FunctionBuilderAddLineNumber(builder, node);
 		FunctionBuilderAppend(builder, &b, sizeof(b));
-	} else if (node->type == T_STR_INTERPOLATE) {
-		Node *type = node->firstChild->sibling->expressionType;
-		uint8_t b = type->type == T_STR ? T_INTERPOLATE_STR
-			: type->type == T_FLOAT ? T_INTERPOLATE_FLOAT
-			: (type->type == T_INT || ASTIsIntType(type)) ? T_INTERPOLATE_INT
-			: (type->type == T_LIST && type->firstChild->type == T_INT) ? T_INTERPOLATE_ILIST
-			: type->type == T_BOOL ? T_INTERPOLATE_BOOL : T_ERROR;
-		Assert(b != T_ERROR);
-		FunctionBuilderAddLineNumber(builder, node);
-		FunctionBuilderAppend(builder, &b, sizeof(b));
 	} else if (node->type == T_LESS_THAN || node->type == T_GREATER_THAN || node->type == T_LT_OR_EQUAL || node->type == T_GT_OR_EQUAL
 			|| node->type == T_DOUBLE_EQUALS || node->type == T_NOT_EQUALS) {
 		uint8_t b = node->firstChild->expressionType->type == T_STR ? node->type - T_DOUBLE_EQUALS + T_STR_DOUBLE_EQUALS 
@@ -5207,9 +5764,8 @@ bool FunctionBuilderRecurse(Tokenizer *tokenizer, Node *node, FunctionBuilder *b
 	} else if (node->type == T_STRING_LITERAL) {
 		FunctionBuilderAddLineNumber(builder, node);
 		FunctionBuilderAppend(builder, &node->type, sizeof(node->type));
-		uint32_t textBytes = node->token.textBytes;
-		FunctionBuilderAppend(builder, &textBytes, sizeof(textBytes));
-		FunctionBuilderAppend(builder, node->token.text, textBytes);
+		uint32_t heapIndex = HeapInternLiteral(builder->context, node->token.text, node->token.textBytes);
+		FunctionBuilderAppend(builder, &heapIndex, sizeof(heapIndex));
 	} else if (node->type == T_TRUE || node->type == T_FALSE) {
 		FunctionBuilderAddLineNumber(builder, node);
 		uint8_t b = T_NUMERIC_LITERAL;
@@ -5331,15 +5887,32 @@ bool ASTGenerate(Tokenizer *tokenizer, Node *root, ExecutionContext *context) {
 
 // --------------------------------- Main script execution.
 
+void HeapGarbageCollectMarkMapNode(ExecutionContext *context, HeapEntry *map, MapNode *node) {
+	if (node->isLeaf) {
+		for (uintptr_t i = 0; i < node->count; i++) {
+			if (map->type == T_MAP_STR) HeapGarbageCollectMark(context, node->entries[i].key.i);
+			if (map->internalValuesAreManaged) HeapGarbageCollectMark(context, node->entries[i].value.i);
+		}
+	} else {
+		for (uintptr_t i = 0; i < node->count; i++) {
+			// The separators may be keys that have since been deleted, so they must be marked too.
+			if (i && map->type == T_MAP_STR) HeapGarbageCollectMark(context, node->separators[i].key.i);
+			HeapGarbageCollectMarkMapNode(context, map, node->children[i]);
+		}
+	}
+}
+
 void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index) {
 	start:;
 	Assert(index < context->heapEntriesAllocated);
 	if (context->heap[index].gcMark) return;
 	context->heap[index].gcMark = true;
 
-	if (context->heap[index].type == T_EOF || context->heap[index].type == T_STR 
+	if (context->heap[index].type == T_EOF || context->heap[index].type == T_STR || context->heap[index].type == T_STRBUILDER
 			|| context->heap[index].type == T_FUNCPTR || context->heap[index].type == T_HANDLETYPE) {
 		// Nothing else to mark.
+	} else if (context->heap[index].type == T_OP_SLICE) {
+		// The parent is marked by HeapGarbageCollectSlices.
 	} else if (context->heap[index].type == T_STRUCT) {
 		for (uintptr_t i = 0; i < context->heap[index].fieldCount; i++) {
 			if (((uint8_t *) context->heap[index].fields)[-1 - i]) {
@@ -5349,11 +5922,24 @@ void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index) {
 	} else if (context->heap[index].type == T_LIST) {
 		if (context->heap[index].internalValuesAreManaged) {
 			for (uintptr_t i = 0; i < context->heap[index].length; i++) {
-				HeapGarbageCollectMark(context, context->heap[index].list[i].i);
+				HeapGarbageCollectMark(context, ListGet(&context->heap[index], i).i);
 			}
 		}
 	} else if (context->heap[index].type == T_MAP_INT || context->heap[index].type == T_MAP_STR) {
-		for (uintptr_t i = 0; i < context->heap[index].length; i++) {
+		if (context->heap[index].storage == STORAGE_MAP_ORDERED && context->heap[index].mapTree) {
+			HeapGarbageCollectMarkMapNode(context, &context->heap[index], context->heap[index].mapTree);
+			return;
+		}
+
+		bool hash = context->heap[index].storage == STORAGE_MAP_HASH;
+		uintptr_t count = !hash ? context->heap[index].mapLength 
+			: context->heap[index].mapIndex ? MapHashExtra(&context->heap[index])[0] : 0;
+
+		for (uintptr_t i = 0; i < count; i++) {
+			if (hash && context->heap[index].mapEntries[i].keyHash == MAP_HASH_DELETED) {
+				continue;
+			}
+
 			if (context->heap[index].type == T_MAP_STR) {
 				HeapGarbageCollectMark(context, context->heap[index].mapEntries[i].key.i);
 			}
@@ -5363,6 +5949,7 @@ void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index) {
 			}
 		}
 	} else if (context->heap[index].type == T_CONCAT) {
+		// Only recurse when both parts are concatenations, which is bounded by CONCAT_MAXIMUM_DEPTH.
 		uintptr_t index1 = context->heap[index].concat1;
 		uintptr_t index2 = context->heap[index].concat2;
 
@@ -5398,18 +5985,20 @@ void HeapGarbageCollectMark(ExecutionContext *context, uintptr_t index) {
 
 void HeapFreeEntry(ExecutionContext *context, uintptr_t i) {
 	if (context->heap[i].type == T_STR) {
-		AllocateResize(context->heap[i].text, 0);
+		if (!context->heap[i].isImmortal) AllocateResize(context->heap[i].text, 0);
+	} else if (context->heap[i].type == T_STRBUILDER) {
+		AllocateResize(context->heap[i].builderText, 0);
 	} else if (context->heap[i].type == T_STRUCT) {
 		AllocateResize((uint8_t *) context->heap[i].fields - ((context->heap[i].fieldCount + 7) & ~7), 0);
 	} else if (context->heap[i].type == T_LIST) {
-		AllocateResize(context->heap[i].list, 0);
+		if (!HeapStorageRelease(context, &context->heap[i])) AllocateResize(context->heap[i].list, 0);
 	} else if (context->heap[i].type == T_MAP_INT || context->heap[i].type == T_MAP_STR) {
-		AllocateResize(context->heap[i].mapEntries, 0);
+		if (!HeapStorageRelease(context, &context->heap[i])) MapFreeStorage(&context->heap[i]);
 	} else if (context->heap[i].type == T_HANDLETYPE) {
-		context->heap[i].close(context, context->heap[i].handleData);
+		if (context->heap[i].close) context->heap[i].close(context, context->heap[i].handleData);
 	} else if (context->heap[i].type == T_OP_DISCARD || context->heap[i].type == T_OP_ASSERT 
 			|| context->heap[i].type == T_FUNCPTR || context->heap[i].type == T_OP_CURRY
-			|| context->heap[i].type == T_CONCAT || context->heap[i].type == T_ERR
+			|| context->heap[i].type == T_CONCAT || context->heap[i].type == T_ERR || context->heap[i].type == T_OP_SLICE
 			|| context->heap[i].type == T_ANYTYPE) {
 	} else {
 		Assert(false);
@@ -5418,102 +6007,308 @@ void HeapFreeEntry(ExecutionContext *context, uintptr_t i) {
 	context->heap[i].type = T_ERROR;
 }
 
-uintptr_t HeapAllocate(ExecutionContext *context) {
-#ifdef STRESS_HEAP
-	{
-#else
-	if (!context->heapFirstUnusedEntry) {
-#endif
-		// All heapEntriesAllocated entries are in use.
+size_t HeapEntryPayloadBytes(HeapEntry *entry) {
+	// Shared storage is counted for each entry that uses it.
+	if (entry->type == T_STR) {
+		return entry->isImmortal ? 0 : entry->bytes;
+	} else if (entry->type == T_STRUCT) {
+		return ((entry->fieldCount + 7) & ~7) + entry->fieldCount * sizeof(Value);
+	} else if (entry->type == T_STRBUILDER) {
+		return entry->builderAllocated;
+	} else if (entry->type == T_LIST) {
+		return ListStorageBytes(entry->storage, entry->allocated);
+	} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
+		if (entry->storage == STORAGE_MAP_ORDERED && entry->mapTree) return entry->mapAllocated * sizeof(MapNode);
+		return entry->mapAllocated * sizeof(MapEntry) + (entry->mapIndex ? (entry->mapAllocated * 2 + MAP_HASH_EXTRA) * sizeof(uint32_t) : 0);
+	} else {
+		return 0;
+	}
+}
+
+void HeapGarbageCollectSlices(ExecutionContext *context, bool materialize) {
+	// Slices do not mark their parent string, so that we can first find out how much of each otherwise unreachable parent is still in use.
+	// If only a small part is, the slices are copied into their own allocations and the parent can be freed.
+	// Materializing moves the text, so it is only done when no pointers into strings can be held by native code.
+	// While summing the slice bytes, the externalReferenceCount of the unmarked parents is borrowed, since it must be zero.
 
-		for (uintptr_t i = 0; i < context->heapEntriesAllocated; i++) {
-			context->heap[i].gcMark = false;
+	if (materialize) {
+		for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+			HeapEntry *entry = &context->heap[i];
+			if (entry->type != T_OP_SLICE || !entry->gcMark) continue;
+			HeapEntry *parent = &context->heap[entry->sliceParent];
+			if (parent->gcMark) continue;
+			Assert(parent->type == T_STR);
+			uint64_t pinned = (uint64_t) parent->externalReferenceCount + entry->sliceBytes;
+			parent->externalReferenceCount = pinned > UINT32_MAX ? UINT32_MAX : pinned;
 		}
+	}
 
-		for (uintptr_t i = 0; i < context->heapEntriesAllocated; i++) {
-			if (context->heap[i].externalReferenceCount) {
-				HeapGarbageCollectMark(context, i);
-			}
+	for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+		HeapEntry *entry = &context->heap[i];
+		if (entry->type != T_OP_SLICE || !entry->gcMark) continue;
+		HeapEntry *parent = &context->heap[entry->sliceParent];
+		if (parent->gcMark) continue;
+
+		if (materialize && (uint64_t) parent->externalReferenceCount * STRING_SLICE_PIN_RATIO < parent->bytes) {
+			char *text = (char *) AllocateResize(NULL, entry->sliceBytes);
+			MemoryCopy(text, parent->text + entry->sliceOffset, entry->sliceBytes);
+			entry->type = T_STR;
+			entry->bytes = entry->sliceBytes;
+			entry->text = text;
+		} else {
+			parent->externalReferenceCount = 0;
+			HeapGarbageCollectMark(context, entry->sliceParent);
 		}
+	}
 
-		for (uintptr_t i = 0; i < context->globalVariableCount; i++) {
-			if (context->globalVariableIsManaged[i]) {
-				HeapGarbageCollectMark(context, context->globalVariables[i].i);
+	if (materialize) {
+		for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+			if (!context->heap[i].gcMark) {
+				context->heap[i].externalReferenceCount = 0;
 			}
 		}
+	}
+}
 
-		CoroutineState *c = context->allCoroutines;
+void HeapGarbageCollect(ExecutionContext *context, bool materializeSlices) {
+	uint64_t pauseStart = TimeGetMicroseconds();
 
-		while (c) {
-			for (uintptr_t i = 0; i < c->localVariableCount; i++) {
-				if (c->localVariableIsManaged[i]) {
-					HeapGarbageCollectMark(context, c->localVariables[i].i);
-				}
-			}
+	for (uintptr_t i = 0; i < context->heapEntriesAllocated; i++) {
+		context->heap[i].gcMark = false;
+	}
 
-			for (uintptr_t i = 0; i < c->stackPointer; i++) {
-				if (c->stackIsManaged[i]) {
-					HeapGarbageCollectMark(context, c->stack[i].i);
-				}
-			}
+	for (uintptr_t i = 0; i < context->heapEntriesAllocated; i++) {
+		if (context->heap[i].externalReferenceCount || (context->heap[i].type == T_STR && context->heap[i].isImmortal)) {
+			HeapGarbageCollectMark(context, i);
+		}
+	}
 
-			c = c->nextCoroutine;
+	for (uintptr_t i = 0; i < context->globalVariableCount; i++) {
+		if (context->globalVariableIsManaged[i]) {
+			HeapGarbageCollectMark(context, context->globalVariables[i].i);
 		}
-		
-		uintptr_t *link = &context->heapFirstUnusedEntry;
-		uintptr_t lastUnusedEntry = *link; // This can only be non-zero if STRESS_HEAP is defined.
-		uintptr_t reclaimed = 0;
+	}
 
-		for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
-#ifdef STRESS_HEAP
-			if (context->heap[i].type == T_ERROR) {
-				reclaimed++;
-				continue;
+	CoroutineState *c = context->allCoroutines;
+
+	while (c) {
+		for (uintptr_t i = 0; i < c->localVariableCount; i++) {
+			if (c->localVariableIsManaged[i]) {
+				HeapGarbageCollectMark(context, c->localVariables[i].i);
 			}
-#endif
+		}
 
-			if (!context->heap[i].gcMark) {
-				// PrintDebug("\033[0;32mFreeing index %d...\033[0m\n", i);
-				Assert(!context->heap[i].externalReferenceCount);
-				HeapFreeEntry(context, i);
-				*link = i;
-				link = &context->heap[i].nextUnusedEntry;
-				reclaimed++;
+		for (uintptr_t i = 0; i < c->stackPointer; i++) {
+			if (c->stackIsManaged[i]) {
+				HeapGarbageCollectMark(context, c->stack[i].i);
 			}
 		}
 
-		if (reclaimed <= context->heapEntriesAllocated / 5) {
-			// PrintDebug("\033[0;32mFreed only %d/%d entries. Doubling heap size...\033[0m\n", reclaimed, context->heapEntriesAllocated);
+		c = c->nextCoroutine;
+	}
 
-			intptr_t linkIndex = link == &context->heapFirstUnusedEntry ? -1 
-				: ((intptr_t) link - (intptr_t) context->heap) / (intptr_t) sizeof(HeapEntry);
-			uintptr_t oldSize = context->heapEntriesAllocated;
-#ifdef STRESS_HEAP
-			context->heapEntriesAllocated += 1;
-#else
-			context->heapEntriesAllocated *= 2;
-#endif
-			context->heap = (HeapEntry *) AllocateResize(context->heap, context->heapEntriesAllocated * sizeof(HeapEntry));
-			link = linkIndex == -1 ? &context->heapFirstUnusedEntry : &context->heap[linkIndex].nextUnusedEntry;
+	HeapGarbageCollectSlices(context, materializeSlices);
+	
+	uintptr_t *link = &context->heapFirstUnusedEntry;
+	uintptr_t lastUnusedEntry = *link; // This is non-zero if the collection was started by allocatedBytes.
+	uintptr_t reclaimed = 0;
+	uint64_t liveBytes = 0;
 
-			for (uintptr_t i = oldSize; i < context->heapEntriesAllocated; i++) {
-				context->heap[i].type = T_ERROR;
-				context->heap[i].externalReferenceCount = 0;
-				context->heap[i].nextUnusedEntry = 0;
-				*link = i;
-				link = &context->heap[i].nextUnusedEntry;
-			}
+	for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+		if (context->heap[i].type == T_ERROR) {
+			// Already in the unused entry list.
+			reclaimed++;
+			continue;
+		}
+
+		if (context->heap[i].gcMark) {
+			liveBytes += HeapEntryPayloadBytes(&context->heap[i]);
 		} else {
-			// PrintDebug("\033[0;32mFreed %d/%d entries.\033[0m\n", reclaimed, context->heapEntriesAllocated);
+			// PrintDebug("\033[0;32mFreeing index %d...\033[0m\n", i);
+			Assert(!context->heap[i].externalReferenceCount);
+			HeapFreeEntry(context, i);
+			*link = i;
+			link = &context->heap[i].nextUnusedEntry;
+			reclaimed++;
+		}
+	}
+
+	if (reclaimed <= context->heapEntriesAllocated / 5) {
+		// PrintDebug("\033[0;32mFreed only %d/%d entries. Doubling heap size...\033[0m\n", reclaimed, context->heapEntriesAllocated);
+		context->heapGrowthCount++;
+
+		intptr_t linkIndex = link == &context->heapFirstUnusedEntry ? -1 
+			: ((intptr_t) link - (intptr_t) context->heap) / (intptr_t) sizeof(HeapEntry);
+		uintptr_t oldSize = context->heapEntriesAllocated;
+#ifdef STRESS_HEAP
+		context->heapEntriesAllocated += 1;
+#else
+		context->heapEntriesAllocated *= 2;
+#endif
+		context->heap = (HeapEntry *) AllocateResize(context->heap, context->heapEntriesAllocated * sizeof(HeapEntry));
+		link = linkIndex == -1 ? &context->heapFirstUnusedEntry : &context->heap[linkIndex].nextUnusedEntry;
+
+		for (uintptr_t i = oldSize; i < context->heapEntriesAllocated; i++) {
+			context->heap[i].type = T_ERROR;
+			context->heap[i].externalReferenceCount = 0;
+			context->heap[i].isImmortal = false;
+			context->heap[i].nextUnusedEntry = 0;
+			*link = i;
+			link = &context->heap[i].nextUnusedEntry;
+		}
+	} else {
+		// PrintDebug("\033[0;32mFreed %d/%d entries.\033[0m\n", reclaimed, context->heapEntriesAllocated);
+	}
+
+	*link = lastUnusedEntry;
+
+	// Pace the next collection by the number of bytes allocated, so that the heap at most roughly doubles in size before then.
+	context->heapLiveBytes = liveBytes + context->heapExternalBytes + context->heapEntriesAllocated * sizeof(HeapEntry);
+	context->heapAllocatedBytesAtCollection = allocatedBytes;
+	context->heapCollectionThresholdBytes = context->heapLiveBytes > HEAP_COLLECTION_MINIMUM_BYTES 
+		? context->heapLiveBytes : HEAP_COLLECTION_MINIMUM_BYTES;
+
+	if (heapLimitBytes) {
+		if (context->heapLiveBytes >= heapLimitBytes) {
+			context->heapCollectionThresholdBytes = 0; // ScriptExecuteFunction will report the error.
+		} else if (context->heapCollectionThresholdBytes > heapLimitBytes - context->heapLiveBytes) {
+			context->heapCollectionThresholdBytes = heapLimitBytes - context->heapLiveBytes;
 		}
+	}
 
-		*link = lastUnusedEntry;
+	uint64_t pause = TimeGetMicroseconds() - pauseStart;
+	context->heapCollectionCount++;
+	context->heapPauseTotalMicroseconds += pause;
+	if (pause > context->heapPauseMaximumMicroseconds) context->heapPauseMaximumMicroseconds = pause;
+}
+
+uintptr_t HeapAllocate(ExecutionContext *context) {
+#ifdef STRESS_HEAP
+	HeapGarbageCollect(context, false);
+#else
+	if (!context->heapFirstUnusedEntry
+			|| allocatedBytes - context->heapAllocatedBytesAtCollection >= context->heapCollectionThresholdBytes) {
+		HeapGarbageCollect(context, false);
 	}
+#endif
 
 	uintptr_t index = context->heapFirstUnusedEntry;
 	Assert(index);
 	context->heapFirstUnusedEntry = context->heap[index].nextUnusedEntry;
 	context->heap[index].externalReferenceCount = 0;
+	context->heap[index].isImmortal = false;
+	context->heap[index].textHash = 0; // Entries converted to a T_STR in place (e.g. concatenations) rely on this.
+	return index;
+}
+
+void HeapGetStatistics(ExecutionContext *context, HeapStatistics *statistics) {
+	HeapStatistics zero = { 0 };
+	*statistics = zero;
+	statistics->collections = context->heapCollectionCount;
+	statistics->growthEvents = context->heapGrowthCount;
+	statistics->pauseTotalMicroseconds = context->heapPauseTotalMicroseconds;
+	statistics->pauseMaximumMicroseconds = context->heapPauseMaximumMicroseconds;
+	statistics->slotsAllocated = context->heapEntriesAllocated;
+	statistics->bytesExternal = context->heapExternalBytes;
+	statistics->bytesLive = context->heapLiveBytes;
+
+	for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+		HeapEntry *entry = &context->heap[i];
+
+		if (entry->type == T_ERROR) {
+			statistics->slotsUnused++;
+		} else if (entry->type == T_STR || entry->type == T_STRBUILDER || entry->type == T_OP_SLICE) {
+			statistics->slotsStr++;
+			statistics->bytesStr += HeapEntryPayloadBytes(entry);
+		} else if (entry->type == T_CONCAT) {
+			statistics->slotsConcat++;
+		} else if (entry->type == T_STRUCT) {
+			statistics->slotsStruct++;
+			statistics->bytesStruct += HeapEntryPayloadBytes(entry);
+		} else if (entry->type == T_LIST) {
+			statistics->slotsList++;
+			statistics->bytesList += HeapEntryPayloadBytes(entry);
+		} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
+			statistics->slotsMap++;
+			statistics->bytesMap += HeapEntryPayloadBytes(entry);
+		} else if (entry->type == T_FUNCPTR || entry->type == T_OP_CURRY || entry->type == T_OP_DISCARD || entry->type == T_OP_ASSERT) {
+			statistics->slotsFunction++;
+		} else if (entry->type == T_ERR) {
+			statistics->slotsErr++;
+		} else if (entry->type == T_ANYTYPE) {
+			statistics->slotsAnyType++;
+		} else if (entry->type == T_HANDLETYPE) {
+			statistics->slotsHandle++;
+		}
+	}
+}
+
+void HeapPrintStatistics(ExecutionContext *context) {
+	HeapStatistics statistics;
+	HeapGetStatistics(context, &statistics);
+	PrintDebug("Garbage collector statistics:\n");
+	PrintDebug("\tCollections: %ld (total pause %.3f ms, maximum pause %.3f ms)\n", statistics.collections,
+			statistics.pauseTotalMicroseconds / 1000.0, statistics.pauseMaximumMicroseconds / 1000.0);
+	PrintDebug("\tHeap growth events: %ld\n", statistics.growthEvents);
+	PrintDebug("\tHeap slots: %ld allocated, %ld unused\n", statistics.slotsAllocated, statistics.slotsUnused);
+	PrintDebug("\t\tstr:        %ld slots, %ld bytes\n", statistics.slotsStr, statistics.bytesStr);
+	PrintDebug("\t\tconcat:     %ld slots\n", statistics.slotsConcat);
+	PrintDebug("\t\tstruct:     %ld slots, %ld bytes\n", statistics.slotsStruct, statistics.bytesStruct);
+	PrintDebug("\t\tlist:       %ld slots, %ld bytes\n", statistics.slotsList, statistics.bytesList);
+	PrintDebug("\t\tmap:        %ld slots, %ld bytes\n", statistics.slotsMap, statistics.bytesMap);
+	PrintDebug("\t\tfunctype:   %ld slots\n", statistics.slotsFunction);
+	PrintDebug("\t\terr:        %ld slots\n", statistics.slotsErr);
+	PrintDebug("\t\tanytype:    %ld slots\n", statistics.slotsAnyType);
+	PrintDebug("\t\thandletype: %ld slots, %ld bytes of external memory\n", statistics.slotsHandle, statistics.bytesExternal);
+	PrintDebug("\tIn use after the last collection: %ld bytes\n", statistics.bytesLive);
+}
+
+uintptr_t HeapInternLiteral(ExecutionContext *context, const char *text, size_t bytes) {
+	// String literals are allocated once when the script is loaded, and shared by every execution of the literal.
+	// The text is kept in the fixed allocation made by the parser, so it lives until the engine exits.
+
+	uint64_t hash = StringHash(text, bytes);
+
+	if (context->internedLiteralCount * 2 >= context->internedLiteralsAllocated) {
+		uintptr_t *oldTable = context->internedLiterals;
+		size_t oldAllocated = context->internedLiteralsAllocated;
+		context->internedLiteralsAllocated = oldAllocated ? oldAllocated * 2 : 64;
+		context->internedLiterals = (uintptr_t *) AllocateResize(NULL, context->internedLiteralsAllocated * sizeof(uintptr_t));
+
+		for (uintptr_t i = 0; i < context->internedLiteralsAllocated; i++) {
+			context->internedLiterals[i] = 0;
+		}
+
+		for (uintptr_t i = 0; i < oldAllocated; i++) {
+			if (!oldTable[i]) continue;
+			uintptr_t slot = context->heap[oldTable[i]].textHash & (context->internedLiteralsAllocated - 1);
+			while (context->internedLiterals[slot]) slot = (slot + 1) & (context->internedLiteralsAllocated - 1);
+			context->internedLiterals[slot] = oldTable[i];
+		}
+
+		AllocateResize(oldTable, 0);
+	}
+
+	uintptr_t slot = hash & (context->internedLiteralsAllocated - 1);
+
+	while (context->internedLiterals[slot]) {
+		HeapEntry *entry = &context->heap[context->internedLiterals[slot]];
+
+		if (entry->textHash == hash && entry->bytes == bytes && 0 == MemoryCompare(entry->text, text, bytes)) {
+			return context->internedLiterals[slot];
+		}
+
+		slot = (slot + 1) & (context->internedLiteralsAllocated - 1);
+	}
+
+	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+	context->heap[index].type = T_STR;
+	context->heap[index].isImmortal = true;
+	context->heap[index].bytes = bytes;
+	context->heap[index].text = (char *) text;
+	context->heap[index].textHash = hash;
+	context->internedLiterals[slot] = index;
+	context->internedLiteralCount++;
 	return index;
 }
 
@@ -5539,56 +6334,79 @@ size_t ScriptHeapEntryGetStringBytes(HeapEntry *entry) {
 		return 0;
 	} else if (entry->type == T_CONCAT) {
 		return entry->concatBytes;
+	} else if (entry->type == T_OP_SLICE) {
+		return entry->sliceBytes;
 	} else {
 		Assert(false);
 		return 0;
 	}
 }
 
+uint32_t HeapEntryConcatDepth(HeapEntry *part1, HeapEntry *part2) {
+	// The depth of a rope only counts the concatenations where both parts are themselves concatenations.
+	// Long chains, like those made by appending to a string in a loop, can be walked with a loop;
+	// so only the branches need to be remembered when flattening or marking the rope.
+	// Keeping this depth below CONCAT_MAXIMUM_DEPTH bounds the amount of stack space needed.
+
+	if (part1->type != T_CONCAT && part2->type != T_CONCAT) return 0;
+	if (part1->type != T_CONCAT) return part2->concatDepth;
+	if (part2->type != T_CONCAT) return part1->concatDepth;
+	return (part1->concatDepth > part2->concatDepth ? part1->concatDepth : part2->concatDepth) + 1;
+}
+
 void ScriptHeapEntryConcatConvertToStringWrite(ExecutionContext *context, HeapEntry *entry, char *buffer) {
+	// Walk the rope using an explicit stack for the branches (see HeapEntryConcatDepth).
+	HeapEntry *stackEntries[CONCAT_MAXIMUM_DEPTH + 1];
+	char *stackBuffers[CONCAT_MAXIMUM_DEPTH + 1];
+	uintptr_t stackCount = 0;
+
 	while (true) {
 		if (entry->type == T_STR) {
 			MemoryCopy(buffer, entry->text, entry->bytes);
+		} else if (entry->type == T_OP_SLICE) {
+			MemoryCopy(buffer, context->heap[entry->sliceParent].text + entry->sliceOffset, entry->sliceBytes);
 		} else if (entry->type == T_EOF) {
 		} else if (entry->type == T_CONCAT) {
 			HeapEntry *part1 = &context->heap[entry->concat1], *part2 = &context->heap[entry->concat2];
 			size_t part1Bytes = ScriptHeapEntryGetStringBytes(part1);
 
-			if (part1->type == T_CONCAT) {
-				ScriptHeapEntryConcatConvertToStringWrite(context, part2, buffer + part1Bytes);
-				Assert(part2->type != T_CONCAT);
-				entry = part1;
-				continue;
-			} else if (part2->type == T_CONCAT) {
-				ScriptHeapEntryConcatConvertToStringWrite(context, part1, buffer);
-				Assert(part1->type != T_CONCAT);
-				entry = part2;
-				buffer += part1Bytes;
-				continue;
+			if (part2->type == T_CONCAT) {
+				if (part1->type == T_CONCAT) {
+					Assert(stackCount < CONCAT_MAXIMUM_DEPTH + 1);
+					stackEntries[stackCount] = part2;
+					stackBuffers[stackCount] = buffer + part1Bytes;
+					stackCount++;
+					entry = part1;
+				} else {
+					ScriptHeapEntryConcatConvertToStringWrite(context, part1, buffer); // Not a rope, so this won't recurse further.
+					entry = part2;
+					buffer += part1Bytes;
+				}
 			} else {
-				ScriptHeapEntryConcatConvertToStringWrite(context, part1, buffer);
 				ScriptHeapEntryConcatConvertToStringWrite(context, part2, buffer + part1Bytes);
+				entry = part1;
 			}
+
+			continue;
 		} else {
 			Assert(false);
 		}
 
-		break;
+		if (!stackCount) break;
+		stackCount--;
+		entry = stackEntries[stackCount];
+		buffer = stackBuffers[stackCount];
 	}
 }
 
 void ScriptHeapEntryConcatConvertToString(ExecutionContext *context, HeapEntry *entry) {
-	// TODO Efficient concatenation of many strings.
-	// TODO Preventing stack overflow.
 	Assert(entry->type == T_CONCAT);
-	HeapEntry *part1 = &context->heap[entry->concat1], *part2 = &context->heap[entry->concat2];
-	size_t part1Bytes = ScriptHeapEntryGetStringBytes(part1), part2Bytes = ScriptHeapEntryGetStringBytes(part2);
-	Assert(entry->concatBytes == part1Bytes + part2Bytes);
+	char *text = (char *) AllocateResize(NULL, entry->concatBytes);
+	size_t bytes = entry->concatBytes;
+	ScriptHeapEntryConcatConvertToStringWrite(context, entry, text);
 	entry->type = T_STR;
-	entry->bytes = part1Bytes + part2Bytes;
-	entry->text = (char *) AllocateResize(NULL, entry->bytes);
-	ScriptHeapEntryConcatConvertToStringWrite(context, part1, entry->text);
-	ScriptHeapEntryConcatConvertToStringWrite(context, part2, entry->text + part1Bytes);
+	entry->bytes = bytes;
+	entry->text = text;
 }
 
 void ScriptHeapEntryToString(ExecutionContext *context, HeapEntry *entry, const char **text, size_t *bytes) {
@@ -5601,6 +6419,9 @@ void ScriptHeapEntryToString(ExecutionContext *context, HeapEntry *entry, const
 	} else if (entry->type == T_CONCAT) {
 		ScriptHeapEntryConcatConvertToString(context, entry);
 		ScriptHeapEntryToString(context, entry, text, bytes);
+	} else if (entry->type == T_OP_SLICE) {
+		*text = context->heap[entry->sliceParent].text + entry->sliceOffset;
+		*bytes = entry->sliceBytes;
 	} else {
 		Assert(false);
 		*text = "";
@@ -5608,2740 +6429,7513 @@ void ScriptHeapEntryToString(ExecutionContext *context, HeapEntry *entry, const
 	}
 }
 
-bool ScriptReturnErrors(ExecutionContext *context, int result, Value returnValue) {
-	bool isErr = result == EXTCALL_RETURN_ERR_ERROR 
-		|| result == EXTCALL_RETURN_ERR_MANAGED 
-		|| result == EXTCALL_RETURN_ERR_UNMANAGED;
+uint64_t StringHash(const char *text, size_t bytes) {
+	// 64-bit FNV-1a. Never returns 0, so that it can be used to mean the hash hasn't been computed.
+	uint64_t hash = 0xCBF29CE484222325;
 
-	if (result == EXTCALL_RETURN_UNMANAGED || result == EXTCALL_RETURN_MANAGED || isErr) {
-		if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-			PrintDebug("Evaluation stack overflow.\n");
-			return false;
+	for (uintptr_t i = 0; i < bytes; i++) {
+		hash = (hash ^ (uint8_t) text[i]) * 0x100000001B3;
+	}
+
+	return hash ? hash : 1;
+}
+
+uint64_t HeapEntryStringHash(HeapEntry *entry) {
+	Assert(entry->type == T_STR);
+	if (!entry->textHash) entry->textHash = StringHash(entry->text, entry->bytes);
+	return entry->textHash;
+}
+
+bool HeapEntryStringsMightBeEqual(HeapEntry *entry1, HeapEntry *entry2) {
+	// Returns false if the hashes show the strings are different. The caller has already checked the lengths match.
+	// Only hashes that are already cached are used (e.g. those of literals, which are computed when they are interned);
+	// computing one here would read the whole string, whereas comparing the text stops at the first difference.
+	if (entry1->type != T_STR || entry2->type != T_STR) return true;
+	if (!entry1->textHash || !entry2->textHash) return true;
+	return entry1->textHash == entry2->textHash;
+}
+
+uint64_t StringKeyPrefix(const char *text, size_t bytes) {
+	// The first 8 bytes of the string, packed so that comparing prefixes as integers gives the same order as StringCompareRaw,
+	// which compares unsigned bytes. Missing bytes are 0, which sorts first.
+	// If the prefixes of two strings are equal, then the strings must be compared in full.
+	uint64_t prefix = 0;
+
+	for (uintptr_t i = 0; i < 8; i++) {
+		prefix = (prefix << 8) | (i < bytes ? (uint8_t) text[i] : 0);
+	}
+
+	return prefix;
+}
+
+uint64_t MapHashInteger(uint64_t x) {
+	// The finalizer from splitmix64, so that keys which only differ in their high bits are spread across the table.
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EB;
+	x ^= x >> 31;
+	return x;
+}
+
+uint64_t MapKeyHash(ExecutionContext *context, HeapEntry *map, Value key) {
+	uint64_t hash;
+
+	if (map->type == T_MAP_INT) {
+		hash = MapHashInteger(key.i);
+	} else if (context->heap[key.i].type == T_STR) {
+		hash = MapHashInteger(HeapEntryStringHash(&context->heap[key.i]));
+	} else {
+		const char *text;
+		size_t bytes;
+		ScriptHeapEntryToString(context, &context->heap[key.i], &text, &bytes);
+		hash = MapHashInteger(StringHash(text, bytes));
+	}
+
+	return hash == MAP_HASH_DELETED ? 0 : hash; // Reserved for deleted entries.
+}
+
+uint32_t *MapHashExtra(HeapEntry *map) {
+	// After the slots in the index of a hash map: [0] is the number of entries used, including deleted ones, 
+	// and [1] is 1 + the index of the first deleted entry, or 0 if there are none. The deleted entries are linked by their values.
+	return &map->mapIndex[map->mapAllocated * 2];
+}
+
+intptr_t MapHashFind(ExecutionContext *context, HeapEntry *map, Value key, uint64_t hash, 
+		const char *keyText, size_t keyBytes, uintptr_t *slot) {
+	// The index is an open addressing hash table with linear probing, which maps keys to entries.
+	// Returns the index of the entry with the key, or -1 if there is none.
+	// The slot is set to the key's position in the index, or the empty slot where it would be inserted.
+
+	*slot = 0;
+	if (!map->mapAllocated) return -1;
+	uintptr_t mask = map->mapAllocated * 2 - 1;
+
+	for (uintptr_t i = hash & mask; true; i = (i + 1) & mask) {
+		uint32_t item = map->mapIndex[i];
+		*slot = i;
+		if (!item) return -1;
+		MapEntry *probe = &map->mapEntries[item - 1];
+		if (probe->keyHash != hash) continue;
+		if (probe->key.i == key.i) return item - 1;
+
+		if (map->type == T_MAP_STR) {
+			const char *probeText;
+			size_t probeBytes;
+			ScriptHeapEntryToString(context, &context->heap[probe->key.i], &probeText, &probeBytes);
+			if (probeBytes == keyBytes && !MemoryCompare(probeText, keyText, keyBytes)) return item - 1;
 		}
+	}
+}
 
-		if (isErr) {
-			if (result != EXTCALL_RETURN_ERR_ERROR || returnValue.i) {
-				// Temporarily put the return value on the stack in case garbage collection occurs 
-				// in the following HeapAllocate (i.e. before the return value has been wrapped).
-				context->c->stackIsManaged[context->c->stackPointer] = result != EXTCALL_RETURN_ERR_UNMANAGED;
-				context->c->stack[context->c->stackPointer++] = returnValue;
-				
-				// TODO Handle memory allocation failures here.
-				uintptr_t index = HeapAllocate(context);
-				context->heap[index].type = T_ERR;
-				context->heap[index].success = result != EXTCALL_RETURN_ERR_ERROR;
-				context->heap[index].internalValuesAreManaged = result != EXTCALL_RETURN_ERR_UNMANAGED;
-				context->heap[index].errorValue = returnValue;
-				returnValue.i = index;
+void MapHashResize(HeapEntry *map, uint32_t allocated) {
+	// The entries keep their indices, including deleted entries. Without an index, the first mapLength entries are used.
+	uint32_t used = map->mapIndex ? MapHashExtra(map)[0] : map->mapLength;
+	uint32_t firstDeleted = map->mapIndex ? MapHashExtra(map)[1] : 0;
+	Assert(allocated >= used && !(allocated & (allocated - 1)));
+	uintptr_t mask = allocated * 2 - 1;
+	map->mapAllocated = allocated;
+	map->mapEntries = (MapEntry *) AllocateResize(map->mapEntries, allocated * sizeof(MapEntry));
+	map->mapIndex = (uint32_t *) AllocateResize(map->mapIndex, (allocated * 2 + MAP_HASH_EXTRA) * sizeof(uint32_t));
+	for (uintptr_t i = 0; i <= mask; i++) map->mapIndex[i] = 0;
+	MapHashExtra(map)[0] = used;
+	MapHashExtra(map)[1] = firstDeleted;
 
-				context->c->stackPointer--;
-			} else {
-				// Unknown error.
-				returnValue.i = 0;
-			}
+	for (uintptr_t i = 0; i < used; i++) {
+		if (map->mapEntries[i].keyHash == MAP_HASH_DELETED) continue;
+		uintptr_t slot = map->mapEntries[i].keyHash & mask;
+		while (map->mapIndex[slot]) slot = (slot + 1) & mask;
+		map->mapIndex[slot] = i + 1;
+	}
+}
 
-			result = EXTCALL_RETURN_MANAGED;
+uintptr_t MapHashInsert(HeapEntry *map, uintptr_t slot, uint64_t hash) {
+	// Adds an entry for a key that MapHashFind did not find, and returns its index. The caller sets the key and value.
+	// Deleted entries are reused first. The index is kept at most half full.
+	uintptr_t result;
+
+	if (map->mapIndex && MapHashExtra(map)[1]) {
+		result = MapHashExtra(map)[1] - 1;
+		MapHashExtra(map)[1] = map->mapEntries[result].value.i;
+	} else {
+		if (!map->mapIndex || MapHashExtra(map)[0] == map->mapAllocated) {
+			MapHashResize(map, map->mapAllocated ? map->mapAllocated * 2 : 8);
+			uintptr_t mask = map->mapAllocated * 2 - 1;
+			slot = hash & mask;
+			while (map->mapIndex[slot]) slot = (slot + 1) & mask;
 		}
 
-		context->c->stackIsManaged[context->c->stackPointer] = result == EXTCALL_RETURN_MANAGED;
-		context->c->stack[context->c->stackPointer++] = returnValue;
+		result = MapHashExtra(map)[0]++;
 	}
 
-	return true;
+	map->mapIndex[slot] = result + 1;
+	map->mapEntries[result].keyHash = hash;
+	map->mapLength++;
+	return result;
 }
 
-int ScriptExecuteFunction(uintptr_t instructionPointer, ExecutionContext *context) {
-#ifndef NO_SCRIPT_EXECUTE
-	// TODO Things to verify if loading untrusted scripts -- is this a feature we will need?
-	// 	Checking we don't go off the end of the function body.
-	// 	Checking that this is actually a valid function body pointer.
-	// 	Checking various integer overflows.
+void MapHashDelete(HeapEntry *map, uintptr_t slot) {
+	// Removes the entry referenced by the slot. Rather than leaving a tombstone, the following slots in the probe sequence
+	// are shifted back to fill the gap. The other entries are not moved, so that iterations over the map are not disturbed;
+	// instead, the removed entry is marked as deleted, and it is reused by the next insertion.
 
-	uintptr_t variableBase = context->c->localVariableCount - 1;
-	uint8_t *functionData = context->functionData->data;
+	uintptr_t mask = map->mapAllocated * 2 - 1;
+	uint32_t removed = map->mapIndex[slot] - 1;
+	uintptr_t hole = slot;
 
-	while (true) {
-		uint8_t command = functionData[instructionPointer++];
+	for (uintptr_t i = (slot + 1) & mask; map->mapIndex[i]; i = (i + 1) & mask) {
+		uintptr_t home = map->mapEntries[map->mapIndex[i] - 1].keyHash & mask;
 
-		if (debugBytecodeLevel >= 1) {
-			PrintDebug("--> %d, %ld, %ld, %ld\n", command, instructionPointer - 1, context->c->id, context->c->stackPointer);
-			if (debugBytecodeLevel >= 2) PrintBackTrace(context, instructionPointer - 1, context->c, "");
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			map->mapIndex[hole] = map->mapIndex[i];
+			hole = i;
 		}
+	}
 
-		if (command == T_BLOCK || command == T_FUNCBODY) {
-			uint16_t newVariableCount = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
-			instructionPointer += 2;
+	map->mapIndex[hole] = 0;
+	map->mapLength--;
+	map->mapEntries[removed].keyHash = MAP_HASH_DELETED;
+	map->mapEntries[removed].key.i = 0;
+	map->mapEntries[removed].value.i = MapHashExtra(map)[1];
+	MapHashExtra(map)[1] = removed + 1;
+}
 
-			if (context->c->localVariableCount + newVariableCount > context->c->localVariablesAllocated) {
-				// TODO Handling memory errors here.
-				context->c->localVariablesAllocated = context->c->localVariableCount + newVariableCount;
-				context->c->localVariables = (Value *) AllocateResize(context->c->localVariables, context->c->localVariablesAllocated * sizeof(Value)); 
-				context->c->localVariableIsManaged = (bool *) AllocateResize(context->c->localVariableIsManaged, context->c->localVariablesAllocated * sizeof(bool)); 
-			}
+int MapCompareKeys(ExecutionContext *context, HeapEntry *map, Value key, uint64_t keyPrefix, const char *keyText, size_t keyBytes, 
+		Value otherKey, uint64_t otherKeyPrefix) {
+	// Returns a negative number if the key is less than the other key, 0 if they are equal, or a positive number if it is greater.
+	// For T_MAP_STR, the text of the key must be given, and most comparisons are decided by the prefixes alone.
 
-			MemoryCopy(context->c->localVariableIsManaged + context->c->localVariableCount, functionData + instructionPointer, newVariableCount);
-			instructionPointer += newVariableCount;
+	if (map->type == T_MAP_INT) {
+		return key.i < otherKey.i ? -1 : key.i > otherKey.i ? 1 : 0;
+	}
 
-			for (uintptr_t i = context->c->localVariableCount; i < context->c->localVariableCount + newVariableCount; i++) {
-				if (command == T_FUNCBODY) {
-					if (context->c->stackPointer < 1) return -1;
-					context->c->localVariables[i] = context->c->stack[--context->c->stackPointer];
+	if (keyPrefix != otherKeyPrefix) return keyPrefix < otherKeyPrefix ? -1 : 1;
+	if (key.i == otherKey.i) return 0;
+	const char *otherKeyText;
+	size_t otherKeyBytes;
+	ScriptHeapEntryToString(context, &context->heap[otherKey.i], &otherKeyText, &otherKeyBytes);
+	return StringCompareRaw(keyText, keyBytes, otherKeyText, otherKeyBytes);
+}
+
+int MapCompareEntries(ExecutionContext *context, HeapEntry *map, MapEntry *entry, MapEntry *other) {
+	if (map->type == T_MAP_STR && entry->keyPrefix == other->keyPrefix && entry->key.i != other->key.i) {
+		const char *keyText;
+		size_t keyBytes;
+		ScriptHeapEntryToString(context, &context->heap[entry->key.i], &keyText, &keyBytes);
+		return MapCompareKeys(context, map, entry->key, entry->keyPrefix, keyText, keyBytes, other->key, other->keyPrefix);
+	}
+
+	return MapCompareKeys(context, map, entry->key, entry->keyPrefix, NULL, 0, other->key, other->keyPrefix);
+}
+
+void MapSortEntries(ExecutionContext *context, HeapEntry *map, MapEntry *entries, uintptr_t count) {
+	// A bottom-up merge sort of the entries by key. The key prefixes must already be set.
+	// The sort is stable, so entries with equal keys stay in the same order.
+
+	uintptr_t sorted = 1;
+	while (sorted < count && MapCompareEntries(context, map, &entries[sorted - 1], &entries[sorted]) <= 0) sorted++;
+	if (sorted >= count) return;
+
+	MapEntry *source = entries;
+	MapEntry *destination = (MapEntry *) AllocateResize(NULL, count * sizeof(MapEntry));
+	MapEntry *buffer = destination;
+
+	for (uintptr_t width = 1; width < count; width *= 2) {
+		for (uintptr_t start = 0; start < count; start += width * 2) {
+			uintptr_t middle = start + width < count ? start + width : count;
+			uintptr_t end = start + width * 2 < count ? start + width * 2 : count;
+			uintptr_t i = start, j = middle, k = start;
+
+			while (i < middle && j < end) {
+				if (MapCompareEntries(context, map, &source[j], &source[i]) < 0) {
+					destination[k++] = source[j++];
 				} else {
-					Value zero = { 0 };
-					context->c->localVariables[i] = zero;
+					destination[k++] = source[i++];
 				}
 			}
 
-			context->c->localVariableCount += newVariableCount;
-		} else if (command == T_EXIT_SCOPE) {
-			uint16_t count = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
-			instructionPointer += 2;
-			if (context->c->localVariableCount < count) return -1;
-			context->c->localVariableCount -= count;
-		} else if (command == T_NUMERIC_LITERAL) {
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-				return 0;
-			}
+			while (i < middle) destination[k++] = source[i++];
+			while (j < end) destination[k++] = source[j++];
+		}
 
-			context->c->stackIsManaged[context->c->stackPointer] = false;
-			MemoryCopy(&context->c->stack[context->c->stackPointer++], &functionData[instructionPointer], sizeof(Value));
-			instructionPointer += sizeof(Value);
-		} else if (command == T_NULL || command == T_ZERO) {
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-				return 0;
-			}
+		MapEntry *swap = source;
+		source = destination;
+		destination = swap;
+	}
 
-			context->c->stackIsManaged[context->c->stackPointer] = command == T_NULL;
-			context->c->stack[context->c->stackPointer++].i = 0;
-		} else if (command == T_STRING_LITERAL) {
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-				return 0;
-			}
+	if (source != entries) MemoryCopy(entries, source, count * sizeof(MapEntry));
+	AllocateResize(buffer, 0);
+}
 
-			uint32_t textBytes;
-			MemoryCopy(&textBytes, &functionData[instructionPointer], sizeof(textBytes));
-			instructionPointer += sizeof(textBytes);
+MapNode *MapNodeCreate(HeapEntry *map, bool isLeaf) {
+	MapNode *node = (MapNode *) AllocateResize(NULL, sizeof(MapNode));
+	node->count = 0;
+	node->isLeaf = isLeaf;
+	if (isLeaf) node->previous = node->next = NULL;
+	map->mapAllocated++;
+	return node;
+}
 
-			// TODO Handle memory allocation failures here.
-			uintptr_t index = HeapAllocate(context);
-			context->heap[index].type = T_STR;
-			context->heap[index].text = (char *) AllocateResize(NULL, textBytes);
-			context->heap[index].bytes = textBytes;
-			MemoryCopy(context->heap[index].text, &functionData[instructionPointer], textBytes);
-			instructionPointer += textBytes;
+void MapNodeDestroy(HeapEntry *map, MapNode *node) {
+	if (map->mapCacheLeaf == node) map->mapCacheLeaf = NULL;
+	AllocateResize(node, 0);
+	map->mapAllocated--;
+}
 
-			Value v;
-			v.i = index;
-			context->c->stackIsManaged[context->c->stackPointer] = true;
-			context->c->stack[context->c->stackPointer++] = v;
-		} else if (command == T_CONCAT) {
-			if (context->c->stackPointer < 2) return -1;
-			uint64_t index1 = context->c->stack[context->c->stackPointer - 2].i;
-			uint64_t index2 = context->c->stack[context->c->stackPointer - 1].i;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			if (context->heapEntriesAllocated <= index1) return -1;
-			if (context->heapEntriesAllocated <= index2) return -1;
-			Assert(index1 <= 0xFFFFFFFF && index2 <= 0xFFFFFFFF);
-			size_t bytes1 = ScriptHeapEntryGetStringBytes(&context->heap[index1]);
-			size_t bytes2 = ScriptHeapEntryGetStringBytes(&context->heap[index2]);
-			uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
-			context->heap[index].type = T_CONCAT;
-			context->heap[index].concat1 = index1;
-			context->heap[index].concat2 = index2;
-			context->heap[index].concatBytes = bytes1 + bytes2;
+void MapNodeMoveItems(MapNode *to, uintptr_t toIndex, MapNode *from, uintptr_t fromIndex, uintptr_t count) {
+	// Moves entries between leaves, or children and their separators between branches. The ranges may overlap.
+	// The caller updates the counts.
 
-			// At most one argument can be a T_CONCAT (ohterwise converting to a string could stack overflow).
-			if (context->heap[index1].type == T_CONCAT && context->heap[index2].type == T_CONCAT) {
-				ScriptHeapEntryConcatConvertToString(context, bytes1 < bytes2 ? &context->heap[index1] : &context->heap[index2]);
-			}
+	if (from->isLeaf) {
+		MemoryMove(&to->entries[toIndex], &from->entries[fromIndex], count * sizeof(MapEntry));
+	} else {
+		MemoryMove(&to->children[toIndex], &from->children[fromIndex], count * sizeof(MapNode *));
+		MemoryMove(&to->separators[toIndex], &from->separators[fromIndex], count * sizeof(MapSeparator));
+	}
+}
 
-			context->c->stack[context->c->stackPointer - 2].i = index;
-			context->c->stackPointer--;
-		} else if (command == T_INTERPOLATE_STR || command == T_INTERPOLATE_BOOL 
-				|| command == T_INTERPOLATE_INT || command == T_INTERPOLATE_FLOAT
-				|| command == T_INTERPOLATE_ILIST) {
-			// TODO Handle memory allocation failures here.
-			uintptr_t index = HeapAllocate(context);
-			// NOTE Call HeapAllocate before STACK_READ_STRING!!
+MapSeparator MapNodeLeastKey(MapNode *node) {
+	while (!node->isLeaf) node = node->children[0];
+	return (MapSeparator) { node->entries[0].key, node->entries[0].keyPrefix };
+}
 
-			STACK_READ_STRING(text1, bytes1, 3);
-			STACK_READ_STRING(text3, bytes3, 1);
+void MapTreeFree(MapNode *node) {
+	if (!node->isLeaf) {
+		for (uintptr_t i = 0; i < node->count; i++) {
+			MapTreeFree(node->children[i]);
+		}
+	}
 
-			char *freeText = NULL;
-			const char *text2 = "";
-			size_t bytes2 = 0;
-			char temp[30];
+	AllocateResize(node, 0);
+}
 
-			if (command == T_INTERPOLATE_STR) {
-				STACK_READ_STRING(entryText2, entryBytes2, 2);
-				text2 = entryText2, bytes2 = entryBytes2;
-			} else if (command == T_INTERPOLATE_BOOL) {
-				text2 = context->c->stack[context->c->stackPointer - 2].i ? "true" : "false";
-				bytes2 = context->c->stack[context->c->stackPointer - 2].i ? 4 : 5;
-			} else if (command == T_INTERPOLATE_INT) {
-				text2 = temp;
-				bytes2 = PrintIntegerToBuffer(temp, sizeof(temp), context->c->stack[context->c->stackPointer - 2].i);
-			} else if (command == T_INTERPOLATE_FLOAT) {
-				text2 = temp;
-				bytes2 = PrintFloatToBuffer(temp, sizeof(temp), context->c->stack[context->c->stackPointer - 2].f);
-			} else if (command == T_INTERPOLATE_ILIST) {
-				if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-				uint64_t index2 = context->c->stack[context->c->stackPointer - 2].i;
-				if (context->heapEntriesAllocated <= index2) return -1;
-				HeapEntry *entry2 = &context->heap[index2];
-				if (entry2->type != T_EOF && entry2->type != T_LIST) return -1;
-
-				if (entry2->type == T_EOF) {
-					text2 = "null";
-					bytes2 = 4;
-				} else if (entry2->length == 0) {
-					text2 = "[]";
-					bytes2 = 2;
-				} else {
-					if (entry2->internalValuesAreManaged) return -1;
-					bytes2 = 4;
+void MapTreeBuild(HeapEntry *map) {
+	// Converts the sorted array of entries to a tree. Nodes are filled to 3/4 of their capacity, to leave space for insertions.
+	uintptr_t fill = MAP_NODE_CAPACITY * 3 / 4;
+	uintptr_t count = map->mapLength ? (map->mapLength + fill - 1) / fill : 1;
+	MapNode **level = (MapNode **) AllocateResize(NULL, count * sizeof(MapNode *));
+	map->mapAllocated = 0;
 
-					for (uintptr_t i = 0; i < entry2->length; i++) {
-						bytes2 += PrintIntegerToBuffer(temp, sizeof(temp), entry2->list[i].i) + 2;
-					}
+	for (uintptr_t i = 0; i < count; i++) {
+		// Spread the entries evenly, so that the last leaf is not left with too few.
+		uintptr_t start = map->mapLength * i / count, end = map->mapLength * (i + 1) / count;
+		MapNode *leaf = MapNodeCreate(map, true);
+		MemoryCopy(leaf->entries, &map->mapEntries[start], (end - start) * sizeof(MapEntry));
+		leaf->count = end - start;
+		leaf->previous = i ? level[i - 1] : NULL;
+		if (i) level[i - 1]->next = leaf;
+		level[i] = leaf;
+	}
 
-					freeText = (char *) AllocateResize(freeText, bytes2);
-					text2 = freeText;
-					bytes2 = 0;
-					freeText[bytes2++] = '[';
-					freeText[bytes2++] = ' ';
+	while (count > 1) {
+		uintptr_t parents = (count + fill - 1) / fill;
 
-					for (uintptr_t i = 0; i < entry2->length; i++) {
-						bytes2 += PrintIntegerToBuffer(freeText + bytes2, sizeof(temp) /* enough space */, entry2->list[i].i);
-						freeText[bytes2++] = ',';
-						freeText[bytes2++] = ' ';
-					}
+		for (uintptr_t i = 0; i < parents; i++) {
+			uintptr_t start = count * i / parents, end = count * (i + 1) / parents;
+			MapNode *branch = MapNodeCreate(map, false);
 
-					bytes2 -= 2;
-					freeText[bytes2++] = ' ';
-					freeText[bytes2++] = ']';
-				}
+			for (uintptr_t j = start; j < end; j++) {
+				branch->children[j - start] = level[j];
+				branch->separators[j - start] = MapNodeLeastKey(level[j]);
 			}
 
-			context->heap[index].type = T_STR;
-			context->heap[index].bytes = bytes1 + bytes2 + bytes3;
-			context->heap[index].text = (char *) AllocateResize(NULL, context->heap[index].bytes);
-			if (bytes1) MemoryCopy(context->heap[index].text + 0,               text1, bytes1);
-			if (bytes2) MemoryCopy(context->heap[index].text + bytes1,          text2, bytes2);
-			if (bytes3) MemoryCopy(context->heap[index].text + bytes1 + bytes2, text3, bytes3);
-			context->c->stack[context->c->stackPointer - 3].i = index;
+			branch->count = end - start;
+			level[i] = branch;
+		}
 
-			if (freeText) AllocateResize(freeText, 0);
+		count = parents;
+	}
 
-			context->c->stackPointer -= 2;
-		} else if (command == T_VARIABLE) {
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintDebug("Stack overflow.\n");
-				return -1;
-			}
+	map->mapTree = level[0];
+	AllocateResize(level, 0);
+	AllocateResize(map->mapEntries, 0);
+	map->mapCacheLeaf = NULL;
+}
 
-			int32_t scopeIndex;
-			MemoryCopy(&scopeIndex, &functionData[instructionPointer], sizeof(scopeIndex));
-			instructionPointer += sizeof(scopeIndex);
+void MapTreeFlatten(HeapEntry *map) {
+	// Converts the tree back to a sorted array of entries.
+	MapNode *leaf = map->mapTree;
+	while (!leaf->isLeaf) leaf = leaf->children[0];
+	map->mapEntries = (MapEntry *) AllocateResize(NULL, map->mapLength * sizeof(MapEntry));
+	uintptr_t position = 0;
 
-			if (scopeIndex >= 0) {
-				if ((uintptr_t) scopeIndex >= context->globalVariableCount) return -1;
-				context->c->stackIsManaged[context->c->stackPointer] = context->globalVariableIsManaged[scopeIndex];
-				context->c->stack[context->c->stackPointer++] = context->globalVariables[scopeIndex];
+	for (; leaf; leaf = leaf->next) {
+		MemoryCopy(&map->mapEntries[position], leaf->entries, leaf->count * sizeof(MapEntry));
+		position += leaf->count;
+	}
+
+	Assert(position == map->mapLength);
+	MapTreeFree(map->mapTree);
+	map->mapTree = NULL;
+	map->mapAllocated = map->mapLength;
+}
+
+bool MapTreeFind(ExecutionContext *context, HeapEntry *map, Value key, uint64_t keyPrefix, const char *keyText, size_t keyBytes, 
+		MapTreePath *path, bool useCache) {
+	// Finds the leaf where the key is, or would be inserted, recording the branches taken to get there.
+	// path->index is set to the position of the first entry in the leaf whose key is not less than the key.
+	// Returns true if the key was found.
+	// If useCache, the most recently accessed leaf is tried first, which makes sequential access cheap.
+	// When it is used, path->fromCache is set and no branches are recorded, so the path cannot be used to split or merge nodes.
+
+	MapNode *node = map->mapTree;
+	MapNode *cache = map->mapCacheLeaf;
+	path->depth = 0;
+	path->fromCache = false;
+
+	if (useCache && cache && cache != node && cache->count) {
+		// The key belongs in this leaf if it is within the range of its keys, or beyond that range at the ends of the map.
+		MapEntry *first = &cache->entries[0], *last = &cache->entries[cache->count - 1];
+
+		if ((!cache->previous || MapCompareKeys(context, map, key, keyPrefix, keyText, keyBytes, first->key, first->keyPrefix) >= 0)
+				&& (!cache->next || MapCompareKeys(context, map, key, keyPrefix, keyText, keyBytes, last->key, last->keyPrefix) <= 0)) {
+			node = cache;
+			path->fromCache = true;
+		}
+	}
+
+	while (!node->isLeaf) {
+		// Take the last child whose separator is not greater than the key.
+		uintptr_t low = 1, high = node->count;
+
+		while (low < high) {
+			uintptr_t middle = (low + high) >> 1;
+			MapSeparator *separator = &node->separators[middle];
+
+			if (MapCompareKeys(context, map, key, keyPrefix, keyText, keyBytes, separator->key, separator->keyPrefix) < 0) {
+				high = middle;
 			} else {
-				scopeIndex = variableBase - scopeIndex;
-				if ((uintptr_t) scopeIndex >= context->c->localVariableCount) return -1;
-				context->c->stackIsManaged[context->c->stackPointer] = context->c->localVariableIsManaged[scopeIndex];
-				context->c->stack[context->c->stackPointer++] = context->c->localVariables[scopeIndex];
+				low = middle + 1;
 			}
-		} else if (command == T_EQUALS) {
-			if (!context->c->stackPointer) return -1;
-			int32_t scopeIndex;
-			MemoryCopy(&scopeIndex, &functionData[instructionPointer], sizeof(scopeIndex));
-			instructionPointer += sizeof(scopeIndex);
+		}
 
-			if (scopeIndex >= 0) {
-				if ((uintptr_t) scopeIndex >= context->globalVariableCount) return -1;
-				if (context->globalVariableIsManaged[scopeIndex] != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-				context->globalVariables[scopeIndex] = context->c->stack[--context->c->stackPointer];
+		Assert(path->depth < MAP_TREE_MAXIMUM_DEPTH);
+		path->branches[path->depth] = node;
+		path->children[path->depth] = low - 1;
+		path->depth++;
+		node = node->children[low - 1];
+	}
+
+	uintptr_t low = 0, high = node->count;
+	path->leaf = node;
+	map->mapCacheLeaf = node;
+
+	while (low < high) {
+		uintptr_t middle = (low + high) >> 1;
+		MapEntry *entry = &node->entries[middle];
+		int comparison = MapCompareKeys(context, map, key, keyPrefix, keyText, keyBytes, entry->key, entry->keyPrefix);
+
+		if (comparison < 0) {
+			high = middle;
+		} else if (comparison > 0) {
+			low = middle + 1;
+		} else {
+			path->index = middle;
+			return true;
+		}
+	}
+
+	path->index = low;
+	return false;
+}
+
+void MapTreeInsertChild(HeapEntry *map, MapTreePath *path, uintptr_t level, MapSeparator separator, MapNode *child) {
+	// Inserts a new child after the one taken by the path at the given level. Full branches are split, up to the root.
+
+	while (level) {
+		MapNode *parent = path->branches[level - 1];
+		uintptr_t position = path->children[level - 1] + 1;
+		MapNode *right = NULL;
+		MapSeparator up;
+
+		if (parent->count == MAP_NODE_CAPACITY) {
+			uintptr_t half = MAP_NODE_CAPACITY / 2;
+			right = MapNodeCreate(map, false);
+			MapNodeMoveItems(right, 0, parent, half, MAP_NODE_CAPACITY - half);
+			right->count = MAP_NODE_CAPACITY - half;
+			parent->count = half;
+			up = right->separators[0];
+			if (position > half) parent = right, position -= half;
+		}
+
+		MapNodeMoveItems(parent, position + 1, parent, position, parent->count - position);
+		parent->children[position] = child;
+		parent->separators[position] = separator;
+		parent->count++;
+
+		if (!right) return;
+		separator = up;
+		child = right;
+		level--;
+	}
+
+	MapNode *root = MapNodeCreate(map, false);
+	root->children[0] = map->mapTree;
+	root->children[1] = child;
+	root->separators[1] = separator;
+	root->count = 2;
+	map->mapTree = root;
+}
+
+MapEntry *MapTreeInsert(HeapEntry *map, MapTreePath *path) {
+	// Makes space for an entry at the position found by MapTreeFind, and returns it. The caller sets the key and value.
+	// If the leaf is full, the path must have been found without the cache.
+	MapNode *leaf = path->leaf;
+	uintptr_t index = path->index;
+
+	if (leaf->count == MAP_NODE_CAPACITY) {
+		Assert(!path->fromCache);
+		uintptr_t half = MAP_NODE_CAPACITY / 2;
+		MapNode *right = MapNodeCreate(map, true);
+		MapNodeMoveItems(right, 0, leaf, half, MAP_NODE_CAPACITY - half);
+		right->count = MAP_NODE_CAPACITY - half;
+		leaf->count = half;
+		right->previous = leaf;
+		right->next = leaf->next;
+		if (right->next) right->next->previous = right;
+		leaf->next = right;
+		MapTreeInsertChild(map, path, path->depth, MapNodeLeastKey(right), right);
+		if (index > half) leaf = right, index -= half;
+	}
+
+	MapNodeMoveItems(leaf, index + 1, leaf, index, leaf->count - index);
+	leaf->count++;
+	map->mapLength++;
+	map->mapCacheLeaf = leaf;
+	return &leaf->entries[index];
+}
+
+void MapTreeDelete(HeapEntry *map, MapTreePath *path) {
+	// Removes the entry found by MapTreeFind without the cache. Nodes left with too few items borrow from, or are merged with, a sibling.
+	Assert(!path->fromCache);
+	MapNode *node = path->leaf;
+	MapNodeMoveItems(node, path->index, node, path->index + 1, node->count - path->index - 1);
+	node->count--;
+	map->mapLength--;
+
+	for (uintptr_t level = path->depth; level && node->count < MAP_NODE_MINIMUM; level--) {
+		MapNode *parent = path->branches[level - 1];
+		uintptr_t i = path->children[level - 1];
+		if (i == parent->count - 1) i--;
+		MapNode *left = parent->children[i], *right = parent->children[i + 1];
+
+		// Bring the separator down, so that the items of branches can be moved as a single sequence.
+		if (!right->isLeaf) right->separators[0] = parent->separators[i + 1];
+
+		if (left->count + right->count <= MAP_NODE_CAPACITY) {
+			MapNodeMoveItems(left, left->count, right, 0, right->count);
+			left->count += right->count;
+
+			if (left->isLeaf) {
+				left->next = right->next;
+				if (left->next) left->next->previous = left;
+			}
+
+			MapNodeDestroy(map, right);
+			MapNodeMoveItems(parent, i + 1, parent, i + 2, parent->count - i - 2);
+			parent->count--;
+			node = parent;
+		} else {
+			uintptr_t total = left->count + right->count;
+			uintptr_t leftCount = total / 2;
+
+			if (left->count > leftCount) {
+				uintptr_t move = left->count - leftCount;
+				MapNodeMoveItems(right, move, right, 0, right->count);
+				MapNodeMoveItems(right, 0, left, leftCount, move);
 			} else {
-				scopeIndex = variableBase - scopeIndex;
-				if ((uintptr_t) scopeIndex >= context->c->localVariableCount) return -1;
-				if (context->c->localVariableIsManaged[scopeIndex] != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-				context->c->localVariables[scopeIndex] = context->c->stack[--context->c->stackPointer];
+				uintptr_t move = leftCount - left->count;
+				MapNodeMoveItems(left, left->count, right, 0, move);
+				MapNodeMoveItems(right, 0, right, move, right->count - move);
 			}
-		} else if (command == T_EQUALS_DOT) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+			left->count = leftCount;
+			right->count = total - leftCount;
+			parent->separators[i + 1] = right->isLeaf ? MapNodeLeastKey(right) : right->separators[0];
+			break;
+		}
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The struct is null.\n");
-				return 0;
-			}
+	MapNode *root = map->mapTree;
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_STRUCT) return -1;
+	if (!root->isLeaf && root->count == 1) {
+		map->mapTree = root->children[0];
+		MapNodeDestroy(map, root);
+	}
+}
 
-			int32_t fieldIndex;
-			MemoryCopy(&fieldIndex, &functionData[instructionPointer], sizeof(fieldIndex));
-			instructionPointer += sizeof(fieldIndex);
-			bool isManaged = fieldIndex < 0;
-			if (isManaged) fieldIndex = -fieldIndex - 1;
-			if (fieldIndex < 0 || fieldIndex >= entry->fieldCount) return -1;
+void MapFreeStorage(HeapEntry *map) {
+	if (map->storage == STORAGE_MAP_ORDERED && map->mapTree) {
+		MapTreeFree(map->mapTree);
+	} else {
+		if (map->storage == STORAGE_MAP_HASH) AllocateResize(map->mapIndex, 0);
+		AllocateResize(map->mapEntries, 0);
+	}
 
-			entry->fields[fieldIndex] = context->c->stack[context->c->stackPointer - 2];
-			if (isManaged != context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			((uint8_t *) entry->fields - 1)[-fieldIndex] = isManaged;
+	map->mapEntries = NULL;
+	map->mapIndex = NULL;
+	map->mapLength = map->mapAllocated = 0;
+}
 
-			context->c->stackPointer -= 2;
-		} else if (command == T_EQUALS_LIST) {
-			if (context->c->stackPointer < 3) return -1;
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+void MapConvertToHash(ExecutionContext *context, HeapEntry *map) {
+	if (map->storage == STORAGE_MAP_HASH) return;
+	if (map->storage == STORAGE_MAP_ORDERED && map->mapTree) MapTreeFlatten(map);
+	uint32_t allocated = 8;
+	while (allocated < map->mapLength) allocated *= 2;
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+	for (uintptr_t i = 0; i < map->mapLength; i++) {
+		map->mapEntries[i].keyHash = MapKeyHash(context, map, map->mapEntries[i].key);
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	map->storage = STORAGE_MAP_HASH;
+	MapHashResize(map, allocated);
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+void MapConvertToOrdered(ExecutionContext *context, HeapEntry *map) {
+	if (map->storage == STORAGE_MAP_ORDERED) return;
 
-			index = context->c->stack[context->c->stackPointer - 1].i;
+	if (map->storage == STORAGE_MAP_HASH) {
+		// The deleted entries are removed, and the key hashes are replaced by the prefixes, which are needed for sorting.
+		uintptr_t used = map->mapIndex ? MapHashExtra(map)[0] : 0, count = 0;
 
-			if (index >= entry->length) {
-				PrintError4(context, instructionPointer - 1, "The index %ld is not valid for the list, which has length %d.\n", index, entry->length);
-				return 0;
-			}
+		for (uintptr_t i = 0; i < used; i++) {
+			if (map->mapEntries[i].keyHash != MAP_HASH_DELETED) map->mapEntries[count++] = map->mapEntries[i];
+		}
 
-			entry->list[index] = context->c->stack[context->c->stackPointer - 3];
-			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+		Assert(count == map->mapLength);
+		map->mapIndex = (uint32_t *) AllocateResize(map->mapIndex, 0);
 
-			context->c->stackPointer -= 3;
-		} else if (command == T_INDEX_LIST) {
-			if (context->c->stackPointer < 2) return -1;
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+		for (uintptr_t i = 0; i < map->mapLength; i++) {
+			const char *keyText;
+			size_t keyBytes;
+			if (map->type == T_MAP_INT) { map->mapEntries[i].keyPrefix = 0; continue; }
+			ScriptHeapEntryToString(context, &context->heap[map->mapEntries[i].key.i], &keyText, &keyBytes);
+			map->mapEntries[i].keyPrefix = StringKeyPrefix(keyText, keyBytes);
+		}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+		MapSortEntries(context, map, map->mapEntries, map->mapLength);
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	map->storage = STORAGE_MAP_ORDERED;
+	if (map->mapLength > MAP_NODE_CAPACITY) MapTreeBuild(map);
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+void MapInsertEntries(ExecutionContext *context, HeapEntry *map, MapEntry *entries, uintptr_t count) {
+	// Sets the keys in the map to the values given by the entries, as if they were set one at a time in order,
+	// so if a key is repeated the last value is kept. Only the keys and values of the entries are used.
+	// The entries must not be stored in the map, and nothing may be allocated on the heap while this runs.
 
-			index = context->c->stack[context->c->stackPointer - 1].i;
+	if (map->storage == STORAGE_DEFAULT && map->mapLength + count > MAP_TREE_THRESHOLD) {
+		MapConvertToOrdered(context, map);
+	}
 
-			if (index >= entry->length) {
-				PrintError4(context, instructionPointer - 1, "The index %ld is not valid for the list, which has length %d.\n", index, entry->length);
-				return 0;
-			}
+	if (map->storage == STORAGE_MAP_HASH) {
+		for (uintptr_t i = 0; i < count; i++) {
+			const char *keyText = NULL;
+			size_t keyBytes = 0;
+			uintptr_t slot;
+			if (map->type == T_MAP_STR) ScriptHeapEntryToString(context, &context->heap[entries[i].key.i], &keyText, &keyBytes);
+			uint64_t keyHash = MapKeyHash(context, map, entries[i].key);
+			intptr_t position = MapHashFind(context, map, entries[i].key, keyHash, keyText, keyBytes, &slot);
+			if (position == -1) position = MapHashInsert(map, slot, keyHash);
+			map->mapEntries[position].key = entries[i].key;
+			map->mapEntries[position].value = entries[i].value;
+		}
 
-			context->c->stack[context->c->stackPointer - 2] = entry->list[index];
-			context->c->stackIsManaged[context->c->stackPointer - 2] = entry->internalValuesAreManaged;
-			context->c->stackPointer--;
-		} else if (command == T_OP_FIRST || command == T_OP_LAST) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+		return;
+	}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+	if (map->mapTree && count < map->mapLength / 8) {
+		// Only a few entries are being added, so it is quicker to insert them into the tree than to rebuild it.
+		for (uintptr_t i = 0; i < count; i++) {
+			const char *keyText = NULL;
+			size_t keyBytes = 0;
+			uint64_t keyPrefix = 0;
+			MapTreePath path;
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
+			if (map->type == T_MAP_STR) {
+				ScriptHeapEntryToString(context, &context->heap[entries[i].key.i], &keyText, &keyBytes);
+				keyPrefix = StringKeyPrefix(keyText, keyBytes);
 			}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+			MapEntry *target;
 
-			if (!entry->length) {
-				PrintError4(context, instructionPointer - 1, "The list is empty.\n");
-				return 0;
+			if (MapTreeFind(context, map, entries[i].key, keyPrefix, keyText, keyBytes, &path, true)) {
+				target = &path.leaf->entries[path.index];
+			} else {
+				if (path.fromCache && path.leaf->count == MAP_NODE_CAPACITY) {
+					MapTreeFind(context, map, entries[i].key, keyPrefix, keyText, keyBytes, &path, false);
+				}
+
+				target = MapTreeInsert(map, &path);
+				target->key = entries[i].key;
+				target->keyPrefix = keyPrefix;
 			}
 
-			context->c->stack[context->c->stackPointer - 1] = entry->list[command == T_OP_FIRST ? 0 : entry->length - 1];
-			context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
-		} else if (command == T_DOT) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			target->value = entries[i].value;
+		}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+		return;
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The struct is null.\n");
-				return 0;
-			}
+	// Sort the entries, and then merge them with the existing sorted array.
+	if (map->mapTree) MapTreeFlatten(map);
+	MapEntry *added = (MapEntry *) AllocateResize(NULL, count * sizeof(MapEntry));
+	MemoryCopy(added, entries, count * sizeof(MapEntry));
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_STRUCT) return -1;
+	for (uintptr_t i = 0; i < count; i++) {
+		const char *keyText;
+		size_t keyBytes;
+		if (map->type == T_MAP_INT) { added[i].keyPrefix = 0; continue; }
+		ScriptHeapEntryToString(context, &context->heap[added[i].key.i], &keyText, &keyBytes);
+		added[i].keyPrefix = StringKeyPrefix(keyText, keyBytes);
+	}
 
-			int16_t fieldIndex;
-			MemoryCopy(&fieldIndex, &functionData[instructionPointer], sizeof(fieldIndex));
-			instructionPointer += sizeof(fieldIndex);
-			bool isManaged = fieldIndex < 0;
-			if (isManaged) fieldIndex = -fieldIndex - 1;
-			if (fieldIndex < 0 || fieldIndex >= entry->fieldCount) return -1;
+	MapSortEntries(context, map, added, count);
 
-			// Only allow the isManaged bool to be incorrect if it's a null managed variable.
-			if (isManaged != ((uint8_t *) entry->fields - 1)[-fieldIndex] && (entry->fields[fieldIndex].i || !isManaged)) return -1;
+	// Keep only the last of each run of equal keys. The sort is stable, so that is the one that was set last.
+	uintptr_t unique = 0;
 
-			context->c->stack[context->c->stackPointer - 1] = entry->fields[fieldIndex];
-			context->c->stackIsManaged[context->c->stackPointer - 1] = isManaged;
-		} else if (command == T_BIT_SHIFT_LEFT) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = (uint64_t) context->c->stack[context->c->stackPointer - 2].i << (uint64_t) context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_BIT_SHIFT_RIGHT) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = (uint64_t) context->c->stack[context->c->stackPointer - 2].i >> (uint64_t) context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_BITWISE_OR) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i | context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_BITWISE_AND) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i & context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_BITWISE_XOR) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i ^ context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_ADD) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i + context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_MINUS) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i - context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_ASTERISK) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i * context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_SLASH) {
-			if (context->c->stackPointer < 2) return -1;
+	for (uintptr_t i = 0; i < count; i++) {
+		if (i + 1 < count && !MapCompareEntries(context, map, &added[i], &added[i + 1])) continue;
+		added[unique++] = added[i];
+	}
 
-			if (0 == context->c->stack[context->c->stackPointer - 1].i) {
-				PrintError4(context, instructionPointer - 1, "Attempted division by zero.\n");
-				return 0;
+	uintptr_t existing = map->mapLength, i = 0, j = 0, length = 0;
+	MapEntry *merged = (MapEntry *) AllocateResize(NULL, (existing + unique) * sizeof(MapEntry));
+
+	while (i < existing || j < unique) {
+		int comparison = i == existing ? 1 : j == unique ? -1 : MapCompareEntries(context, map, &map->mapEntries[i], &added[j]);
+		if (comparison < 0) merged[length++] = map->mapEntries[i++];
+		else merged[length++] = added[j++], i += comparison == 0;
+	}
+
+	AllocateResize(map->mapEntries, 0);
+	AllocateResize(added, 0);
+	map->mapEntries = merged;
+	map->mapLength = length;
+	map->mapAllocated = existing + unique;
+	if (map->storage == STORAGE_MAP_ORDERED && map->mapLength > MAP_NODE_CAPACITY) MapTreeBuild(map);
+}
+
+MapEntry *MapSeek(ExecutionContext *context, HeapEntry *map, Value key, bool hasKey, bool forwards, bool inclusive) {
+	// Finds the entry with the least key greater than the given key, or if not forwards, the greatest key less than it.
+	// If inclusive, an entry with the key itself is also accepted. Without a key, the first or last entry is found.
+	// Returns NULL if there is no such entry.
+
+	const char *keyText = NULL;
+	size_t keyBytes = 0;
+	uint64_t keyPrefix = 0;
+
+	if (hasKey && map->type == T_MAP_STR) {
+		ScriptHeapEntryToString(context, &context->heap[key.i], &keyText, &keyBytes);
+		keyPrefix = StringKeyPrefix(keyText, keyBytes);
+	}
+
+	if (map->storage == STORAGE_MAP_HASH) {
+		// The entries are in no particular order, so they must all be checked.
+		// Prefixes are not stored in this mode, so they are all treated as 0, and the full keys are compared.
+		MapEntry *best = NULL;
+		uintptr_t used = map->mapIndex ? MapHashExtra(map)[0] : 0;
+
+		for (uintptr_t i = 0; i < used; i++) {
+			MapEntry *entry = &map->mapEntries[i];
+			if (entry->keyHash == MAP_HASH_DELETED) continue;
+			const char *entryText = NULL;
+			size_t entryBytes = 0;
+			if (map->type == T_MAP_STR) ScriptHeapEntryToString(context, &context->heap[entry->key.i], &entryText, &entryBytes);
+			int comparison = hasKey ? MapCompareKeys(context, map, entry->key, 0, entryText, entryBytes, key, 0) : forwards ? 1 : -1;
+			if (forwards ? comparison < 0 : comparison > 0) continue;
+			if (!comparison && !inclusive) continue;
+			if (!best) { best = entry; continue; }
+			comparison = MapCompareKeys(context, map, entry->key, 0, entryText, entryBytes, best->key, 0);
+			if (forwards ? comparison < 0 : comparison > 0) best = entry;
+		}
+
+		return best;
+	}
+
+	MapNode *leaf = NULL;
+	MapEntry *entries;
+	intptr_t count, index;
+	bool found = false;
+
+	if (map->mapTree) {
+		leaf = map->mapTree;
+
+		if (hasKey) {
+			MapTreePath path;
+			found = MapTreeFind(context, map, key, keyPrefix, keyText, keyBytes, &path, true);
+			leaf = path.leaf;
+			index = path.index;
+		} else {
+			while (!leaf->isLeaf) leaf = leaf->children[forwards ? 0 : leaf->count - 1];
+		}
+
+		entries = leaf->entries;
+		count = leaf->count;
+	} else {
+		entries = map->mapEntries;
+		count = map->mapLength;
+
+		if (hasKey) {
+			intptr_t low = 0, high = count;
+
+			while (low < high) {
+				intptr_t middle = (low + high) >> 1;
+				MapEntry *entry = &entries[middle];
+				int comparison = MapCompareKeys(context, map, key, keyPrefix, keyText, keyBytes, entry->key, entry->keyPrefix);
+				if (comparison < 0) high = middle;
+				else if (comparison > 0) low = middle + 1;
+				else { low = middle, found = true; break; }
 			}
 
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i / context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_NEGATE) {
-			if (context->c->stackPointer < 1) return -1;
-			context->c->stack[context->c->stackPointer - 1].i = -context->c->stack[context->c->stackPointer - 1].i;
-		} else if (command == T_BITWISE_NOT) {
-			if (context->c->stackPointer < 1) return -1;
-			context->c->stack[context->c->stackPointer - 1].i = ~context->c->stack[context->c->stackPointer - 1].i;
-		} else if (command == T_FLOAT_ADD) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f + context->c->stack[context->c->stackPointer - 1].f;
-			context->c->stackPointer--;
-		} else if (command == T_FLOAT_MINUS) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f - context->c->stack[context->c->stackPointer - 1].f;
-			context->c->stackPointer--;
-		} else if (command == T_FLOAT_ASTERISK) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f * context->c->stack[context->c->stackPointer - 1].f;
-			context->c->stackPointer--;
-		} else if (command == T_FLOAT_SLASH) {
+			index = low;
+		}
+	}
+
+	if (!hasKey) {
+		index = forwards ? 0 : count - 1;
+	} else if (forwards) {
+		if (found && !inclusive) index++;
+	} else {
+		if (!found || !inclusive) index--;
+	}
+
+	if (index >= 0 && index < count) {
+		if (leaf) map->mapCacheLeaf = leaf;
+		return &entries[index];
+	} else if (leaf && index == count && leaf->next) {
+		map->mapCacheLeaf = leaf->next;
+		return &leaf->next->entries[0];
+	} else if (leaf && index == -1 && leaf->previous) {
+		map->mapCacheLeaf = leaf->previous;
+		return &leaf->previous->entries[leaf->previous->count - 1];
+	} else {
+		return NULL;
+	}
+}
+
+MapEntry *MapIterate(ExecutionContext *context, HeapEntry *map, Value key, bool hasKey, uintptr_t *position) {
+	// Finds the entry after the given key for T_MAP_ITERATE_NEXT, or without a key, the first entry for T_MAP_ITERATE.
+	// The position is where the key was found on the previous step; it is updated to where the result is.
+	// Usually the key has not moved, so the next entry is found without a search. Returns NULL at the end of the map.
+
+	uintptr_t i = *position;
+	MapEntry *result;
+
+	if (map->storage == STORAGE_MAP_HASH) {
+		// The entries are visited in the order they are stored, skipping deleted entries. 
+		// Entries are not moved while they are in the map, so the next entry is after the position even if the key was deleted.
+		uintptr_t used = map->mapIndex ? MapHashExtra(map)[0] : 0;
+		i = hasKey ? i + 1 : 0;
+		while (i < used && map->mapEntries[i].keyHash == MAP_HASH_DELETED) i++;
+		result = i < used ? &map->mapEntries[i] : NULL;
+	} else if (map->mapTree) {
+		MapNode *leaf = map->mapCacheLeaf;
+
+		if (hasKey && leaf && i < leaf->count && leaf->entries[i].key.i == key.i) {
+			if (i + 1 == leaf->count) leaf = leaf->next, i = 0;
+			else i++;
+			if (leaf) map->mapCacheLeaf = leaf;
+			result = leaf ? &leaf->entries[i] : NULL;
+		} else {
+			result = MapSeek(context, map, key, hasKey, true, false);
+		}
+
+		if (result) *position = result - map->mapCacheLeaf->entries;
+		return result;
+	} else if (hasKey && i < map->mapLength && map->mapEntries[i].key.i == key.i) {
+		result = i + 1 < map->mapLength ? &map->mapEntries[i + 1] : NULL;
+	} else {
+		result = MapSeek(context, map, key, hasKey, true, false);
+	}
+
+	if (result) *position = result - map->mapEntries;
+	return result;
+}
+
+uintptr_t ListStorageBits(uint8_t storage) {
+	return storage == STORAGE_LIST_BITS ? 1 : storage == STORAGE_LIST_INT8 ? 8 : storage == STORAGE_LIST_INT16 ? 16 
+		: storage == STORAGE_LIST_INT32 ? 32 : 64;
+}
+
+size_t ListStorageBytes(uint8_t storage, uintptr_t count) {
+	return storage == STORAGE_LIST_BITS ? (count + 63) / 64 * sizeof(uint64_t) : count * (ListStorageBits(storage) / 8);
+}
+
+uint8_t ListStorageForInt(int64_t x) {
+	// The narrowest packed storage that holds the int.
+	return x == (int8_t) x ? STORAGE_LIST_INT8 : x == (int16_t) x ? STORAGE_LIST_INT16 : x == (int32_t) x ? STORAGE_LIST_INT32 : STORAGE_DEFAULT;
+}
+
+uintptr_t ListRingIndex(HeapEntry *entry, uintptr_t i) {
+	// The index in the ring buffer of the i-th item. Valid for i < entry->allocated.
+	uintptr_t j = entry->listHead + i;
+	return j >= entry->allocated ? j - entry->allocated : j;
+}
+
+Value ListGet(HeapEntry *entry, uintptr_t i) {
+	Value v;
+	if (entry->storage == STORAGE_DEFAULT) v = entry->list[i];
+	else if (entry->storage == STORAGE_LIST_RING) v = entry->list[ListRingIndex(entry, i)];
+	else if (entry->storage == STORAGE_LIST_BITS) v.i = (((uint64_t *) entry->list)[i >> 6] >> (i & 63)) & 1;
+	else if (entry->storage == STORAGE_LIST_INT8) v.i = ((int8_t *) entry->list)[i];
+	else if (entry->storage == STORAGE_LIST_INT16) v.i = ((int16_t *) entry->list)[i];
+	else v.i = ((int32_t *) entry->list)[i];
+	return v;
+}
+
+bool ListFits(HeapEntry *entry, Value v) {
+	return entry->storage == STORAGE_DEFAULT || entry->storage == STORAGE_LIST_BITS || entry->storage == STORAGE_LIST_RING
+		|| ListStorageBits(ListStorageForInt(v.i)) <= ListStorageBits(entry->storage);
+}
+
+void ListPut(HeapEntry *entry, uintptr_t i, Value v) {
+	// The item must fit in the list's storage; see ListFits.
+	if (entry->storage == STORAGE_DEFAULT) {
+		entry->list[i] = v;
+	} else if (entry->storage == STORAGE_LIST_RING) {
+		entry->list[ListRingIndex(entry, i)] = v;
+	} else if (entry->storage == STORAGE_LIST_BITS) {
+		uint64_t *word = &((uint64_t *) entry->list)[i >> 6];
+		uint64_t bit = (uint64_t) 1 << (i & 63);
+		*word = v.i ? *word | bit : *word & ~bit;
+	} else if (entry->storage == STORAGE_LIST_INT8) {
+		((int8_t *) entry->list)[i] = v.i;
+	} else if (entry->storage == STORAGE_LIST_INT16) {
+		((int16_t *) entry->list)[i] = v.i;
+	} else {
+		((int32_t *) entry->list)[i] = v.i;
+	}
+}
+
+void ListConvert(HeapEntry *entry, uint8_t storage) {
+	// Changes how the items of the list are stored. Every item must fit in the new storage.
+	Assert(!entry->shared);
+	HeapEntry converted = *entry;
+	size_t bytes = ListStorageBytes(storage, entry->allocated);
+	converted.storage = storage;
+	converted.listHead = 0;
+	converted.list = (Value *) AllocateResize(NULL, bytes);
+	if (storage == STORAGE_LIST_BITS) for (uintptr_t i = 0; i < bytes / sizeof(uint64_t); i++) ((uint64_t *) converted.list)[i] = 0;
+	for (uintptr_t i = 0; i < entry->length; i++) ListPut(&converted, i, ListGet(entry, i));
+	AllocateResize(entry->list, 0);
+	entry->list = converted.list;
+	entry->storage = storage;
+	entry->listHead = 0;
+}
+
+uint8_t ListUnpack(HeapEntry *entry) {
+	// Ops that only work on arrays of Values unpack the list first, and then pack it again with ListPack.
+	// Returns how the list was stored.
+	uint8_t storage = entry->storage;
+	if (storage != STORAGE_DEFAULT) ListConvert(entry, STORAGE_DEFAULT);
+	return storage;
+}
+
+void ListPack(HeapEntry *entry, uint8_t storage) {
+	// Packs an unpacked list. Lists of ints are packed into the given storage, or a wider one if an item needs it.
+	if (storage == STORAGE_DEFAULT) return;
+	Assert(entry->storage == STORAGE_DEFAULT);
+
+	if (storage != STORAGE_LIST_BITS && storage != STORAGE_LIST_RING) {
+		for (uintptr_t i = 0; i < entry->length && storage != STORAGE_DEFAULT; i++) {
+			uint8_t needed = ListStorageForInt(entry->list[i].i);
+			if (ListStorageBits(needed) > ListStorageBits(storage)) storage = needed;
+		}
+
+		if (storage == STORAGE_DEFAULT) return;
+	}
+
+	ListConvert(entry, storage);
+}
+
+void ListReallocate(HeapEntry *entry, uintptr_t count, uint32_t allocated) {
+	// Changes the size of the storage of a list, keeping its first count items. Ring buffers are moved to the start of the new storage.
+	Assert(!entry->shared);
+	if (entry->storage == STORAGE_LIST_RING && entry->listHead) {
+		Value *list = (Value *) AllocateResize(NULL, allocated * sizeof(Value));
+		for (uintptr_t i = 0; i < count; i++) list[i] = entry->list[ListRingIndex(entry, i)];
+		AllocateResize(entry->list, 0);
+		entry->list = list;
+		entry->listHead = 0;
+	} else {
+		entry->list = (Value *) AllocateResize(entry->list, ListStorageBytes(entry->storage, allocated));
+	}
+
+	entry->allocated = allocated;
+}
+
+void ListRingOpen(HeapEntry *entry, uintptr_t index, uintptr_t count, uintptr_t length) {
+	// Makes a gap for count items at index, in a ring buffer of length items, by moving the items on the shorter side of the gap.
+	// The storage must already have space for the new items.
+	if (!count) return;
+
+	if (index < length - index) {
+		entry->listHead = ListRingIndex(entry, entry->allocated - count);
+		for (uintptr_t i = 0; i < index; i++) entry->list[ListRingIndex(entry, i)] = entry->list[ListRingIndex(entry, i + count)];
+	} else {
+		for (uintptr_t i = length; i > index; i--) entry->list[ListRingIndex(entry, i - 1 + count)] = entry->list[ListRingIndex(entry, i - 1)];
+	}
+}
+
+void ListRingClose(HeapEntry *entry, uintptr_t index, uintptr_t count, uintptr_t length) {
+	// Removes count items at index from a ring buffer of length items, by moving the items on the shorter side of the gap.
+	if (!count) return;
+
+	if (index < length - index - count) {
+		for (uintptr_t i = index; i > 0; i--) entry->list[ListRingIndex(entry, i - 1 + count)] = entry->list[ListRingIndex(entry, i - 1)];
+		entry->listHead = ListRingIndex(entry, count);
+	} else {
+		for (uintptr_t i = index; i < length - count; i++) entry->list[ListRingIndex(entry, i)] = entry->list[ListRingIndex(entry, i + count)];
+	}
+}
+
+void ListCopyItems(HeapEntry *copy, HeapEntry *entry, uintptr_t start, uintptr_t count) {
+	// Fills in a new list with items from another list, stored in the same way.
+	copy->type = T_LIST;
+	copy->internalValuesAreManaged = entry->internalValuesAreManaged;
+	copy->storage = entry->storage;
+	copy->listHead = 0;
+	copy->length = copy->allocated = count;
+	copy->list = (Value *) AllocateResize(NULL, ListStorageBytes(entry->storage, count));
+
+	if (entry->storage == STORAGE_LIST_BITS || entry->storage == STORAGE_LIST_RING) {
+		for (uintptr_t i = 0; i < count; i++) ListPut(copy, i, ListGet(entry, start + i));
+	} else {
+		size_t itemBytes = ListStorageBits(entry->storage) / 8;
+		MemoryCopy(copy->list, (uint8_t *) entry->list + start * itemBytes, count * itemBytes);
+	}
+}
+
+Value *ListContiguousItems(HeapEntry *entry) {
+	// Returns the items as an array of Values, if they are stored as one.
+	if (entry->storage == STORAGE_DEFAULT) return entry->list;
+	if (entry->storage == STORAGE_LIST_RING && entry->listHead + entry->length <= entry->allocated) return entry->list + entry->listHead;
+	return NULL;
+}
+
+bool ListItemEquals(ExecutionContext *context, Value item, Value x, bool strings, const char *text, size_t bytes) {
+	// For strings, text and bytes are the contents of x.
+	if (item.i == x.i) return true;
+	if (!strings) return false;
+	const char *itemText;
+	size_t itemBytes;
+	ScriptHeapEntryToString(context, &context->heap[item.i], &itemText, &itemBytes);
+	return itemBytes == bytes && HeapEntryStringsMightBeEqual(&context->heap[item.i], &context->heap[x.i]) 
+		&& 0 == MemoryCompare(itemText, text, bytes);
+}
+
+intptr_t ListFind(ExecutionContext *context, HeapEntry *entry, Value x, bool strings, bool last) {
+	// Returns the index of the first item equal to x, or the last if last is set. Returns -1 if there is none.
+	Value *items = ListContiguousItems(entry);
+	uintptr_t count = entry->length;
+	const char *text = NULL;
+	size_t bytes = 0;
+	uintptr_t j = 0;
+
+	if (strings) {
+		ScriptHeapEntryToString(context, &context->heap[x.i], &text, &bytes);
+	} else if (items) {
+		j = ListSkipIntBlocks(items, count, x.i, last);
+	} else if (!ListFits(entry, x)) {
+		return -1;
+	}
+
+	for (; j < count; j++) {
+		uintptr_t i = last ? count - 1 - j : j;
+
+		if (entry->storage == STORAGE_LIST_BITS && (last ? (i & 63) == 63 : (i & 63) == 0 && i + 64 <= count)
+				&& ((uint64_t *) entry->list)[i >> 6] == (x.i ? 0 : ~(uint64_t) 0)) {
+			j += 63; // Skip words of the bitset without a matching bit.
+		} else if (ListItemEquals(context, items ? items[i] : ListGet(entry, i), x, strings, text, bytes)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+uintptr_t ListCount(ExecutionContext *context, HeapEntry *entry, Value x, bool strings) {
+	// Returns the number of items equal to x.
+	Value *items = ListContiguousItems(entry);
+	uintptr_t count = entry->length;
+	uintptr_t result = 0, i = 0;
+	const char *text = NULL;
+	size_t bytes = 0;
+
+	if (strings) {
+		ScriptHeapEntryToString(context, &context->heap[x.i], &text, &bytes);
+	} else if (items) {
+		result = ListCountIntBlocks(items, count, x.i, &i);
+	} else if (!ListFits(entry, x)) {
+		return 0;
+	} else if (entry->storage == STORAGE_LIST_BITS) {
+		for (; i + 64 <= count; i += 64) {
+			uint64_t word = ((uint64_t *) entry->list)[i >> 6];
+			word = word - ((word >> 1) & 0x5555555555555555);
+			word = (word & 0x3333333333333333) + ((word >> 2) & 0x3333333333333333);
+			word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0F;
+			result += (word * 0x0101010101010101) >> 56;
+		}
+
+		if (!x.i) result = i - result;
+	}
+
+	for (; i < count; i++) {
+		result += ListItemEquals(context, items ? items[i] : ListGet(entry, i), x, strings, text, bytes);
+	}
+
+	return result;
+}
+
+Value ListReduce(HeapEntry *entry, uint8_t command) {
+	// Sums the items, or finds the smallest or largest. The list must not be empty, unless the items are summed.
+	// Floats are summed in 16 lanes, where item i goes in lane i % 16, so that the vectorized code gives the same result.
+	Value *items = ListContiguousItems(entry);
+	uintptr_t count = entry->length;
+	uintptr_t i = 0;
+	Value result = { 0 };
+
+	if (command == T_OP_SUM_INT) {
+		if (items) result.i = ListSumIntBlocks(items, count, &i);
+		for (; i < count; i++) result.i = (uint64_t) result.i + (uint64_t) ListGet(entry, i).i;
+	} else if (command == T_OP_SUM_FLOAT) {
+		double lanes[16];
+		for (uintptr_t j = 0; j < 16; j++) lanes[j] = 0;
+		if (items) ListSumFloatBlocks(items, count, lanes, &i);
+		for (; i < count; i++) lanes[i & 15] += ListGet(entry, i).f;
+		for (uintptr_t width = 8; width; width >>= 1) for (uintptr_t j = 0; j < width; j++) lanes[j] += lanes[j + width];
+		result.f = lanes[0];
+	} else if (command == T_OP_MIN_INT || command == T_OP_MAX_INT) {
+		bool max = command == T_OP_MAX_INT;
+		result = ListGet(entry, 0);
+		if (items) result.i = ListMinMaxIntBlocks(items, count, max, result.i, &i);
+
+		for (; i < count; i++) {
+			int64_t x = ListGet(entry, i).i;
+			if (max ? x > result.i : x < result.i) result.i = x;
+		}
+	} else {
+		// If any item is NaN, then the result is NaN, wherever it is in the list.
+		bool max = command == T_OP_MAX_FLOAT;
+		result = ListGet(entry, 0);
+		if (items) result.f = ListMinMaxFloatBlocks(items, count, max, result.f, &i);
+
+		for (; i < count && result.f == result.f; i++) {
+			double x = ListGet(entry, i).f;
+			if (x != x || (max ? x > result.f : x < result.f)) result.f = x;
+		}
+	}
+
+	return result;
+}
+
+void *HeapStorageAddress(HeapEntry *entry) {
+	// The allocation that holds the items of a list or map, which identifies the storage in context->sharedStorage. NULL if there is none.
+	if (entry->type == T_LIST) return entry->list;
+	if (entry->storage == STORAGE_MAP_ORDERED && entry->mapTree) return entry->mapTree;
+	return entry->mapEntries;
+}
+
+uintptr_t *HeapStorageShareSlot(ExecutionContext *context, void *address) {
+	// Returns the slot for the storage in context->sharedStorage. If it is empty, the storage is not shared.
+	uintptr_t mask = context->sharedStorageAllocated - 1;
+	uintptr_t slot = MapHashInteger((uintptr_t) address) & mask;
+	while (context->sharedStorage[slot * 2] && context->sharedStorage[slot * 2] != (uintptr_t) address) slot = (slot + 1) & mask;
+	return &context->sharedStorage[slot * 2];
+}
+
+void HeapStorageShare(ExecutionContext *context, HeapEntry *entry, HeapEntry *copy) {
+	// Marks the storage of entry as used by copy too. The caller copies the fields. 
+	// Both use the storage until one of them is modified, which first makes it its own copy with HeapEntryUnshare.
+	if (context->sharedStorageCount * 2 >= context->sharedStorageAllocated) {
+		uintptr_t *oldTable = context->sharedStorage;
+		size_t oldAllocated = context->sharedStorageAllocated;
+		context->sharedStorageAllocated = oldAllocated ? oldAllocated * 2 : 64;
+		context->sharedStorage = (uintptr_t *) AllocateResize(NULL, context->sharedStorageAllocated * 2 * sizeof(uintptr_t));
+
+		for (uintptr_t i = 0; i < context->sharedStorageAllocated * 2; i++) {
+			context->sharedStorage[i] = 0;
+		}
+
+		for (uintptr_t i = 0; i < oldAllocated; i++) {
+			if (!oldTable[i * 2]) continue;
+			uintptr_t *slot = HeapStorageShareSlot(context, (void *) oldTable[i * 2]);
+			slot[0] = oldTable[i * 2 + 0];
+			slot[1] = oldTable[i * 2 + 1];
+		}
+
+		AllocateResize(oldTable, 0);
+	}
+
+	void *address = HeapStorageAddress(entry);
+	Assert(address);
+	uintptr_t *slot = HeapStorageShareSlot(context, address);
+
+	if (!slot[0]) {
+		// This is the first time the storage is shared, or the other entries sharing it have since released it.
+		slot[0] = (uintptr_t) address;
+		slot[1] = 1;
+		context->sharedStorageCount++;
+	}
+
+	slot[1]++;
+	entry->shared = copy->shared = true;
+}
+
+bool HeapStorageRelease(ExecutionContext *context, HeapEntry *entry) {
+	// Called when a list or map stops using its storage. 
+	// Returns true if other entries still use the storage, in which case it must not be freed or modified.
+	if (!entry->shared) return false;
+	entry->shared = false;
+	uintptr_t *slot = HeapStorageShareSlot(context, HeapStorageAddress(entry));
+	if (!slot[0]) return false; // The other entries have released it.
+	if (--slot[1] > 1) return true;
+
+	// Only one entry is left using the storage, so remove it from the table. 
+	// The slots after it are moved back, if they are not already at or before the slot for their hash.
+	uintptr_t mask = context->sharedStorageAllocated - 1;
+	uintptr_t hole = (slot - context->sharedStorage) / 2;
+	context->sharedStorage[hole * 2] = 0;
+	context->sharedStorageCount--;
+
+	for (uintptr_t i = (hole + 1) & mask; context->sharedStorage[i * 2]; i = (i + 1) & mask) {
+		uintptr_t home = MapHashInteger(context->sharedStorage[i * 2]) & mask;
+		if (((i - home) & mask) < ((i - hole) & mask)) continue;
+		context->sharedStorage[hole * 2 + 0] = context->sharedStorage[i * 2 + 0];
+		context->sharedStorage[hole * 2 + 1] = context->sharedStorage[i * 2 + 1];
+		context->sharedStorage[i * 2] = 0;
+		hole = i;
+	}
+
+	return true;
+}
+
+void HeapEntryUnshare(ExecutionContext *context, HeapEntry *entry) {
+	// Gives a list or map its own copy of its storage, if it is shared. Call this before modifying the items or the storage.
+	if (!HeapStorageRelease(context, entry)) return;
+
+	if (entry->type == T_LIST) {
+		size_t bytes = ListStorageBytes(entry->storage, entry->allocated);
+		Value *list = (Value *) AllocateResize(NULL, bytes);
+		MemoryCopy(list, entry->list, bytes);
+		entry->list = list;
+	} else if (entry->storage == STORAGE_MAP_ORDERED && entry->mapTree) {
+		MapNode *leaf = entry->mapTree;
+		while (!leaf->isLeaf) leaf = leaf->children[0];
+		MapEntry *entries = (MapEntry *) AllocateResize(NULL, entry->mapLength * sizeof(MapEntry));
+		uintptr_t position = 0;
+
+		for (; leaf; leaf = leaf->next) {
+			MemoryCopy(&entries[position], leaf->entries, leaf->count * sizeof(MapEntry));
+			position += leaf->count;
+		}
+
+		entry->mapEntries = entries;
+		MapTreeBuild(entry);
+	} else {
+		MapEntry *entries = (MapEntry *) AllocateResize(NULL, entry->mapAllocated * sizeof(MapEntry));
+		MemoryCopy(entries, entry->mapEntries, entry->mapAllocated * sizeof(MapEntry));
+		entry->mapEntries = entries;
+
+		if (entry->storage == STORAGE_MAP_HASH) {
+			size_t bytes = (entry->mapAllocated * 2 + MAP_HASH_EXTRA) * sizeof(uint32_t);
+			uint32_t *mapIndex = (uint32_t *) AllocateResize(NULL, bytes);
+			MemoryCopy(mapIndex, entry->mapIndex, bytes);
+			entry->mapIndex = mapIndex;
+		}
+	}
+}
+
+uintptr_t HeapCloneEntry(ExecutionContext *context, uintptr_t index) {
+	// Makes a shallow copy of a list, struct or map. This calls HeapAllocate, so the original must be reachable.
+	// Lists and maps share the storage of the original, until one of them is modified.
+	uintptr_t result = HeapAllocate(context);
+	HeapEntry *entry = &context->heap[index];
+	HeapEntry *copy = &context->heap[result];
+	copy->type = entry->type;
+	copy->internalValuesAreManaged = entry->internalValuesAreManaged;
+
+	if (entry->type == T_LIST) {
+		copy->storage = entry->storage;
+		copy->length = entry->length;
+		copy->allocated = entry->allocated;
+		copy->list = entry->list;
+		copy->listHead = entry->listHead;
+		if (copy->list) HeapStorageShare(context, entry, copy);
+	} else if (entry->type == T_STRUCT) {
+		// The managed flags are stored before the fields.
+		size_t fieldCountAligned = (entry->fieldCount + 7) & ~7;
+		size_t bytes = fieldCountAligned + entry->fieldCount * sizeof(Value);
+		uint8_t *fields = (uint8_t *) AllocateResize(NULL, bytes);
+		MemoryCopy(fields, (uint8_t *) entry->fields - fieldCountAligned, bytes);
+		copy->fields = (Value *) (fields + fieldCountAligned);
+		copy->fieldCount = entry->fieldCount;
+	} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
+		copy->storage = entry->storage;
+		copy->mapLength = entry->mapLength;
+		copy->mapAllocated = entry->mapAllocated;
+		copy->mapEntries = entry->mapEntries; // Or mapCacheLeaf.
+		copy->mapIndex = entry->mapIndex; // Or mapTree.
+		if (HeapStorageAddress(copy)) HeapStorageShare(context, entry, copy);
+	} else {
+		Assert(false);
+	}
+
+	return result;
+}
+
+uint64_t HeapCloneReference(ExecutionContext *context, uint64_t index, uintptr_t clonesIndex, HeapCloneTable *table) {
+	// Returns the clone of a list, struct or map, making it if this is the first reference to it. Other values are returned as is.
+	if (!index || index >= context->heapEntriesAllocated) return index;
+	uint8_t type = context->heap[index].type;
+	if (type != T_LIST && type != T_STRUCT && type != T_MAP_INT && type != T_MAP_STR) return index;
+
+	uintptr_t slot = MapHashInteger(index) & (table->capacity - 1);
+
+	while (table->slots[slot * 2]) {
+		if (table->slots[slot * 2] == index) return table->slots[slot * 2 + 1];
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+
+	uintptr_t clone = HeapCloneEntry(context, index);
+	HeapEntry *clones = &context->heap[clonesIndex];
+
+	if (clones->length == clones->allocated) {
+		clones->allocated = clones->allocated ? clones->allocated * 2 : 16;
+		clones->list = (Value *) AllocateResize(clones->list, clones->allocated * sizeof(Value));
+	}
+
+	clones->list[clones->length++].i = clone;
+	table->slots[slot * 2 + 0] = index;
+	table->slots[slot * 2 + 1] = clone;
+	table->count++;
+
+	if (table->count * 2 > table->capacity) {
+		// Keep the table at most half full.
+		HeapCloneTable old = *table;
+		table->capacity *= 2;
+		table->slots = (uint64_t *) AllocateResize(NULL, table->capacity * 2 * sizeof(uint64_t));
+		for (uintptr_t i = 0; i < table->capacity * 2; i++) table->slots[i] = 0;
+
+		for (uintptr_t i = 0; i < old.capacity; i++) {
+			if (!old.slots[i * 2]) continue;
+			uintptr_t newSlot = MapHashInteger(old.slots[i * 2]) & (table->capacity - 1);
+			while (table->slots[newSlot * 2]) newSlot = (newSlot + 1) & (table->capacity - 1);
+			table->slots[newSlot * 2 + 0] = old.slots[i * 2 + 0];
+			table->slots[newSlot * 2 + 1] = old.slots[i * 2 + 1];
+		}
+
+		AllocateResize(old.slots, 0);
+	}
+
+	return clone;
+}
+
+uintptr_t HeapCloneAll(ExecutionContext *context, uintptr_t root, uintptr_t clonesIndex) {
+	// Clones the list, struct or map at root, and every list, struct and map reachable from it.
+	// References to the same item lead to the same clone, so shared items and cycles are kept.
+	// Strings, functions and errors are immutable, and handles and string builders are shared rather than copied.
+	// The clones are added to the list at clonesIndex, which must be reachable, so that they survive garbage collections;
+	// then each clone in turn has its references redirected to the clones of what they referred to.
+
+	HeapCloneTable table = { .capacity = 16 };
+	table.slots = (uint64_t *) AllocateResize(NULL, table.capacity * 2 * sizeof(uint64_t));
+	for (uintptr_t i = 0; i < table.capacity * 2; i++) table.slots[i] = 0;
+	uintptr_t result = HeapCloneReference(context, root, clonesIndex, &table);
+
+	for (uintptr_t i = 0; i < context->heap[clonesIndex].length; i++) {
+		// HeapCloneReference can move the heap, so the entry is looked up again after each call.
+		uintptr_t index = context->heap[clonesIndex].list[i].i;
+		uint8_t type = context->heap[index].type;
+
+		if (type == T_LIST && context->heap[index].internalValuesAreManaged) {
+			HeapEntryUnshare(context, &context->heap[index]);
+
+			for (uintptr_t j = 0; j < context->heap[index].length; j++) {
+				Value clone = { .i = HeapCloneReference(context, ListGet(&context->heap[index], j).i, clonesIndex, &table) };
+				ListPut(&context->heap[index], j, clone);
+			}
+		} else if (type == T_STRUCT) {
+			for (uintptr_t j = 0; j < context->heap[index].fieldCount; j++) {
+				if (!((uint8_t *) context->heap[index].fields)[-1 - j]) continue;
+				uint64_t clone = HeapCloneReference(context, context->heap[index].fields[j].i, clonesIndex, &table);
+				context->heap[index].fields[j].i = clone;
+			}
+		} else if ((type == T_MAP_INT || type == T_MAP_STR) && context->heap[index].internalValuesAreManaged) {
+			// Only the values; the keys are ints or strs. The map's storage is not moved by HeapAllocate.
+			uintptr_t position = 0;
+			Value zero = { 0 };
+			HeapEntryUnshare(context, &context->heap[index]);
+
+			for (MapEntry *item = MapIterate(context, &context->heap[index], zero, false, &position); item; 
+					item = MapIterate(context, &context->heap[index], item->key, true, &position)) {
+				item->value.i = HeapCloneReference(context, item->value.i, clonesIndex, &table);
+			}
+		}
+	}
+
+	AllocateResize(table.slots, 0);
+	return result;
+}
+
+#define LIST_SORT_SMALL (24)
+#define LIST_SORT_NINTHER (128)
+#define LIST_SORT_PARTIAL_INSERTION_LIMIT (8)
+
+// Defines a pattern-defeating quicksort for an array of Type, with the functions prefixed by name.
+// LESS(sort, a, b) takes pointers to two items, and returns whether a should go before b.
+// If it sets sort->result <= 0, the sort stops early, leaving the items in some order.
+// Items are only moved by swapping, so every item is always somewhere in the array.
+#define LIST_SORT_DEFINE(name, Type, LESS) \
+	\
+	void name ## Swap(Type *items, intptr_t a, intptr_t b) { \
+		Type swap = items[a]; \
+		items[a] = items[b]; \
+		items[b] = swap; \
+	} \
+	\
+	void name ## Insertion(ListSort *sort, Type *items, intptr_t start, intptr_t end) { \
+		for (intptr_t i = start + 1; i < end && sort->result > 0; i++) { \
+			for (intptr_t j = i; j > start && LESS(sort, &items[j], &items[j - 1]); j--) { \
+				name ## Swap(items, j, j - 1); \
+			} \
+		} \
+	} \
+	\
+	bool name ## PartialInsertion(ListSort *sort, Type *items, intptr_t start, intptr_t end) { \
+		/* An insertion sort that gives up if it has to move many items. Returns true if the range was sorted. */ \
+		uintptr_t moved = 0; \
+		\
+		for (intptr_t i = start + 1; i < end && sort->result > 0; i++) { \
+			intptr_t j = i; \
+			for (; j > start && LESS(sort, &items[j], &items[j - 1]); j--) name ## Swap(items, j, j - 1); \
+			moved += i - j; \
+			if (moved > LIST_SORT_PARTIAL_INSERTION_LIMIT) return false; \
+		} \
+		\
+		return true; \
+	} \
+	\
+	void name ## SiftDown(ListSort *sort, Type *items, intptr_t start, intptr_t count, intptr_t root) { \
+		while (sort->result > 0) { \
+			intptr_t child = root * 2 + 1; \
+			if (child >= count) return; \
+			if (child + 1 < count && LESS(sort, &items[start + child], &items[start + child + 1])) child++; \
+			if (!LESS(sort, &items[start + root], &items[start + child])) return; \
+			name ## Swap(items, start + root, start + child); \
+			root = child; \
+		} \
+	} \
+	\
+	void name ## HeapSort(ListSort *sort, Type *items, intptr_t start, intptr_t end) { \
+		intptr_t count = end - start; \
+		for (intptr_t i = count / 2 - 1; i >= 0; i--) name ## SiftDown(sort, items, start, count, i); \
+		\
+		for (intptr_t i = count - 1; i > 0 && sort->result > 0; i--) { \
+			name ## Swap(items, start, start + i); \
+			name ## SiftDown(sort, items, start, i, 0); \
+		} \
+	} \
+	\
+	void name ## Sort3(ListSort *sort, Type *items, intptr_t a, intptr_t b, intptr_t c) { \
+		/* Puts the median of the three items at b. */ \
+		(void) sort; /* Not every LESS uses it. */ \
+		if (LESS(sort, &items[b], &items[a])) name ## Swap(items, a, b); \
+		if (LESS(sort, &items[c], &items[b])) name ## Swap(items, b, c); \
+		if (LESS(sort, &items[b], &items[a])) name ## Swap(items, a, b); \
+	} \
+	\
+	intptr_t name ## PartitionRight(ListSort *sort, Type *items, intptr_t start, intptr_t end, bool *alreadyPartitioned) { \
+		/* Partitions the range around the pivot at items[start], and returns where the pivot ends up. */ \
+		/* The items before it are less than the pivot, and the items after it are not. */ \
+		(void) sort; /* Not every LESS uses it. */ \
+		intptr_t i = start + 1, j = end - 1; \
+		*alreadyPartitioned = true; \
+		\
+		while (true) { \
+			while (i <= j && LESS(sort, &items[i], &items[start])) i++; \
+			while (i <= j && !LESS(sort, &items[j], &items[start])) j--; \
+			if (i > j) break; \
+			name ## Swap(items, i++, j--); \
+			*alreadyPartitioned = false; \
+		} \
+		\
+		name ## Swap(items, start, j); \
+		return j; \
+	} \
+	\
+	intptr_t name ## PartitionLeft(ListSort *sort, Type *items, intptr_t start, intptr_t end) { \
+		/* Like PartitionRight, but the items equal to the pivot go before it instead. */ \
+		(void) sort; /* Not every LESS uses it. */ \
+		intptr_t i = start + 1, j = end - 1; \
+		\
+		while (true) { \
+			while (i <= j && !LESS(sort, &items[start], &items[i])) i++; \
+			while (i <= j && LESS(sort, &items[start], &items[j])) j--; \
+			if (i > j) break; \
+			name ## Swap(items, i++, j--); \
+		} \
+		\
+		name ## Swap(items, start, j); \
+		return j; \
+	} \
+	\
+	void name ## Range(ListSort *sort, Type *items, intptr_t start, intptr_t end, intptr_t badAllowed, bool leftmost) { \
+		while (sort->result > 0) { \
+			intptr_t count = end - start; \
+			\
+			if (count < LIST_SORT_SMALL) { \
+				name ## Insertion(sort, items, start, end); \
+				return; \
+			} \
+			\
+			/* Move the pivot to the start. Above LIST_SORT_NINTHER items, it is the median of 3 medians of 3. */ \
+			intptr_t half = count / 2; \
+			\
+			if (count > LIST_SORT_NINTHER) { \
+				name ## Sort3(sort, items, start, start + half, end - 1); \
+				name ## Sort3(sort, items, start + 1, start + half - 1, end - 2); \
+				name ## Sort3(sort, items, start + 2, start + half + 1, end - 3); \
+				name ## Sort3(sort, items, start + half - 1, start + half, start + half + 1); \
+				name ## Swap(items, start, start + half); \
+			} else { \
+				name ## Sort3(sort, items, start + half, start, end - 1); \
+			} \
+			\
+			/* The item before the range was a pivot, so it is not greater than anything in the range. */ \
+			/* If it equals this pivot, then so do all the items that would go left of it; skip over them. */ \
+			if (!leftmost && !LESS(sort, &items[start - 1], &items[start])) { \
+				start = name ## PartitionLeft(sort, items, start, end) + 1; \
+				continue; \
+			} \
+			\
+			bool alreadyPartitioned; \
+			intptr_t pivot = name ## PartitionRight(sort, items, start, end, &alreadyPartitioned); \
+			intptr_t leftCount = pivot - start, rightCount = end - pivot - 1; \
+			\
+			if (leftCount < count / 8 || rightCount < count / 8) { \
+				/* A bad pivot. After too many of these, fall back to a heap sort. */ \
+				/* Otherwise, swap some items around, so that the same pattern does not give a bad pivot again. */ \
+				if (--badAllowed == 0) { \
+					name ## HeapSort(sort, items, start, end); \
+					return; \
+				} \
+				\
+				if (leftCount >= LIST_SORT_SMALL) { \
+					name ## Swap(items, start, start + leftCount / 4); \
+					name ## Swap(items, pivot - 1, pivot - leftCount / 4); \
+				} \
+				\
+				if (rightCount >= LIST_SORT_SMALL) { \
+					name ## Swap(items, pivot + 1, pivot + 1 + rightCount / 4); \
+					name ## Swap(items, end - 1, end - rightCount / 4); \
+				} \
+			} else if (alreadyPartitioned && name ## PartialInsertion(sort, items, start, pivot) \
+					&& name ## PartialInsertion(sort, items, pivot + 1, end)) { \
+				/* The range was probably already sorted, and it was. */ \
+				return; \
+			} \
+			\
+			/* Recurse into the smaller side, so that the depth of the recursion is logarithmic. */ \
+			if (leftCount < rightCount) { \
+				name ## Range(sort, items, start, pivot, badAllowed, leftmost); \
+				start = pivot + 1, leftmost = false; \
+			} else { \
+				name ## Range(sort, items, pivot + 1, end, badAllowed, false); \
+				end = pivot; \
+			} \
+		} \
+	} \
+	\
+	void name(ListSort *sort, Type *items, uintptr_t count) { \
+		intptr_t badAllowed = 1; \
+		for (uintptr_t i = count; i > 1; i >>= 1) badAllowed++; \
+		name ## Range(sort, items, 0, count, badAllowed, true); \
+	}
+
+int ListSortCompareStrings(const ListSortString *a, const ListSortString *b) {
+	// Compares two strings with the same prefix, in the order of StringCompareRaw.
+	// The rest of the common part is compared 8 bytes at a time, and only the block that differs is converted.
+	size_t common = a->bytes < b->bytes ? a->bytes : b->bytes;
+	uintptr_t offset = 8;
+
+	while (offset + 8 <= common && 0 == MemoryCompare(a->text + offset, b->text + offset, 8)) {
+		offset += 8;
+	}
+
+	if (offset < common) {
+		uint64_t x = StringKeyPrefix(a->text + offset, common - offset);
+		uint64_t y = StringKeyPrefix(b->text + offset, common - offset);
+		if (x != y) return x < y ? -1 : 1;
+	}
+
+	return a->bytes < b->bytes ? -1 : a->bytes > b->bytes;
+}
+
+bool ListSortCallComparator(ListSort *sort, Value a, Value b) {
+	// Calls the script's comparison function. This is ScriptRunCallback, without the parameter arrays.
+	ExecutionContext *context = sort->context;
+	if (sort->result <= 0) return false;
+
+	if (context->c->stackPointer + 3 > context->c->stackEntriesAllocated) {
+		PrintError4(context, sort->instructionPointer, "Stack overflow.\n");
+		sort->result = 0;
+		return false;
+	}
+
+	uintptr_t stackPointer = context->c->stackPointer;
+	context->c->stack[stackPointer + 0] = b;
+	context->c->stackIsManaged[stackPointer + 0] = sort->itemsAreManaged;
+	context->c->stack[stackPointer + 1] = a;
+	context->c->stackIsManaged[stackPointer + 1] = sort->itemsAreManaged;
+	context->c->stack[stackPointer + 2].i = sort->comparator;
+	context->c->stackIsManaged[stackPointer + 2] = true;
+	context->c->stackPointer += 3;
+
+	uintptr_t previousParameterCount = context->c->parameterCount;
+	int previousReturnValueType = context->c->returnValueType;
+	int result = ScriptExecuteFunction(2, context);
+	context->c->parameterCount = previousParameterCount;
+	context->c->returnValueType = previousReturnValueType;
+
+	if (result <= 0) {
+		sort->result = result;
+		return false;
+	} else if (context->c->stackPointer != stackPointer + 1 || context->c->stackIsManaged[stackPointer]) {
+		sort->result = -1;
+		return false;
+	}
+
+	context->c->stackPointer = stackPointer;
+	return context->c->stack[stackPointer].i != 0;
+}
+
+#define LIST_SORT_LESS_VALUE(sort, a, b) ListSortCallComparator(sort, *(a), *(b))
+#define LIST_SORT_LESS_STRING(sort, a, b) ((a)->prefix != (b)->prefix ? (a)->prefix < (b)->prefix : ListSortCompareStrings(a, b) < 0)
+LIST_SORT_DEFINE(ListSortValues, Value, LIST_SORT_LESS_VALUE)
+LIST_SORT_DEFINE(ListSortStrings, ListSortString, LIST_SORT_LESS_STRING)
+
+void ListSortValuesStable(ListSort *sort, Value *items, Value *scratch, uintptr_t count) {
+	// A bottom-up merge sort, starting from runs sorted by insertion. The scratch array must start as a copy of the items,
+	// since the garbage collector can run during the comparisons, and so both arrays must only ever contain the items.
+
+	uintptr_t width = 16;
+
+	for (uintptr_t start = 0; start < count; start += width) {
+		ListSortValuesInsertion(sort, items, start, start + width < count ? start + width : count);
+	}
+
+	Value *source = items;
+	Value *destination = scratch;
+
+	for (; width < count && sort->result > 0; width *= 2) {
+		for (uintptr_t start = 0; start < count; start += width * 2) {
+			uintptr_t middle = start + width < count ? start + width : count;
+			uintptr_t end = start + width * 2 < count ? start + width * 2 : count;
+			uintptr_t i = start, j = middle, k = start;
+
+			while (i < middle && j < end) {
+				if (LIST_SORT_LESS_VALUE(sort, &source[j], &source[i])) {
+					destination[k++] = source[j++];
+				} else {
+					destination[k++] = source[i++];
+				}
+			}
+
+			while (i < middle) destination[k++] = source[i++];
+			while (j < end) destination[k++] = source[j++];
+		}
+
+		Value *swap = source;
+		source = destination;
+		destination = swap;
+	}
+
+	if (source != items) MemoryCopy(items, source, count * sizeof(Value));
+}
+
+#define LIST_SORT_RADIX_BITS (11)
+#define LIST_SORT_RADIX_PASSES ((64 + LIST_SORT_RADIX_BITS - 1) / LIST_SORT_RADIX_BITS)
+
+void ListSortRadix(Value *items, Value *scratch, uintptr_t count) {
+	// Sorts by the unsigned 64-bit keys in items[].i. This is an LSD radix sort, 11 bits at a time,
+	// which skips the digits that are the same in every key. Small lists use an insertion sort.
+	// The scratch array must have space for count items.
+
+	uintptr_t sorted = 1;
+	while (sorted < count && (uint64_t) items[sorted - 1].i <= (uint64_t) items[sorted].i) sorted++;
+	if (sorted >= count) return;
+
+	if (count < 64) {
+		for (uintptr_t i = 1; i < count; i++) {
+			Value item = items[i];
+			uintptr_t j = i;
+			for (; j && (uint64_t) items[j - 1].i > (uint64_t) item.i; j--) items[j] = items[j - 1];
+			items[j] = item;
+		}
+
+		return;
+	}
+
+	const uint64_t mask = (1 << LIST_SORT_RADIX_BITS) - 1;
+	uint32_t counts[LIST_SORT_RADIX_PASSES][1 << LIST_SORT_RADIX_BITS] = { 0 }; // Lists have at most UINT32_MAX items.
+
+	for (uintptr_t i = 0; i < count; i++) {
+		uint64_t key = items[i].i;
+
+		for (uintptr_t pass = 0; pass < LIST_SORT_RADIX_PASSES; pass++) {
+			counts[pass][(key >> (pass * LIST_SORT_RADIX_BITS)) & mask]++;
+		}
+	}
+
+	Value *source = items;
+	Value *destination = scratch;
+
+	for (uintptr_t pass = 0; pass < LIST_SORT_RADIX_PASSES; pass++) {
+		uintptr_t shift = pass * LIST_SORT_RADIX_BITS;
+		uint32_t *offsets = counts[pass];
+		if (offsets[((uint64_t) source[0].i >> shift) & mask] == count) continue;
+
+		for (uint32_t i = 0, total = 0; i <= mask; i++) {
+			uint32_t digitCount = offsets[i];
+			offsets[i] = total;
+			total += digitCount;
+		}
+
+		for (uintptr_t i = 0; i < count; i++) {
+			destination[offsets[((uint64_t) source[i].i >> shift) & mask]++] = source[i];
+		}
+
+		Value *swap = source;
+		source = destination;
+		destination = swap;
+	}
+
+	if (source != items) MemoryCopy(items, source, count * sizeof(Value));
+}
+
+bool ScriptReturnErrors(ExecutionContext *context, int result, Value returnValue) {
+	bool isErr = result == EXTCALL_RETURN_ERR_ERROR 
+		|| result == EXTCALL_RETURN_ERR_MANAGED 
+		|| result == EXTCALL_RETURN_ERR_UNMANAGED;
+
+	if (result == EXTCALL_RETURN_UNMANAGED || result == EXTCALL_RETURN_MANAGED || isErr) {
+		if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+			PrintDebug("Evaluation stack overflow.\n");
+			return false;
+		}
+
+		if (isErr) {
+			if (result != EXTCALL_RETURN_ERR_ERROR || returnValue.i) {
+				// Temporarily put the return value on the stack in case garbage collection occurs 
+				// in the following HeapAllocate (i.e. before the return value has been wrapped).
+				context->c->stackIsManaged[context->c->stackPointer] = result != EXTCALL_RETURN_ERR_UNMANAGED;
+				context->c->stack[context->c->stackPointer++] = returnValue;
+				
+				// TODO Handle memory allocation failures here.
+				uintptr_t index = HeapAllocate(context);
+				context->heap[index].type = T_ERR;
+				context->heap[index].success = result != EXTCALL_RETURN_ERR_ERROR;
+				context->heap[index].internalValuesAreManaged = result != EXTCALL_RETURN_ERR_UNMANAGED;
+				context->heap[index].errorValue = returnValue;
+				returnValue.i = index;
+
+				context->c->stackPointer--;
+			} else {
+				// Unknown error.
+				returnValue.i = 0;
+			}
+
+			result = EXTCALL_RETURN_MANAGED;
+		}
+
+		context->c->stackIsManaged[context->c->stackPointer] = result == EXTCALL_RETURN_MANAGED;
+		context->c->stack[context->c->stackPointer++] = returnValue;
+	}
+
+	return true;
+}
+
+int ScriptExecuteFunction(uintptr_t instructionPointer, ExecutionContext *context) {
+#ifndef NO_SCRIPT_EXECUTE
+	// TODO Things to verify if loading untrusted scripts -- is this a feature we will need?
+	// 	Checking we don't go off the end of the function body.
+	// 	Checking that this is actually a valid function body pointer.
+	// 	Checking various integer overflows.
+
+	uintptr_t variableBase = context->c->localVariableCount - 1;
+	uint8_t *functionData = context->functionData->data;
+
+	while (true) {
+		uint8_t command = functionData[instructionPointer++];
+
+		if (debugBytecodeLevel >= 1) {
+			PrintDebug("--> %d, %ld, %ld, %ld\n", command, instructionPointer - 1, context->c->id, context->c->stackPointer);
+			if (debugBytecodeLevel >= 2) PrintBackTrace(context, instructionPointer - 1, context->c, "");
+		}
+
+		if (allocatedBytes - context->heapAllocatedBytesAtCollection >= context->heapCollectionThresholdBytes) {
+			// Lists and strings can grow without allocating new heap entries, so collections are also started from here.
+			// No native code is running, so this is also where slices that pin large strings are materialized.
+			HeapGarbageCollect(context, true);
+
+			if (heapLimitBytes && context->heapLiveBytes >= heapLimitBytes) {
+				PrintError4(context, instructionPointer - 1, "The script is using more memory than the heap limit of %ld bytes.\n", heapLimitBytes);
+				return 0;
+			}
+		}
+
+		if (command == T_BLOCK || command == T_FUNCBODY) {
+			uint16_t newVariableCount = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
+			instructionPointer += 2;
+
+			if (context->c->localVariableCount + newVariableCount > context->c->localVariablesAllocated) {
+				// TODO Handling memory errors here.
+				context->c->localVariablesAllocated = context->c->localVariableCount + newVariableCount;
+				context->c->localVariables = (Value *) AllocateResize(context->c->localVariables, context->c->localVariablesAllocated * sizeof(Value)); 
+				context->c->localVariableIsManaged = (bool *) AllocateResize(context->c->localVariableIsManaged, context->c->localVariablesAllocated * sizeof(bool)); 
+			}
+
+			MemoryCopy(context->c->localVariableIsManaged + context->c->localVariableCount, functionData + instructionPointer, newVariableCount);
+			instructionPointer += newVariableCount;
+
+			for (uintptr_t i = context->c->localVariableCount; i < context->c->localVariableCount + newVariableCount; i++) {
+				if (command == T_FUNCBODY) {
+					if (context->c->stackPointer < 1) return -1;
+					context->c->localVariables[i] = context->c->stack[--context->c->stackPointer];
+				} else {
+					Value zero = { 0 };
+					context->c->localVariables[i] = zero;
+				}
+			}
+
+			context->c->localVariableCount += newVariableCount;
+		} else if (command == T_EXIT_SCOPE) {
+			uint16_t count = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
+			instructionPointer += 2;
+			if (context->c->localVariableCount < count) return -1;
+			context->c->localVariableCount -= count;
+		} else if (command == T_NUMERIC_LITERAL) {
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			context->c->stackIsManaged[context->c->stackPointer] = false;
+			MemoryCopy(&context->c->stack[context->c->stackPointer++], &functionData[instructionPointer], sizeof(Value));
+			instructionPointer += sizeof(Value);
+		} else if (command == T_NULL || command == T_ZERO) {
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			context->c->stackIsManaged[context->c->stackPointer] = command == T_NULL;
+			context->c->stack[context->c->stackPointer++].i = 0;
+		} else if (command == T_STRING_LITERAL) {
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			uint32_t index;
+			MemoryCopy(&index, &functionData[instructionPointer], sizeof(index));
+			instructionPointer += sizeof(index);
+
+			Value v;
+			v.i = index;
+			context->c->stackIsManaged[context->c->stackPointer] = true;
+			context->c->stack[context->c->stackPointer++] = v;
+		} else if (command == T_CONCAT) {
+			if (context->c->stackPointer < 2) return -1;
+			uint64_t index1 = context->c->stack[context->c->stackPointer - 2].i;
+			uint64_t index2 = context->c->stack[context->c->stackPointer - 1].i;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (context->heapEntriesAllocated <= index1) return -1;
+			if (context->heapEntriesAllocated <= index2) return -1;
+			Assert(index1 <= 0xFFFFFFFF && index2 <= 0xFFFFFFFF);
+			size_t bytes1 = ScriptHeapEntryGetStringBytes(&context->heap[index1]);
+			size_t bytes2 = ScriptHeapEntryGetStringBytes(&context->heap[index2]);
+
+			uintptr_t index;
+
+			if (!bytes1 || !bytes2) {
+				// Strings are immutable, so the other string can be used as the result.
+				index = bytes1 ? index1 : index2;
+			} else if (bytes1 + bytes2 < CONCAT_COPY_BYTES || bytes1 + bytes2 > UINT32_MAX) {
+				// Short strings are cheaper to copy than to keep as a rope.
+				index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+				char *text = (char *) AllocateResize(NULL, bytes1 + bytes2);
+				ScriptHeapEntryConcatConvertToStringWrite(context, &context->heap[index1], text);
+				ScriptHeapEntryConcatConvertToStringWrite(context, &context->heap[index2], text + bytes1);
+				context->heap[index].type = T_STR;
+				context->heap[index].bytes = bytes1 + bytes2;
+				context->heap[index].text = text;
+			} else {
+				index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+				HeapEntry *entry1 = &context->heap[index1], *entry2 = &context->heap[index2];
+
+				if (HeapEntryConcatDepth(entry1, entry2) > CONCAT_MAXIMUM_DEPTH) {
+					// Rebalance by flattening the smaller part. A byte can only be in the smaller part
+					// a logarithmic number of times before it is flattened, so building a string stays close to linear.
+					ScriptHeapEntryConcatConvertToString(context, bytes1 < bytes2 ? entry1 : entry2);
+				}
+
+				context->heap[index].type = T_CONCAT;
+				context->heap[index].concat1 = index1;
+				context->heap[index].concat2 = index2;
+				context->heap[index].concatBytes = bytes1 + bytes2;
+				context->heap[index].concatDepth = HeapEntryConcatDepth(entry1, entry2);
+				Assert(context->heap[index].concatDepth <= CONCAT_MAXIMUM_DEPTH);
+			}
+
+			context->c->stack[context->c->stackPointer - 2].i = index;
+			context->c->stackPointer--;
+		} else if (command == T_FORMAT) {
+			uint16_t argumentCount;
+			MemoryCopy(&argumentCount, &functionData[instructionPointer], sizeof(argumentCount));
+			instructionPointer += sizeof(argumentCount);
+			if (!argumentCount || argumentCount > FORMAT_MAX_ARGUMENTS) return -1;
+			if (context->c->stackPointer < argumentCount) return -1;
+
+			// TODO Handle memory allocation failures here.
+			uintptr_t index = HeapAllocate(context);
+			// NOTE Call HeapAllocate before reading the strings!!
+
+			// First, find the text of every piece, so that the exact length of the output is known.
+			const char *pieceText[FORMAT_MAX_ARGUMENTS * 2 + 1];
+			size_t pieceBytes[FORMAT_MAX_ARGUMENTS * 2 + 1];
+			HeapEntry *pieceIntegerList[FORMAT_MAX_ARGUMENTS * 2 + 1];
+			char numbers[FORMAT_MAX_ARGUMENTS][32];
+			char temporary[32];
+			size_t bytes = 0;
+
+			for (uintptr_t i = 0; i <= (uintptr_t) argumentCount * 2; i++) {
+				pieceIntegerList[i] = NULL;
+
+				if (~i & 1) {
+					uint32_t literal;
+					MemoryCopy(&literal, &functionData[instructionPointer], sizeof(literal));
+					instructionPointer += sizeof(literal);
+					if (context->heapEntriesAllocated <= literal) return -1;
+					HeapEntry *entry = &context->heap[literal];
+					if (entry->type != T_EOF && entry->type != T_STR) return -1;
+					ScriptHeapEntryToString(context, entry, &pieceText[i], &pieceBytes[i]);
+					bytes += pieceBytes[i];
+					continue;
+				}
+
+				uint8_t type = functionData[instructionPointer++];
+				uintptr_t slot = context->c->stackPointer - argumentCount + i / 2;
+				Value value = context->c->stack[slot];
+				bool isManaged = context->c->stackIsManaged[slot];
+
+				if (type == T_STR) {
+					if (!isManaged || context->heapEntriesAllocated <= (uint64_t) value.i) return -1;
+					HeapEntry *entry = &context->heap[value.i];
+					if (entry->type != T_EOF && entry->type != T_STR && entry->type != T_CONCAT && entry->type != T_OP_SLICE) return -1;
+					ScriptHeapEntryToString(context, entry, &pieceText[i], &pieceBytes[i]);
+				} else if (type == T_BOOL) {
+					pieceText[i] = value.i ? "true" : "false";
+					pieceBytes[i] = value.i ? 4 : 5;
+				} else if (type == T_INT) {
+					pieceText[i] = numbers[i / 2];
+					pieceBytes[i] = PrintIntegerToBuffer(numbers[i / 2], sizeof(numbers[0]), value.i);
+				} else if (type == T_FLOAT) {
+					pieceText[i] = numbers[i / 2];
+					pieceBytes[i] = PrintFloatToBuffer(numbers[i / 2], sizeof(numbers[0]), value.f);
+				} else if (type == T_LIST) {
+					if (!isManaged || context->heapEntriesAllocated <= (uint64_t) value.i) return -1;
+					HeapEntry *entry = &context->heap[value.i];
+					if (entry->type != T_EOF && entry->type != T_LIST) return -1;
+
+					if (entry->type == T_EOF) {
+						pieceText[i] = "null";
+						pieceBytes[i] = 4;
+					} else if (entry->length == 0) {
+						pieceText[i] = "[]";
+						pieceBytes[i] = 2;
+					} else {
+						if (entry->internalValuesAreManaged) return -1;
+						pieceIntegerList[i] = entry;
+						pieceBytes[i] = 2;
+
+						for (uintptr_t j = 0; j < entry->length; j++) {
+							pieceBytes[i] += PrintIntegerToBuffer(temporary, sizeof(temporary), ListGet(entry, j).i) + 2;
+						}
+					}
+				} else {
+					return -1;
+				}
+
+				bytes += pieceBytes[i];
+			}
+
+			// Then write the output.
+			char *text = (char *) AllocateResize(NULL, bytes);
+			uintptr_t position = 0;
+
+			for (uintptr_t i = 0; i <= (uintptr_t) argumentCount * 2; i++) {
+				if (pieceIntegerList[i]) {
+					HeapEntry *entry = pieceIntegerList[i];
+					text[position++] = '[';
+
+					for (uintptr_t j = 0; j < entry->length; j++) {
+						text[position++] = ' ';
+						position += PrintIntegerToBuffer(text + position, 21, ListGet(entry, j).i);
+						text[position++] = j == entry->length - 1 ? ' ' : ',';
+					}
+
+					text[position++] = ']';
+				} else if (pieceBytes[i]) {
+					MemoryCopy(text + position, pieceText[i], pieceBytes[i]);
+					position += pieceBytes[i];
+				}
+			}
+
+			Assert(position == bytes);
+			context->heap[index].type = T_STR;
+			context->heap[index].bytes = bytes;
+			context->heap[index].text = text;
+			context->c->stackPointer -= argumentCount - 1;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
+			context->c->stack[context->c->stackPointer - 1].i = index;
+		} else if (command == T_VARIABLE) {
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintDebug("Stack overflow.\n");
+				return -1;
+			}
+
+			int32_t scopeIndex;
+			MemoryCopy(&scopeIndex, &functionData[instructionPointer], sizeof(scopeIndex));
+			instructionPointer += sizeof(scopeIndex);
+
+			if (scopeIndex >= 0) {
+				if ((uintptr_t) scopeIndex >= context->globalVariableCount) return -1;
+				context->c->stackIsManaged[context->c->stackPointer] = context->globalVariableIsManaged[scopeIndex];
+				context->c->stack[context->c->stackPointer++] = context->globalVariables[scopeIndex];
+			} else {
+				scopeIndex = variableBase - scopeIndex;
+				if ((uintptr_t) scopeIndex >= context->c->localVariableCount) return -1;
+				context->c->stackIsManaged[context->c->stackPointer] = context->c->localVariableIsManaged[scopeIndex];
+				context->c->stack[context->c->stackPointer++] = context->c->localVariables[scopeIndex];
+			}
+		} else if (command == T_EQUALS) {
+			if (!context->c->stackPointer) return -1;
+			int32_t scopeIndex;
+			MemoryCopy(&scopeIndex, &functionData[instructionPointer], sizeof(scopeIndex));
+			instructionPointer += sizeof(scopeIndex);
+
+			if (scopeIndex >= 0) {
+				if ((uintptr_t) scopeIndex >= context->globalVariableCount) return -1;
+				if (context->globalVariableIsManaged[scopeIndex] != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				context->globalVariables[scopeIndex] = context->c->stack[--context->c->stackPointer];
+			} else {
+				scopeIndex = variableBase - scopeIndex;
+				if ((uintptr_t) scopeIndex >= context->c->localVariableCount) return -1;
+				if (context->c->localVariableIsManaged[scopeIndex] != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				context->c->localVariables[scopeIndex] = context->c->stack[--context->c->stackPointer];
+			}
+		} else if (command == T_EQUALS_DOT) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The struct is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_STRUCT) return -1;
+
+			int32_t fieldIndex;
+			MemoryCopy(&fieldIndex, &functionData[instructionPointer], sizeof(fieldIndex));
+			instructionPointer += sizeof(fieldIndex);
+			bool isManaged = fieldIndex < 0;
+			if (isManaged) fieldIndex = -fieldIndex - 1;
+			if (fieldIndex < 0 || fieldIndex >= entry->fieldCount) return -1;
+
+			entry->fields[fieldIndex] = context->c->stack[context->c->stackPointer - 2];
+			if (isManaged != context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			((uint8_t *) entry->fields - 1)[-fieldIndex] = isManaged;
+
+			context->c->stackPointer -= 2;
+		} else if (command == T_EQUALS_LIST) {
+			if (context->c->stackPointer < 3) return -1;
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index >= entry->length) {
+				PrintError4(context, instructionPointer - 1, "The index %ld is not valid for the list, which has length %d.\n", index, entry->length);
+				return 0;
+			}
+
+			Value value = context->c->stack[context->c->stackPointer - 3];
+			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+
+			if (entry->storage == STORAGE_DEFAULT) {
+				entry->list[index] = value;
+			} else {
+				if (!ListFits(entry, value)) ListConvert(entry, ListStorageForInt(value.i));
+				ListPut(entry, index, value);
+			}
+
+			context->c->stackPointer -= 3;
+		} else if (command == T_INDEX_LIST) {
+			if (context->c->stackPointer < 2) return -1;
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index >= entry->length) {
+				PrintError4(context, instructionPointer - 1, "The index %ld is not valid for the list, which has length %d.\n", index, entry->length);
+				return 0;
+			}
+
+			context->c->stack[context->c->stackPointer - 2] = entry->storage == STORAGE_DEFAULT ? entry->list[index] : ListGet(entry, index);
+			context->c->stackIsManaged[context->c->stackPointer - 2] = entry->internalValuesAreManaged;
+			context->c->stackPointer--;
+		} else if (command == T_OP_FIRST || command == T_OP_LAST) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			if (!entry->length) {
+				PrintError4(context, instructionPointer - 1, "The list is empty.\n");
+				return 0;
+			}
+
+			context->c->stack[context->c->stackPointer - 1] = ListGet(entry, command == T_OP_FIRST ? 0 : entry->length - 1);
+			context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
+		} else if (command == T_DOT) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The struct is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_STRUCT) return -1;
+
+			int16_t fieldIndex;
+			MemoryCopy(&fieldIndex, &functionData[instructionPointer], sizeof(fieldIndex));
+			instructionPointer += sizeof(fieldIndex);
+			bool isManaged = fieldIndex < 0;
+			if (isManaged) fieldIndex = -fieldIndex - 1;
+			if (fieldIndex < 0 || fieldIndex >= entry->fieldCount) return -1;
+
+			// Only allow the isManaged bool to be incorrect if it's a null managed variable.
+			if (isManaged != ((uint8_t *) entry->fields - 1)[-fieldIndex] && (entry->fields[fieldIndex].i || !isManaged)) return -1;
+
+			context->c->stack[context->c->stackPointer - 1] = entry->fields[fieldIndex];
+			context->c->stackIsManaged[context->c->stackPointer - 1] = isManaged;
+		} else if (command == T_BIT_SHIFT_LEFT) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = (uint64_t) context->c->stack[context->c->stackPointer - 2].i << (uint64_t) context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_BIT_SHIFT_RIGHT) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = (uint64_t) context->c->stack[context->c->stackPointer - 2].i >> (uint64_t) context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_BITWISE_OR) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i | context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_BITWISE_AND) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i & context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_BITWISE_XOR) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i ^ context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_ADD) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i + context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_MINUS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i - context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_ASTERISK) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i * context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_SLASH) {
+			if (context->c->stackPointer < 2) return -1;
+
+			if (0 == context->c->stack[context->c->stackPointer - 1].i) {
+				PrintError4(context, instructionPointer - 1, "Attempted division by zero.\n");
+				return 0;
+			}
+
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i / context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_NEGATE) {
+			if (context->c->stackPointer < 1) return -1;
+			context->c->stack[context->c->stackPointer - 1].i = -context->c->stack[context->c->stackPointer - 1].i;
+		} else if (command == T_BITWISE_NOT) {
+			if (context->c->stackPointer < 1) return -1;
+			context->c->stack[context->c->stackPointer - 1].i = ~context->c->stack[context->c->stackPointer - 1].i;
+		} else if (command == T_FLOAT_ADD) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f + context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_MINUS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f - context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_ASTERISK) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f * context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_SLASH) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f / context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_NEGATE) {
+			if (context->c->stackPointer < 1) return -1;
+			context->c->stack[context->c->stackPointer - 1].f = -context->c->stack[context->c->stackPointer - 1].f;
+		} else if (command == T_LESS_THAN) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i < context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_GREATER_THAN) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i > context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_LT_OR_EQUAL) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i <= context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_GT_OR_EQUAL) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i >= context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackPointer--;
+		} else if (command == T_DOUBLE_EQUALS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i == context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = false; // Necessary since pointers can be compared.
+			context->c->stackPointer--;
+		} else if (command == T_NOT_EQUALS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i != context->c->stack[context->c->stackPointer - 1].i;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = false; // Necessary since pointers can be compared.
+			context->c->stackPointer--;
+		} else if (command == T_LOGICAL_NOT) {
+			if (context->c->stackPointer < 1) return -1;
+			context->c->stack[context->c->stackPointer - 1].i = !context->c->stack[context->c->stackPointer - 1].i;
+		} else if (command == T_FLOAT_LESS_THAN) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f < context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_GREATER_THAN) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f > context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_LT_OR_EQUAL) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f <= context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_GT_OR_EQUAL) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f >= context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_DOUBLE_EQUALS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f == context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_FLOAT_NOT_EQUALS) {
+			if (context->c->stackPointer < 2) return -1;
+			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f != context->c->stack[context->c->stackPointer - 1].f;
+			context->c->stackPointer--;
+		} else if (command == T_STR_DOUBLE_EQUALS || command == T_STR_NOT_EQUALS) {
+			STACK_READ_STRING(text1, bytes1, 2);
+			STACK_READ_STRING(text2, bytes2, 1);
+			bool equal = _index1 == _index2 || (bytes1 == bytes2 && HeapEntryStringsMightBeEqual(_entry1, _entry2) 
+					&& 0 == MemoryCompare(text1, text2, bytes1));
+			context->c->stack[context->c->stackPointer - 2].i = command == T_STR_NOT_EQUALS ? !equal : equal;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = false;
+			context->c->stackPointer--;
+		} else if (command == T_OP_LEN) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+
+			if (entry->type == T_LIST) {
+				context->c->stack[context->c->stackPointer - 1].i = entry->length;
+			} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
+				context->c->stack[context->c->stackPointer - 1].i = entry->mapLength;
+			} else if (entry->type == T_STRBUILDER) {
+				context->c->stack[context->c->stackPointer - 1].i = entry->builderBytes;
+			} else {
+				STACK_READ_STRING(stringText, stringBytes, 1);
+				context->c->stack[context->c->stackPointer - 1].i = stringBytes;
+			}
+
+			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
+		} else if (command == T_INDEX) {
+			if (context->c->stackPointer < 2) return -1;
+			STACK_READ_STRING(text, bytes, 2);
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index >= bytes) {
+				PrintError4(context, instructionPointer - 1, "Index %ld out of bounds in string '%.*s' of length %ld.\n", 
+						index, bytes, text, bytes);
+				return 0;
+			}
+
+			char c = text[index];
+			index = HeapAllocate(context);
+			context->heap[index].type = T_STR;
+			context->heap[index].bytes = 1;
+			context->heap[index].text = (char *) AllocateResize(NULL, 1); // TODO Handling allocation failure.
+			context->heap[index].text[0] = c;
+			context->c->stack[context->c->stackPointer - 2].i = index;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = true;
+			context->c->stackPointer--;
+		} else if (command == T_CALL) {
+			callCommand:;
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			Value newBody = context->c->stack[--context->c->stackPointer];
+
+			if (newBody.i == 0) {
+				PrintError4(context, instructionPointer - 1, "Function pointer was null.\n");
+				return 0;
+			}
+
+			bool popResult = false;
+			bool assertResult = false;
+
+			while (true) {
+				uint64_t index = newBody.i;
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				newBody.i = entry->lambdaID;
+
+				if (entry->type == T_OP_DISCARD) {
+					popResult = true;
+				} else if (entry->type == T_OP_ASSERT) {
+					assertResult = true;
+				} else if (entry->type == T_OP_CURRY) {
+					if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+						PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+						return 0;
+					}
+
+					context->c->stack[context->c->stackPointer] = entry->curryValue;
+					context->c->stackIsManaged[context->c->stackPointer] = entry->internalValuesAreManaged;
+					context->c->stackPointer++;
+				} else if (entry->type == T_FUNCPTR) {
+					break;
+				} else {
+					return -1;
+				}
+			} 
+
+			if (context->c->backTracePointer == sizeof(context->c->backTrace) / sizeof(context->c->backTrace[0])) {
+				PrintError4(context, instructionPointer - 1, "Back trace overflow.\n");
+				return 0;
+			}
+			
+			BackTraceItem *link = &context->c->backTrace[context->c->backTracePointer];
+			context->c->backTracePointer++;
+			link->instructionPointer = instructionPointer;
+			link->variableBase = variableBase;
+			link->popResult = popResult;
+			link->assertResult = assertResult;
+			instructionPointer = newBody.i;
+			variableBase = context->c->localVariableCount - 1;
+		} else if (command == T_IF) {
+			if (context->c->stackPointer < 1) return -1;
+			Value condition = context->c->stack[--context->c->stackPointer];
+			int32_t delta;
+			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
+			instructionPointer += condition.i ? (int32_t) sizeof(delta) : delta; 
+		} else if (command == T_LOGICAL_OR) {
+			if (context->c->stackPointer < 1) return -1;
+			Value condition = context->c->stack[context->c->stackPointer - 1];
+			int32_t delta;
+			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
+			instructionPointer += condition.i ? delta : (int32_t) sizeof(delta); 
+			if (!condition.i) context->c->stackPointer--;
+		} else if (command == T_LOGICAL_AND) {
+			if (context->c->stackPointer < 1) return -1;
+			Value condition = context->c->stack[context->c->stackPointer - 1];
+			int32_t delta;
+			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
+			instructionPointer += condition.i ? (int32_t) sizeof(delta) : delta; 
+			if (condition.i) context->c->stackPointer--;
+		} else if (command == T_BRANCH) {
+			int32_t delta;
+			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
+			instructionPointer += delta; 
+		} else if (command == T_POP) {
+			if (context->c->stackPointer < 1) return -1;
+			context->c->stackPointer--;
+		} else if (command == T_DUP) {
+			if (context->c->stackPointer < 1) return -1;
+
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			context->c->stack[context->c->stackPointer] = context->c->stack[context->c->stackPointer - 1];
+			context->c->stackIsManaged[context->c->stackPointer] = context->c->stackIsManaged[context->c->stackPointer - 1];
+			context->c->stackPointer++;
+		} else if (command == T_SWAP) {
+			if (context->c->stackPointer < 2) return -1;
+			Value v1 = context->c->stack[context->c->stackPointer - 1];
+			Value v2 = context->c->stack[context->c->stackPointer - 2];
+			bool m1 = context->c->stackIsManaged[context->c->stackPointer - 1];
+			bool m2 = context->c->stackIsManaged[context->c->stackPointer - 2];
+			context->c->stack[context->c->stackPointer - 1] = v2;
+			context->c->stack[context->c->stackPointer - 2] = v1;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = m2;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = m1;
+		} else if (command == T_ROT3) {
+			if (context->c->stackPointer < 3) return -1;
+			Value v1 = context->c->stack[context->c->stackPointer - 1];
+			Value v2 = context->c->stack[context->c->stackPointer - 2];
+			Value v3 = context->c->stack[context->c->stackPointer - 3];
+			bool m1 = context->c->stackIsManaged[context->c->stackPointer - 1];
+			bool m2 = context->c->stackIsManaged[context->c->stackPointer - 2];
+			bool m3 = context->c->stackIsManaged[context->c->stackPointer - 3];
+			context->c->stack[context->c->stackPointer - 1] = v3;
+			context->c->stack[context->c->stackPointer - 2] = v1;
+			context->c->stack[context->c->stackPointer - 3] = v2;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = m3;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = m1;
+			context->c->stackIsManaged[context->c->stackPointer - 3] = m2;
+		} else if (command == T_ASSERT) {
+			if (context->c->stackPointer < 1) return -1;
+			Value condition = context->c->stack[--context->c->stackPointer];
+
+			if (condition.i == 0) {
+				PrintError4(context, instructionPointer - 1, "Assertion failed.\n");
+				return 0;
+			}
+		} else if (command == T_ERR_CAST) {
+			if (context->c->stackPointer < 1) return -1;
+
+			// TODO Handle memory allocation failures here.
+			uintptr_t index = HeapAllocate(context);
+			context->heap[index].type = T_ERR;
+			context->heap[index].success = true;
+			context->heap[index].internalValuesAreManaged = context->c->stackIsManaged[context->c->stackPointer - 1];;
+			context->heap[index].errorValue = context->c->stack[context->c->stackPointer - 1];
+
+			Value v;
+			v.i = index;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
+			context->c->stack[context->c->stackPointer - 1] = v;
+		} else if (command == T_ANYTYPE_CAST) {
+			if (context->c->stackPointer < 1) return -1;
+
+			// TODO Handle memory allocation failures here.
+			uintptr_t index = HeapAllocate(context);
+			context->heap[index].type = T_ANYTYPE;
+			MemoryCopy(&context->heap[index].anyType, &functionData[instructionPointer], sizeof(context->heap[index].anyType));
+			context->heap[index].internalValuesAreManaged = ASTIsManagedType(context->heap[index].anyType);
+			context->heap[index].anyValue = context->c->stack[context->c->stackPointer - 1];
+
+			Value v;
+			v.i = index;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
+			context->c->stack[context->c->stackPointer - 1] = v;
+
+			instructionPointer += sizeof(context->heap[index].anyType);
+		} else if (command == T_OP_CAST) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index == 0) {
+				PrintError4(context, instructionPointer - 1, "The object is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_ANYTYPE) return -1;
+			Node *expressionType;
+			MemoryCopy(&expressionType, &functionData[instructionPointer], sizeof(expressionType));
+
+			if (!ASTMatching(expressionType, entry->anyType)) {
+				PrintError4(context, instructionPointer - 1, "Invalid cast.\n");
+				return 0;
+			}
+
+			Assert(ASTIsManagedType(expressionType) == entry->internalValuesAreManaged);
+			context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
+			context->c->stack[context->c->stackPointer - 1] = entry->anyValue;
+			instructionPointer += sizeof(expressionType);
+		} else if (command == T_OP_SUCCESS) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+			bool success = false;
+
+			if (index) {
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				if (entry->type != T_ERR) return -1;
+				success = entry->success;
+			}
+
+			context->c->stack[context->c->stackPointer - 1].i = success;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
+		} else if (command == T_OP_ASSERT_ERR) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index == 0) {
+				PrintError4(context, instructionPointer - 1, "Assertion failed. Unknown error.\n");
+				return 0;
+			} else {
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				if (entry->type != T_ERR) return -1;
+
+				if (!entry->success) {
+					if (!entry->internalValuesAreManaged) return -1;
+					size_t textBytes;
+					const char *text;
+					ScriptHeapEntryToString(context, &context->heap[entry->errorValue.i], &text, &textBytes);
+					PrintError4(context, instructionPointer - 1, "Assertion failed.\nThe error code is: '%.*s'.\n", textBytes, text);
+					return 0;
+				}
+
+				context->c->stack[context->c->stackPointer - 1] = entry->errorValue;
+				context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
+			}
+		} else if (command == T_OP_ERROR) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (index == 0) {
+				index = HeapAllocate(context);
+				context->heap[index].type = T_STR;
+				context->heap[index].text = (char *) AllocateResize(NULL, 7);
+				context->heap[index].bytes = 7;
+				MemoryCopy(context->heap[index].text, "UNKNOWN", 7);
+			} else {
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				if (entry->type != T_ERR) return -1;
+				if (!entry->success && !entry->internalValuesAreManaged) return -1;
+				index = entry->success ? 0 : entry->errorValue.i;
+			}
+
+			context->c->stack[context->c->stackPointer - 1].i = index;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
+		} else if (command == T_OP_DEFAULT) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			uintptr_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (index) {
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				if (entry->type != T_ERR) return -1;
+				if (!entry->success && !entry->internalValuesAreManaged) return -1;
+
+				if (entry->success) {
+					context->c->stack[context->c->stackPointer - 1] = entry->errorValue;
+					context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
+				}
+			}
+
+			context->c->stack[context->c->stackPointer - 2] = context->c->stack[context->c->stackPointer - 1];
+			context->c->stackIsManaged[context->c->stackPointer - 2] = context->c->stackIsManaged[context->c->stackPointer - 1];
+			context->c->stackPointer--;
+		} else if (command == T_OP_INT_TO_FLOAT) {
+			if (context->c->stackPointer < 1) return -1;
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			context->c->stack[context->c->stackPointer - 1].f = context->c->stack[context->c->stackPointer - 1].i;
+		} else if (command == T_OP_FLOAT_TRUNCATE) {
+			if (context->c->stackPointer < 1) return -1;
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			context->c->stack[context->c->stackPointer - 1].i = context->c->stack[context->c->stackPointer - 1].f;
+		} else if (command == T_PERSIST) {
+			if (!ExternalPersistWrite(context, NULL)) {
+				return 0;
+			}
+		} else if (command == T_NEW) {
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			int16_t fieldCount = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
+			instructionPointer += 2;
+			uintptr_t index = HeapAllocate(context);
+			uint8_t type = context->heap[index].type = fieldCount >= 0 ? T_STRUCT 
+				: fieldCount >= -2 ? T_LIST 
+				: fieldCount >= -4 ? T_ERR
+				: fieldCount >= -6 ? T_MAP_INT
+				: fieldCount >= -8 ? T_MAP_STR
+				: fieldCount >= -9 ? T_STRBUILDER : T_ERROR;
+
+			if (type == T_STRUCT) {
+				size_t fieldCountAligned = (fieldCount + 7) & ~7;
+				context->heap[index].fields = (Value *) ((uint8_t *) AllocateResize(NULL, 
+							fieldCountAligned + fieldCount * sizeof(Value)) + fieldCountAligned);
+				context->heap[index].fieldCount = fieldCount;
+
+				for (intptr_t i = 0; i < fieldCount; i++) {
+					context->heap[index].fields[i].i = 0;
+
+					// Default all fields to being unmanaged.
+					// The first type they are set this will be updated.
+					((uint8_t *) context->heap[index].fields)[-1 - i] = false;
+				}
+			} else if (type == T_LIST) {
+				context->heap[index].internalValuesAreManaged = fieldCount == -2;
+				context->heap[index].length = context->heap[index].allocated = 0;
+				context->heap[index].list = NULL;
+			} else if (type == T_MAP_INT || type == T_MAP_STR) {
+				context->heap[index].internalValuesAreManaged = fieldCount == -6 || fieldCount == -8;
+				context->heap[index].storage = STORAGE_DEFAULT;
+				context->heap[index].mapLength = context->heap[index].mapAllocated = 0;
+				context->heap[index].mapEntries = NULL;
+				context->heap[index].mapIndex = NULL;
+			} else if (type == T_STRBUILDER) {
+				context->heap[index].builderBytes = context->heap[index].builderAllocated = 0;
+				context->heap[index].builderText = NULL;
+			} else if (type == T_ERR) {
+				context->heap[index].internalValuesAreManaged = true;
+				context->heap[index].success = false;
+
+				if (context->c->stackPointer < 1) return -1;
+				if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				context->heap[index].errorValue = context->c->stack[context->c->stackPointer - 1];
+				context->c->stackPointer--;
+			} else {
+				return -1;
+			}
+
+			Value v;
+			v.i = index;
+			context->c->stackIsManaged[context->c->stackPointer] = true;
+			context->c->stack[context->c->stackPointer++] = v;
+		} else if (command == T_OP_RESIZE) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			int64_t newLength = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (newLength < 0 || newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
+				return 0;
+			}
+
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint32_t oldLength = entry->length;
+			// TODO Handling out of memory errors.
+			ListReallocate(entry, oldLength < newLength ? oldLength : newLength, newLength);
+			entry->length = newLength;
+
+			// Zero the new items. In a bitset, the rest of the last word may be left over from when the list was longer.
+			if (entry->storage == STORAGE_LIST_BITS && (oldLength & 63) && newLength > oldLength) {
+				((uint64_t *) entry->list)[oldLength >> 6] &= ((uint64_t) 1 << (oldLength & 63)) - 1;
+			}
+
+			for (uintptr_t i = ListStorageBytes(entry->storage, oldLength); i < ListStorageBytes(entry->storage, newLength); i++) {
+				((uint8_t *) entry->list)[i] = 0;
+			}
+
+			context->c->stackPointer -= 2;
+		} else if (command == T_OP_ADD) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			int64_t newLength = entry->length + 1;
+
+			if (newLength < 0 || newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
+				return 0;
+			}
+
+			uint32_t oldLength = context->heap[index].length;
+			Value value = context->c->stack[context->c->stackPointer - 1];
+			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			if (!ListFits(entry, value)) ListConvert(entry, ListStorageForInt(value.i));
+			entry->length = newLength;
+
+			if (entry->length > entry->allocated) {
+				// TODO Handling out of memory errors.
+				ListReallocate(entry, oldLength, entry->allocated ? entry->allocated * 2 : 4);
+				Assert(entry->length <= entry->allocated);
+			}
+
+			if (entry->storage == STORAGE_DEFAULT) entry->list[oldLength] = value;
+			else ListPut(entry, oldLength, value);
+
+			context->c->stackPointer -= 2;
+		} else if (command == T_OP_INSERT) {
+			if (context->c->stackPointer < 3) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 3].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = entry->storage == STORAGE_LIST_RING ? STORAGE_DEFAULT : ListUnpack(entry);
+
+			int64_t newLength = entry->length + 1;
+
+			if (newLength < 0 || newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
+				return 0;
+			}
+
+			uint32_t oldLength = context->heap[index].length;
+			entry->length = newLength;
+
+			if (entry->length > entry->allocated) {
+				// TODO Handling out of memory errors.
+				ListReallocate(entry, oldLength, entry->allocated ? entry->allocated * 2 : 4);
+				Assert(entry->length <= entry->allocated);
+			}
+
+			if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			int64_t insertIndex = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (insertIndex < 0 || insertIndex > oldLength) {
+				PrintError4(context, instructionPointer - 1, "Cannot insert at index %ld. The list has length %ld.\n",
+						insertIndex, oldLength);
+				return 0;
+			}
+
+			if (entry->storage == STORAGE_LIST_RING) {
+				ListRingOpen(entry, insertIndex, 1, oldLength);
+			} else {
+				MemoryMove(entry->list + insertIndex + 1, entry->list + insertIndex, (oldLength - insertIndex) * sizeof(Value));
+			}
+
+			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			ListPut(entry, insertIndex, context->c->stack[context->c->stackPointer - 1]);
+
+			ListPack(entry, storage);
+			context->c->stackPointer -= 3;
+		} else if (command == T_OP_INSERT_MANY) {
+			if (context->c->stackPointer < 3) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 3].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = entry->storage == STORAGE_LIST_RING ? STORAGE_DEFAULT : ListUnpack(entry);
+
+			if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			int64_t insertCount = context->c->stack[context->c->stackPointer - 2].i;
+			int64_t newLength = (int64_t) entry->length + insertCount;
+
+			if (insertCount < 0) {
+				PrintError4(context, instructionPointer - 1, "The number of items to insert is negative (%ld).\n", insertCount);
+				return 0;
+			} else if (newLength < 0 || newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list (%ld + %ld = %ld) "
+						"is out of the supported range (0..1000000000).\n", (int64_t) entry->length, insertCount, newLength);
+				return 0;
+			}
+
+			uint32_t oldLength = context->heap[index].length;
+			entry->length = newLength;
+
+			if (entry->length > entry->allocated) {
+				// TODO Handling out of memory errors.
+				uint32_t allocated = entry->allocated ? entry->allocated * 2 : 4;
+				if (entry->length > allocated) allocated = entry->length + 5;
+				ListReallocate(entry, oldLength, allocated);
+				Assert(entry->length <= entry->allocated);
+			}
+
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			int64_t insertIndex = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (insertIndex < 0 || insertIndex > oldLength) {
+				PrintError4(context, instructionPointer - 1, "Cannot insert at index %ld. The list has length %ld.\n",
+						insertIndex, oldLength);
+				return 0;
+			}
+
+			if (entry->storage == STORAGE_LIST_RING) {
+				ListRingOpen(entry, insertIndex, insertCount, oldLength);
+			} else {
+				MemoryMove(entry->list + insertIndex + insertCount, entry->list + insertIndex, (oldLength - insertIndex) * sizeof(Value));
+			}
+
+			for (uintptr_t i = 0; i < (uintptr_t) insertCount; i++) {
+				Value zero = { 0 };
+				ListPut(entry, i + insertIndex, zero);
+			}
+
+			ListPack(entry, storage);
+			context->c->stackPointer -= 3;
+		} else if (command == T_OP_DELETE || command == T_OP_DELETE_MANY) {
+			int stackIndexList = command == T_OP_DELETE ? 2 : 3;
+			if (context->c->stackPointer < (uintptr_t) stackIndexList) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - stackIndexList]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - stackIndexList].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = entry->storage == STORAGE_LIST_RING ? STORAGE_DEFAULT : ListUnpack(entry);
+
+			if (command == T_OP_DELETE_MANY && context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			int64_t deleteCount = command == T_OP_DELETE ? 1 : context->c->stack[context->c->stackPointer - 2].i;
+			int64_t newLength = (int64_t) entry->length - deleteCount;
+
+			if (deleteCount < 0) {
+				PrintError4(context, instructionPointer - 1, "The number of items to delete is negative (%ld).\n", deleteCount);
+				return 0;
+			} else if (newLength < 0 || newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list (%ld - %ld = %ld) "
+						"is out of the supported range (0..1000000000).\n", (int64_t) entry->length, deleteCount, newLength);
+				return 0;
+			}
+
+			// TODO Maybe shrink the list storage, if it will save a lot of memory.
+
+			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			int64_t deleteIndex = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (deleteIndex < 0 || deleteIndex > newLength) {
+				PrintError4(context, instructionPointer - 1, "Cannot delete %ld items starting at index %ld. The list has length %ld.\n",
+						deleteCount, deleteIndex, (int64_t) entry->length);
+				return 0;
+			}
+
+			if (entry->storage == STORAGE_LIST_RING) {
+				ListRingClose(entry, deleteIndex, deleteCount, entry->length);
+			} else {
+				MemoryMove(entry->list + deleteIndex, entry->list + deleteIndex + deleteCount, (newLength - deleteIndex) * sizeof(Value));
+			}
+
+			entry->length = newLength;
+			ListPack(entry, storage);
+			context->c->stackPointer -= command == T_OP_DELETE ? 2 : 3;
+		} else if (command == T_OP_DELETE_ALL) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The object is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+
+			if (entry->type == T_LIST) {
+				if (!HeapStorageRelease(context, entry)) AllocateResize(entry->list, 0);
+				entry->length = entry->allocated = entry->listHead = 0;
+				entry->list = NULL;
+			} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
+				if (HeapStorageRelease(context, entry)) entry->mapEntries = NULL, entry->mapIndex = NULL; // Leave the storage to the other maps.
+				MapFreeStorage(entry);
+			} else {
+				return -1;
+			}
+
+			context->c->stackPointer--;
+		} else if (command == T_OP_HINT_UNORDERED || command == T_OP_HINT_ORDERED) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The map is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_MAP_INT && entry->type != T_MAP_STR) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			if (command == T_OP_HINT_UNORDERED) MapConvertToHash(context, entry);
+			else MapConvertToOrdered(context, entry);
+			context->c->stackPointer--;
+		} else if (command == T_OP_FIRST_KEY || command == T_OP_LAST_KEY || command == T_OP_NEXT_KEY 
+				|| command == T_OP_PRIOR_KEY || command == T_OP_LOWER_BOUND) {
+			bool hasKey = command != T_OP_FIRST_KEY && command != T_OP_LAST_KEY;
+			if (context->c->stackPointer < (hasKey ? 2 : 1)) return -1;
+			uintptr_t mapSlot = context->c->stackPointer - (hasKey ? 2 : 1);
+			if (!context->c->stackIsManaged[mapSlot]) return -1;
+			uint64_t index = context->c->stack[mapSlot].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The map is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_MAP_INT && entry->type != T_MAP_STR) return -1;
+			bool keyIsManaged = entry->type == T_MAP_STR;
+			Value key = { 0 };
+
+			if (hasKey) {
+				if (context->c->stackIsManaged[mapSlot + 1] != keyIsManaged) return -1;
+				key = context->c->stack[mapSlot + 1];
+			}
+
+			bool forwards = command == T_OP_FIRST_KEY || command == T_OP_NEXT_KEY || command == T_OP_LOWER_BOUND;
+			MapEntry *result = MapSeek(context, entry, key, hasKey, forwards, command == T_OP_LOWER_BOUND);
+			Value resultKey = { 0 };
+			if (result) resultKey = result->key;
+
+			// The map is still on the stack, so the key cannot be freed if HeapAllocate starts a garbage collection.
+			uintptr_t errorIndex = HeapAllocate(context);
+			context->heap[errorIndex].type = T_ERR;
+			context->heap[errorIndex].success = result != NULL;
+			context->heap[errorIndex].internalValuesAreManaged = keyIsManaged || !result;
+			context->heap[errorIndex].errorValue = resultKey;
+			context->c->stackIsManaged[mapSlot] = true;
+			context->c->stack[mapSlot].i = errorIndex;
+			context->c->stackPointer = mapSlot + 1;
+		} else if (command == T_MAP_ITERATE || command == T_MAP_ITERATE_NEXT) {
+			// Stack in: map (T_MAP_ITERATE); or map, key, position (T_MAP_ITERATE_NEXT).
+			// Stack out: map, key, position, value, found. The key and value are zero if nothing was found.
+			bool hasKey = command == T_MAP_ITERATE_NEXT;
+			if (context->c->stackPointer < (hasKey ? 3 : 1)) return -1;
+			uintptr_t mapSlot = context->c->stackPointer - (hasKey ? 3 : 1);
+			if (!context->c->stackIsManaged[mapSlot]) return -1;
+			uint64_t index = context->c->stack[mapSlot].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The map is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_MAP_INT && entry->type != T_MAP_STR) return -1;
+
+			if (mapSlot + 5 > context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			bool keyIsManaged = entry->type == T_MAP_STR;
+			Value key = { 0 };
+			uintptr_t position = 0;
+
+			if (hasKey) {
+				if (context->c->stackIsManaged[mapSlot + 1] != keyIsManaged) return -1;
+				if (context->c->stackIsManaged[mapSlot + 2]) return -1;
+				key = context->c->stack[mapSlot + 1];
+				position = context->c->stack[mapSlot + 2].i;
+			}
+
+			MapEntry *result = MapIterate(context, entry, key, hasKey, &position);
+			context->c->stack[mapSlot + 1] = result ? result->key : (Value) { 0 };
+			context->c->stackIsManaged[mapSlot + 1] = keyIsManaged;
+			context->c->stack[mapSlot + 2].i = position;
+			context->c->stackIsManaged[mapSlot + 2] = false;
+			context->c->stack[mapSlot + 3] = result ? result->value : (Value) { 0 };
+			context->c->stackIsManaged[mapSlot + 3] = entry->internalValuesAreManaged;
+			context->c->stack[mapSlot + 4].i = result != NULL;
+			context->c->stackIsManaged[mapSlot + 4] = false;
+			context->c->stackPointer = mapSlot + 5;
+		} else if (command == T_MAP_APPEND) {
+			// Stack: key, map, value, ... The map is a new map from a map initializer, which is sorted by T_MAP_BUILD.
+			if (context->c->stackPointer < 3) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+			if (!index || context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if ((entry->type != T_MAP_INT && entry->type != T_MAP_STR) || entry->storage != STORAGE_DEFAULT) return -1;
+			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+			if ((entry->type == T_MAP_STR) != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			if (entry->type == T_MAP_STR) {
+				uint64_t keyIndex = context->c->stack[context->c->stackPointer - 1].i;
+				if (context->heapEntriesAllocated <= keyIndex) return -1;
+				uint8_t keyType = context->heap[keyIndex].type;
+				if (keyType != T_EOF && keyType != T_STR && keyType != T_CONCAT && keyType != T_OP_SLICE) return -1;
+			}
+
+			if (entry->mapLength == entry->mapAllocated) {
+				entry->mapAllocated = entry->mapAllocated ? entry->mapAllocated * 2 : 4;
+				entry->mapEntries = (MapEntry *) AllocateResize(entry->mapEntries, sizeof(MapEntry) * entry->mapAllocated);
+			}
+
+			entry->mapEntries[entry->mapLength].key = context->c->stack[context->c->stackPointer - 1];
+			entry->mapEntries[entry->mapLength].value = context->c->stack[context->c->stackPointer - 3];
+			entry->mapLength++;
+			context->c->stackPointer -= 3;
+		} else if (command == T_MAP_BUILD) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+			if (!index || context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if ((entry->type != T_MAP_INT && entry->type != T_MAP_STR) || entry->storage != STORAGE_DEFAULT) return -1;
+
+			// Take the unsorted entries out of the map, and insert them all together.
+			MapEntry *entries = entry->mapEntries;
+			uintptr_t count = entry->mapLength;
+			entry->mapEntries = NULL;
+			entry->mapLength = entry->mapAllocated = 0;
+			MapInsertEntries(context, entry, entries, count);
+			AllocateResize(entries, 0);
+		} else if (command == T_OP_MERGE) {
 			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].f = context->c->stack[context->c->stackPointer - 2].f / context->c->stack[context->c->stackPointer - 1].f;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+			uint64_t otherIndex = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index || !otherIndex) {
+				PrintError4(context, instructionPointer - 1, "The map is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index || context->heapEntriesAllocated <= otherIndex) return -1;
+			HeapEntry *entry = &context->heap[index];
+			HeapEntry *other = &context->heap[otherIndex];
+			if (entry->type != T_MAP_INT && entry->type != T_MAP_STR) return -1;
+			if (other->type != entry->type || other->internalValuesAreManaged != entry->internalValuesAreManaged) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+
+			if (index != otherIndex) {
+				// Copy the other map's entries first, since they might be in a tree.
+				MapEntry *entries = (MapEntry *) AllocateResize(NULL, other->mapLength * sizeof(MapEntry));
+				uintptr_t count = 0, position = 0;
+				Value zero = { 0 };
+
+				for (MapEntry *item = MapIterate(context, other, zero, false, &position); item; 
+						item = MapIterate(context, other, item->key, true, &position)) {
+					entries[count++] = *item;
+				}
+
+				Assert(count == other->mapLength);
+				MapInsertEntries(context, entry, entries, count);
+				AllocateResize(entries, 0);
+			}
+
+			context->c->stackPointer -= 2;
+		} else if (command == T_OP_KEYS || command == T_OP_VALUES) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The map is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			if (context->heap[index].type != T_MAP_INT && context->heap[index].type != T_MAP_STR) return -1;
+
+			// The map is still on the stack, so it cannot be freed if HeapAllocate starts a garbage collection.
+			uintptr_t listIndex = HeapAllocate(context);
+			HeapEntry *entry = &context->heap[index];
+			HeapEntry *list = &context->heap[listIndex];
+			list->type = T_LIST;
+			list->internalValuesAreManaged = command == T_OP_KEYS ? entry->type == T_MAP_STR : entry->internalValuesAreManaged;
+			list->length = list->allocated = entry->mapLength;
+			list->list = (Value *) AllocateResize(NULL, entry->mapLength * sizeof(Value));
+			uintptr_t count = 0, position = 0;
+			Value zero = { 0 };
+
+			for (MapEntry *item = MapIterate(context, entry, zero, false, &position); item; 
+					item = MapIterate(context, entry, item->key, true, &position)) {
+				list->list[count++] = command == T_OP_KEYS ? item->key : item->value;
+			}
+
+			Assert(count == entry->mapLength);
+			context->c->stack[context->c->stackPointer - 1].i = listIndex;
+		} else if (command == T_OP_SORT_INT || command == T_OP_SORT_FLOAT || command == T_OP_SORT_STR) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST || entry->internalValuesAreManaged != (command == T_OP_SORT_STR)) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = ListUnpack(entry);
+			Value *items = entry->list;
+			uintptr_t count = entry->length;
+
+			if (command == T_OP_SORT_STR) {
+				// Sort by the string prefixes, only comparing the full strings when they are equal.
+				// Nothing is allocated on the heap here, so the text pointers stay valid.
+				ListSortString *strings = (ListSortString *) AllocateResize(NULL, count * sizeof(ListSortString));
+				ListSort sort = { .context = context, .result = 1 };
+
+				for (uintptr_t i = 0; i < count; i++) {
+					HeapEntry *item = context->heapEntriesAllocated > (uint64_t) items[i].i ? &context->heap[items[i].i] : NULL;
+
+					if (!item || (item->type != T_STR && item->type != T_EOF && item->type != T_CONCAT && item->type != T_OP_SLICE)) {
+						AllocateResize(strings, 0);
+						return -1;
+					}
+
+					ScriptHeapEntryToString(context, item, &strings[i].text, &strings[i].bytes);
+					strings[i].prefix = StringKeyPrefix(strings[i].text, strings[i].bytes);
+					strings[i].value = items[i];
+				}
+
+				ListSortStrings(&sort, strings, count);
+				for (uintptr_t i = 0; i < count; i++) items[i] = strings[i].value;
+				AllocateResize(strings, 0);
+			} else {
+				// Map the items to unsigned keys in the same order, and radix sort them.
+				// For floats, negative numbers have their bits inverted, so that more negative numbers come first.
+				const uint64_t sign = (uint64_t) 1 << 63;
+
+				for (uintptr_t i = 0; i < count; i++) {
+					uint64_t bits = items[i].i;
+					items[i].i = command == T_OP_SORT_INT ? bits ^ sign : (bits & sign) ? ~bits : bits | sign;
+				}
+
+				Value *scratch = count >= 64 ? (Value *) AllocateResize(NULL, count * sizeof(Value)) : NULL;
+				ListSortRadix(items, scratch, count);
+				AllocateResize(scratch, 0);
+
+				for (uintptr_t i = 0; i < count; i++) {
+					uint64_t bits = items[i].i;
+					items[i].i = command == T_OP_SORT_INT ? bits ^ sign : (bits & sign) ? bits & ~sign : ~bits;
+				}
+			}
+
+			ListPack(entry, storage);
+			context->c->stackPointer--;
+		} else if (command == T_OP_SORT_CALLBACK || command == T_OP_SORT_UNSTABLE_CALLBACK) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			if (context->heap[index].type != T_LIST) return -1;
+
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			// The items are sorted in a copy of the list, which the comparison function cannot modify.
+			// The copy is kept on the stack, so that its items stay alive if the comparison function starts a garbage collection.
+			// Its second third is the scratch space for the stable sort, and the last third keeps the original items,
+			// so that any modification to the list by the comparison function can be detected.
+			uintptr_t copyIndex = HeapAllocate(context);
+			HeapEntry *entry = &context->heap[index];
+			HeapEntry *copy = &context->heap[copyIndex];
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = ListUnpack(entry);
+			uintptr_t count = entry->length;
+			copy->type = T_LIST;
+			copy->internalValuesAreManaged = entry->internalValuesAreManaged;
+			copy->length = copy->allocated = count * 3;
+			copy->list = (Value *) AllocateResize(NULL, count * 3 * sizeof(Value));
+			MemoryCopy(copy->list, entry->list, count * sizeof(Value));
+			MemoryCopy(copy->list + count, entry->list, count * sizeof(Value));
+			MemoryCopy(copy->list + count * 2, entry->list, count * sizeof(Value));
+			context->c->stack[context->c->stackPointer].i = copyIndex;
+			context->c->stackIsManaged[context->c->stackPointer] = true;
+			context->c->stackPointer++;
+
+			ListSort sort = { 
+				.context = context, 
+				.instructionPointer = instructionPointer - 1, 
+				.comparator = context->c->stack[context->c->stackPointer - 2].i,
+				.itemsAreManaged = entry->internalValuesAreManaged,
+				.result = 1,
+			};
+
+			Value *items = copy->list; // The copy is never resized, so this stays valid.
+			if (command == T_OP_SORT_CALLBACK) ListSortValuesStable(&sort, items, items + count, count);
+			else ListSortValues(&sort, items, count);
+			if (sort.result <= 0) return sort.result;
+
+			entry = &context->heap[index];
+
+			if (entry->length != count || entry->storage != STORAGE_DEFAULT 
+					|| (count && MemoryCompare(entry->list, items + count * 2, count * sizeof(Value)))) {
+				PrintError4(context, instructionPointer - 1, "The list was modified while it was being sorted.\n");
+				return 0;
+			}
+
+			if (entry->shared) HeapEntryUnshare(context, entry); // The comparator might have cloned the list.
+			MemoryCopy(entry->list, items, count * sizeof(Value));
+			ListPack(entry, storage);
+			context->c->stackPointer -= 3;
+		} else if (command == T_OP_CLONE || command == T_OP_LIST_SLICE) {
+			uintptr_t stackIndexList = command == T_OP_CLONE ? 1 : 3;
+			if (context->c->stackPointer < stackIndexList) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - stackIndexList]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - stackIndexList].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, command == T_OP_CLONE ? "The object is null.\n" : "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			uint8_t type = context->heap[index].type;
+
+			if (command == T_OP_CLONE) {
+				if (type != T_LIST && type != T_MAP_INT && type != T_MAP_STR) return -1;
+				// The object is still on the stack, so it cannot be freed if HeapAllocate starts a garbage collection.
+				context->c->stack[context->c->stackPointer - 1].i = HeapCloneEntry(context, index);
+				continue;
+			}
+
+			if (type != T_LIST) return -1;
+			uint64_t start = 0, end = context->heap[index].length;
+
+			if (command == T_OP_LIST_SLICE) {
+				if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+				start = context->c->stack[context->c->stackPointer - 1].i;
+				end = context->c->stack[context->c->stackPointer - 2].i;
+
+				if (start > context->heap[index].length || end > context->heap[index].length || end < start) {
+					PrintError4(context, instructionPointer - 1, "The slice range (%ld..%ld) is invalid for the list of length %ld.\n",
+							start, end, (int64_t) context->heap[index].length);
+					return 0;
+				}
+			}
+
+			// The list is still on the stack, so it cannot be freed if HeapAllocate starts a garbage collection.
+			uintptr_t copyIndex = HeapAllocate(context);
+			ListCopyItems(&context->heap[copyIndex], &context->heap[index], start, end - start);
+			context->c->stackPointer -= stackIndexList - 1;
+			context->c->stack[context->c->stackPointer - 1].i = copyIndex;
+		} else if (command == T_OP_CLONE_ALL) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The object is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			uint8_t type = context->heap[index].type;
+			if (type != T_LIST && type != T_MAP_INT && type != T_MAP_STR) return -1;
+
+			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
+				return 0;
+			}
+
+			// The clones are kept alive by a list on the stack, until they have all been linked together.
+			uintptr_t clonesIndex = HeapAllocate(context);
+			HeapEntry *clones = &context->heap[clonesIndex];
+			clones->type = T_LIST;
+			clones->internalValuesAreManaged = true;
+			clones->length = clones->allocated = 0;
+			clones->list = NULL;
+			context->c->stack[context->c->stackPointer].i = clonesIndex;
+			context->c->stackIsManaged[context->c->stackPointer] = true;
+			context->c->stackPointer++;
+
+			uintptr_t result = HeapCloneAll(context, index, clonesIndex);
+			context->c->stackPointer--;
+			context->c->stack[context->c->stackPointer - 1].i = result;
+		} else if (command == T_OP_INSERT_FROM) {
+			if (context->c->stackPointer < 3) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 3].i;
+			uint64_t otherIndex = context->c->stack[context->c->stackPointer - 1].i;
+			int64_t insertIndex = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			} else if (!otherIndex) {
+				PrintError4(context, instructionPointer - 1, "The list to insert from is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index || context->heapEntriesAllocated <= otherIndex) return -1;
+			HeapEntry *entry = &context->heap[index];
+			HeapEntry *other = &context->heap[otherIndex];
+			if (entry->type != T_LIST || other->type != T_LIST) return -1;
+			if (entry->internalValuesAreManaged != other->internalValuesAreManaged) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			if (other->shared && other->storage != STORAGE_DEFAULT) HeapEntryUnshare(context, other); // It is unpacked.
+			uint8_t storage = ListUnpack(entry);
+			uint8_t otherStorage = ListUnpack(other);
+
+			uint32_t oldLength = entry->length;
+			uint32_t insertCount = other->length;
+			int64_t newLength = (int64_t) oldLength + insertCount;
+
+			if (newLength >= 1000000000) {
+				PrintError4(context, instructionPointer - 1, "The new length of the list (%ld + %ld = %ld) "
+						"is out of the supported range (0..1000000000).\n", (int64_t) oldLength, (int64_t) insertCount, newLength);
+				return 0;
+			} else if (insertIndex < 0 || insertIndex > oldLength) {
+				PrintError4(context, instructionPointer - 1, "Cannot insert at index %ld. The list has length %ld.\n",
+						insertIndex, (int64_t) oldLength);
+				return 0;
+			}
+
+			if (newLength > entry->allocated) {
+				// TODO Handling out of memory errors.
+				entry->allocated = entry->allocated * 2 > newLength ? entry->allocated * 2 : newLength;
+				entry->list = (Value *) AllocateResize(entry->list, entry->allocated * sizeof(Value));
+			}
+
+			Value *list = entry->list;
+			MemoryMove(list + insertIndex + insertCount, list + insertIndex, (oldLength - insertIndex) * sizeof(Value));
+
+			if (index == otherIndex) {
+				// The list is being inserted into itself; the items after the insertion point have just moved.
+				MemoryCopy(list + insertIndex, list, insertIndex * sizeof(Value));
+				MemoryCopy(list + insertIndex * 2, list + insertIndex + insertCount, (oldLength - insertIndex) * sizeof(Value));
+			} else {
+				MemoryCopy(list + insertIndex, other->list, insertCount * sizeof(Value));
+			}
+
+			entry->length = newLength;
+			ListPack(entry, storage);
+			if (other != entry) ListPack(other, otherStorage);
+			context->c->stackPointer -= 3;
+		} else if (command == T_OP_REVERSE) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			uint8_t storage = ListUnpack(entry);
+
+			for (uintptr_t i = 0, j = entry->length; i + 1 < j; i++, j--) {
+				Value swap = entry->list[i];
+				entry->list[i] = entry->list[j - 1];
+				entry->list[j - 1] = swap;
+			}
+
+			ListPack(entry, storage);
 			context->c->stackPointer--;
-		} else if (command == T_FLOAT_NEGATE) {
+		} else if (command == T_OP_HINT_PACKED_BITS || command == T_OP_HINT_PACKED_INTS) {
 			if (context->c->stackPointer < 1) return -1;
-			context->c->stack[context->c->stackPointer - 1].f = -context->c->stack[context->c->stackPointer - 1].f;
-		} else if (command == T_LESS_THAN) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i < context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_GREATER_THAN) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i > context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_LT_OR_EQUAL) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i <= context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_GT_OR_EQUAL) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i >= context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackPointer--;
-		} else if (command == T_DOUBLE_EQUALS) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i == context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = false; // Necessary since pointers can be compared.
-			context->c->stackPointer--;
-		} else if (command == T_NOT_EQUALS) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].i != context->c->stack[context->c->stackPointer - 1].i;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = false; // Necessary since pointers can be compared.
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST || entry->internalValuesAreManaged) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+
+			if (command == T_OP_HINT_PACKED_BITS) {
+				if (entry->storage != STORAGE_LIST_BITS) ListConvert(entry, STORAGE_LIST_BITS);
+			} else {
+				// Repack the ints, in case they now fit in a narrower storage.
+				ListUnpack(entry);
+				ListPack(entry, STORAGE_LIST_INT8);
+			}
+
 			context->c->stackPointer--;
-		} else if (command == T_LOGICAL_NOT) {
+		} else if (command == T_OP_HINT_DEQUE) {
 			if (context->c->stackPointer < 1) return -1;
-			context->c->stack[context->c->stackPointer - 1].i = !context->c->stack[context->c->stackPointer - 1].i;
-		} else if (command == T_FLOAT_LESS_THAN) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f < context->c->stack[context->c->stackPointer - 1].f;
-			context->c->stackPointer--;
-		} else if (command == T_FLOAT_GREATER_THAN) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f > context->c->stack[context->c->stackPointer - 1].f;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->shared) HeapEntryUnshare(context, entry);
+			if (entry->storage != STORAGE_LIST_RING) ListConvert(entry, STORAGE_LIST_RING);
 			context->c->stackPointer--;
-		} else if (command == T_FLOAT_LT_OR_EQUAL) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f <= context->c->stack[context->c->stackPointer - 1].f;
+		} else if (command == T_OP_DELETE_LAST) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+
+			context->heap[index].length--;
 			context->c->stackPointer--;
-		} else if (command == T_FLOAT_GT_OR_EQUAL) {
+		} else if (command == T_OP_FIND_AND_DELETE || command == T_OP_FIND || command == T_OP_FIND_LAST 
+				|| command == T_OP_CONTAINS || command == T_OP_COUNT
+				|| command == T_OP_FIND_AND_DEL_STR || command == T_OP_FIND_STR || command == T_OP_FIND_LAST_STR 
+				|| command == T_OP_CONTAINS_STR || command == T_OP_COUNT_STR) {
 			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f >= context->c->stack[context->c->stackPointer - 1].f;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST) return -1;
+			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			bool strings = command == T_OP_FIND_AND_DEL_STR || command == T_OP_FIND_STR || command == T_OP_FIND_LAST_STR 
+				|| command == T_OP_CONTAINS_STR || command == T_OP_COUNT_STR;
+			if (strings && !entry->internalValuesAreManaged) return -1;
+			Value x = context->c->stack[context->c->stackPointer - 1];
+			int64_t result;
+
+			if (command == T_OP_COUNT || command == T_OP_COUNT_STR) {
+				result = ListCount(context, entry, x, strings);
+			} else {
+				intptr_t found = ListFind(context, entry, x, strings, command == T_OP_FIND_LAST || command == T_OP_FIND_LAST_STR);
+				bool returnsIndex = command == T_OP_FIND || command == T_OP_FIND_STR || command == T_OP_FIND_LAST || command == T_OP_FIND_LAST_STR;
+				result = returnsIndex ? found : found != -1;
+
+				if ((command == T_OP_FIND_AND_DELETE || command == T_OP_FIND_AND_DEL_STR) && found != -1) {
+					if (entry->shared) HeapEntryUnshare(context, entry);
+					uint8_t storage = entry->storage == STORAGE_LIST_RING ? STORAGE_DEFAULT : ListUnpack(entry);
+
+					if (entry->storage == STORAGE_LIST_RING) {
+						ListRingClose(entry, found, 1, entry->length);
+					} else {
+						MemoryMove(entry->list + found, entry->list + found + 1, (entry->length - found - 1) * sizeof(Value));
+					}
+
+					entry->length--;
+					ListPack(entry, storage);
+				}
+			}
+
+			context->c->stack[context->c->stackPointer - 2].i = result;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = false;
 			context->c->stackPointer--;
-		} else if (command == T_FLOAT_DOUBLE_EQUALS) {
-			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f == context->c->stack[context->c->stackPointer - 1].f;
+		} else if (command == T_OP_SUM_INT || command == T_OP_SUM_FLOAT || command == T_OP_MIN_INT 
+				|| command == T_OP_MIN_FLOAT || command == T_OP_MAX_INT || command == T_OP_MAX_FLOAT) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The list is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_LIST || entry->internalValuesAreManaged) return -1;
+
+			if (!entry->length && command != T_OP_SUM_INT && command != T_OP_SUM_FLOAT) {
+				PrintError4(context, instructionPointer - 1, "The list is empty.\n");
+				return 0;
+			}
+
+			context->c->stack[context->c->stackPointer - 1] = ListReduce(entry, command);
+			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
+#define HANDLE_MAP_BYTECODES(keyType, keyPrep, keyCompare) \
+		} else if (command == T_OP_DELETE_MAP_##keyType || command == T_OP_HAS_##keyType || command == T_EQUALS_MAP_##keyType \
+				|| command == T_INDEX_MAP_##keyType || command == T_OP_GET_##keyType) { \
+			if (context->c->stackPointer < (command == T_EQUALS_MAP_##keyType ? 3 : 2)) return -1; \
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1; \
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i; \
+			\
+			if (!index) { \
+				PrintError4(context, instructionPointer - 1, "The map is null.\n"); \
+				return 0; \
+			} \
+			\
+			if (context->heapEntriesAllocated <= index) return -1; \
+			HeapEntry *entry = &context->heap[index]; \
+			if (entry->type != T_MAP_##keyType) return -1; \
+			\
+			if ((command == T_EQUALS_MAP_##keyType || command == T_OP_DELETE_MAP_##keyType) && entry->shared) { \
+				HeapEntryUnshare(context, entry); \
+			} \
+			\
+			Value key = context->c->stack[context->c->stackPointer - 1]; \
+			Value value = { 0 }; \
+			uintptr_t resultIndex = 0; \
+			MapEntry *target = NULL; /* The entry to set, if it exists. */ \
+			bool found = false; \
+			keyPrep; \
+			\
+			if (command == T_EQUALS_MAP_##keyType && entry->storage == STORAGE_DEFAULT && entry->mapLength >= MAP_TREE_THRESHOLD) { \
+				MapConvertToOrdered(context, entry); /* The keys stay sorted, so iteration order does not depend on the size. */ \
+			} else if (command == T_EQUALS_MAP_##keyType && entry->storage == STORAGE_MAP_ORDERED \
+					&& !entry->mapTree && entry->mapLength >= MAP_NODE_CAPACITY) { \
+				MapTreeBuild(entry); \
+			} \
+			\
+			if (entry->storage == STORAGE_MAP_HASH) { \
+				uint64_t keyHash = MapKeyHash(context, entry, key); \
+				uintptr_t slot; \
+				intptr_t position = MapHashFind(context, entry, key, keyHash, keyText, keyBytes, &slot); \
+				found = position != -1; \
+				\
+				if (found) { \
+					target = &entry->mapEntries[position]; \
+					value = target->value; \
+					if (command == T_OP_DELETE_MAP_##keyType) MapHashDelete(entry, slot); \
+				} else if (command == T_EQUALS_MAP_##keyType) { \
+					resultIndex = MapHashInsert(entry, slot, keyHash); \
+					target = &entry->mapEntries[resultIndex]; \
+				} \
+			} else if (entry->mapTree) { \
+				MapTreePath path; \
+				found = MapTreeFind(context, entry, key, keyPrefix, keyText, keyBytes, &path, command != T_OP_DELETE_MAP_##keyType); \
+				\
+				if (!found && command == T_EQUALS_MAP_##keyType && path.fromCache && path.leaf->count == MAP_NODE_CAPACITY) { \
+					/* The leaf must be split, which needs the full path. */ \
+					MapTreeFind(context, entry, key, keyPrefix, keyText, keyBytes, &path, false); \
+				} \
+				\
+				if (found) { \
+					target = &path.leaf->entries[path.index]; \
+					value = target->value; \
+					if (command == T_OP_DELETE_MAP_##keyType) MapTreeDelete(entry, &path); \
+				} else if (command == T_EQUALS_MAP_##keyType) { \
+					target = MapTreeInsert(entry, &path); \
+				} \
+			} else if (entry->mapLength) { \
+				intptr_t low = 0; \
+				intptr_t high = entry->mapLength - 1; \
+				\
+				while (low <= high) { \
+					uintptr_t average = ((high - low) >> 1) + low; \
+					keyCompare; \
+					\
+					if (lt) { \
+						high = average - 1; \
+					} else if (gt) { \
+						low = average + 1; \
+					} else { \
+						if (command == T_OP_DELETE_MAP_##keyType) { \
+							entry->mapLength--; \
+							MemoryMove(&entry->mapEntries[average], &entry->mapEntries[average + 1], \
+									(entry->mapLength - average) * sizeof(MapEntry)); \
+						} else { \
+							target = &entry->mapEntries[average]; \
+							value = target->value; \
+						} \
+						\
+						found = true; \
+						break; \
+					} \
+				} \
+				\
+				if (high < low) { \
+					Assert(!found); \
+					resultIndex = low; \
+				} \
+			} \
+			\
+			if (command == T_INDEX_MAP_##keyType) { \
+				context->c->stackIsManaged[context->c->stackPointer - 2] = entry->internalValuesAreManaged; \
+				context->c->stack[context->c->stackPointer - 2] = value; \
+			} else if (command == T_OP_GET_##keyType) { \
+				/* TODO handle memory allocation failures here */ \
+				/* TODO allocate a message string; be careful with GC */ \
+				bool internalValuesAreManaged = entry->internalValuesAreManaged; \
+				uintptr_t index = HeapAllocate(context); \
+				context->heap[index].type = T_ERR; \
+				context->heap[index].success = found; \
+				context->heap[index].internalValuesAreManaged = internalValuesAreManaged || !found; \
+				if (found) context->heap[index].errorValue = value; \
+				else context->heap[index].errorValue.i = 0; \
+				context->c->stackIsManaged[context->c->stackPointer - 2] = true; \
+				context->c->stack[context->c->stackPointer - 2].i = index; \
+			} else if (command == T_EQUALS_MAP_##keyType) { \
+				if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 3]) return -1; \
+				\
+				if (!target) { \
+					if (entry->mapLength == entry->mapAllocated) { \
+						entry->mapAllocated = entry->mapAllocated ? entry->mapAllocated * 2 : 4; \
+						entry->mapEntries = (MapEntry *) AllocateResize(entry->mapEntries, sizeof(MapEntry) * entry->mapAllocated); \
+					} \
+					\
+					MemoryMove(&entry->mapEntries[resultIndex + 1], &entry->mapEntries[resultIndex], \
+							(entry->mapLength - resultIndex) * sizeof(MapEntry)); \
+					entry->mapLength++; \
+					target = &entry->mapEntries[resultIndex]; \
+				} \
+				\
+				if (entry->storage != STORAGE_MAP_HASH) target->keyPrefix = keyPrefix; \
+				target->key = key; \
+				target->value = context->c->stack[context->c->stackPointer - 3]; \
+				context->c->stackPointer -= 2; \
+			} else { \
+				context->c->stackIsManaged[context->c->stackPointer - 2] = false; \
+				context->c->stack[context->c->stackPointer - 2].i = found ? 1 : 0; \
+			} \
+			\
+			context->c->stackPointer -= 1
+			HANDLE_MAP_BYTECODES(INT, 
+				if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1; 
+				const char *keyText = NULL; 
+				size_t keyBytes = 0; 
+				uint64_t keyPrefix = 0, 
+				
+				bool lt = key.i < entry->mapEntries[average].key.i; 
+				bool gt = key.i > entry->mapEntries[average].key.i);
+			HANDLE_MAP_BYTECODES(STR, 
+				STACK_READ_STRING(keyText, keyBytes, 1); 
+				uint64_t keyPrefix = StringKeyPrefix(keyText, keyBytes), 
+
+				// Most probes are decided by the prefix, without needing to look at the key's heap entry.
+				MapEntry *probe = &entry->mapEntries[average];
+				bool lt = keyPrefix < probe->keyPrefix;
+				bool gt = keyPrefix > probe->keyPrefix;
+
+				if (!lt && !gt && probe->key.i != key.i) {
+					const char *entryKeyText; 
+					size_t entryKeyBytes; 
+					ScriptHeapEntryToString(context, &context->heap[probe->key.i], &entryKeyText, &entryKeyBytes); 
+					int comparisonResult = StringCompareRaw(keyText, keyBytes, entryKeyText, entryKeyBytes);
+					lt = comparisonResult < 0; 
+					gt = comparisonResult > 0;
+				});
+		} else if (command == T_OP_SLICE || command == T_OP_BYTE || command == T_OP_STR) {
+			Value returnValue;
+			int result = (command == T_OP_SLICE ? ExternalOpStringSlice 
+					: command == T_OP_BYTE ? ExternalOpCharacterToByte : ExternalOpStringFromByte)(context, &returnValue);
+			if (result <= 0) return result;
+			if (!ScriptReturnErrors(context, result, returnValue)) return -1;
+		} else if (command == T_OP_CLOSE) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+			if (context->heapEntriesAllocated <= index) return -1;
+			HeapEntry *entry = &context->heap[index];
+
+			if (entry->type == T_HANDLETYPE) {
+				// Release the resources now rather than waiting for the garbage collector.
+				// The handle remains valid, but native code will see it as null.
+				ScriptCloseHandleFunction close = entry->close;
+				void *handleData = entry->handleData;
+				entry->close = NULL;
+				entry->handleData = NULL;
+				if (close) close(context, handleData);
+			} else if (entry->type != T_EOF) {
+				return -1;
+			}
+
 			context->c->stackPointer--;
-		} else if (command == T_FLOAT_NOT_EQUALS) {
+		} else if (command == T_OP_APPEND_STR || command == T_OP_APPEND_INT 
+				|| command == T_OP_APPEND_FLOAT || command == T_OP_RESERVE) {
 			if (context->c->stackPointer < 2) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = context->c->stack[context->c->stackPointer - 2].f != context->c->stack[context->c->stackPointer - 1].f;
-			context->c->stackPointer--;
-		} else if (command == T_STR_DOUBLE_EQUALS || command == T_STR_NOT_EQUALS) {
-			STACK_READ_STRING(text1, bytes1, 2);
-			STACK_READ_STRING(text2, bytes2, 1);
-			bool equal = bytes1 == bytes2 && 0 == MemoryCompare(text1, text2, bytes1);
-			context->c->stack[context->c->stackPointer - 2].i = command == T_STR_NOT_EQUALS ? !equal : equal;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = false;
-			context->c->stackPointer--;
-		} else if (command == T_OP_LEN) {
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+
+			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The string builder is null.\n");
+				return 0;
+			}
+
+			if (context->heapEntriesAllocated <= index) return -1;
+			if (context->heap[index].type != T_STRBUILDER) return -1;
+
+			const char *text = NULL;
+			size_t bytes = 0;
+			char temp[30];
+
+			if (command == T_OP_APPEND_STR) {
+				STACK_READ_STRING(appendText, appendBytes, 1);
+				text = appendText, bytes = appendBytes;
+			} else {
+				if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				Value value = context->c->stack[context->c->stackPointer - 1];
+
+				if (command == T_OP_APPEND_INT) {
+					text = temp, bytes = PrintIntegerToBuffer(temp, sizeof(temp), value.i);
+				} else if (command == T_OP_APPEND_FLOAT) {
+					text = temp, bytes = PrintFloatToBuffer(temp, sizeof(temp), value.f);
+				} else if (value.i < 0 || value.i > UINT32_MAX) {
+					PrintError4(context, instructionPointer - 1, "The number of bytes to reserve is out of the supported range (0..%ld).\n", (int64_t) UINT32_MAX);
+					return 0;
+				} else {
+					bytes = value.i;
+				}
+			}
+
+			HeapEntry *entry = &context->heap[index];
+			uint64_t needed = (uint64_t) entry->builderBytes + bytes;
+
+			if (needed > UINT32_MAX) {
+				PrintError4(context, instructionPointer - 1, "The string builder is too large; strings are limited to %ld bytes.\n", (int64_t) UINT32_MAX);
+				return 0;
+			}
+
+			if (needed > entry->builderAllocated) {
+				// Appends grow the buffer geometrically so that they are amortized O(1);
+				// reserve allocates exactly what was asked for.
+				uint64_t allocated = (uint64_t) entry->builderAllocated * 2;
+				if (allocated < 16) allocated = 16;
+				if (allocated > UINT32_MAX) allocated = UINT32_MAX;
+				if (command == T_OP_RESERVE || allocated < needed) allocated = needed;
+				// TODO Handling out of memory errors.
+				entry->builderText = (char *) AllocateResize(entry->builderText, allocated);
+				entry->builderAllocated = allocated;
+			}
+
+			if (command != T_OP_RESERVE && bytes) {
+				MemoryCopy(entry->builderText + entry->builderBytes, text, bytes);
+				entry->builderBytes += bytes;
+			}
+
+			context->c->stackPointer -= 2;
+		} else if (command == T_OP_BUILDER_STR) {
+			uintptr_t stringIndex = HeapAllocate(context);
+			// NOTE Call HeapAllocate before taking a pointer to the builder's heap entry!!
+
 			if (context->c->stackPointer < 1) return -1;
 			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+
 			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+
+			if (!index) {
+				PrintError4(context, instructionPointer - 1, "The string builder is null.\n");
+				return 0;
+			}
+
 			if (context->heapEntriesAllocated <= index) return -1;
 			HeapEntry *entry = &context->heap[index];
+			if (entry->type != T_STRBUILDER) return -1;
+
+			// The string takes ownership of the buffer, and the builder is left empty.
+			context->heap[stringIndex].type = T_STR;
+			context->heap[stringIndex].bytes = entry->builderBytes;
+			context->heap[stringIndex].text = entry->builderText;
+			entry->builderBytes = entry->builderAllocated = 0;
+			entry->builderText = NULL;
+			context->c->stack[context->c->stackPointer - 1].i = stringIndex;
+		} else if (command == T_OP_DISCARD || command == T_OP_ASSERT) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			int64_t id = context->c->stack[context->c->stackPointer - 1].i;
+			uintptr_t index = HeapAllocate(context);
+			context->heap[index].type = command;
+			context->heap[index].lambdaID = id;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
+			context->c->stack[context->c->stackPointer - 1].i = index;
+		} else if (command == T_OP_CURRY) {
+			if (context->c->stackPointer < 2) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			bool valueIsManaged = context->c->stackIsManaged[context->c->stackPointer - 1];
+			Value value = context->c->stack[context->c->stackPointer - 1];
+			int64_t id = context->c->stack[context->c->stackPointer - 2].i;
+			uintptr_t index = HeapAllocate(context);
+			context->heap[index].type = command;
+			context->heap[index].lambdaID = id;
+			context->heap[index].curryValue = value;
+			context->heap[index].internalValuesAreManaged = valueIsManaged;
+			context->c->stackIsManaged[context->c->stackPointer - 2] = true;
+			context->c->stack[context->c->stackPointer - 2].i = index;
+			context->c->stackPointer--;
+		} else if (command == T_OP_ASYNC) {
+			if (context->c->stackPointer < 1) return -1;
+			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			CoroutineState *c = (CoroutineState *) AllocateResize(NULL, sizeof(CoroutineState)); // TODO Handle allocation failure.
+			CoroutineState empty = { 0 };
+			*c = empty;
+			c->id = ++context->lastCoroutineID;
+			c->startedByAsync = true;
+			c->stackEntriesAllocated = sizeof(context->c->stack) / sizeof(context->c->stack[0]);
+			c->stackPointer = 2;
+			c->stack[0].i = -1; // Indicates to T_AWAIT to remove the coroutine.
+			c->stackIsManaged[0] = false;
+			c->stack[1] = context->c->stack[context->c->stackPointer - 1];
+			c->stackIsManaged[1] = true;
+			c->nextCoroutine = context->allCoroutines;
+			if (c->nextCoroutine) c->nextCoroutine->previousCoroutineLink = &c->nextCoroutine;
+			c->previousCoroutineLink = &context->allCoroutines;
+			context->allCoroutines = c;
+			c->nextUnblockedCoroutine = context->unblockedCoroutines;
+			if (c->nextUnblockedCoroutine) c->nextUnblockedCoroutine->previousUnblockedCoroutineLink = &c->nextUnblockedCoroutine;
+			c->previousUnblockedCoroutineLink = &context->unblockedCoroutines;
+			context->unblockedCoroutines = c;
+			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
+			context->c->stack[context->c->stackPointer - 1].i = c->id;
+		} else if (command == T_AWAIT) {
+			awaitCommand:;
+			if (context->c->stackPointer < 1 && !context->c->externalCoroutine) return -1;
+
+			// PrintDebug("== AWAIT from %ld\n", context->c->id);
+			Assert(!context->c->nextUnblockedCoroutine && !context->c->previousUnblockedCoroutineLink);
+			bool unblockImmediately = false;
+
+			if (context->c->externalCoroutine) {
+				// PrintDebug("== external coroutine\n");
+				context->c->unblockedBy = -1;
+				context->c->awaiting = true;
+				context->c->instructionPointer = instructionPointer;
+				context->c->variableBase = variableBase;
+				context->c->waitingOnCount = 0;
+			} else if (context->c->stack[context->c->stackPointer - 1].i == -1) {
+				if (context->c->stackPointer != 1) return -1;
+				// The coroutine has finished. Remove it from the list of all coroutines.
+				*context->c->previousCoroutineLink = context->c->nextCoroutine;
+				if (context->c->nextCoroutine) context->c->nextCoroutine->previousCoroutineLink = context->c->previousCoroutineLink;
+
+				// PrintDebug("== finished\n");
+
+				for (uintptr_t i = 0; i < context->c->waiterCount; i++) {
+					CoroutineState *c = context->c->waiters[i];
+					if (!c) continue;
+					Assert(!c->nextUnblockedCoroutine && !c->previousUnblockedCoroutineLink);
+					c->unblockedBy = context->c->id;
+					c->nextUnblockedCoroutine = context->unblockedCoroutines;
+					if (c->nextUnblockedCoroutine) c->nextUnblockedCoroutine->previousUnblockedCoroutineLink = &c->nextUnblockedCoroutine;
+					c->previousUnblockedCoroutineLink = &context->unblockedCoroutines;
+					context->unblockedCoroutines = c;
+
+					for (uintptr_t j = 0; j < c->waitingOnCount; j++) {
+						Assert(*(c->waitingOn[j]) == c);
+						*(c->waitingOn[j]) = NULL;
+					}
+
+					c->waitingOnCount = 0;
+					// PrintDebug("== unblocked %ld\n", c->id);
+				}
+
+				ScriptFreeCoroutine(context->c);
+			} else {
+				if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+				// The coroutine is waiting.
+				context->c->unblockedBy = -1;
+				context->c->awaiting = true;
+				context->c->instructionPointer = instructionPointer;
+				context->c->variableBase = variableBase;
+				uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+				if (context->heapEntriesAllocated <= index) return -1;
+				HeapEntry *entry = &context->heap[index];
+				if (entry->internalValuesAreManaged || entry->type != T_LIST) return -1;
+				
+				context->c->waitingOn = (CoroutineState ***) AllocateResize(context->c->waitingOn, sizeof(CoroutineState **) * entry->length);
+				Assert(context->c->waitingOnCount == 0);
+
+				intptr_t alreadyFinished = -1;
+
+				for (uintptr_t i = 0; i < entry->length; i++) {
+					CoroutineState *c = context->allCoroutines;
+					bool found = false;
+
+					while (c) {
+						if (c->id == (uint64_t) ListGet(entry, i).i) { found = true; break; }
+						c = c->nextCoroutine;
+					}
+
+					if (!found) {
+						alreadyFinished = ListGet(entry, i).i;
+						break;
+					}
+				}
+
+				if (alreadyFinished != -1 || !entry->length) {
+					// PrintDebug("== immediately unblocking\n");
+					context->c->unblockedBy = alreadyFinished;
+					unblockImmediately = true;
+				} else {
+					CoroutineState *c = context->allCoroutines;
+
+					while (c) {
+						for (uintptr_t i = 0; i < entry->length; i++) {
+							if (c->id == (uint64_t) ListGet(entry, i).i) {
+								if (c->waiterCount == c->waitersAllocated) {
+									c->waitersAllocated = c->waitersAllocated ? c->waitersAllocated * 2 : 4;
+									c->waiters = (CoroutineState **) AllocateResize(c->waiters, sizeof(CoroutineState *) * c->waitersAllocated);
+								}
+
+								c->waiters[c->waiterCount] = context->c;
+								context->c->waitingOn[context->c->waitingOnCount++] = &c->waiters[c->waiterCount];
+								c->waiterCount++;
+								break;
+							}
+						}
+
+						c = c->nextCoroutine;
+					}
+
+					// PrintDebug("== waiting on %d...\n", context->c->waitingOnCount);
+					Assert(context->c->waitingOnCount);
+				}
+			}
+
+			CoroutineState *next = unblockImmediately ? context->c : context->unblockedCoroutines;
+
+			if (!next) {
+				if (context->externalCoroutineCount) {
+					// PrintDebug("== wait for an external coroutine\n");
+					next = ExternalCoroutineWaitAny(context);
+					Assert(next->externalCoroutine);
+					unblockImmediately = true;
+				} else {
+					// TODO Earlier deadlock detection.
+					PrintError4(context, instructionPointer - 1, "No tasks can run if this task (ID %ld) starts waiting.\n", context->c->id);
+					PrintDebug("All tasks:\n");
+					CoroutineState *c = context->allCoroutines;
+
+					while (c) {
+						PrintDebug("\t%ld blocks ", c->id);
+						bool first = true;
+
+						for (uintptr_t i = 0; i < c->waiterCount; i++) {
+							if (!c->waiters[i]) continue;
+							PrintDebug("%s%ld", first ? "" : ", ", c->waiters[i]->id);
+							first = false;
+						}
+
+						PrintDebug("\n");
+						PrintBackTrace(context, c->instructionPointer - 1, c, "\t");
+						c = c->nextCoroutine;
+					}
+
+					return 0;
+				}
+			}
+
+			if (!unblockImmediately) {
+				Assert(next->previousUnblockedCoroutineLink);
+				*next->previousUnblockedCoroutineLink = next->nextUnblockedCoroutine;
+				if (next->nextUnblockedCoroutine) next->nextUnblockedCoroutine->previousUnblockedCoroutineLink = next->previousUnblockedCoroutineLink;
+			}
+
+			next->nextUnblockedCoroutine = NULL;
+			next->previousUnblockedCoroutineLink = NULL;
+			context->c = next;
+			// PrintDebug("== switch to %ld\n", next->id);
+
+			if (context->c->awaiting) {
+				if (!context->c->externalCoroutine) {
+					context->c->stackIsManaged[context->c->stackPointer - 1] = false;
+					context->c->stack[context->c->stackPointer - 1].i = context->c->unblockedBy;
+				}
+
+				instructionPointer = context->c->instructionPointer;
+				variableBase = context->c->variableBase;
+				// PrintDebug("== unblocked by %ld\n", context->c->unblockedBy);
+			} else {
+				// PrintDebug("== just started\n");
+				// There is a T_AWAIT command at address 1. It'll be executed when the coroutine finishes.
+				// The creator should have pushed a -1 at the very start of the stack, which indicates
+				// to us that the coroutine has finished.
+				instructionPointer = 1; 
+				goto callCommand;
+			}
+		} else if (command == T_REPL_RESULT) {
+			if (context->c->stackPointer < 1) return -1;
+			ExternalPassREPLResult(context, context->c->stack[--context->c->stackPointer]);
+		} else if (command == T_END_FUNCTION || command == T_EXTCALL || command == T_LIBCALL) {
+			if (command == T_EXTCALL) {
+				uint16_t index = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
+				instructionPointer += 2;
+
+				if (index < sizeof(externalFunctions) / sizeof(externalFunctions[0])) {
+					Value returnValue;
+					int result = externalFunctions[index].callback(context, &returnValue);
+					if (result <= 0) return result;
+
+					if (result == EXTCALL_START_COROUTINE) {
+						context->externalCoroutineCount++;
+						context->c->externalCoroutine = true;
+						instructionPointer -= 3;
+						// PrintDebug("start external coroutine %ld\n", context->c->id);
+						goto awaitCommand;
+					} else if (context->c->externalCoroutine) {
+						context->externalCoroutineCount--;
+						context->c->externalCoroutine = false;
+						// PrintDebug("end external coroutine %ld\n", context->c->id);
+					}
+
+					if (!ScriptReturnErrors(context, result, returnValue)) return -1;
+				} else {
+					return -1;
+				}
+			} else if (command == T_LIBCALL) {
+				context->c->parameterCount = 0;
+				context->c->returnValueType = EXTCALL_NO_RETURN;
+
+				void *address;
+				MemoryCopy(&address, &functionData[instructionPointer], sizeof(address));
+				instructionPointer += sizeof(address);
+
+				if (!((bool (*)(void *)) address)(context)) {
+					return 0;
+				}
+
+				context->c->stackPointer -= context->c->parameterCount;
+				if (!ScriptReturnErrors(context, context->c->returnValueType, context->c->returnValue)) return -1;
+			}
+
+			context->c->localVariableCount = variableBase + 1;
+
+			if (context->c->backTracePointer) {
+				BackTraceItem *item = &context->c->backTrace[context->c->backTracePointer - 1];
+
+				if (command == T_EXTCALL || command == T_LIBCALL) {
+					context->c->backTracePointer--;
+					instructionPointer = item->instructionPointer;
+					variableBase = item->variableBase;
+				}
+
+				if (item->popResult) {
+					if (context->c->stackPointer < 1) return -1;
+					context->c->stackPointer--;
+				} else if (item->assertResult) {
+					if (context->c->stackPointer < 1) return -1;
+					Value condition = context->c->stack[--context->c->stackPointer];
+
+					if (condition.i == 0) {
+						PrintError4(context, instructionPointer - 1, "Return value was false on an asserting function pointer.\n");
+						return 0;
+					}
+				}
+
+				if (command != T_EXTCALL && command != T_LIBCALL) {
+					context->c->backTracePointer--;
+					instructionPointer = item->instructionPointer;
+					variableBase = item->variableBase;
+				}
+			} else {
+				break;
+			}
+		} else if (command == T_END_CALLBACK) {
+			// Other tasks may still be running, since callbacks can be called from inside the script.
+			return 1;
+		} else {
+			PrintDebug("Unknown command %d.\n", command);
+			return -1;
+		}
+	}
+
+	if (context->allCoroutines->nextCoroutine || context->allCoroutines->startedByAsync) {
+		PrintError3("Script ended with unfinished tasks.\n");
+		return false;
+	}
+
+	return true;
+#else
+#warning "Compiling without the ability to execute scripts."
+	(void) instructionPointer;
+	(void) context;
+	return 0;
+#endif
+}
+
+bool ScriptSetOption(ExecutionContext *context, Node *node, uintptr_t index, const char *value, size_t valueBytes) {
+	if (node->expressionType->type == T_STR) {
+		uintptr_t heapIndex = HeapAllocate(context);
+		context->heap[heapIndex].type = T_STR;
+		context->heap[heapIndex].bytes = valueBytes;
+		context->heap[heapIndex].text = (char *) AllocateResize(NULL, context->heap[heapIndex].bytes);
+		context->globalVariables[index].i = heapIndex;
+		MemoryCopy(context->heap[heapIndex].text, value, context->heap[heapIndex].bytes);
+	} else if (node->expressionType->type == T_INT) {
+		// TODO Overflow checking.
+
+		Value v;
+		v.i = 0;
+
+		for (uintptr_t j = 0; j < valueBytes; j++) {
+			char c = value[j];
+
+			if (c >= '0' && c <= '9') {
+				v.i *= 10;
+				v.i += c - '0';
+			} else {
+				PrintError3("#option variable '%.*s' should be an integer.\n", node->token.textBytes, node->token.text);
+				return false;
+			}
+		}
+
+		context->globalVariables[index] = v;
+	} else if (node->expressionType->type == T_BOOL) {
+		char c = valueBytes ? value[0] : 0;
+		bool truthy = c == 't' || c == 'y' || c == '1';
+		bool falsey = c == 'f' || c == 'n' || c == '0';
+
+		if (!truthy && !falsey) {
+			PrintError3("#option variable '%.*s' should be a boolean value 'true' or 'false'.\n", node->token.textBytes, node->token.text);
+			return false;
+		}
+
+		context->globalVariables[index].i = truthy ? 1 : 0;
+	}
+
+	return true;
+}
+
+bool ScriptParseOptions(ExecutionContext *context) {
+	for (uintptr_t j = 0, index = 0; j < context->rootNode->scope->entryCount; j++) {
+		Node *node = context->rootNode->scope->entries[j];
+		if (ScopeIsVariableType(node)) index++;
+
+		if (node->type == T_DECLARE && node->isOptionVariable) {
+			if (node->expressionType->type != T_STR && node->expressionType->type != T_INT && node->expressionType->type != T_BOOL) {
+				PrintError3("#option variable '%.*s' is not of string, boolean or integer type.\n", node->token.textBytes, node->token.text);
+				return false;
+			}
+
+			Node *args = node->firstChild->sibling ? node->firstChild->sibling->firstChild->sibling->firstChild : NULL;
+			if (!args) continue;
+
+			if ((node->expressionType->type == T_INT && args->type != T_NUMERIC_LITERAL)
+					|| (node->expressionType->type == T_STR && args->type != T_STRING_LITERAL)
+					|| (node->expressionType->type == T_BOOL && args->type != T_TRUE && args->type != T_FALSE)) {
+				PrintError3("#option variable '%.*s' has an invalid default value. It must be a literal of the correct type.\n", 
+						node->token.textBytes, node->token.text);
+				return false;
+			}
+
+			if (!ScriptSetOption(context, node, index - 1 + context->functionData->globalVariableOffset, 
+						args->token.text, args->token.textBytes)) return false;
+
+			args = args->sibling;
+			if (!args) continue;
+
+			if (args->type != T_STRING_LITERAL) {
+				PrintError3("#option variable '%.*s' has an invalid description. It must be a string literal.\n", 
+						node->token.textBytes, node->token.text);
+				return false;
+			}
+
+			args = args->sibling;
+			if (!args) continue;
+
+			if (args->type != T_STRING_LITERAL) {
+				PrintError3("#option variable '%.*s' has an invalid alternate name. It must be a string literal.\n", 
+						node->token.textBytes, node->token.text);
+				return false;
+			}
+
+			args = args->sibling;
+
+			if (args) {
+				PrintError3("#option variable '%.*s' has too many arguments. Expected: #option(defaultValue, description, alternateName)\n",
+						node->token.textBytes, node->token.text);
+				return false;
+			}
+		}
+	}
+
+	for (uintptr_t i = 0; i < optionCount; i++) {
+		uintptr_t equalsPosition = 0;
+		uintptr_t optionLength = 0;
+
+		for (uintptr_t j = 0; options[i][j]; j++) {
+			if (options[i][j] == '=') {
+				equalsPosition = j;
+				break;
+			}
+		}
+
+		for (uintptr_t j = 0; options[i][j]; j++) {
+			optionLength++;
+		}
+
+		if (!equalsPosition) {
+			PrintError3("Invalid script option passed on command line '%s'.\n", options[i]);
+			return false;
+		}
+
+		uintptr_t index = 0;
+		Node *node = NULL;
+
+		for (uintptr_t j = 0; j < context->rootNode->scope->entryCount; j++) {
+			Node *n = context->rootNode->scope->entries[j];
+
+			if (n->type == T_DECLARE && n->isOptionVariable) {
+				Token token = n->token;
+
+				if (n->firstChild->sibling && n->firstChild->sibling->firstChild->sibling->firstChild->sibling
+						&& n->firstChild->sibling->firstChild->sibling->firstChild->sibling->sibling) {
+					token = n->firstChild->sibling->firstChild->sibling->firstChild->sibling->sibling->token;
+				}
+
+				if (token.textBytes == equalsPosition && 0 == MemoryCompare(token.text, options[i], equalsPosition)) {
+					node = n;
+					break;
+				}
+			}
+
+			if (ScopeIsVariableType(context->rootNode->scope->entries[j])) {
+				index++;
+			}
+		}
+
+		if (!node) {
+			continue;
+		}
+
+		if (!ScriptSetOption(context, node, index + context->functionData->globalVariableOffset, 
+					options[i] + equalsPosition + 1, optionLength - equalsPosition - 1)) return false;
+
+		if (optionsMatched[i]) {
+			PrintError3("Script option passed on command line '%s' matches multiple #option variables in different modules.\n", options[i]);
+			return false;
+		}
+
+		optionsMatched[i] = true;
+	}
+
+	return true;
+}
+
+bool ScriptParameterCString(ExecutionContext *context, char **output) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
+	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
+	if (context->heapEntriesAllocated <= index) return false;
+	const char *text;
+	size_t bytes;
+	HeapEntry *entry = &context->heap[index];
+	ScriptHeapEntryToString(context, entry, &text, &bytes);
+	*output = (char *) AllocateResize(NULL, bytes + 1);
+	MemoryCopy(*output, text, bytes);
+	(*output)[bytes] = 0;
+	return true;
+}
+
+bool ScriptParameterString(ExecutionContext *context, const void **output, size_t *outputBytes) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
+	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
+	if (context->heapEntriesAllocated <= index) return false;
+	HeapEntry *entry = &context->heap[index];
+	ScriptHeapEntryToString(context, entry, (const char **) output, outputBytes);
+	return true;
+}
+
+bool ScriptParameterHandle(ExecutionContext *context, void **output) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
+	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
+	if (context->heapEntriesAllocated <= index) return false;
+	HeapEntry *entry = &context->heap[index];
+	if (entry->type == T_HANDLETYPE) *output = entry->handleData;
+	else if (entry->type == T_EOF) *output = NULL;
+	else return false;
+	return true;
+}
+
+bool ScriptListCount(ExecutionContext *context, intptr_t index, size_t *output) {
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+
+	if (context->heap[index].type == T_LIST) {
+		*output = context->heap[index].length;
+		return true;
+	} else if (context->heap[index].type == T_EOF) {
+		PrintError4(context, 0, "List is null.");
+		return false;
+	} else {
+		PrintError4(context, 0, "The script was malformed.\n");
+		return false;
+	}
+}
+
+#define _ScriptStructAccess(managed) \
+	Value *v; \
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated); \
+	if (context->heap[index].type == T_STRUCT) { \
+		Assert(fieldIndex < context->heap[index].fieldCount); \
+		v = &context->heap[index].fields[fieldIndex]; \
+		if (v->i || !managed /* NULL may not be marked as managed */) Assert(managed == ((uint8_t *) context->heap[index].fields)[-1 - fieldIndex]); \
+		else ((uint8_t *) context->heap[index].fields)[-1 - fieldIndex] = managed; \
+	} else if (context->heap[index].type == T_LIST) { \
+		Assert(fieldIndex < context->heap[index].length); \
+		HeapEntryUnshare(context, &context->heap[index]); /* Native code might modify the items. */ \
+		ListUnpack(&context->heap[index]); /* Native code accesses the items directly, so the list stays unpacked. */ \
+		v = &context->heap[index].list[fieldIndex]; \
+		Assert(managed == context->heap[index].internalValuesAreManaged); \
+	} else if (context->heap[index].type == T_EOF) { \
+		PrintError4(context, 0, "Structure or list is null."); \
+		return false; \
+	} else { \
+		PrintError4(context, 0, "The script was malformed.\n"); \
+		return false; \
+	}
+#define _ScriptStructReadInteger(which, name) \
+bool name(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, which *output) { \
+	int64_t x; \
+	if (!ScriptStructReadInt64(context, index, fieldIndex, &x)) return false; \
+	*output = (which) x; \
+	return true; \
+}
+
+bool ScriptStructReadString(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, const void **output, size_t *outputBytes) {
+	_ScriptStructAccess(true);
+	index = v->i;
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+	HeapEntry *entry = &context->heap[index];
+	ScriptHeapEntryToString(context, entry, (const char **) output, outputBytes);
+	return true;
+}
+
+bool ScriptStructReadInt64(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, int64_t *output) {
+	_ScriptStructAccess(false);
+	*output = v->i;
+	return true;
+}
+
+bool ScriptStructReadDouble(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, double *output) {
+	_ScriptStructAccess(false);
+	*output = v->f;
+	return true;
+}
+
+bool ScriptStructReadHandle(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, void **output) {
+	_ScriptStructAccess(true);
+	index = v->i;
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+	HeapEntry *entry = &context->heap[index];
+	if (entry->type == T_HANDLETYPE) *output = entry->handleData;
+	else if (entry->type == T_EOF) *output = NULL;
+	else return false;
+	return true;
+}
+
+bool ScriptStructReadHeapRef(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, intptr_t *output) {
+	_ScriptStructAccess(true);
+	index = v->i;
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+	if (context->heap[index].externalReferenceCount == 0xFFFFFFFF) return false;
+	context->heap[index].externalReferenceCount++;
+	*output = index;
+	return true;
+}
+
+bool ScriptStructWriteString(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, const void *input, size_t inputBytes) {
+	_ScriptStructAccess(true);
+	index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+	context->heap[index].type = T_STR;
+	context->heap[index].bytes = inputBytes;
+	context->heap[index].text = (char *) AllocateResize(NULL, inputBytes);
+	MemoryCopy(context->heap[index].text, input, inputBytes);
+	return true;
+}
+
+bool ScriptStructWriteHandle(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, void *input, ScriptCloseHandleFunction close) {
+	_ScriptStructAccess(true);
+	
+	if (input) {
+		v->i = HeapAllocate(context); // TODO Handle memory allocation failures here.
+		context->heap[v->i].type = T_HANDLETYPE;
+		context->heap[v->i].close = close;
+		context->heap[v->i].handleData = input;
+		return true;
+	} else {
+		v->i = 0;
+	}
+
+	return true;
+}
+
+bool ScriptStructWriteInt(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, int64_t input) {
+	_ScriptStructAccess(false);
+	v->i = input;
+	return true;
+}
+
+bool ScriptStructWriteDouble(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, double input) {
+	_ScriptStructAccess(false);
+	v->f = input;
+	return true;
+}
+
+bool ScriptStructWriteHeapRef(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, intptr_t input) {
+	Assert(input >= 0 || input < (intptr_t) context->heapEntriesAllocated);
+	_ScriptStructAccess(true);
+	v->i = input;
+	return true;
+}
+
+_ScriptStructReadInteger(bool, ScriptStructReadBool);
+_ScriptStructReadInteger(int32_t, ScriptStructReadInt32);
+_ScriptStructReadInteger(uint64_t, ScriptStructReadUint64);
+_ScriptStructReadInteger(uint32_t, ScriptStructReadUint32);
+
+void ScriptReportExternalMemory(ExecutionContext *context, int64_t bytes) {
+	// Native modules call this when memory owned by a handle is allocated (bytes > 0) or freed (bytes < 0),
+	// so that the garbage collector can account for it.
+	context->heapExternalBytes += bytes;
+	if (bytes > 0) allocatedBytes += bytes;
+}
+
+void ScriptHeapRefClose(ExecutionContext *context, intptr_t index) {
+	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+	Assert(context->heap[index].externalReferenceCount);
+	context->heap[index].externalReferenceCount--;
+}
+
+bool ScriptParameterHeapRef(ExecutionContext *context, intptr_t *output) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	intptr_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
+	if (index < 0 || index >= (intptr_t) context->heapEntriesAllocated) return false;
+	if (context->heap[index].externalReferenceCount == 0xFFFFFFFF) return false;
+	context->heap[index].externalReferenceCount++;
+	*output = index;
+	return true;
+}
+
+bool ScriptParameterInt64(ExecutionContext *context, int64_t *output) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	*output = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
+	return true;
+}
+
+bool ScriptParameterDouble(ExecutionContext *context, double *output) {
+	context->c->parameterCount++;
+	if (context->c->stackPointer < context->c->parameterCount) return false;
+	*output = context->c->stack[context->c->stackPointer - context->c->parameterCount].f;
+	return true;
+}
+
+bool ScriptParameterBool  (ExecutionContext *context,     bool *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
+bool ScriptParameterUint32(ExecutionContext *context, uint32_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
+bool ScriptParameterUint64(ExecutionContext *context, uint64_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
+bool ScriptParameterInt32 (ExecutionContext *context,  int32_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
+
+bool ScriptReturnInt(ExecutionContext *context, int64_t input) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_UNMANAGED;
+	context->c->returnValue.i = input;
+	return true;
+}
+
+bool ScriptReturnDouble(ExecutionContext *context, double input) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_UNMANAGED;
+	context->c->returnValue.f = input;
+	return true;
+}
+
+bool ScriptReturnHeapRef(ExecutionContext *context, intptr_t index) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
+	context->c->returnValue.i = index;
+	return true;
+}
+
+bool ScriptReturnString(ExecutionContext *context, const void *data, size_t bytes) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
+	Value *returnValue = &context->c->returnValue;
+	RETURN_STRING_COPY((const char *) data, bytes);
+	return true;
+}
+
+bool ScriptCreateString(ExecutionContext *context, const void *_text, size_t _bytes, intptr_t *_index) {
+	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+	context->heap[index].type = T_STR;
+	context->heap[index].bytes = _bytes;
+	context->heap[index].text = (char *) AllocateResize(NULL, _bytes);
+	MemoryCopy(context->heap[index].text, _text, _bytes);
+	context->heap[index].externalReferenceCount = 1;
+	*_index = index;
+	return true;
+}
+
+bool ScriptCreateStruct(ExecutionContext *context, int64_t *fields, bool *managedFields, size_t fieldCount, intptr_t *_index) {
+	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+	context->heap[index].type = T_STRUCT;
+	size_t fieldCountAligned = (fieldCount + 7) & ~7;
+	context->heap[index].fields = (Value *) ((uint8_t *) AllocateResize(NULL, fieldCountAligned + fieldCount * sizeof(Value)) + fieldCountAligned);
+	context->heap[index].fieldCount = fieldCount;
+	context->heap[index].externalReferenceCount = 1;
+
+	for (uintptr_t i = 0; i < fieldCount; i++) {
+		context->heap[index].fields[i].i = fields ? fields[i] : 0;
+		((uint8_t *) context->heap[index].fields)[-1 - i] = managedFields ? managedFields[i] : false;
+	}
+
+	*_index = index;
+	return true;
+}
+
+bool ScriptReturnStruct(ExecutionContext *context, int64_t *fields, bool *managedFields, size_t fieldCount) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
+	intptr_t index;
+	if (!ScriptCreateStruct(context, fields, managedFields, fieldCount, &index)) return false;
+	context->c->returnValue.i = index;
+	return true;
+}
 
-			if (entry->type == T_LIST) {
-				context->c->stack[context->c->stackPointer - 1].i = entry->length;
-			} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
-				context->c->stack[context->c->stackPointer - 1].i = entry->mapLength;
+bool ScriptReturnStructInl(struct ExecutionContext *context, size_t fieldCount, ...) {
+	va_list arguments;
+	va_start(arguments, fieldCount);
+
+	Assert(fieldCount < FUNCTION_MAX_ARGUMENTS);
+	int64_t fields[FUNCTION_MAX_ARGUMENTS];
+	bool managedFields[FUNCTION_MAX_ARGUMENTS];
+
+	for (uintptr_t i = 0; i < fieldCount; i++) {
+		fields[i] = va_arg(arguments, int64_t);
+		managedFields[i] = va_arg(arguments, int);
+	}
+
+	va_end(arguments);
+	return ScriptReturnStruct(context, fields, managedFields, fieldCount);
+}
+
+bool ScriptParameterScan(struct ExecutionContext *context, const char *cFormat, ...) {
+	va_list arguments;
+	va_start(arguments, cFormat);
+
+	while (*cFormat) {
+		if (*cFormat == '(') {
+			cFormat++;
+			uintptr_t fieldIndex = 0;
+			intptr_t structIndex;
+			bool success = true;
+
+			if (!ScriptParameterHeapRef(context, &structIndex)) {
+				return false;
+			}
+
+			if (structIndex == 0) {
+				// TODO If 'n' is not found, then the null value should be an error.
+
+				while (success && *cFormat != ')') {
+					if (*cFormat == 'i') { int32_t *i = va_arg(arguments, int32_t *); *i = 0; }
+					else if (*cFormat == 'u') { uint32_t *i = va_arg(arguments, uint32_t *); *i = 0; }
+					else if (*cFormat == 'n') { bool *b = va_arg(arguments, bool *); if (b) *b = true; }
+					else if (*cFormat == '-') {}
+					else { success = false; }
+
+					cFormat++;
+					fieldIndex++;
+				}
 			} else {
-				STACK_READ_STRING(stringText, stringBytes, 1);
-				context->c->stack[context->c->stackPointer - 1].i = stringBytes;
+				while (success && *cFormat != ')') {
+					if (*cFormat == 'i') { success = ScriptStructReadInt32(context, structIndex, fieldIndex, va_arg(arguments, int32_t *)); }
+					else if (*cFormat == 'u') { success = ScriptStructReadUint32(context, structIndex, fieldIndex, va_arg(arguments, uint32_t *)); }
+					else if (*cFormat == 'n') { bool *b = va_arg(arguments, bool *); *b = false; }
+					else if (*cFormat == '-') {}
+					else { success = false; }
+
+					cFormat++;
+					fieldIndex++;
+				}
 			}
 
-			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
-		} else if (command == T_INDEX) {
-			if (context->c->stackPointer < 2) return -1;
-			STACK_READ_STRING(text, bytes, 2);
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+			ScriptHeapRefClose(context, structIndex);
 
-			if (index >= bytes) {
-				PrintError4(context, instructionPointer - 1, "Index %ld out of bounds in string '%.*s' of length %ld.\n", 
-						index, bytes, text, bytes);
-				return 0;
+			if (!success) {
+				return false;
 			}
+		}
 
-			char c = text[index];
-			index = HeapAllocate(context);
-			context->heap[index].type = T_STR;
-			context->heap[index].bytes = 1;
-			context->heap[index].text = (char *) AllocateResize(NULL, 1); // TODO Handling allocation failure.
-			context->heap[index].text[0] = c;
-			context->c->stack[context->c->stackPointer - 2].i = index;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = true;
-			context->c->stackPointer--;
-		} else if (command == T_CALL) {
-			callCommand:;
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			Value newBody = context->c->stack[--context->c->stackPointer];
+		else if (*cFormat == 'S') { 
+			const void **output = va_arg(arguments, const void **);
+			size_t *outputBytes = va_arg(arguments, size_t *);
+
+			if (!ScriptParameterString(context, output, outputBytes)) {
+				return false; 
+			}
+		}
+
+		else if (*cFormat == 'b') { if (!ScriptParameterBool(context, va_arg(arguments, bool *))) return false; }
+		else if (*cFormat == 'i') { if (!ScriptParameterInt32(context, va_arg(arguments, int32_t *))) return false; }
+		else if (*cFormat == 'I') { if (!ScriptParameterInt64(context, va_arg(arguments, int64_t *))) return false; }
+		else if (*cFormat == 'u') { if (!ScriptParameterUint32(context, va_arg(arguments, uint32_t *))) return false; }
+		else if (*cFormat == 'U') { if (!ScriptParameterUint64(context, va_arg(arguments, uint64_t *))) return false; }
+		else if (*cFormat == 'F') { if (!ScriptParameterDouble(context, va_arg(arguments, double *))) return false; }
+		else if (*cFormat == 'h') { if (!ScriptParameterHandle(context, va_arg(arguments, void **))) return false; }
+		else { return false; }
+
+		cFormat++;
+	}
+
+	va_end(arguments);
+	return true;
+}
+
+bool ScriptCreateHandle(ExecutionContext *context, void *handleData, ScriptCloseHandleFunction close, intptr_t *handle) {
+	if (handleData) {
+		intptr_t index = *handle = HeapAllocate(context); // TODO Handle memory allocation failures here.
+		context->heap[index].type = T_HANDLETYPE;
+		context->heap[index].close = close;
+		context->heap[index].handleData = handleData;
+		context->heap[index].externalReferenceCount = 1;
+	} else {
+		*handle = 0;
+	}
+
+	return true;
+}
+
+bool ScriptReturnHandle(ExecutionContext *context, void *handleData, ScriptCloseHandleFunction close) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
+
+	if (handleData) {
+		int64_t index = context->c->returnValue.i = HeapAllocate(context); // TODO Handle memory allocation failures here.
+		context->heap[index].type = T_HANDLETYPE;
+		context->heap[index].close = close;
+		context->heap[index].handleData = handleData;
+	} else {
+		context->c->returnValue.i = 0;
+	}
+
+	return true;
+}
+
+bool ScriptReturnBoxInError(ExecutionContext *context) {
+	Assert(context->c->returnValueType == EXTCALL_RETURN_MANAGED || context->c->returnValueType == EXTCALL_RETURN_UNMANAGED);
+	context->c->returnValueType = context->c->returnValueType == EXTCALL_RETURN_MANAGED ? EXTCALL_RETURN_ERR_MANAGED : EXTCALL_RETURN_ERR_UNMANAGED;
+	return true;
+}
+
+bool ScriptReturnError(ExecutionContext *context, const char *message) {
+	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
+	context->c->returnValueType = EXTCALL_RETURN_ERR_ERROR;
+	Value *returnValue = &context->c->returnValue;
+	RETURN_STRING_COPY(message, StringLength(message));
+	return true;
+}
+
+bool ScriptRunCallback(ExecutionContext *context, intptr_t functionPointer, 
+		int64_t *parameters, bool *managedParameters, size_t parameterCount, int64_t *returnValue, bool managedReturnValue) {
+	// TODO Do this in a separate coroutine?
+
+	for (intptr_t i = parameterCount - 1; i >= -1; i--) {
+		if (context->c->stackPointer == context->c->stackEntriesAllocated) {
+			PrintError4(context, 0, "Stack overflow.\n");
+			return false;
+		}
+
+		if (i == -1) {
+			context->c->stack[context->c->stackPointer].i = functionPointer;
+			context->c->stackIsManaged[context->c->stackPointer] = true;
+		} else {
+			context->c->stack[context->c->stackPointer].i = parameters[i];
+			context->c->stackIsManaged[context->c->stackPointer] = managedParameters[i];
+		}
+
+		context->c->stackPointer++;
+	}
+
+	uintptr_t previousParameterCount = context->c->parameterCount;
+	int previousReturnValueType = context->c->returnValueType;
+
+	int result = ScriptExecuteFunction(2, context);
+
+	context->c->parameterCount = previousParameterCount;
+	context->c->returnValueType = previousReturnValueType;
+
+	if (result == -1 || (returnValue && (context->c->stackPointer == 0 
+					|| context->c->stackIsManaged[context->c->stackPointer - 1] != managedReturnValue))) {
+		PrintError4(context, 0, "The script was malformed.\n");
+		wantCompletionConfirmation = false;
+	}
+
+	if (returnValue) {
+		*returnValue = context->c->stack[--context->c->stackPointer].i;
+	}
+
+	return result > 0;
+}
+
+const ScriptNativeInterface _scriptNativeInterface = {
+	.CreateHandle = ScriptCreateHandle,
+	.CreateString = ScriptCreateString,
+	.CreateStruct = ScriptCreateStruct,
+	.HeapRefClose = ScriptHeapRefClose,
+	.ListCount = ScriptListCount,
+	.ParameterBool = ScriptParameterBool,
+	.ParameterCString = ScriptParameterCString,
+	.ParameterDouble = ScriptParameterDouble,
+	.ParameterHandle = ScriptParameterHandle,
+	.ParameterHeapRef = ScriptParameterHeapRef,
+	.ParameterInt32 = ScriptParameterInt32,
+	.ParameterInt64 = ScriptParameterInt64,
+	.ParameterScan = ScriptParameterScan,
+	.ParameterString = ScriptParameterString,
+	.ParameterUint32 = ScriptParameterUint32,
+	.ParameterUint64 = ScriptParameterUint64,
+	.ReportExternalMemory = ScriptReportExternalMemory,
+	.ReturnBoxInError = ScriptReturnBoxInError,
+	.ReturnDouble = ScriptReturnDouble,
+	.ReturnError = ScriptReturnError,
+	.ReturnHandle = ScriptReturnHandle,
+	.ReturnHeapRef = ScriptReturnHeapRef,
+	.ReturnInt = ScriptReturnInt,
+	.ReturnString = ScriptReturnString,
+	.ReturnStruct = ScriptReturnStruct,
+	.ReturnStructInl = ScriptReturnStructInl,
+	.RunCallback = ScriptRunCallback,
+	.StructReadBool = ScriptStructReadBool,
+	.StructReadDouble = ScriptStructReadDouble,
+	.StructReadHandle = ScriptStructReadHandle,
+	.StructReadHeapRef = ScriptStructReadHeapRef,
+	.StructReadInt32 = ScriptStructReadInt32,
+	.StructReadInt64 = ScriptStructReadInt64,
+	.StructReadString = ScriptStructReadString,
+	.StructReadUint32 = ScriptStructReadUint32,
+	.StructReadUint64 = ScriptStructReadUint64,
+	.StructWriteDouble = ScriptStructWriteDouble,
+	.StructWriteHandle = ScriptStructWriteHandle,
+	.StructWriteHeapRef = ScriptStructWriteHeapRef,
+	.StructWriteInt = ScriptStructWriteInt,
+	.StructWriteString = ScriptStructWriteString,
+};
+
+void ScriptOutputOverview(ExecutionContext *context, ImportData *mainModule) {
+	Node *node = context->rootNode->firstChild;
+
+	if (mainModule->parentImport) {
+		return;
+	}
+
+	while (node) {
+		if (node->type == T_FUNCTION || node->type == T_FUNCTYPE) {
+			PrintOutput("[%.*s]\ntype=%s\nreturn=", (int) node->token.textBytes, node->token.text, 
+					node->type == T_FUNCTION ? "function" : "functype");
+			PrintOutputType(node->expressionType->firstChild->sibling);
+			PrintOutput("\n");
 
-			if (newBody.i == 0) {
-				PrintError4(context, instructionPointer - 1, "Function pointer was null.\n");
-				return 0;
+			Node *argument = node->expressionType->firstChild->firstChild;
+			int index = 0;
+
+			while (argument) {
+				PrintOutput("arg%d_type=", index);
+				PrintOutputType(argument->firstChild);
+				PrintOutput("\narg%d_name=%.*s\n", index, (int) argument->token.textBytes, argument->token.text);
+				index++;
+				argument = argument->sibling;
 			}
+		} else if (node->type == T_STRUCT) {
+			PrintOutput("[%.*s]\ntype=struct\n", (int) node->token.textBytes, node->token.text);
 
-			bool popResult = false;
-			bool assertResult = false;
+			Node *field = node->firstChild;
+			int index = 0;
 
-			while (true) {
-				uint64_t index = newBody.i;
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				newBody.i = entry->lambdaID;
+			while (field) {
+				Assert(field->type == T_DECLARE);
+				PrintOutput("field%d_type=", index);
+				PrintOutputType(field->firstChild);
+				PrintOutput("\nfield%d_name=%.*s\n", index, (int) field->token.textBytes, field->token.text);
+				index++;
+				field = field->sibling;
+			}
+		} else if (node->type == T_INTTYPE) {
+			PrintOutput("[%.*s]\ntype=inttype\n", (int) node->token.textBytes, node->token.text);
 
-				if (entry->type == T_OP_DISCARD) {
-					popResult = true;
-				} else if (entry->type == T_OP_ASSERT) {
-					assertResult = true;
-				} else if (entry->type == T_OP_CURRY) {
-					if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-						PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-						return 0;
-					}
+			Node *define = node->firstChild;
+			int index = 0;
 
-					context->c->stack[context->c->stackPointer] = entry->curryValue;
-					context->c->stackIsManaged[context->c->stackPointer] = entry->internalValuesAreManaged;
-					context->c->stackPointer++;
-				} else if (entry->type == T_FUNCPTR) {
-					break;
-				} else {
-					return -1;
+			while (define) {
+				if (define->type == T_INTTYPE_CONSTANT) {
+					PrintOutput("const%d_name=%.*s\n", index, (int) define->token.textBytes, define->token.text);
+					bool error = false;
+					int64_t value = ASTEvaluateIntConstant(NULL, define->firstChild, &error);
+					Assert(!error);
+					char buffer[32];
+					size_t bytes = PrintIntegerToBuffer(buffer, sizeof(buffer), value);
+					PrintOutput("const%d_value=%.*s\n", index, (int) bytes, buffer);
+					index++;
+				} else if (define->type == T_INTTYPE) {
+					PrintOutput("parent=%.*s\n", (int) define->token.textBytes, define->token.text);
 				}
-			} 
 
-			if (context->c->backTracePointer == sizeof(context->c->backTrace) / sizeof(context->c->backTrace[0])) {
-				PrintError4(context, instructionPointer - 1, "Back trace overflow.\n");
-				return 0;
+				define = define->sibling;
 			}
-			
-			BackTraceItem *link = &context->c->backTrace[context->c->backTracePointer];
-			context->c->backTracePointer++;
-			link->instructionPointer = instructionPointer;
-			link->variableBase = variableBase;
-			link->popResult = popResult;
-			link->assertResult = assertResult;
-			instructionPointer = newBody.i;
-			variableBase = context->c->localVariableCount - 1;
-		} else if (command == T_IF) {
-			if (context->c->stackPointer < 1) return -1;
-			Value condition = context->c->stack[--context->c->stackPointer];
-			int32_t delta;
-			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
-			instructionPointer += condition.i ? (int32_t) sizeof(delta) : delta; 
-		} else if (command == T_LOGICAL_OR) {
-			if (context->c->stackPointer < 1) return -1;
-			Value condition = context->c->stack[context->c->stackPointer - 1];
-			int32_t delta;
-			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
-			instructionPointer += condition.i ? delta : (int32_t) sizeof(delta); 
-			if (!condition.i) context->c->stackPointer--;
-		} else if (command == T_LOGICAL_AND) {
-			if (context->c->stackPointer < 1) return -1;
-			Value condition = context->c->stack[context->c->stackPointer - 1];
-			int32_t delta;
-			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
-			instructionPointer += condition.i ? (int32_t) sizeof(delta) : delta; 
-			if (condition.i) context->c->stackPointer--;
-		} else if (command == T_BRANCH) {
-			int32_t delta;
-			MemoryCopy(&delta, &functionData[instructionPointer], sizeof(delta));
-			instructionPointer += delta; 
-		} else if (command == T_POP) {
-			if (context->c->stackPointer < 1) return -1;
-			context->c->stackPointer--;
-		} else if (command == T_DUP) {
-			if (context->c->stackPointer < 1) return -1;
+		} else if (node->type == T_HANDLETYPE) {
+			PrintOutput("[%.*s]\ntype=handletype\n", (int) node->token.textBytes, node->token.text);
 
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-				return 0;
+			if (node->firstChild) {
+				PrintOutput("parent=%.*s\n", (int) node->firstChild->token.textBytes, node->firstChild->token.text);
 			}
+		} else if (node->type == T_DECLARE && node->isOptionVariable) {
+			PrintOutput("[%.*s]\ntype=option\n", (int) node->token.textBytes, node->token.text);
 
-			context->c->stack[context->c->stackPointer] = context->c->stack[context->c->stackPointer - 1];
-			context->c->stackIsManaged[context->c->stackPointer] = context->c->stackIsManaged[context->c->stackPointer - 1];
-			context->c->stackPointer++;
-		} else if (command == T_SWAP) {
-			if (context->c->stackPointer < 2) return -1;
-			Value v1 = context->c->stack[context->c->stackPointer - 1];
-			Value v2 = context->c->stack[context->c->stackPointer - 2];
-			bool m1 = context->c->stackIsManaged[context->c->stackPointer - 1];
-			bool m2 = context->c->stackIsManaged[context->c->stackPointer - 2];
-			context->c->stack[context->c->stackPointer - 1] = v2;
-			context->c->stack[context->c->stackPointer - 2] = v1;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = m2;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = m1;
-		} else if (command == T_ROT3) {
-			if (context->c->stackPointer < 3) return -1;
-			Value v1 = context->c->stack[context->c->stackPointer - 1];
-			Value v2 = context->c->stack[context->c->stackPointer - 2];
-			Value v3 = context->c->stack[context->c->stackPointer - 3];
-			bool m1 = context->c->stackIsManaged[context->c->stackPointer - 1];
-			bool m2 = context->c->stackIsManaged[context->c->stackPointer - 2];
-			bool m3 = context->c->stackIsManaged[context->c->stackPointer - 3];
-			context->c->stack[context->c->stackPointer - 1] = v3;
-			context->c->stack[context->c->stackPointer - 2] = v1;
-			context->c->stack[context->c->stackPointer - 3] = v2;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = m3;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = m1;
-			context->c->stackIsManaged[context->c->stackPointer - 3] = m2;
-		} else if (command == T_ASSERT) {
-			if (context->c->stackPointer < 1) return -1;
-			Value condition = context->c->stack[--context->c->stackPointer];
-
-			if (condition.i == 0) {
-				PrintError4(context, instructionPointer - 1, "Assertion failed.\n");
-				return 0;
+			if (node->firstChild->sibling && node->firstChild->sibling->firstChild->sibling->firstChild->sibling) {
+				Node *arg = node->firstChild->sibling->firstChild->sibling->firstChild->sibling;
+				PrintOutput("description=");
+				for (uintptr_t i = 0; i < arg->token.textBytes; i++) PrintOutput("%c", arg->token.text[i] == '\n' ? ' ' : arg->token.text[i]);
+				PrintOutput("\n");
 			}
-		} else if (command == T_ERR_CAST) {
-			if (context->c->stackPointer < 1) return -1;
+		}
 
-			// TODO Handle memory allocation failures here.
-			uintptr_t index = HeapAllocate(context);
-			context->heap[index].type = T_ERR;
-			context->heap[index].success = true;
-			context->heap[index].internalValuesAreManaged = context->c->stackIsManaged[context->c->stackPointer - 1];;
-			context->heap[index].errorValue = context->c->stack[context->c->stackPointer - 1];
+		node = node->sibling;
+	}
+}
 
-			Value v;
-			v.i = index;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
-			context->c->stack[context->c->stackPointer - 1] = v;
-		} else if (command == T_ANYTYPE_CAST) {
-			if (context->c->stackPointer < 1) return -1;
+bool ScriptLoad(Tokenizer tokenizer, ExecutionContext *context, ImportData *importData, bool replMode) {
+	Node *previousRootNode = context->rootNode;
+	ImportData *previousImportData = context->functionData->importData;
 
-			// TODO Handle memory allocation failures here.
-			uintptr_t index = HeapAllocate(context);
-			context->heap[index].type = T_ANYTYPE;
-			MemoryCopy(&context->heap[index].anyType, &functionData[instructionPointer], sizeof(context->heap[index].anyType));
-			context->heap[index].internalValuesAreManaged = ASTIsManagedType(context->heap[index].anyType);
-			context->heap[index].anyValue = context->c->stack[context->c->stackPointer - 1];
+	context->rootNode = replMode ? ParseRootREPL(&tokenizer) : ParseRoot(&tokenizer); 
+	context->functionData->importData = tokenizer.module;
 
-			Value v;
-			v.i = index;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
-			context->c->stack[context->c->stackPointer - 1] = v;
+	uint8_t b = 0; // Make sure no function can start at 0.
+	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
+	b = T_AWAIT; // Put a T_AWAIT command at address 1.
+	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
+	b = T_CALL; // Put a T_CALL command at address 2 (for ScriptRunCallback).
+	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
+	b = T_END_CALLBACK; // Put a T_END_CALLBACK command at address 3 (for ScriptRunCallback).
+	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
 
-			instructionPointer += sizeof(context->heap[index].anyType);
-		} else if (command == T_OP_CAST) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+	bool success = context->rootNode 
+		&& ASTSetScopes(&tokenizer, context, context->rootNode, NULL)
+		&& ASTLookupTypeIdentifiers(&tokenizer, context->rootNode)
+		&& ASTSetTypes(&tokenizer, context->rootNode)
+		&& ASTCheckForReturnStatements(&tokenizer, context->rootNode)
+		&& ASTGenerate(&tokenizer, context->rootNode, context)
+		&& ScriptParseOptions(context);
 
-			if (index == 0) {
-				PrintError4(context, instructionPointer - 1, "The object is null.\n");
-				return 0;
-			}
+	importData->globalVariableOffset = context->functionData->globalVariableOffset;
+	importData->rootNode = context->rootNode;
+	*importedModulesLink = importData;
+	importedModulesLink = &importData->nextImport;
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_ANYTYPE) return -1;
-			Node *expressionType;
-			MemoryCopy(&expressionType, &functionData[instructionPointer], sizeof(expressionType));
+	if (outputOverview && success) ScriptOutputOverview(context, importData);
 
-			if (!ASTMatching(expressionType, entry->anyType)) {
-				PrintError4(context, instructionPointer - 1, "Invalid cast.\n");
-				return 0;
-			}
+	context->rootNode = previousRootNode;
+	context->functionData->importData = previousImportData;
 
-			Assert(ASTIsManagedType(expressionType) == entry->internalValuesAreManaged);
-			context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
-			context->c->stack[context->c->stackPointer - 1] = entry->anyValue;
-			instructionPointer += sizeof(expressionType);
-		} else if (command == T_OP_SUCCESS) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
-			bool success = false;
+	return success;
+}
+
+int ScriptExecute(ExecutionContext *context, ImportData *mainModule) {
+#ifndef NO_SCRIPT_EXECUTE
+	bool optionMatchingError = false;
+
+	for (uintptr_t i = 0; i < optionCount; i++) {
+		if (!optionsMatched[i]) {
+			PrintError3("Script option passed on command line '%s' does not match any #option variable.\n", options[i]);
+			optionMatchingError = true;
+		}
+	}
+
+	if (optionMatchingError) {
+		return 1;
+	}
+
+	Node n;
+	n.token.textBytes = startFunctionBytes;
+	n.token.text = startFunction;
+	intptr_t startIndex = ScopeLookupIndex(&n, mainModule->rootNode->scope, true, false);
 
-			if (index) {
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				if (entry->type != T_ERR) return -1;
-				success = entry->success;
-			}
+	if (startIndex == -1) {
+		PrintError3("The script does not have a start function '%.*s'.\n", startFunctionBytes, startFunction);
+		return 1;
+	}
 
-			context->c->stack[context->c->stackPointer - 1].i = success;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
-		} else if (command == T_OP_ASSERT_ERR) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
+	Node mainFunctionArguments = { 0 };
+	mainFunctionArguments.type = T_ARGUMENTS;
+	Node mainFunctionReturn = { 0 };
+	mainFunctionReturn.type = T_VOID;
+	Node mainFunctionType = { 0 };
+	mainFunctionType.type = T_FUNCPTR;
+	mainFunctionType.firstChild = &mainFunctionArguments;
+	mainFunctionArguments.sibling = &mainFunctionReturn;
 
-			if (index == 0) {
-				PrintError4(context, instructionPointer - 1, "Assertion failed. Unknown error.\n");
-				return 0;
-			} else {
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				if (entry->type != T_ERR) return -1;
+	if (!ASTMatching(&mainFunctionType, mainModule->rootNode->scope->entries[ScopeLookupIndex(&n, mainModule->rootNode->scope, false, true)]->expressionType)) {
+		PrintError3("The start function '%.*s' should take no arguments and return 'void'.\n", startFunctionBytes, startFunction);
+		return 1;
+	}
 
-				if (!entry->success) {
-					if (!entry->internalValuesAreManaged) return -1;
-					size_t textBytes;
-					const char *text;
-					ScriptHeapEntryToString(context, &context->heap[entry->errorValue.i], &text, &textBytes);
-					PrintError4(context, instructionPointer - 1, "Assertion failed.\nThe error code is: '%.*s'.\n", textBytes, text);
-					return 0;
-				}
+	ImportData *module = importedModules;
 
-				context->c->stack[context->c->stackPointer - 1] = entry->errorValue;
-				context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
+	while (module) {
+		Node n;
+		n.token.textBytes = 10;
+		n.token.text = "Initialise";
+		intptr_t index = ScopeLookupIndex(&n, module->rootNode->scope, true, false);
+
+		if (index != -1) {
+			if (!ASTMatching(&mainFunctionType, module->rootNode->scope->entries[ScopeLookupIndex(&n, module->rootNode->scope, false, true)]->expressionType)) {
+				PrintError3("The 'Initialise' function in the module '%s' should take no arguments and return 'void'.\n", module->prettyName);
+				return 1;
 			}
-		} else if (command == T_OP_ERROR) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 1].i;
 
-			if (index == 0) {
-				index = HeapAllocate(context);
-				context->heap[index].type = T_STR;
-				context->heap[index].text = (char *) AllocateResize(NULL, 7);
-				context->heap[index].bytes = 7;
-				MemoryCopy(context->heap[index].text, "UNKNOWN", 7);
-			} else {
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				if (entry->type != T_ERR) return -1;
-				if (!entry->success && !entry->internalValuesAreManaged) return -1;
-				index = entry->success ? 0 : entry->errorValue.i;
+			int result = ScriptExecuteFunction(context->heap[context->globalVariables[index + module->globalVariableOffset].i].lambdaID, context);
+
+			if (result == 0) {
+				// A runtime error occurred.
+				return 1;
+			} else if (result == -1 || context->c->stackPointer != 0) {
+				PrintError4(context, 0, "The script was malformed.\n");
+				wantCompletionConfirmation = false;
+				return 1;
 			}
+		}
 
-			context->c->stack[context->c->stackPointer - 1].i = index;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
-		} else if (command == T_OP_DEFAULT) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			uintptr_t index = context->c->stack[context->c->stackPointer - 2].i;
+		module = module->nextImport;
+	}
 
-			if (index) {
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				if (entry->type != T_ERR) return -1;
-				if (!entry->success && !entry->internalValuesAreManaged) return -1;
+	int result = ScriptExecuteFunction(context->heap[context->globalVariables[context->functionData->globalVariableOffset + startIndex].i].lambdaID, context);
 
-				if (entry->success) {
-					context->c->stack[context->c->stackPointer - 1] = entry->errorValue;
-					context->c->stackIsManaged[context->c->stackPointer - 1] = entry->internalValuesAreManaged;
-				}
-			}
+	if (result == 0) {
+		// A runtime error occurred.
+		return 1;
+	} else if (result == -1 || context->c->stackPointer != 0) {
+		PrintError4(context, 0, "The script was malformed.\n");
+		wantCompletionConfirmation = false;
+		return 1;
+	}
 
-			context->c->stack[context->c->stackPointer - 2] = context->c->stack[context->c->stackPointer - 1];
-			context->c->stackIsManaged[context->c->stackPointer - 2] = context->c->stackIsManaged[context->c->stackPointer - 1];
-			context->c->stackPointer--;
-		} else if (command == T_OP_INT_TO_FLOAT) {
-			if (context->c->stackPointer < 1) return -1;
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			context->c->stack[context->c->stackPointer - 1].f = context->c->stack[context->c->stackPointer - 1].i;
-		} else if (command == T_OP_FLOAT_TRUNCATE) {
-			if (context->c->stackPointer < 1) return -1;
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			context->c->stack[context->c->stackPointer - 1].i = context->c->stack[context->c->stackPointer - 1].f;
-		} else if (command == T_PERSIST) {
-			if (!ExternalPersistWrite(context, NULL)) {
-				return 0;
-			}
-		} else if (command == T_NEW) {
-			if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-				PrintError4(context, instructionPointer - 1, "Stack overflow.\n");
-				return 0;
-			}
+	return 0;
+#else
+	(void) mainModule;
+	(void) context;
+	return 0;
+#endif
+}
 
-			int16_t fieldCount = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
-			instructionPointer += 2;
-			uintptr_t index = HeapAllocate(context);
-			uint8_t type = context->heap[index].type = fieldCount >= 0 ? T_STRUCT 
-				: fieldCount >= -2 ? T_LIST 
-				: fieldCount >= -4 ? T_ERR
-				: fieldCount >= -6 ? T_MAP_INT
-				: fieldCount >= -8 ? T_MAP_STR : T_ERROR;
+void ScriptFreeCoroutine(CoroutineState *c) {
+	AllocateResize(c->waiters, 0);
+	AllocateResize(c->waitingOn, 0);
+	AllocateResize(c->localVariables, 0);
+	AllocateResize(c->localVariableIsManaged, 0);
+	AllocateResize(c, 0);
+}
 
-			if (type == T_STRUCT) {
-				size_t fieldCountAligned = (fieldCount + 7) & ~7;
-				context->heap[index].fields = (Value *) ((uint8_t *) AllocateResize(NULL, 
-							fieldCountAligned + fieldCount * sizeof(Value)) + fieldCountAligned);
-				context->heap[index].fieldCount = fieldCount;
+void ScriptFree(ExecutionContext *context) {
+	ImportData *module = importedModules;
 
-				for (intptr_t i = 0; i < fieldCount; i++) {
-					context->heap[index].fields[i].i = 0;
+	while (module) {
+		if (!module->isBaseModule) {
+			AllocateResize(module->fileData, 0);
+		}
 
-					// Default all fields to being unmanaged.
-					// The first type they are set this will be updated.
-					((uint8_t *) context->heap[index].fields)[-1 - i] = false;
-				}
-			} else if (type == T_LIST) {
-				context->heap[index].internalValuesAreManaged = fieldCount == -2;
-				context->heap[index].length = context->heap[index].allocated = 0;
-				context->heap[index].list = NULL;
-			} else if (type == T_MAP_INT) {
-				context->heap[index].internalValuesAreManaged = fieldCount == -6;
-				context->heap[index].mapLength = 0;
-				context->heap[index].mapEntries = NULL;
-			} else if (type == T_MAP_STR) {
-				context->heap[index].internalValuesAreManaged = fieldCount == -8;
-				context->heap[index].mapLength = 0;
-				context->heap[index].mapEntries = NULL;
-			} else if (type == T_ERR) {
-				context->heap[index].internalValuesAreManaged = true;
-				context->heap[index].success = false;
+		ASTFreeScopes(module->rootNode);
+		module = module->nextImport;
+	}
 
-				if (context->c->stackPointer < 1) return -1;
-				if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-				context->heap[index].errorValue = context->c->stack[context->c->stackPointer - 1];
-				context->c->stackPointer--;
-			} else {
-				return -1;
-			}
+	for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
+		if (context->heap[i].type != T_ERROR) {
+			HeapFreeEntry(context, i);
+		}
+	}
 
-			Value v;
-			v.i = index;
-			context->c->stackIsManaged[context->c->stackPointer] = true;
-			context->c->stack[context->c->stackPointer++] = v;
-		} else if (command == T_OP_RESIZE) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	CoroutineState *coroutine = context->allCoroutines;
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+	while (coroutine) {
+		CoroutineState *next = coroutine->nextCoroutine;
+		ScriptFreeCoroutine(coroutine);
+		coroutine = next;
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	AllocateResize(context->heap, 0);
+	AllocateResize(context->internedLiterals, 0);
+	AllocateResize(context->sharedStorage, 0);
+	AllocateResize(context->globalVariables, 0);
+	AllocateResize(context->globalVariableIsManaged, 0);
+	AllocateResize(context->functionData->lineNumbers, 0);
+	AllocateResize(context->functionData->data, 0);
+	AllocateResize(context->scriptPersistFile, 0);
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+// --------------------------------- Helpers.
 
-			int64_t newLength = context->c->stack[context->c->stackPointer - 1].i;
+void LineNumberLookup(ExecutionContext *context, uint32_t instructionPointer, LineNumber *output) {
+	for (uintptr_t i = 0; i < context->functionData->lineNumberCount; i++) {
+		if (context->functionData->lineNumbers[i].instructionPointer == instructionPointer) {
+			*output = context->functionData->lineNumbers[i];
+			return;
+		}
+	}
+}
 
-			if (newLength < 0 || newLength >= 1000000000) {
-				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
-				return 0;
-			}
+void PrintBackTrace(ExecutionContext *context, uint32_t instructionPointer, CoroutineState *c, const char *prefix) {
+	LineNumber lineNumber = { 0 };
+	LineNumberLookup(context, instructionPointer, &lineNumber);
 
-			uint32_t oldLength = context->heap[index].length;
-			context->heap[index].length = newLength;
-			context->heap[index].allocated = newLength;
+	if (lineNumber.importData) {
+		PrintDebug("%s\t%s:%d %s %.*s\n", prefix, lineNumber.importData->prettyName, lineNumber.lineNumber, lineNumber.function ? "in" : "",
+				lineNumber.function ? (int) lineNumber.function->textBytes : 0, lineNumber.function ? lineNumber.function->text : "");
+	}
+
+	uintptr_t btp = c->backTracePointer;
+	uintptr_t minimum = c->startedByAsync ? 1 : 0;
+
+	while (btp > minimum) {
+		BackTraceItem *link = &c->backTrace[--btp];
+		LineNumberLookup(context, link->instructionPointer - 1, &lineNumber);
+		PrintDebug("%s\t%s:%d %s %.*s\n", prefix, 
+				lineNumber.importData && lineNumber.importData->prettyName ? lineNumber.importData->prettyName : "??", 
+				lineNumber.lineNumber, lineNumber.function ? "in" : "",
+				lineNumber.function ? (int) lineNumber.function->textBytes : 0, lineNumber.function ? lineNumber.function->text : "");
+	}
+}
 
-			// TODO Handling out of memory errors.
-			context->heap[index].list = (Value *) AllocateResize(context->heap[index].list, newLength * sizeof(Value));
+void PrintLine(ImportData *importData, uintptr_t line) {
+	if (!importData) {
+		return;
+	}
+	
+	uintptr_t position = 0;
 
-			for (uintptr_t i = oldLength; i < (size_t) newLength; i++) {
-				context->heap[index].list[i].i = 0;
+	for (uintptr_t i = 1; i < line; i++) {
+		while (position < importData->fileDataBytes) {
+			if (((char *) importData->fileData)[position] == '\n') {
+				position++;
+				break;
 			}
 
-			context->c->stackPointer -= 2;
-		} else if (command == T_OP_ADD) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+			position++;
+		}
+	}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+	uintptr_t length = 0;
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	for (uintptr_t i = position; i <= importData->fileDataBytes; i++) {
+		if (i == importData->fileDataBytes || ((char *) importData->fileData)[i] == '\n') {
+			length = i - position;
+			break;
+		}
+	}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+	PrintDebug("%s>> %.*s%s\n", IsColoredOutputEnabled() ? "\033[0;36m" : "", (int) length, 
+			&((char *) importData->fileData)[position], IsColoredOutputEnabled() ? "\033[0m" : "");
+}
 
-			int64_t newLength = entry->length + 1;
+int ScriptExecuteFromFile(char *scriptPath, char *fileData, size_t fileDataBytes, bool replMode) {
+	Tokenizer tokenizer = { 0 };
+	ImportData importData = { 0 };
+	importData.path = PathToAbsolute(scriptPath, true);
+	importData.prettyName = PathToPrettyName(importData.path);
+	importData.baseDirectory = PathToBaseDirectory(importData.path);
+	importData.fileData = fileData;
+	importData.fileDataBytes = fileDataBytes;
+	tokenizer.module = &importData;
+	tokenizer.line = 1;
+	tokenizer.input = fileData;
+	tokenizer.inputBytes = fileDataBytes;
 
-			if (newLength < 0 || newLength >= 1000000000) {
-				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
-				return 0;
-			}
+	FunctionBuilder builder = { 0 };
+	ExecutionContext context = { 0 };
+	context.functionData = &builder;
+	context.mainModule = &importData;
+	builder.context = &context;
+	context.heapAllocatedBytesAtCollection = allocatedBytes;
+	context.heapCollectionThresholdBytes = HEAP_COLLECTION_MINIMUM_BYTES;
 
-			uint32_t oldLength = context->heap[index].length;
-			entry->length = newLength;
+	context.heapEntriesAllocated = 2;
+	context.heap = (HeapEntry *) AllocateResize(NULL, sizeof(HeapEntry) * context.heapEntriesAllocated);
+	HeapEntry emptyHeapEntry = { 0 };
+	context.heap[0] = emptyHeapEntry;
+	context.heap[0].type = T_EOF;
+	context.heap[1] = emptyHeapEntry;
+	context.heapFirstUnusedEntry = 1;
+	context.c = (CoroutineState *) AllocateResize(0, sizeof(CoroutineState));
+	CoroutineState empty = { 0 };
+	*context.c = empty;
+	context.c->stackEntriesAllocated = sizeof(context.c->stack) / sizeof(context.c->stack[0]);
+	context.c->previousCoroutineLink = &context.allCoroutines;
+	context.allCoroutines = context.c;
 
-			if (entry->length > entry->allocated) {
-				// TODO Handling out of memory errors.
-				entry->allocated = entry->allocated ? entry->allocated * 2 : 4;
-				entry->list = (Value *) AllocateResize(entry->list, entry->allocated * sizeof(Value));
-				Assert(entry->length <= entry->allocated);
-			}
+	int result = 1;
 
-			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			entry->list[oldLength] = context->c->stack[context->c->stackPointer - 1];
+	if (ScriptLoad(tokenizer, &context, &importData, replMode)) {
+		if (outputOverview) {
+			result = 0;
+		} else {
+			result = ScriptExecute(&context, &importData);
+		}
+	}
 
-			context->c->stackPointer -= 2;
-		} else if (command == T_OP_INSERT) {
-			if (context->c->stackPointer < 3) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+	if (gcStats) HeapPrintStatistics(&context);
+	ScriptFree(&context);
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 3].i;
+	importedModules = NULL;
+	importedModulesLink = &importedModules;
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	return result;
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+int ExternalOpStringSlice(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 3) return -1;
+	uint64_t start = context->c->stack[--context->c->stackPointer].i;
+	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
+	uint64_t end = context->c->stack[--context->c->stackPointer].i;
+	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
+	STACK_READ_STRING(string, bytes, 1);
 
-			int64_t newLength = entry->length + 1;
+	if (start > bytes || end > bytes || end < start) {
+		PrintError4(context, 0, "The slice range (%ld..%ld) is invalid for the string of length %ld.\n",
+				start, end, bytes);
+		return 0;
+	}
 
-			if (newLength < 0 || newLength >= 1000000000) {
-				PrintError4(context, instructionPointer - 1, "The new length of the list is out of the supported range (0..1000000000).\n");
-				return 0;
-			}
+	(void) string;
+	returnValue->i = HeapCreateSlice(context, _index1, start, end);
+	context->c->stackPointer--; // Don't pop the string until HeapCreateSlice has finished, as it might allocate.
+	return EXTCALL_RETURN_MANAGED;
+}
 
-			uint32_t oldLength = context->heap[index].length;
-			entry->length = newLength;
+uintptr_t HeapCreateSlice(ExecutionContext *context, uintptr_t index, size_t start, size_t end) {
+	// The string must be a T_STR, T_OP_SLICE or T_EOF (use ScriptHeapEntryToString to convert a T_CONCAT first),
+	// and it must be reachable by the garbage collector, since this calls HeapAllocate.
 
-			if (entry->length > entry->allocated) {
-				// TODO Handling out of memory errors.
-				entry->allocated = entry->allocated ? entry->allocated * 2 : 4;
-				entry->list = (Value *) AllocateResize(entry->list, entry->allocated * sizeof(Value));
-				Assert(entry->length <= entry->allocated);
-			}
+	Assert(context->heap[index].type != T_CONCAT);
+	size_t bytes = ScriptHeapEntryGetStringBytes(&context->heap[index]);
+	Assert(start <= end && end <= bytes);
 
-			if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			int64_t insertIndex = context->c->stack[context->c->stackPointer - 2].i;
+	if (start == 0 && end == bytes) {
+		// Strings are immutable, so the whole string can be returned as is.
+		return index;
+	} else if (start == end) {
+		return 0;
+	}
 
-			if (insertIndex < 0 || insertIndex > oldLength) {
-				PrintError4(context, instructionPointer - 1, "Cannot insert at index %ld. The list has length %ld.\n",
-						insertIndex, oldLength);
-				return 0;
-			}
+	uintptr_t result = HeapAllocate(context);
+	HeapEntry *entry = &context->heap[index];
+	HeapEntry *slice = &context->heap[result];
+
+	if (end - start < STRING_SLICE_COPY_BYTES || end - start > UINT32_MAX) {
+		const char *text;
+		ScriptHeapEntryToString(context, entry, &text, &bytes);
+		slice->type = T_STR;
+		slice->bytes = end - start;
+		slice->text = (char *) AllocateResize(NULL, slice->bytes);
+		MemoryCopy(slice->text, text + start, slice->bytes);
+	} else {
+		// Share the text of the parent string instead of copying it.
+		// The collection in HeapAllocate does not materialize slices, so the entry's type has not changed.
+		slice->type = T_OP_SLICE;
+		slice->sliceBytes = end - start;
+
+		if (entry->type == T_OP_SLICE) {
+			slice->sliceParent = entry->sliceParent;
+			slice->sliceOffset = entry->sliceOffset + start;
+		} else {
+			Assert(entry->type == T_STR && index <= UINT32_MAX);
+			slice->sliceParent = index;
+			slice->sliceOffset = start;
+		}
+	}
 
-			for (int64_t i = (int64_t) oldLength - (int64_t) 1; i >= insertIndex; i--) {
-				entry->list[i + 1] = entry->list[i];
-			}
+	return result;
+}
 
-			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			entry->list[insertIndex] = context->c->stack[context->c->stackPointer - 1];
+int ExternalOpCharacterToByte(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	uint64_t index = context->c->stack[--context->c->stackPointer].i;
+	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
+	STACK_POP_STRING(entryText, entryBytes);
+	returnValue->i = index < entryBytes ? ((uint8_t) entryText[index]) : -1;
+	return EXTCALL_RETURN_UNMANAGED;
+}
 
-			context->c->stackPointer -= 3;
-		} else if (command == T_OP_INSERT_MANY) {
-			if (context->c->stackPointer < 3) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+int ExternalOpStringFromByte(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 1) return -1;
+	int64_t byte = context->c->stack[--context->c->stackPointer].i;
+	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 3].i;
+	if (byte < 0 || byte > 255) {
+		char buffer[64];
+		size_t count = PrintIntegerToBuffer(buffer, sizeof(buffer), byte);
+		PrintError4(context, 0, "The byte %.*s is not in the range (0..255).\n", count, buffer);
+		return 0;
+	}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+	uint8_t single = byte;
+	RETURN_STRING_COPY(&single, 1);
+	return EXTCALL_RETURN_MANAGED;
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+void RandomSeed(uint64_t x) {
+	rngState.s[0] = rngState.s[1] = rngState.s[2] = rngState.s[3] = 0;
 
-			if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			int64_t insertCount = context->c->stack[context->c->stackPointer - 2].i;
-			int64_t newLength = (int64_t) entry->length + insertCount;
+	for (uintptr_t i = 0; i < 4; i++) {
+		x += 0x9E3779B97F4A7C15;
 
-			if (insertCount < 0) {
-				PrintError4(context, instructionPointer - 1, "The number of items to insert is negative (%ld).\n", insertCount);
-				return 0;
-			} else if (newLength < 0 || newLength >= 1000000000) {
-				PrintError4(context, instructionPointer - 1, "The new length of the list (%ld + %ld = %ld) "
-						"is out of the supported range (0..1000000000).\n", (int64_t) entry->length, insertCount, newLength);
-				return 0;
-			}
+		uint64_t result = x;
+		result = (result ^ (result >> 30)) * 0xBF58476D1CE4E5B9;
+		result = (result ^ (result >> 27)) * 0x94D049BB133111EB;
+		rngState.s[i] = result ^ (result >> 31);
+	}
+}
 
-			uint32_t oldLength = context->heap[index].length;
-			entry->length = newLength;
+uint64_t RandomU64() {
+	uint64_t result = rngState.s[1] * 5;
+	result = ((result << 7) | (result >> 57)) * 9;
 
-			if (entry->length > entry->allocated) {
-				// TODO Handling out of memory errors.
-				entry->allocated = entry->allocated ? entry->allocated * 2 : 4;
-				if (entry->length > entry->allocated) entry->allocated = entry->length + 5;
-				entry->list = (Value *) AllocateResize(entry->list, entry->allocated * sizeof(Value));
-				Assert(entry->length <= entry->allocated);
-			}
+	uint64_t t = rngState.s[1] << 17;
+	rngState.s[2] ^= rngState.s[0];
+	rngState.s[3] ^= rngState.s[1];
+	rngState.s[1] ^= rngState.s[2];
+	rngState.s[0] ^= rngState.s[3];
+	rngState.s[2] ^= t;
+	rngState.s[3] = (rngState.s[3] << 45) | (rngState.s[3] >> 19);
 
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			int64_t insertIndex = context->c->stack[context->c->stackPointer - 1].i;
+	return result;
+}
 
-			if (insertIndex < 0 || insertIndex > oldLength) {
-				PrintError4(context, instructionPointer - 1, "Cannot insert at index %ld. The list has length %ld.\n",
-						insertIndex, oldLength);
-				return 0;
-			}
+int ExternalRandomInt(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	int64_t min = context->c->stack[context->c->stackPointer - 1].i;
+	int64_t max = context->c->stack[context->c->stackPointer - 2].i;
+	if (max < min) { PrintError4(context, 0, "RandomInt() called with maximum limit (%ld) less than the minimum limit (%ld).\n", max, min); return 0; }
+	returnValue->i = (int64_t) (RandomU64() % (uint64_t) (max - min + 1)) + min;
+	context->c->stackPointer -= 2;
+	return EXTCALL_RETURN_UNMANAGED;
+}
 
-			for (int64_t i = oldLength - 1; i >= insertIndex; i--) {
-				entry->list[i + insertCount] = entry->list[i];
-			}
+int ExternalSystemGetHeapStatistics(ExecutionContext *context, Value *returnValue) {
+	HeapStatistics statistics;
+	HeapGetStatistics(context, &statistics);
+	size_t fieldCount = sizeof(statistics) / sizeof(int64_t);
+	size_t fieldCountAligned = (fieldCount + 7) & ~7;
+	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
+	context->heap[index].type = T_STRUCT;
+	context->heap[index].fields = (Value *) ((uint8_t *) AllocateResize(NULL, fieldCountAligned + fieldCount * sizeof(Value)) + fieldCountAligned);
+	context->heap[index].fieldCount = fieldCount;
 
-			for (uintptr_t i = 0; i < (uintptr_t) insertCount; i++) {
-				entry->list[i + insertIndex].i = 0;
-			}
+	for (uintptr_t i = 0; i < fieldCount; i++) {
+		context->heap[index].fields[i].i = ((int64_t *) &statistics)[i];
+		((uint8_t *) context->heap[index].fields)[-1 - i] = false;
+	}
 
-			context->c->stackPointer -= 3;
-		} else if (command == T_OP_DELETE || command == T_OP_DELETE_MANY) {
-			int stackIndexList = command == T_OP_DELETE ? 2 : 3;
-			if (context->c->stackPointer < (uintptr_t) stackIndexList) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - stackIndexList]) return -1;
-			uint64_t index = context->c->stack[context->c->stackPointer - stackIndexList].i;
+	returnValue->i = index;
+	return EXTCALL_RETURN_MANAGED;
+}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+int ExternalStringFind(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 4) return -1;
+	STACK_READ_STRING(haystack, haystackBytes, 1);
+	STACK_READ_STRING(needle, needleBytes, 2);
+	if (context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+	if (context->c->stackIsManaged[context->c->stackPointer - 4]) return -1;
+	int64_t startAt = context->c->stack[context->c->stackPointer - 3].i;
+	bool reverse = context->c->stack[context->c->stackPointer - 4].i;
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+	if (!needleBytes) {
+		PrintError4(context, 0, "StringFind() was called with an empty needle.\n");
+		return 0;
+	}
 
-			if (command == T_OP_DELETE_MANY && context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			int64_t deleteCount = command == T_OP_DELETE ? 1 : context->c->stack[context->c->stackPointer - 2].i;
-			int64_t newLength = (int64_t) entry->length - deleteCount;
+	returnValue->i = startAt < 0 || (uint64_t) startAt >= haystackBytes ? -1 
+		: StringFindRaw(haystack, haystackBytes, needle, needleBytes, startAt, reverse);
+	context->c->stackPointer -= 4;
+	return EXTCALL_RETURN_UNMANAGED;
+}
 
-			if (deleteCount < 0) {
-				PrintError4(context, instructionPointer - 1, "The number of items to delete is negative (%ld).\n", deleteCount);
-				return 0;
-			} else if (newLength < 0 || newLength >= 1000000000) {
-				PrintError4(context, instructionPointer - 1, "The new length of the list (%ld - %ld = %ld) "
-						"is out of the supported range (0..1000000000).\n", (int64_t) entry->length, deleteCount, newLength);
-				return 0;
-			}
+#define STRING_SPLIT_DELIMITER (0)
+#define STRING_SPLIT_LINES (1)
+#define STRING_SPLIT_WHITESPACE (2)
 
-			// TODO Maybe shrink the list storage, if it will save a lot of memory.
+typedef struct StringSplitter {
+	const char *text, *delimiter;
+	size_t bytes, delimiterBytes;
+	uintptr_t position;
+	uint8_t mode;
+	bool includeEmptyStrings, done;
+} StringSplitter;
 
-			if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			int64_t deleteIndex = context->c->stack[context->c->stackPointer - 1].i;
+bool StringSplitterNext(StringSplitter *splitter, uintptr_t *start, uintptr_t *end) {
+	const char *text = splitter->text;
 
-			if (deleteIndex < 0 || deleteIndex > newLength) {
-				PrintError4(context, instructionPointer - 1, "Cannot delete %ld items starting at index %ld. The list has length %ld.\n",
-						deleteCount, deleteIndex, (int64_t) entry->length);
-				return 0;
+	while (!splitter->done) {
+		if (splitter->mode == STRING_SPLIT_WHITESPACE) {
+			while (splitter->position < splitter->bytes && (text[splitter->position] == ' ' || text[splitter->position] == '\t' 
+						|| text[splitter->position] == '\r' || text[splitter->position] == '\n' 
+						|| text[splitter->position] == '\v' || text[splitter->position] == '\f')) {
+				splitter->position++;
 			}
 
-			for (int64_t i = deleteIndex; i < newLength; i++) {
-				entry->list[i] = entry->list[i + deleteCount];
+			if (splitter->position == splitter->bytes) break;
+			*start = splitter->position;
+
+			while (splitter->position < splitter->bytes && text[splitter->position] != ' ' && text[splitter->position] != '\t' 
+						&& text[splitter->position] != '\r' && text[splitter->position] != '\n' 
+						&& text[splitter->position] != '\v' && text[splitter->position] != '\f') {
+				splitter->position++;
 			}
 
-			entry->length = newLength;
-			context->c->stackPointer -= command == T_OP_DELETE ? 2 : 3;
-		} else if (command == T_OP_DELETE_ALL) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+			*end = splitter->position;
+			return true;
+		}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+		if (splitter->mode == STRING_SPLIT_LINES && splitter->position == splitter->bytes) {
+			// A line terminator at the end of the string does not start another line.
+			break;
+		}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The object is null.\n");
-				return 0;
-			}
+		// Single byte delimiters (including newlines) are found by memchr in StringFindRaw.
+		const char *delimiter = splitter->mode == STRING_SPLIT_LINES ? "\n" : splitter->delimiter;
+		size_t delimiterBytes = splitter->mode == STRING_SPLIT_LINES ? 1 : splitter->delimiterBytes;
+		intptr_t found = StringFindRaw(text, splitter->bytes, delimiter, delimiterBytes, splitter->position, false);
+		*start = splitter->position;
+		*end = found == -1 ? splitter->bytes : (uintptr_t) found;
+		splitter->position = found == -1 ? splitter->bytes : found + delimiterBytes;
+		if (found == -1 && splitter->mode == STRING_SPLIT_DELIMITER) splitter->done = true;
+		if (splitter->mode == STRING_SPLIT_LINES && *end > *start && text[*end - 1] == '\r') (*end)--;
+		if (*end > *start || splitter->includeEmptyStrings) return true;
+	}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
+	splitter->done = true;
+	return false;
+}
 
-			if (entry->type == T_LIST) {
-				context->heap[index].length = context->heap[index].allocated = 0;
-				context->heap[index].list = (Value *) AllocateResize(context->heap[index].list, 0);
-			} else if (entry->type == T_MAP_INT || entry->type == T_MAP_STR) {
-				context->heap[index].mapLength = 0;
-				context->heap[index].mapEntries = (MapEntry *) AllocateResize(context->heap[index].mapEntries, 0);
-			} else {
-				return -1;
-			}
+int ExternalStringSplitInternal(ExecutionContext *context, Value *returnValue, StringSplitter *splitter, uintptr_t stringIndex, uintptr_t argumentCount) {
+	// Count the pieces first, so that the list can be allocated at the right size.
+	StringSplitter counter = *splitter;
+	uintptr_t start, end, count = 0;
+	while (StringSplitterNext(&counter, &start, &end)) count++;
 
-			context->c->stackPointer--;
-		} else if (command == T_OP_DELETE_LAST) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
+	if (count > 1000000000) {
+		PrintError4(context, 0, "The string splits into more pieces than a list can hold.\n");
+		return 0;
+	}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
+	uintptr_t index = HeapAllocate(context);
+	HeapEntry *list = &context->heap[index];
+	list->type = T_LIST;
+	list->internalValuesAreManaged = true;
+	list->length = 0;
+	list->allocated = count;
+	list->list = (Value *) AllocateResize(NULL, count * sizeof(Value));
+	list->externalReferenceCount++; // Keep the list alive while the pieces are allocated.
+
+	while (StringSplitterNext(splitter, &start, &end)) {
+		Value piece;
+		piece.i = HeapCreateSlice(context, stringIndex, start, end);
+		list = &context->heap[index];
+		list->list[list->length++] = piece;
+	}
+
+	Assert(list->length == count);
+	list->externalReferenceCount--;
+	context->c->stackPointer -= argumentCount; // Don't pop the string until the pieces have been allocated!
+	returnValue->i = index;
+	return EXTCALL_RETURN_MANAGED;
+}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+int ExternalStringSplit(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 3) return -1;
+	STACK_READ_STRING(string, bytes, 1);
+	STACK_READ_STRING(delimiter, delimiterBytes, 2);
+	if (context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
+	if (!delimiterBytes) {
+		PrintError4(context, 0, "StringSplit() was called with an empty delimiter.\n");
+		return 0;
+	}
 
-			context->heap[index].length--;
-			context->c->stackPointer--;
-		} else if (command == T_OP_FIND_AND_DELETE || command == T_OP_FIND
-				|| command == T_OP_FIND_AND_DEL_STR || command == T_OP_FIND_STR) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	StringSplitter splitter = { .text = string, .bytes = bytes, .delimiter = delimiter, .delimiterBytes = delimiterBytes, 
+		.mode = STRING_SPLIT_DELIMITER, .includeEmptyStrings = context->c->stack[context->c->stackPointer - 3].i };
+	return ExternalStringSplitInternal(context, returnValue, &splitter, _index1, 3);
+}
 
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i;
+int ExternalStringSplitLines(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	STACK_READ_STRING(string, bytes, 1);
+	if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	StringSplitter splitter = { .text = string, .bytes = bytes, .mode = STRING_SPLIT_LINES, 
+		.includeEmptyStrings = context->c->stack[context->c->stackPointer - 2].i };
+	return ExternalStringSplitInternal(context, returnValue, &splitter, _index1, 2);
+}
 
-			if (!index) {
-				PrintError4(context, instructionPointer - 1, "The list is null.\n");
-				return 0;
-			}
+int ExternalStringSplitWhitespace(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 1) return -1;
+	STACK_READ_STRING(string, bytes, 1);
+	StringSplitter splitter = { .text = string, .bytes = bytes, .mode = STRING_SPLIT_WHITESPACE };
+	return ExternalStringSplitInternal(context, returnValue, &splitter, _index1, 1);
+}
 
-			if (context->heapEntriesAllocated <= index) return -1;
-			HeapEntry *entry = &context->heap[index];
-			if (entry->type != T_LIST) return -1;
-			if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			if ((command == T_OP_FIND_STR || command == T_OP_FIND_AND_DEL_STR) && !entry->internalValuesAreManaged) return -1;
-			context->c->stack[context->c->stackPointer - 2].i = command == T_OP_FIND || command == T_OP_FIND_STR ? -1 : 0;
+int ExternalSystemGetMicroseconds(ExecutionContext *context, Value *returnValue) {
+	(void) context;
+	returnValue->i = TimeGetMicroseconds();
+	return EXTCALL_RETURN_UNMANAGED;
+}
 
-			for (uintptr_t i = 0; i < entry->length; i++) {
-				if (command == T_OP_FIND_STR || command == T_OP_FIND_AND_DEL_STR) {
-					const char *text1, *text2;
-					size_t bytes1, bytes2;
-					ScriptHeapEntryToString(context, &context->heap[entry->list[i].i], &text1, &bytes1);
-					ScriptHeapEntryToString(context, &context->heap[context->c->stack[context->c->stackPointer - 1].i], &text2, &bytes2);
-					bool equal = bytes1 == bytes2 && 0 == MemoryCompare(text1, text2, bytes1);
-					if (!equal) continue;
-				} else {
-					bool equal = entry->list[i].i == context->c->stack[context->c->stackPointer - 1].i;
-					if (!equal) continue;
-				}
-					
-				if (command == T_OP_FIND || command == T_OP_FIND_STR) {
-					context->c->stack[context->c->stackPointer - 2].i = i;
-				} else {
-					context->c->stack[context->c->stackPointer - 2].i = 1;
-					entry->length--;
+intptr_t StringFindRaw(const char *haystack, size_t haystackBytes, const char *needle, size_t needleBytes, uintptr_t startAt, bool reverse) {
+	// Returns the index of the first match starting at or after startAt, 
+	// or the last match starting at or before startAt if reverse is set.
+	// Candidate positions are found by looking for the first byte of the needle (using memchr, which is vectorized),
+	// and then filtered by checking the last byte before comparing the whole needle.
 
-					for (uintptr_t j = i; j < entry->length; j++) {
-						entry->list[j] = entry->list[j + 1];
-					}
-				}
+	if (!needleBytes || needleBytes > haystackBytes) return -1;
+	uintptr_t lastStart = haystackBytes - needleBytes;
+	char firstByte = needle[0], lastByte = needle[needleBytes - 1];
 
-				break;
+	if (reverse) {
+		for (intptr_t i = startAt < lastStart ? startAt : lastStart; i >= 0; i--) {
+			if (haystack[i] == firstByte && haystack[i + needleBytes - 1] == lastByte 
+					&& 0 == MemoryCompare(haystack + i, needle, needleBytes)) {
+				return i;
 			}
+		}
+	} else {
+		uintptr_t position = startAt;
 
-			context->c->stackIsManaged[context->c->stackPointer - 2] = false;
-			context->c->stackPointer--;
-#define HANDLE_MAP_BYTECODES(keyType, keyPrep, keyCompare) \
-		} else if (command == T_OP_DELETE_MAP_##keyType || command == T_OP_HAS_##keyType || command == T_EQUALS_MAP_##keyType \
-				|| command == T_INDEX_MAP_##keyType || command == T_OP_GET_##keyType) { \
-			if (context->c->stackPointer < (command == T_EQUALS_MAP_##keyType ? 3 : 2)) return -1; \
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1; \
-			uint64_t index = context->c->stack[context->c->stackPointer - 2].i; \
-			\
-			if (!index) { \
-				PrintError4(context, instructionPointer - 1, "The map is null.\n"); \
-				return 0; \
-			} \
-			\
-			if (context->heapEntriesAllocated <= index) return -1; \
-			HeapEntry *entry = &context->heap[index]; \
-			if (entry->type != T_MAP_##keyType) return -1; \
-			\
-			Value key = context->c->stack[context->c->stackPointer - 1]; \
-			Value value = { 0 }; \
-			uintptr_t resultIndex = 0; \
-			bool found = false; \
-			keyPrep; \
-			\
-			if (entry->mapLength) { \
-				intptr_t low = 0; \
-				intptr_t high = entry->mapLength - 1; \
-				\
-				while (low <= high) { \
-					uintptr_t average = ((high - low) >> 1) + low; \
-					keyCompare; \
-					\
-					if (lt) { \
-						high = average - 1; \
-					} else if (gt) { \
-						low = average + 1; \
-					} else { \
-						if (command == T_OP_DELETE_MAP_##keyType) { \
-							entry->mapLength--; \
-							\
-							for (uintptr_t i = average; i < entry->mapLength; i++) { \
-								entry->mapEntries[i] = entry->mapEntries[i + 1]; \
-							} \
-						} else { \
-							value = entry->mapEntries[average].value; \
-						} \
-						\
-						found = true; \
-						resultIndex = average; \
-						break; \
-					} \
-				} \
-				\
-				if (high < low) { \
-					Assert(!found); \
-					resultIndex = low; \
-				} \
-			} \
-			\
-			if (command == T_INDEX_MAP_##keyType) { \
-				context->c->stackIsManaged[context->c->stackPointer - 2] = entry->internalValuesAreManaged; \
-				context->c->stack[context->c->stackPointer - 2] = value; \
-			} else if (command == T_OP_GET_##keyType) { \
-				/* TODO handle memory allocation failures here */ \
-				/* TODO allocate a message string; be careful with GC */ \
-				bool internalValuesAreManaged = entry->internalValuesAreManaged; \
-				uintptr_t index = HeapAllocate(context); \
-				context->heap[index].type = T_ERR; \
-				context->heap[index].success = found; \
-				context->heap[index].internalValuesAreManaged = internalValuesAreManaged || !found; \
-				if (found) context->heap[index].errorValue = value; \
-				else context->heap[index].errorValue.i = 0; \
-				context->c->stackIsManaged[context->c->stackPointer - 2] = true; \
-				context->c->stack[context->c->stackPointer - 2].i = index; \
-			} else if (command == T_EQUALS_MAP_##keyType) { \
-				if (!found) { \
-					if (!entry->mapLength) { \
-						entry->mapLength = 1; \
-						entry->mapEntries = (MapEntry *) AllocateResize(NULL, sizeof(MapEntry)); \
-					} else { \
-						entry->mapLength++; \
-						entry->mapEntries = (MapEntry *) AllocateResize(entry->mapEntries, sizeof(MapEntry) * entry->mapLength); \
-						\
-						for (uintptr_t i = entry->mapLength - 1; i > resultIndex; i--) { \
-							entry->mapEntries[i] = entry->mapEntries[i - 1]; \
-						} \
-					} \
-				} \
-				\
-				if (entry->internalValuesAreManaged != context->c->stackIsManaged[context->c->stackPointer - 3]) return -1; \
-				entry->mapEntries[resultIndex].key = key; \
-				entry->mapEntries[resultIndex].value = context->c->stack[context->c->stackPointer - 3]; \
-				context->c->stackPointer -= 2; \
-			} else { \
-				context->c->stackIsManaged[context->c->stackPointer - 2] = false; \
-				context->c->stack[context->c->stackPointer - 2].i = found ? 1 : 0; \
-			} \
-			\
-			context->c->stackPointer -= 1
-			HANDLE_MAP_BYTECODES(INT, if (context->c->stackIsManaged[context->c->stackPointer - 1]) return -1, bool lt = entry->mapEntries[average].key.i < key.i; bool gt = entry->mapEntries[average].key.i > key.i);
-			HANDLE_MAP_BYTECODES(STR, STACK_READ_STRING(keyText, keyBytes, 1), const char *entryKeyText; size_t entryKeyBytes; ScriptHeapEntryToString(context, &context->heap[entry->mapEntries[average].key.i], &entryKeyText, &entryKeyBytes); int comparisonResult = StringCompareRaw(keyText, keyBytes, entryKeyText, entryKeyBytes); bool lt = comparisonResult < 0; bool gt = comparisonResult > 0);
-		} else if (command == T_OP_SLICE || command == T_OP_BYTE || command == T_OP_STR) {
-			Value returnValue;
-			int result = (command == T_OP_SLICE ? ExternalOpStringSlice 
-					: command == T_OP_BYTE ? ExternalOpCharacterToByte : ExternalOpStringFromByte)(context, &returnValue);
-			if (result <= 0) return result;
-			if (!ScriptReturnErrors(context, result, returnValue)) return -1;
-		} else if (command == T_OP_DISCARD || command == T_OP_ASSERT) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			int64_t id = context->c->stack[context->c->stackPointer - 1].i;
-			uintptr_t index = HeapAllocate(context);
-			context->heap[index].type = command;
-			context->heap[index].lambdaID = id;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = true;
-			context->c->stack[context->c->stackPointer - 1].i = index;
-		} else if (command == T_OP_CURRY) {
-			if (context->c->stackPointer < 2) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
-			bool valueIsManaged = context->c->stackIsManaged[context->c->stackPointer - 1];
-			Value value = context->c->stack[context->c->stackPointer - 1];
-			int64_t id = context->c->stack[context->c->stackPointer - 2].i;
-			uintptr_t index = HeapAllocate(context);
-			context->heap[index].type = command;
-			context->heap[index].lambdaID = id;
-			context->heap[index].curryValue = value;
-			context->heap[index].internalValuesAreManaged = valueIsManaged;
-			context->c->stackIsManaged[context->c->stackPointer - 2] = true;
-			context->c->stack[context->c->stackPointer - 2].i = index;
-			context->c->stackPointer--;
-		} else if (command == T_OP_ASYNC) {
-			if (context->c->stackPointer < 1) return -1;
-			if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-			CoroutineState *c = (CoroutineState *) AllocateResize(NULL, sizeof(CoroutineState)); // TODO Handle allocation failure.
-			CoroutineState empty = { 0 };
-			*c = empty;
-			c->id = ++context->lastCoroutineID;
-			c->startedByAsync = true;
-			c->stackEntriesAllocated = sizeof(context->c->stack) / sizeof(context->c->stack[0]);
-			c->stackPointer = 2;
-			c->stack[0].i = -1; // Indicates to T_AWAIT to remove the coroutine.
-			c->stackIsManaged[0] = false;
-			c->stack[1] = context->c->stack[context->c->stackPointer - 1];
-			c->stackIsManaged[1] = true;
-			c->nextCoroutine = context->allCoroutines;
-			if (c->nextCoroutine) c->nextCoroutine->previousCoroutineLink = &c->nextCoroutine;
-			c->previousCoroutineLink = &context->allCoroutines;
-			context->allCoroutines = c;
-			c->nextUnblockedCoroutine = context->unblockedCoroutines;
-			if (c->nextUnblockedCoroutine) c->nextUnblockedCoroutine->previousUnblockedCoroutineLink = &c->nextUnblockedCoroutine;
-			c->previousUnblockedCoroutineLink = &context->unblockedCoroutines;
-			context->unblockedCoroutines = c;
-			context->c->stackIsManaged[context->c->stackPointer - 1] = false;
-			context->c->stack[context->c->stackPointer - 1].i = c->id;
-		} else if (command == T_AWAIT) {
-			awaitCommand:;
-			if (context->c->stackPointer < 1 && !context->c->externalCoroutine) return -1;
+		while (position <= lastStart) {
+			const char *candidate = (const char *) MemoryFindByte(haystack + position, firstByte, lastStart - position + 1);
+			if (!candidate) break;
+			uintptr_t i = candidate - haystack;
+
+			if (haystack[i + needleBytes - 1] == lastByte && 0 == MemoryCompare(candidate, needle, needleBytes)) {
+				return i;
+			}
+
+			position = i + 1;
+		}
+	}
 
-			// PrintDebug("== AWAIT from %ld\n", context->c->id);
-			Assert(!context->c->nextUnblockedCoroutine && !context->c->previousUnblockedCoroutineLink);
-			bool unblockImmediately = false;
+	return -1;
+}
 
-			if (context->c->externalCoroutine) {
-				// PrintDebug("== external coroutine\n");
-				context->c->unblockedBy = -1;
-				context->c->awaiting = true;
-				context->c->instructionPointer = instructionPointer;
-				context->c->variableBase = variableBase;
-				context->c->waitingOnCount = 0;
-			} else if (context->c->stack[context->c->stackPointer - 1].i == -1) {
-				if (context->c->stackPointer != 1) return -1;
-				// The coroutine has finished. Remove it from the list of all coroutines.
-				*context->c->previousCoroutineLink = context->c->nextCoroutine;
-				if (context->c->nextCoroutine) context->c->nextCoroutine->previousCoroutineLink = context->c->previousCoroutineLink;
+// Exactly representable powers of ten, used by the fast paths for converting between floats and decimal strings.
+const double powersOfTen[] = { 
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-				// PrintDebug("== finished\n");
+const char decimalDigitPairs[] = 
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869"
+	"7071727374757677787980818283848586878889909192939495969798990";
 
-				for (uintptr_t i = 0; i < context->c->waiterCount; i++) {
-					CoroutineState *c = context->c->waiters[i];
-					if (!c) continue;
-					Assert(!c->nextUnblockedCoroutine && !c->previousUnblockedCoroutineLink);
-					c->unblockedBy = context->c->id;
-					c->nextUnblockedCoroutine = context->unblockedCoroutines;
-					if (c->nextUnblockedCoroutine) c->nextUnblockedCoroutine->previousUnblockedCoroutineLink = &c->nextUnblockedCoroutine;
-					c->previousUnblockedCoroutineLink = &context->unblockedCoroutines;
-					context->unblockedCoroutines = c;
+size_t PrintUnsignedToBuffer(char *buffer, uint64_t value) {
+	// Write two digits at a time into a temporary buffer from the end, then copy them out.
+	char temporary[20];
+	uintptr_t position = sizeof(temporary);
 
-					for (uintptr_t j = 0; j < c->waitingOnCount; j++) {
-						Assert(*(c->waitingOn[j]) == c);
-						*(c->waitingOn[j]) = NULL;
-					}
+	while (value >= 100) {
+		uintptr_t pair = (value % 100) * 2;
+		value /= 100;
+		temporary[--position] = decimalDigitPairs[pair + 1];
+		temporary[--position] = decimalDigitPairs[pair + 0];
+	}
 
-					c->waitingOnCount = 0;
-					// PrintDebug("== unblocked %ld\n", c->id);
-				}
+	if (value >= 10) {
+		temporary[--position] = decimalDigitPairs[value * 2 + 1];
+		temporary[--position] = decimalDigitPairs[value * 2 + 0];
+	} else {
+		temporary[--position] = '0' + value;
+	}
 
-				ScriptFreeCoroutine(context->c);
-			} else {
-				if (!context->c->stackIsManaged[context->c->stackPointer - 1]) return -1;
-				// The coroutine is waiting.
-				context->c->unblockedBy = -1;
-				context->c->awaiting = true;
-				context->c->instructionPointer = instructionPointer;
-				context->c->variableBase = variableBase;
-				uint64_t index = context->c->stack[context->c->stackPointer - 1].i;
-				if (context->heapEntriesAllocated <= index) return -1;
-				HeapEntry *entry = &context->heap[index];
-				if (entry->internalValuesAreManaged || entry->type != T_LIST) return -1;
-				
-				context->c->waitingOn = (CoroutineState ***) AllocateResize(context->c->waitingOn, sizeof(CoroutineState **) * entry->length);
-				Assert(context->c->waitingOnCount == 0);
+	MemoryCopy(buffer, temporary + position, sizeof(temporary) - position);
+	return sizeof(temporary) - position;
+}
 
-				intptr_t alreadyFinished = -1;
+size_t PrintIntegerToBuffer(char *buffer, size_t bufferBytes, int64_t i) {
+	Assert(bufferBytes >= 21);
+	(void) bufferBytes;
 
-				for (uintptr_t i = 0; i < entry->length; i++) {
-					CoroutineState *c = context->allCoroutines;
-					bool found = false;
+	if (i < 0) {
+		buffer[0] = '-';
+		return 1 + PrintUnsignedToBuffer(buffer + 1, -(uint64_t) i);
+	} else {
+		return PrintUnsignedToBuffer(buffer, i);
+	}
+}
 
-					while (c) {
-						if (c->id == (uint64_t) entry->list[i].i) { found = true; break; }
-						c = c->nextCoroutine;
-					}
+size_t PrintFloatToBuffer(char *buffer, size_t bufferBytes, double f) {
+	// Prints the shortest decimal string that parses back to the same float.
+	// The fast path looks for the fewest fractional digits k such that round(f * 10^k) / 10^k == f. 
+	// When the scaled value fits in 53 bits and k <= 22, that division is correctly rounded, 
+	// and so it gives the same result as parsing the decimal string would.
+	// Other values fall back to snprintf, which prints them in exponential notation if needed.
+
+	Assert(bufferBytes >= 30);
+	double magnitude = f < 0 ? -f : f;
+	size_t bytes = 0;
+
+	if (f != f) {
+		MemoryCopy(buffer, "nan", 3);
+		return 3;
+	} else if (magnitude == 0) {
+		if (1 / f < 0) buffer[bytes++] = '-';
+		MemoryCopy(buffer + bytes, "0.0", 3);
+		return bytes + 3;
+	} else if (magnitude >= 1e-5 && magnitude < 9007199254740992.0) {
+		for (uintptr_t k = 0; k < sizeof(powersOfTen) / sizeof(powersOfTen[0]); k++) {
+			double scaled = magnitude * powersOfTen[k];
+			if (scaled >= 9007199254740992.0) break;
+			uint64_t candidate = (uint64_t) (scaled + 0.5);
+
+			for (uintptr_t j = 0; j < 3; j++) {
+				uint64_t test = candidate + j - 1;
+				if ((double) test / powersOfTen[k] != magnitude) continue;
+
+				char digits[24];
+				size_t digitCount = PrintUnsignedToBuffer(digits, test);
+				if (f < 0) buffer[bytes++] = '-';
+
+				if (digitCount <= k) {
+					buffer[bytes++] = '0';
+					buffer[bytes++] = '.';
+					for (uintptr_t i = digitCount; i < k; i++) buffer[bytes++] = '0';
+					MemoryCopy(buffer + bytes, digits, digitCount);
+					bytes += digitCount;
+				} else {
+					MemoryCopy(buffer + bytes, digits, digitCount - k);
+					bytes += digitCount - k;
+					buffer[bytes++] = '.';
 
-					if (!found) {
-						alreadyFinished = entry->list[i].i;
-						break;
+					if (k) {
+						MemoryCopy(buffer + bytes, digits + digitCount - k, k);
+						bytes += k;
+					} else {
+						buffer[bytes++] = '0';
 					}
 				}
 
-				if (alreadyFinished != -1 || !entry->length) {
-					// PrintDebug("== immediately unblocking\n");
-					context->c->unblockedBy = alreadyFinished;
-					unblockImmediately = true;
-				} else {
-					CoroutineState *c = context->allCoroutines;
+				return bytes;
+			}
+		}
+	}
 
-					while (c) {
-						for (uintptr_t i = 0; i < entry->length; i++) {
-							if (c->id == (uint64_t) entry->list[i].i) {
-								if (c->waiterCount == c->waitersAllocated) {
-									c->waitersAllocated = c->waitersAllocated ? c->waitersAllocated * 2 : 4;
-									c->waiters = (CoroutineState **) AllocateResize(c->waiters, sizeof(CoroutineState *) * c->waitersAllocated);
-								}
+	// If a precision round-trips then so does every larger precision, so we can binary search for the smallest.
+	int low = 1, high = 17;
 
-								c->waiters[c->waiterCount] = context->c;
-								context->c->waitingOn[context->c->waitingOnCount++] = &c->waiters[c->waiterCount];
-								c->waiterCount++;
-								break;
-							}
-						}
+	while (low < high) {
+		int middle = (low + high) / 2;
+		PrintFloatToBufferWithPrecision(buffer, bufferBytes, f, middle);
+		if (StringToDouble(buffer) == f) high = middle;
+		else low = middle + 1;
+	}
 
-						c = c->nextCoroutine;
-					}
+	bytes = PrintFloatToBufferWithPrecision(buffer, bufferBytes, f, low);
 
-					// PrintDebug("== waiting on %d...\n", context->c->waitingOnCount);
-					Assert(context->c->waitingOnCount);
-				}
-			}
+	for (uintptr_t i = 0; i < bytes; i++) {
+		if (buffer[i] == '.' || buffer[i] == 'e' || buffer[i] == 'n') {
+			return bytes;
+		}
+	}
 
-			CoroutineState *next = unblockImmediately ? context->c : context->unblockedCoroutines;
+	// Make sure that integral values still look like floats.
+	buffer[bytes++] = '.';
+	buffer[bytes++] = '0';
+	return bytes;
+}
 
-			if (!next) {
-				if (context->externalCoroutineCount) {
-					// PrintDebug("== wait for an external coroutine\n");
-					next = ExternalCoroutineWaitAny(context);
-					Assert(next->externalCoroutine);
-					unblockImmediately = true;
-				} else {
-					// TODO Earlier deadlock detection.
-					PrintError4(context, instructionPointer - 1, "No tasks can run if this task (ID %ld) starts waiting.\n", context->c->id);
-					PrintDebug("All tasks:\n");
-					CoroutineState *c = context->allCoroutines;
+const char *StringParseIntegerRaw(const char *text, size_t bytes, int64_t *output) {
+	// Accepts an optional sign, then decimal digits, or hexadecimal/binary digits after a 0x/0b prefix.
+	// Underscores are ignored, as they are in numeric literals.
+	// As with literals, hexadecimal and binary numbers can use all 64 bits.
 
-					while (c) {
-						PrintDebug("\t%ld blocks ", c->id);
-						bool first = true;
+	uintptr_t position = 0;
+	bool negate = false;
 
-						for (uintptr_t i = 0; i < c->waiterCount; i++) {
-							if (!c->waiters[i]) continue;
-							PrintDebug("%s%ld", first ? "" : ", ", c->waiters[i]->id);
-							first = false;
-						}
+	if (position < bytes && (text[position] == '-' || text[position] == '+')) {
+		negate = text[position++] == '-';
+	}
 
-						PrintDebug("\n");
-						PrintBackTrace(context, c->instructionPointer - 1, c, "\t");
-						c = c->nextCoroutine;
-					}
+	uint64_t base = 10;
 
-					return 0;
-				}
-			}
+	if (position + 1 < bytes && text[position] == '0' && (text[position + 1] == 'x' || text[position + 1] == 'X')) {
+		base = 16, position += 2;
+	} else if (position + 1 < bytes && text[position] == '0' && (text[position + 1] == 'b' || text[position + 1] == 'B')) {
+		base = 2, position += 2;
+	}
 
-			if (!unblockImmediately) {
-				Assert(next->previousUnblockedCoroutineLink);
-				*next->previousUnblockedCoroutineLink = next->nextUnblockedCoroutine;
-				if (next->nextUnblockedCoroutine) next->nextUnblockedCoroutine->previousUnblockedCoroutineLink = next->previousUnblockedCoroutineLink;
-			}
+	uint64_t limit = base != 10 ? UINT64_MAX : negate ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+	uint64_t value = 0;
+	bool anyDigits = false;
 
-			next->nextUnblockedCoroutine = NULL;
-			next->previousUnblockedCoroutineLink = NULL;
-			context->c = next;
-			// PrintDebug("== switch to %ld\n", next->id);
+	for (; position < bytes; position++) {
+		char c = text[position];
+		uint64_t digit;
 
-			if (context->c->awaiting) {
-				if (!context->c->externalCoroutine) {
-					context->c->stackIsManaged[context->c->stackPointer - 1] = false;
-					context->c->stack[context->c->stackPointer - 1].i = context->c->unblockedBy;
-				}
+		if (c == '_') continue;
+		else if (c >= '0' && c <= '9') digit = c - '0';
+		else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+		else return "INVALID_FORMAT";
 
-				instructionPointer = context->c->instructionPointer;
-				variableBase = context->c->variableBase;
-				// PrintDebug("== unblocked by %ld\n", context->c->unblockedBy);
+		if (digit >= base) return "INVALID_FORMAT";
+		if (value > (limit - digit) / base) return "OVERFLOW";
+		value = value * base + digit;
+		anyDigits = true;
+	}
+
+	if (!anyDigits) return "INVALID_FORMAT";
+	*output = negate ? -value : value;
+	return NULL;
+}
+
+const char *StringParseFloatRaw(const char *text, size_t bytes, double *output) {
+	// Accepts an optional sign, digits with an optional decimal point, and an optional exponent.
+	// Underscores are ignored. If the significant digits fit in 53 bits and the exponent is small,
+	// then the result is computed exactly with a single multiplication or division (Clinger's fast path).
+	// Otherwise, the significant digits and the adjusted exponent are passed to strtod.
+
+	uintptr_t position = 0;
+	bool negate = false, anyDigits = false, dot = false, truncated = false;
+	uint64_t mantissa = 0;
+	int64_t exponent = 0;
+	char digits[400];
+	size_t digitCount = 0;
+
+	if (position < bytes && (text[position] == '-' || text[position] == '+')) {
+		negate = text[position++] == '-';
+	}
+
+	for (; position < bytes; position++) {
+		char c = text[position];
+
+		if (c == '_') {
+			continue;
+		} else if (c == '.') {
+			if (dot) return "INVALID_FORMAT";
+			dot = true;
+		} else if (c >= '0' && c <= '9') {
+			anyDigits = true;
+
+			if (!digitCount && c == '0') {
+				// Leading zeroes are not significant.
+				if (dot) exponent--;
+			} else if (digitCount < sizeof(digits) - 32) {
+				if (digitCount < 19) mantissa = mantissa * 10 + (c - '0');
+				digits[digitCount++] = c;
+				if (dot) exponent--;
 			} else {
-				// PrintDebug("== just started\n");
-				// There is a T_AWAIT command at address 1. It'll be executed when the coroutine finishes.
-				// The creator should have pushed a -1 at the very start of the stack, which indicates
-				// to us that the coroutine has finished.
-				instructionPointer = 1; 
-				goto callCommand;
+				// Digits this far beyond the first can only affect the result through rounding ties.
+				if (c != '0') truncated = true;
+				if (!dot) exponent++;
 			}
-		} else if (command == T_REPL_RESULT) {
-			if (context->c->stackPointer < 1) return -1;
-			ExternalPassREPLResult(context, context->c->stack[--context->c->stackPointer]);
-		} else if (command == T_END_FUNCTION || command == T_EXTCALL || command == T_LIBCALL) {
-			if (command == T_EXTCALL) {
-				uint16_t index = functionData[instructionPointer + 0] + (functionData[instructionPointer + 1] << 8); 
-				instructionPointer += 2;
+		} else if (c == 'e' || c == 'E') {
+			break;
+		} else {
+			return "INVALID_FORMAT";
+		}
+	}
 
-				if (index < sizeof(externalFunctions) / sizeof(externalFunctions[0])) {
-					Value returnValue;
-					int result = externalFunctions[index].callback(context, &returnValue);
-					if (result <= 0) return result;
+	if (!anyDigits) return "INVALID_FORMAT";
 
-					if (result == EXTCALL_START_COROUTINE) {
-						context->externalCoroutineCount++;
-						context->c->externalCoroutine = true;
-						instructionPointer -= 3;
-						// PrintDebug("start external coroutine %ld\n", context->c->id);
-						goto awaitCommand;
-					} else if (context->c->externalCoroutine) {
-						context->externalCoroutineCount--;
-						context->c->externalCoroutine = false;
-						// PrintDebug("end external coroutine %ld\n", context->c->id);
-					}
+	if (position < bytes) {
+		position++;
+		bool negateExponent = false, anyExponentDigits = false;
+		int64_t explicitExponent = 0;
 
-					if (!ScriptReturnErrors(context, result, returnValue)) return -1;
-				} else {
-					return -1;
-				}
-			} else if (command == T_LIBCALL) {
-				context->c->parameterCount = 0;
-				context->c->returnValueType = EXTCALL_NO_RETURN;
+		if (position < bytes && (text[position] == '-' || text[position] == '+')) {
+			negateExponent = text[position++] == '-';
+		}
 
-				void *address;
-				MemoryCopy(&address, &functionData[instructionPointer], sizeof(address));
-				instructionPointer += sizeof(address);
+		for (; position < bytes; position++) {
+			char c = text[position];
+			if (c == '_') continue;
+			if (c < '0' || c > '9') return "INVALID_FORMAT";
+			if (explicitExponent < 100000) explicitExponent = explicitExponent * 10 + (c - '0');
+			anyExponentDigits = true;
+		}
 
-				if (!((bool (*)(void *)) address)(context)) {
-					return 0;
-				}
+		if (!anyExponentDigits) return "INVALID_FORMAT";
+		exponent += negateExponent ? -explicitExponent : explicitExponent;
+	}
 
-				context->c->stackPointer -= context->c->parameterCount;
-				if (!ScriptReturnErrors(context, context->c->returnValueType, context->c->returnValue)) return -1;
-			}
+	double result;
 
-			context->c->localVariableCount = variableBase + 1;
+	if (!digitCount) {
+		result = 0;
+	} else if (digitCount <= 19 && mantissa < ((uint64_t) 1 << 53) && exponent >= -22 && exponent <= 22) {
+		result = exponent < 0 ? (double) mantissa / powersOfTen[-exponent] : (double) mantissa * powersOfTen[exponent];
+	} else {
+		if (truncated) digits[digitCount++] = '1', exponent--; // Make sure ties are broken correctly.
+		digits[digitCount++] = 'e';
+		digitCount += PrintIntegerToBuffer(digits + digitCount, 21, exponent);
+		digits[digitCount] = 0;
+		result = StringToDouble(digits);
+	}
+
+	if (result - result != 0) return "OVERFLOW";
+	*output = negate ? -result : result;
+	return NULL;
+}
+
+int ExternalStringParseInteger(ExecutionContext *context, Value *returnValue) {
+	STACK_POP_STRING(text, bytes);
+	const char *error = StringParseIntegerRaw(text, bytes, &returnValue->i);
+	if (!error) return EXTCALL_RETURN_ERR_UNMANAGED;
+	RETURN_STRING_COPY(error, StringLength(error));
+	return EXTCALL_RETURN_ERR_ERROR;
+}
+
+int ExternalStringParseFloat(ExecutionContext *context, Value *returnValue) {
+	STACK_POP_STRING(text, bytes);
+	const char *error = StringParseFloatRaw(text, bytes, &returnValue->f);
+	if (!error) return EXTCALL_RETURN_ERR_UNMANAGED;
+	RETURN_STRING_COPY(error, StringLength(error));
+	return EXTCALL_RETURN_ERR_ERROR;
+}
+
+int StringCompareRaw(const char *s1, size_t length1, const char *s2, size_t length2) {
+	// The bytes are compared unsigned, so the order does not depend on whether char is signed on the platform.
+	// For UTF-8, this is the order of the code points.
+	if (s1 == s2 && length1 == length2) return 0;
+
+	while (length1 || length2) {
+		if (!length1) return -1;
+		if (!length2) return 1;
+
+		uint8_t c1 = *s1;
+		uint8_t c2 = *s2;
+
+		if (c1 != c2) {
+			return (int) c1 - (int) c2;
+		}
+
+		length1--;
+		length2--;
+		s1++;
+		s2++;
+	}
+
+	return 0;
+}
+
+uint64_t ReadLittleEndian64(const uint8_t *p) {
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+		| ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+uint32_t ReadLittleEndian32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void WriteLittleEndian64(uint8_t *p, uint64_t x) {
+	p[0] = x, p[1] = x >> 8, p[2] = x >> 16, p[3] = x >> 24, p[4] = x >> 32, p[5] = x >> 40, p[6] = x >> 48, p[7] = x >> 56;
+}
+
+// --------------------------------- Hashing.
+
+// The CRCs use the reflected polynomials from zlib (CRC-32) and xz (CRC-64), so their results can be compared with cksum-like tools.
+// Tables are for slicing-by-8; long inputs are first folded 64 bytes at a time with carry-less multiplication if the platform supports it.
+
+#define HASH_CRC32 (0)
+#define HASH_CRC64 (1)
+#define HASH_FNV1A (2)
+#define HASH_XXHASH64 (3)
+
+#define HASH_CRC32_POLYNOMIAL (0xEDB88320)
+#define HASH_CRC64_POLYNOMIAL (0xC96C5795D7870F42)
+#define HASH_CRC_FOLD_MINIMUM_BYTES (256)
 
-			if (context->c->backTracePointer) {
-				BackTraceItem *item = &context->c->backTrace[context->c->backTracePointer - 1];
+#define XXHASH64_PRIME_1 (0x9E3779B185EBCA87)
+#define XXHASH64_PRIME_2 (0xC2B2AE3D27D4EB4F)
+#define XXHASH64_PRIME_3 (0x165667B19E3779F9)
+#define XXHASH64_PRIME_4 (0x85EBCA77C2B2AE63)
+#define XXHASH64_PRIME_5 (0x27D4EB2F165667C5)
 
-				if (command == T_EXTCALL || command == T_LIBCALL) {
-					context->c->backTracePointer--;
-					instructionPointer = item->instructionPointer;
-					variableBase = item->variableBase;
-				}
+typedef struct HashState {
+	uint8_t algorithm;
+	uint64_t value; // The CRC register, or the FNV-1a hash.
+	uint64_t lanes[4]; // XXH64 accumulators.
+	uint8_t buffer[32]; // XXH64 input that does not yet fill a stripe.
+	size_t bufferBytes;
+	uint64_t totalBytes;
+} HashState;
 
-				if (item->popResult) {
-					if (context->c->stackPointer < 1) return -1;
-					context->c->stackPointer--;
-				} else if (item->assertResult) {
-					if (context->c->stackPointer < 1) return -1;
-					Value condition = context->c->stack[--context->c->stackPointer];
+uint32_t hashCRC32Table[8][256];
+uint64_t hashCRC64Table[8][256];
+uint64_t hashCRC32FoldConstants[4];
+uint64_t hashCRC64FoldConstants[4];
+bool hashTablesInitialised;
 
-					if (condition.i == 0) {
-						PrintError4(context, instructionPointer - 1, "Return value was false on an asserting function pointer.\n");
-						return 0;
-					}
-				}
+uint64_t HashCRCFoldConstant(uint64_t polynomial, int width, int exponent) {
+	// Computes x^exponent mod P, where polynomial is P in reflected form without its leading term.
+	// The result is returned reflected into 64 bits, i.e. the coefficient of x^d is at bit 63-d, which is what the folding needs.
+	uint64_t normal = 0, mask = width == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << width) - 1);
 
-				if (command != T_EXTCALL && command != T_LIBCALL) {
-					context->c->backTracePointer--;
-					instructionPointer = item->instructionPointer;
-					variableBase = item->variableBase;
-				}
-			} else {
-				break;
-			}
-		} else if (command == T_END_CALLBACK) {
-			break;
-		} else {
-			PrintDebug("Unknown command %d.\n", command);
-			return -1;
+	for (int i = 0; i < width; i++) {
+		if (polynomial & ((uint64_t) 1 << i)) {
+			normal |= (uint64_t) 1 << (width - 1 - i);
 		}
 	}
 
-	if (context->allCoroutines->nextCoroutine || context->allCoroutines->startedByAsync) {
-		PrintError3("Script ended with unfinished tasks.\n");
-		return false;
+	uint64_t remainder = 1; // x^0
+
+	for (int i = 0; i < exponent; i++) {
+		bool carry = remainder & ((uint64_t) 1 << (width - 1));
+		remainder = (remainder << 1) & mask;
+		if (carry) remainder ^= normal;
 	}
 
-	return true;
-#else
-#warning "Compiling without the ability to execute scripts."
-	(void) instructionPointer;
-	(void) context;
-	return 0;
-#endif
-}
+	uint64_t result = 0;
 
-bool ScriptSetOption(ExecutionContext *context, Node *node, uintptr_t index, const char *value, size_t valueBytes) {
-	if (node->expressionType->type == T_STR) {
-		uintptr_t heapIndex = HeapAllocate(context);
-		context->heap[heapIndex].type = T_STR;
-		context->heap[heapIndex].bytes = valueBytes;
-		context->heap[heapIndex].text = (char *) AllocateResize(NULL, context->heap[heapIndex].bytes);
-		context->globalVariables[index].i = heapIndex;
-		MemoryCopy(context->heap[heapIndex].text, value, context->heap[heapIndex].bytes);
-	} else if (node->expressionType->type == T_INT) {
-		// TODO Overflow checking.
+	for (int i = 0; i < width; i++) {
+		if (remainder & ((uint64_t) 1 << i)) {
+			result |= (uint64_t) 1 << (63 - i);
+		}
+	}
 
-		Value v;
-		v.i = 0;
+	return result;
+}
 
-		for (uintptr_t j = 0; j < valueBytes; j++) {
-			char c = value[j];
+void HashInitialiseTables() {
+	if (hashTablesInitialised) return;
 
-			if (c >= '0' && c <= '9') {
-				v.i *= 10;
-				v.i += c - '0';
-			} else {
-				PrintError3("#option variable '%.*s' should be an integer.\n", node->token.textBytes, node->token.text);
-				return false;
-			}
+	for (uintptr_t i = 0; i < 256; i++) {
+		uint32_t crc32 = i;
+		uint64_t crc64 = i;
+
+		for (uintptr_t j = 0; j < 8; j++) {
+			crc32 = (crc32 >> 1) ^ ((crc32 & 1) ? HASH_CRC32_POLYNOMIAL : 0);
+			crc64 = (crc64 >> 1) ^ ((crc64 & 1) ? HASH_CRC64_POLYNOMIAL : 0);
 		}
 
-		context->globalVariables[index] = v;
-	} else if (node->expressionType->type == T_BOOL) {
-		char c = valueBytes ? value[0] : 0;
-		bool truthy = c == 't' || c == 'y' || c == '1';
-		bool falsey = c == 'f' || c == 'n' || c == '0';
+		hashCRC32Table[0][i] = crc32;
+		hashCRC64Table[0][i] = crc64;
+	}
 
-		if (!truthy && !falsey) {
-			PrintError3("#option variable '%.*s' should be a boolean value 'true' or 'false'.\n", node->token.textBytes, node->token.text);
-			return false;
+	for (uintptr_t i = 0; i < 256; i++) {
+		for (uintptr_t j = 1; j < 8; j++) {
+			hashCRC32Table[j][i] = (hashCRC32Table[j - 1][i] >> 8) ^ hashCRC32Table[0][hashCRC32Table[j - 1][i] & 0xFF];
+			hashCRC64Table[j][i] = (hashCRC64Table[j - 1][i] >> 8) ^ hashCRC64Table[0][hashCRC64Table[j - 1][i] & 0xFF];
 		}
+	}
 
-		context->globalVariables[index].i = truthy ? 1 : 0;
+	// Folding a 64-bit half over a distance of D bits multiplies it by x^(D+64) or x^D (mod P),
+	// less one since the product of two reflected 64-bit values is shifted down by one bit.
+	const int distances[2] = { 512, 128 };
+
+	for (uintptr_t i = 0; i < 2; i++) {
+		hashCRC32FoldConstants[i * 2 + 0] = HashCRCFoldConstant(HASH_CRC32_POLYNOMIAL, 32, distances[i] + 63);
+		hashCRC32FoldConstants[i * 2 + 1] = HashCRCFoldConstant(HASH_CRC32_POLYNOMIAL, 32, distances[i] - 1);
+		hashCRC64FoldConstants[i * 2 + 0] = HashCRCFoldConstant(HASH_CRC64_POLYNOMIAL, 64, distances[i] + 63);
+		hashCRC64FoldConstants[i * 2 + 1] = HashCRCFoldConstant(HASH_CRC64_POLYNOMIAL, 64, distances[i] - 1);
 	}
 
-	return true;
+	hashTablesInitialised = true;
 }
 
-bool ScriptParseOptions(ExecutionContext *context) {
-	for (uintptr_t j = 0, index = 0; j < context->rootNode->scope->entryCount; j++) {
-		Node *node = context->rootNode->scope->entries[j];
-		if (ScopeIsVariableType(node)) index++;
+uint32_t HashCRC32Table(uint32_t crc, const uint8_t *data, size_t bytes) {
+	while (bytes >= 8) {
+		uint32_t low = crc ^ ReadLittleEndian32(data), high = ReadLittleEndian32(data + 4);
+		crc = hashCRC32Table[7][low & 0xFF] ^ hashCRC32Table[6][(low >> 8) & 0xFF] 
+			^ hashCRC32Table[5][(low >> 16) & 0xFF] ^ hashCRC32Table[4][low >> 24]
+			^ hashCRC32Table[3][high & 0xFF] ^ hashCRC32Table[2][(high >> 8) & 0xFF] 
+			^ hashCRC32Table[1][(high >> 16) & 0xFF] ^ hashCRC32Table[0][high >> 24];
+		data += 8, bytes -= 8;
+	}
 
-		if (node->type == T_DECLARE && node->isOptionVariable) {
-			if (node->expressionType->type != T_STR && node->expressionType->type != T_INT && node->expressionType->type != T_BOOL) {
-				PrintError3("#option variable '%.*s' is not of string, boolean or integer type.\n", node->token.textBytes, node->token.text);
-				return false;
-			}
+	while (bytes--) crc = (crc >> 8) ^ hashCRC32Table[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
 
-			Node *args = node->firstChild->sibling ? node->firstChild->sibling->firstChild->sibling->firstChild : NULL;
-			if (!args) continue;
+uint64_t HashCRC64Table(uint64_t crc, const uint8_t *data, size_t bytes) {
+	while (bytes >= 8) {
+		crc ^= ReadLittleEndian64(data);
+		crc = hashCRC64Table[7][crc & 0xFF] ^ hashCRC64Table[6][(crc >> 8) & 0xFF] 
+			^ hashCRC64Table[5][(crc >> 16) & 0xFF] ^ hashCRC64Table[4][(crc >> 24) & 0xFF]
+			^ hashCRC64Table[3][(crc >> 32) & 0xFF] ^ hashCRC64Table[2][(crc >> 40) & 0xFF] 
+			^ hashCRC64Table[1][(crc >> 48) & 0xFF] ^ hashCRC64Table[0][crc >> 56];
+		data += 8, bytes -= 8;
+	}
 
-			if ((node->expressionType->type == T_INT && args->type != T_NUMERIC_LITERAL)
-					|| (node->expressionType->type == T_STR && args->type != T_STRING_LITERAL)
-					|| (node->expressionType->type == T_BOOL && args->type != T_TRUE && args->type != T_FALSE)) {
-				PrintError3("#option variable '%.*s' has an invalid default value. It must be a literal of the correct type.\n", 
-						node->token.textBytes, node->token.text);
-				return false;
-			}
+	while (bytes--) crc = (crc >> 8) ^ hashCRC64Table[0][(crc ^ *data++) & 0xFF];
+	return crc;
+}
 
-			if (!ScriptSetOption(context, node, index - 1 + context->functionData->globalVariableOffset, 
-						args->token.text, args->token.textBytes)) return false;
+uint64_t HashXXHash64Round(uint64_t accumulator, uint64_t input) {
+	accumulator += input * XXHASH64_PRIME_2;
+	accumulator = (accumulator << 31) | (accumulator >> 33);
+	return accumulator * XXHASH64_PRIME_1;
+}
 
-			args = args->sibling;
-			if (!args) continue;
+void HashStart(HashState *state, uint8_t algorithm) {
+	HashInitialiseTables();
+	state->algorithm = algorithm;
+	state->value = algorithm == HASH_FNV1A ? 0xCBF29CE484222325 : ~(uint64_t) 0;
+	state->lanes[0] = XXHASH64_PRIME_1 + XXHASH64_PRIME_2;
+	state->lanes[1] = XXHASH64_PRIME_2;
+	state->lanes[2] = 0;
+	state->lanes[3] = -XXHASH64_PRIME_1;
+	state->bufferBytes = 0;
+	state->totalBytes = 0;
+}
 
-			if (args->type != T_STRING_LITERAL) {
-				PrintError3("#option variable '%.*s' has an invalid description. It must be a string literal.\n", 
-						node->token.textBytes, node->token.text);
-				return false;
-			}
+void HashUpdate(HashState *state, const void *_data, size_t bytes) {
+	const uint8_t *data = (const uint8_t *) _data;
+	state->totalBytes += bytes;
 
-			args = args->sibling;
-			if (!args) continue;
+	if (state->algorithm == HASH_CRC32 || state->algorithm == HASH_CRC64) {
+		bool is64 = state->algorithm == HASH_CRC64;
 
-			if (args->type != T_STRING_LITERAL) {
-				PrintError3("#option variable '%.*s' has an invalid alternate name. It must be a string literal.\n", 
-						node->token.textBytes, node->token.text);
-				return false;
+		if (bytes >= HASH_CRC_FOLD_MINIMUM_BYTES) {
+			uint8_t remainder[16];
+			size_t folded = CRCFoldWithCarrylessMultiply(data, bytes, is64 ? state->value : (uint32_t) state->value, 
+					is64 ? hashCRC64FoldConstants : hashCRC32FoldConstants, remainder);
+
+			if (folded) {
+				// The folded remainder has the same CRC as the data it replaces, starting from an empty register.
+				state->value = is64 ? HashCRC64Table(0, remainder, 16) : HashCRC32Table(0, remainder, 16);
+				data += folded, bytes -= folded;
 			}
+		}
 
-			args = args->sibling;
+		state->value = is64 ? HashCRC64Table(state->value, data, bytes) : HashCRC32Table(state->value, data, bytes);
+	} else if (state->algorithm == HASH_FNV1A) {
+		uint64_t hash = state->value;
 
-			if (args) {
-				PrintError3("#option variable '%.*s' has too many arguments. Expected: #option(defaultValue, description, alternateName)\n",
-						node->token.textBytes, node->token.text);
-				return false;
-			}
+		for (uintptr_t i = 0; i < bytes; i++) {
+			hash = (hash ^ data[i]) * 0x100000001B3;
 		}
-	}
 
-	for (uintptr_t i = 0; i < optionCount; i++) {
-		uintptr_t equalsPosition = 0;
-		uintptr_t optionLength = 0;
+		state->value = hash;
+	} else if (state->algorithm == HASH_XXHASH64) {
+		if (state->bufferBytes) {
+			size_t copy = 32 - state->bufferBytes < bytes ? 32 - state->bufferBytes : bytes;
+			MemoryCopy(state->buffer + state->bufferBytes, data, copy);
+			state->bufferBytes += copy, data += copy, bytes -= copy;
+			if (state->bufferBytes != 32) return;
 
-		for (uintptr_t j = 0; options[i][j]; j++) {
-			if (options[i][j] == '=') {
-				equalsPosition = j;
-				break;
+			for (uintptr_t i = 0; i < 4; i++) {
+				state->lanes[i] = HashXXHash64Round(state->lanes[i], ReadLittleEndian64(state->buffer + i * 8));
 			}
-		}
 
-		for (uintptr_t j = 0; options[i][j]; j++) {
-			optionLength++;
+			state->bufferBytes = 0;
 		}
 
-		if (!equalsPosition) {
-			PrintError3("Invalid script option passed on command line '%s'.\n", options[i]);
-			return false;
-		}
+		uint64_t lanes[4] = { state->lanes[0], state->lanes[1], state->lanes[2], state->lanes[3] };
 
-		uintptr_t index = 0;
-		Node *node = NULL;
+		while (bytes >= 32) {
+			lanes[0] = HashXXHash64Round(lanes[0], ReadLittleEndian64(data + 0));
+			lanes[1] = HashXXHash64Round(lanes[1], ReadLittleEndian64(data + 8));
+			lanes[2] = HashXXHash64Round(lanes[2], ReadLittleEndian64(data + 16));
+			lanes[3] = HashXXHash64Round(lanes[3], ReadLittleEndian64(data + 24));
+			data += 32, bytes -= 32;
+		}
 
-		for (uintptr_t j = 0; j < context->rootNode->scope->entryCount; j++) {
-			Node *n = context->rootNode->scope->entries[j];
+		for (uintptr_t i = 0; i < 4; i++) state->lanes[i] = lanes[i];
+		if (bytes) MemoryCopy(state->buffer, data, bytes);
+		state->bufferBytes = bytes;
+	} else {
+		Assert(false);
+	}
+}
 
-			if (n->type == T_DECLARE && n->isOptionVariable) {
-				Token token = n->token;
+uint64_t HashFinish(HashState *state) {
+	if (state->algorithm == HASH_CRC32) {
+		return (uint32_t) ~state->value;
+	} else if (state->algorithm == HASH_CRC64) {
+		return ~state->value;
+	} else if (state->algorithm == HASH_FNV1A) {
+		return state->value;
+	}
 
-				if (n->firstChild->sibling && n->firstChild->sibling->firstChild->sibling->firstChild->sibling
-						&& n->firstChild->sibling->firstChild->sibling->firstChild->sibling->sibling) {
-					token = n->firstChild->sibling->firstChild->sibling->firstChild->sibling->sibling->token;
-				}
+	uint64_t hash;
+	uint64_t *lanes = state->lanes;
 
-				if (token.textBytes == equalsPosition && 0 == MemoryCompare(token.text, options[i], equalsPosition)) {
-					node = n;
-					break;
-				}
-			}
+	if (state->totalBytes >= 32) {
+		hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57)) 
+			+ ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
 
-			if (ScopeIsVariableType(context->rootNode->scope->entries[j])) {
-				index++;
-			}
+		for (uintptr_t i = 0; i < 4; i++) {
+			hash ^= HashXXHash64Round(0, lanes[i]);
+			hash = hash * XXHASH64_PRIME_1 + XXHASH64_PRIME_4;
 		}
+	} else {
+		hash = XXHASH64_PRIME_5;
+	}
 
-		if (!node) {
-			continue;
-		}
+	hash += state->totalBytes;
+	const uint8_t *data = state->buffer;
+	size_t bytes = state->bufferBytes;
 
-		if (!ScriptSetOption(context, node, index + context->functionData->globalVariableOffset, 
-					options[i] + equalsPosition + 1, optionLength - equalsPosition - 1)) return false;
+	while (bytes >= 8) {
+		hash ^= HashXXHash64Round(0, ReadLittleEndian64(data));
+		hash = ((hash << 27) | (hash >> 37)) * XXHASH64_PRIME_1 + XXHASH64_PRIME_4;
+		data += 8, bytes -= 8;
+	}
 
-		if (optionsMatched[i]) {
-			PrintError3("Script option passed on command line '%s' matches multiple #option variables in different modules.\n", options[i]);
-			return false;
-		}
+	if (bytes >= 4) {
+		hash ^= ReadLittleEndian32(data) * XXHASH64_PRIME_1;
+		hash = ((hash << 23) | (hash >> 41)) * XXHASH64_PRIME_2 + XXHASH64_PRIME_3;
+		data += 4, bytes -= 4;
+	}
 
-		optionsMatched[i] = true;
+	while (bytes--) {
+		hash ^= *data++ * XXHASH64_PRIME_5;
+		hash = ((hash << 11) | (hash >> 53)) * XXHASH64_PRIME_1;
 	}
 
-	return true;
+	hash ^= hash >> 33;
+	hash *= XXHASH64_PRIME_2;
+	hash ^= hash >> 29;
+	hash *= XXHASH64_PRIME_3;
+	hash ^= hash >> 32;
+	return hash;
 }
 
-bool ScriptParameterCString(ExecutionContext *context, char **output) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
-	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
-	if (context->heapEntriesAllocated <= index) return false;
-	const char *text;
-	size_t bytes;
-	HeapEntry *entry = &context->heap[index];
-	ScriptHeapEntryToString(context, entry, &text, &bytes);
-	*output = (char *) AllocateResize(NULL, bytes + 1);
-	MemoryCopy(*output, text, bytes);
-	(*output)[bytes] = 0;
-	return true;
+int External_StringHashInternal(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	STACK_READ_STRING(text, bytes, 1);
+	if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	int64_t algorithm = context->c->stack[context->c->stackPointer - 2].i;
+	if (algorithm < HASH_CRC32 || algorithm > HASH_XXHASH64) return -1;
+	HashState state;
+	HashStart(&state, algorithm);
+	HashUpdate(&state, text, bytes);
+	returnValue->i = HashFinish(&state);
+	context->c->stackPointer -= 2;
+	return EXTCALL_RETURN_UNMANAGED;
 }
 
-bool ScriptParameterString(ExecutionContext *context, const void **output, size_t *outputBytes) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
-	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
-	if (context->heapEntriesAllocated <= index) return false;
-	HeapEntry *entry = &context->heap[index];
-	ScriptHeapEntryToString(context, entry, (const char **) output, outputBytes);
-	return true;
+// --------------------------------- UTF-8.
+
+// Validation is done 16 bytes at a time with SIMD instructions if the platform supports them. Otherwise, runs of ASCII are skipped 
+// 16 bytes at a time by testing the high bit of every byte in a pair of 64-bit words, and only non-ASCII sequences are checked a byte at a time.
+// Counting and case mapping work on 8 bytes at once in the same way.
+
+#define UTF8_HIGH_BITS (0x8080808080808080)
+#define UTF8_REPLACEMENT_CHARACTER "\xEF\xBF\xBD"
+
+size_t UTF8SkipASCII(const uint8_t *text, size_t bytes) {
+	size_t i = 0;
+
+	while (i + 16 <= bytes && !((ReadLittleEndian64(text + i) | ReadLittleEndian64(text + i + 8)) & UTF8_HIGH_BITS)) {
+		i += 16;
+	}
+
+	while (i < bytes && text[i] < 0x80) i++;
+	return i;
 }
 
-bool ScriptParameterHandle(ExecutionContext *context, void **output) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	if (!context->c->stackIsManaged[context->c->stackPointer - context->c->parameterCount]) return false;
-	uint64_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
-	if (context->heapEntriesAllocated <= index) return false;
-	HeapEntry *entry = &context->heap[index];
-	if (entry->type == T_HANDLETYPE) *output = entry->handleData;
-	else if (entry->type == T_EOF) *output = NULL;
-	else return false;
-	return true;
+size_t UTF8LeadByteLength(uint8_t c) {
+	// This only looks at the lead byte, as the base module's UTF-8 traversal functions always have.
+	return c < 0x80 ? 1 : c < 0xC0 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF8 ? 4 : 0;
 }
 
-bool ScriptListCount(ExecutionContext *context, intptr_t index, size_t *output) {
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
+bool UTF8SequenceIsValid(const uint8_t *text, size_t bytes, size_t *length) {
+	// Checks the sequence starting with the non-ASCII byte text[0] against RFC 3629, 
+	// so overlong forms, surrogates and values above 0x10FFFF are rejected.
+	// If the sequence is invalid, length is set to the number of bytes that should be replaced by a single replacement character; 
+	// this is the longest prefix that could have started a valid sequence, or 1, as recommended by the Unicode standard.
 
-	if (context->heap[index].type == T_LIST) {
-		*output = context->heap[index].length;
-		return true;
-	} else if (context->heap[index].type == T_EOF) {
-		PrintError4(context, 0, "List is null.");
-		return false;
+	uint8_t c = text[0], low = 0x80, high = 0xBF;
+	size_t expected;
+
+	if (c >= 0xC2 && c <= 0xDF) {
+		expected = 2;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		expected = 3;
+		if (c == 0xE0) low = 0xA0;
+		if (c == 0xED) high = 0x9F;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		expected = 4;
+		if (c == 0xF0) low = 0x90;
+		if (c == 0xF4) high = 0x8F;
 	} else {
-		PrintError4(context, 0, "The script was malformed.\n");
+		*length = 1;
 		return false;
 	}
-}
 
-#define _ScriptStructAccess(managed) \
-	Value *v; \
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated); \
-	if (context->heap[index].type == T_STRUCT) { \
-		Assert(fieldIndex < context->heap[index].fieldCount); \
-		v = &context->heap[index].fields[fieldIndex]; \
-		if (v->i || !managed /* NULL may not be marked as managed */) Assert(managed == ((uint8_t *) context->heap[index].fields)[-1 - fieldIndex]); \
-		else ((uint8_t *) context->heap[index].fields)[-1 - fieldIndex] = managed; \
-	} else if (context->heap[index].type == T_LIST) { \
-		Assert(fieldIndex < context->heap[index].length); \
-		v = &context->heap[index].list[fieldIndex]; \
-		Assert(managed == context->heap[index].internalValuesAreManaged); \
-	} else if (context->heap[index].type == T_EOF) { \
-		PrintError4(context, 0, "Structure or list is null."); \
-		return false; \
-	} else { \
-		PrintError4(context, 0, "The script was malformed.\n"); \
-		return false; \
+	size_t i = 1;
+
+	if (i < bytes && text[i] >= low && text[i] <= high) {
+		i++;
+		while (i < expected && i < bytes && (text[i] & 0xC0) == 0x80) i++;
 	}
-#define _ScriptStructReadInteger(which, name) \
-bool name(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, which *output) { \
-	int64_t x; \
-	if (!ScriptStructReadInt64(context, index, fieldIndex, &x)) return false; \
-	*output = (which) x; \
-	return true; \
-}
 
-bool ScriptStructReadString(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, const void **output, size_t *outputBytes) {
-	_ScriptStructAccess(true);
-	index = v->i;
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
-	HeapEntry *entry = &context->heap[index];
-	ScriptHeapEntryToString(context, entry, (const char **) output, outputBytes);
-	return true;
+	*length = i;
+	return i == expected;
 }
 
-bool ScriptStructReadInt64(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, int64_t *output) {
-	_ScriptStructAccess(false);
-	*output = v->i;
-	return true;
-}
+bool StringUTF8IsValidRaw(const char *_text, size_t bytes) {
+	const uint8_t *text = (const uint8_t *) _text;
+	size_t i, length;
+	if (!UTF8ValidateBlocks(text, bytes, &i)) return false;
 
-bool ScriptStructReadDouble(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, double *output) {
-	_ScriptStructAccess(false);
-	*output = v->f;
-	return true;
+	// The last sequence in the checked blocks might continue past them, so it is checked again here.
+	for (uintptr_t j = 1; j <= 3 && j <= i; j++) {
+		if (text[i - j] >= 0xC0) {
+			i -= j;
+			break;
+		}
+	}
+
+	while (true) {
+		i += UTF8SkipASCII(text + i, bytes - i);
+		if (i == bytes) return true;
+		if (!UTF8SequenceIsValid(text + i, bytes - i, &length)) return false;
+		i += length;
+	}
 }
 
-bool ScriptStructReadHandle(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, void **output) {
-	_ScriptStructAccess(true);
-	index = v->i;
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
-	HeapEntry *entry = &context->heap[index];
-	if (entry->type == T_HANDLETYPE) *output = entry->handleData;
-	else if (entry->type == T_EOF) *output = NULL;
-	else return false;
-	return true;
+int64_t StringUTF8CountRaw(const char *_text, size_t bytes) {
+	const uint8_t *text = (const uint8_t *) _text;
+
+	if (StringUTF8IsValidRaw(_text, bytes)) {
+		// Every byte other than a continuation byte (10xxxxxx) starts a codepoint.
+		size_t continuations = 0, i = 0;
+
+		for (; i + 8 <= bytes; i += 8) {
+			uint64_t word = ReadLittleEndian64(text + i);
+			uint64_t isContinuation = (word & ~(word << 1) & UTF8_HIGH_BITS) >> 7;
+			continuations += (isContinuation * 0x0101010101010101) >> 56;
+		}
+
+		for (; i < bytes; i++) continuations += (text[i] & 0xC0) == 0x80;
+		return bytes - continuations;
+	}
+
+	// Otherwise, traverse the string as StringUTF8Advance would.
+	int64_t count = 0;
+
+	for (size_t i = 0; i < bytes; count++) {
+		size_t length = UTF8LeadByteLength(text[i]);
+		if (!length || length > bytes - i) return -1;
+		i += length;
+	}
+
+	return count;
 }
 
-bool ScriptStructReadHeapRef(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, intptr_t *output) {
-	_ScriptStructAccess(true);
-	index = v->i;
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
-	if (context->heap[index].externalReferenceCount == 0xFFFFFFFF) return false;
-	context->heap[index].externalReferenceCount++;
-	*output = index;
-	return true;
+int64_t StringUTF8AdvanceRaw(const char *text, size_t bytes, int64_t i) {
+	if (i < 0 || (uint64_t) i >= bytes) return -1;
+	size_t length = UTF8LeadByteLength(text[i]);
+	if (!length || length > bytes - i) return -1;
+	return i + length;
 }
 
-bool ScriptStructWriteString(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, const void *input, size_t inputBytes) {
-	_ScriptStructAccess(true);
-	index = HeapAllocate(context); // TODO Handle memory allocation failures here.
-	context->heap[index].type = T_STR;
-	context->heap[index].bytes = inputBytes;
-	context->heap[index].text = (char *) AllocateResize(NULL, inputBytes);
-	MemoryCopy(context->heap[index].text, input, inputBytes);
-	return true;
+int64_t StringUTF8DecodeRaw(const char *_text, size_t bytes, int64_t i) {
+	const uint8_t *text = (const uint8_t *) _text;
+	if (i < 0 || (uint64_t) i >= bytes) return 0xFFFD;
+	size_t length = UTF8LeadByteLength(text[i]);
+	if (!length || length > bytes - i) return 0xFFFD;
+	int64_t value = text[i] & (0xFF >> (length == 1 ? 1 : length + 1));
+
+	for (size_t j = 1; j < length; j++) {
+		if ((text[i + j] & 0xC0) != 0x80) return 0xFFFD;
+		value = (value << 6) | (text[i + j] & 0x3F);
+	}
+
+	return value;
 }
 
-bool ScriptStructWriteHandle(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, void *input, ScriptCloseHandleFunction close) {
-	_ScriptStructAccess(true);
-	
-	if (input) {
-		v->i = HeapAllocate(context); // TODO Handle memory allocation failures here.
-		context->heap[v->i].type = T_HANDLETYPE;
-		context->heap[v->i].close = close;
-		context->heap[v->i].handleData = input;
-		return true;
-	} else {
-		v->i = 0;
+void StringChangeCaseRaw(uint8_t *output, const uint8_t *input, size_t bytes, bool upper) {
+	// For each byte, adding to its low 7 bits sets the high bit if it is at least the first letter of the range,
+	// and adding 26 less sets it if it is past the last letter. Bit 5 is flipped in ASCII bytes that are in the range.
+	uint8_t first = upper ? 'a' : 'A';
+	uint64_t addFirst = (0x80 - first) * 0x0101010101010101;
+	uint64_t addLast = (0x80 - first - 26) * 0x0101010101010101;
+	size_t i = 0;
+
+	for (; i + 8 <= bytes; i += 8) {
+		uint64_t word = ReadLittleEndian64(input + i), low = word & ~UTF8_HIGH_BITS;
+		uint64_t inRange = ((low + addFirst) ^ (low + addLast)) & ~word & UTF8_HIGH_BITS;
+		WriteLittleEndian64(output + i, word ^ (inRange >> 2));
 	}
 
-	return true;
+	for (; i < bytes; i++) {
+		output[i] = input[i] ^ ((unsigned) (input[i] - first) < 26 ? 0x20 : 0);
+	}
 }
 
-bool ScriptStructWriteInt(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, int64_t input) {
-	_ScriptStructAccess(false);
-	v->i = input;
-	return true;
+int ExternalStringUTF8Count(ExecutionContext *context, Value *returnValue) {
+	STACK_POP_STRING(text, bytes);
+	returnValue->i = StringUTF8CountRaw(text, bytes);
+	return EXTCALL_RETURN_UNMANAGED;
 }
 
-bool ScriptStructWriteDouble(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, double input) {
-	_ScriptStructAccess(false);
-	v->f = input;
-	return true;
+int ExternalStringUTF8Advance(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	STACK_READ_STRING(text, bytes, 1);
+	if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	returnValue->i = StringUTF8AdvanceRaw(text, bytes, context->c->stack[context->c->stackPointer - 2].i);
+	context->c->stackPointer -= 2;
+	return EXTCALL_RETURN_UNMANAGED;
 }
 
-bool ScriptStructWriteHeapRef(ExecutionContext *context, intptr_t index, uintptr_t fieldIndex, intptr_t input) {
-	Assert(input >= 0 || input < (intptr_t) context->heapEntriesAllocated);
-	_ScriptStructAccess(true);
-	v->i = input;
-	return true;
+int ExternalStringUTF8Decode(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	STACK_READ_STRING(text, bytes, 1);
+	if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	returnValue->i = StringUTF8DecodeRaw(text, bytes, context->c->stack[context->c->stackPointer - 2].i);
+	context->c->stackPointer -= 2;
+	return EXTCALL_RETURN_UNMANAGED;
 }
 
-_ScriptStructReadInteger(bool, ScriptStructReadBool);
-_ScriptStructReadInteger(int32_t, ScriptStructReadInt32);
-_ScriptStructReadInteger(uint64_t, ScriptStructReadUint64);
-_ScriptStructReadInteger(uint32_t, ScriptStructReadUint32);
+int ExternalStringUTF8IsValid(ExecutionContext *context, Value *returnValue) {
+	STACK_POP_STRING(text, bytes);
+	returnValue->i = StringUTF8IsValidRaw(text, bytes);
+	return EXTCALL_RETURN_UNMANAGED;
+}
 
-void ScriptHeapRefClose(ExecutionContext *context, intptr_t index) {
-	Assert(index >= 0 || index < (intptr_t) context->heapEntriesAllocated);
-	Assert(context->heap[index].externalReferenceCount);
-	context->heap[index].externalReferenceCount--;
+int ExternalStringUTF8MakeValid(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_STRING(_text, bytes, 1);
+
+	if (StringUTF8IsValidRaw(_text, bytes)) {
+		returnValue->i = HeapCreateSlice(context, _index1, 0, bytes);
+		context->c->stackPointer--;
+		return EXTCALL_RETURN_MANAGED;
+	}
+
+	// Each invalid byte becomes a 3 byte replacement character at most.
+	const uint8_t *text = (const uint8_t *) _text;
+	uint8_t *output = (uint8_t *) AllocateResize(NULL, bytes * 3);
+	size_t i = 0, position = 0, length;
+
+	while (i != bytes) {
+		// Copy the string in blocks, and only go through the blocks that contain an invalid sequence a sequence at a time.
+		size_t end = bytes - i > 4096 ? i + 4096 : bytes;
+		for (uintptr_t j = 0; j < 3 && end != bytes && (text[end] & 0xC0) == 0x80; j++) end--;
+
+		if (StringUTF8IsValidRaw((const char *) text + i, end - i)) {
+			MemoryCopy(output + position, text + i, end - i);
+			position += end - i, i = end;
+			continue;
+		}
+
+		while (i < end) {
+			if (text[i] < 0x80) {
+				output[position++] = text[i++];
+			} else if (UTF8SequenceIsValid(text + i, bytes - i, &length)) {
+				for (uintptr_t j = 0; j < length; j++) output[position++] = text[i++];
+			} else {
+				MemoryCopy(output + position, UTF8_REPLACEMENT_CHARACTER, 3);
+				position += 3, i += length;
+			}
+		}
+	}
+
+	context->c->stackPointer--;
+	output = (uint8_t *) AllocateResize(output, position);
+	RETURN_STRING_NO_COPY((char *) output, position);
+	return EXTCALL_RETURN_MANAGED;
 }
 
-bool ScriptParameterHeapRef(ExecutionContext *context, intptr_t *output) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	intptr_t index = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
-	if (index < 0 || index >= (intptr_t) context->heapEntriesAllocated) return false;
-	if (context->heap[index].externalReferenceCount == 0xFFFFFFFF) return false;
-	context->heap[index].externalReferenceCount++;
-	*output = index;
-	return true;
+int StringChangeCase(ExecutionContext *context, Value *returnValue, bool upper) {
+	STACK_POP_STRING(text, bytes);
+	uint8_t *output = (uint8_t *) AllocateResize(NULL, bytes);
+	StringChangeCaseRaw(output, (const uint8_t *) text, bytes, upper);
+	RETURN_STRING_NO_COPY((char *) output, bytes);
+	return EXTCALL_RETURN_MANAGED;
 }
 
-bool ScriptParameterInt64(ExecutionContext *context, int64_t *output) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	*output = context->c->stack[context->c->stackPointer - context->c->parameterCount].i;
-	return true;
+int ExternalStringToUpperRaw(ExecutionContext *context, Value *returnValue) {
+	return StringChangeCase(context, returnValue, true);
 }
 
-bool ScriptParameterDouble(ExecutionContext *context, double *output) {
-	context->c->parameterCount++;
-	if (context->c->stackPointer < context->c->parameterCount) return false;
-	*output = context->c->stack[context->c->stackPointer - context->c->parameterCount].f;
-	return true;
+int ExternalStringToLowerRaw(ExecutionContext *context, Value *returnValue) {
+	return StringChangeCase(context, returnValue, false);
 }
 
-bool ScriptParameterBool  (ExecutionContext *context,     bool *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
-bool ScriptParameterUint32(ExecutionContext *context, uint32_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
-bool ScriptParameterUint64(ExecutionContext *context, uint64_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
-bool ScriptParameterInt32 (ExecutionContext *context,  int32_t *output) { int64_t i; if (!ScriptParameterInt64(context, &i)) return false; *output = i; return true; }
+// --------------------------------- Regular expressions.
 
-bool ScriptReturnInt(ExecutionContext *context, int64_t input) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_UNMANAGED;
-	context->c->returnValue.i = input;
-	return true;
-}
+// A pattern is parsed into a tree, which is compiled into a program for a Thompson NFA.
+// To search, a DFA built lazily from the program first finds whether there is a match, and a position before which it can't start.
+// Then, if the groups are needed, a Pike VM runs the program from that position to find the exact leftmost-first match.
+// Both take time linear in the length of the text, so there is no catastrophic backtracking.
+// Patterns work on bytes: "." and character classes match a single byte.
 
-bool ScriptReturnDouble(ExecutionContext *context, double input) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_UNMANAGED;
-	context->c->returnValue.f = input;
-	return true;
+#define REGEX_MAXIMUM_INSTRUCTIONS (50000)
+#define REGEX_MAXIMUM_CAPTURE_SLOTS (1 << 22) // Instructions times groups; each running thread in the Pike VM has its own copy of the groups.
+#define REGEX_MAXIMUM_REPEAT (1000)
+#define REGEX_MAXIMUM_NESTING (200)
+#define REGEX_DFA_MAXIMUM_STATES (2048) // The cache is cleared when it fills up.
+
+#define REGEX_NODE_BYTES     (0) // Matches one byte in the class.
+#define REGEX_NODE_CONCAT    (1)
+#define REGEX_NODE_ALTERNATE (2)
+#define REGEX_NODE_REPEAT    (3)
+#define REGEX_NODE_GROUP     (4)
+#define REGEX_NODE_BEGIN     (5)
+#define REGEX_NODE_END       (6)
+
+#define REGEX_OP_BYTES (0) // Consume a byte in class x.
+#define REGEX_OP_SPLIT (1) // Continue at x, and with lower priority at y.
+#define REGEX_OP_JUMP  (2) // Continue at x.
+#define REGEX_OP_SAVE  (3) // Record the position in capture slot x.
+#define REGEX_OP_BEGIN (4) // Continue only at the start of the text.
+#define REGEX_OP_END   (5) // Continue only at the end of the text.
+#define REGEX_OP_MATCH (6)
+
+#define REGEX_DFA_INITIAL (0) // The state at the start of the text, where "^" matches.
+#define REGEX_DFA_EMPTY   (1) // No threads are running, apart from the one started at every position.
+
+typedef struct RegexNode {
+	uint8_t type;
+	bool greedy;
+	int32_t firstChild, sibling;
+	uint32_t classIndex, group, minimum, maximum; // maximum is UINT32_MAX if there is no limit.
+} RegexNode;
+
+typedef struct RegexInstruction {
+	uint8_t op;
+	uint32_t x, y;
+} RegexInstruction;
+
+typedef struct RegexDFAState {
+	int32_t next[256]; // -1 if the transition hasn't been computed yet.
+	uint32_t *pcs; // Sorted. Only the REGEX_OP_BYTES, REGEX_OP_END and REGEX_OP_MATCH instructions are included.
+	uint32_t pcCount;
+	uint64_t hash;
+	bool hasMatch, hasMatchAtEnd;
+} RegexDFAState;
+
+typedef struct Regex {
+	RegexInstruction *instructions;
+	uint32_t instructionCount;
+	uint8_t (*classes)[32];
+	uint32_t classCount;
+	uint32_t groupCount; // Including group 0, the whole match.
+
+	uint8_t firstBytes[32]; // The bytes that can start a match, used to skip through the text.
+	int firstByte; // The only byte that can start a match, or -1.
+	bool startMatches, startMatchesAtEnd; // Whether the thread started at each position matches straight away.
+	bool initialMatches, initialMatchesAtEnd; // The same, for the start of the text.
+
+	RegexDFAState *states;
+	uint32_t stateCount;
+	int32_t *stateTable;
+
+	// Scratch space for building closures and running the Pike VM.
+	uint32_t *visited, visitedGeneration;
+	uint32_t *closure, *closureStack, *seeds;
+	uint32_t closureCount;
+	uint32_t *threads[2];
+	intptr_t *threadCaptures[2];
+	intptr_t *captures, *stack;
+} Regex;
+
+typedef struct RegexParser {
+	const char *pattern;
+	size_t bytes;
+	uintptr_t position;
+	RegexNode *nodes;
+	uint32_t nodeCount, nodesAllocated;
+	Regex *regex;
+	const char *error;
+} RegexParser;
+
+bool RegexClassHas(const uint8_t *set, uint8_t byte) {
+	return set[byte >> 3] & (1 << (byte & 7));
 }
 
-bool ScriptReturnHeapRef(ExecutionContext *context, intptr_t index) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
-	context->c->returnValue.i = index;
-	return true;
+void RegexClassAdd(uint8_t *set, uint8_t from, uint8_t to) {
+	for (uintptr_t i = from; i <= to; i++) set[i >> 3] |= 1 << (i & 7);
 }
 
-bool ScriptReturnString(ExecutionContext *context, const void *data, size_t bytes) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
-	Value *returnValue = &context->c->returnValue;
-	RETURN_STRING_COPY((const char *) data, bytes);
-	return true;
+int32_t RegexParserAddNode(RegexParser *parser, uint8_t type) {
+	if (parser->nodeCount == parser->nodesAllocated) {
+		parser->nodesAllocated = parser->nodesAllocated ? parser->nodesAllocated * 2 : 16;
+		parser->nodes = (RegexNode *) AllocateResize(parser->nodes, parser->nodesAllocated * sizeof(RegexNode));
+	}
+
+	RegexNode *node = &parser->nodes[parser->nodeCount];
+	node->type = type;
+	node->greedy = true;
+	node->firstChild = node->sibling = -1;
+	node->classIndex = node->group = node->minimum = node->maximum = 0;
+	return parser->nodeCount++;
 }
 
-bool ScriptCreateString(ExecutionContext *context, const void *_text, size_t _bytes, intptr_t *_index) {
-	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
-	context->heap[index].type = T_STR;
-	context->heap[index].bytes = _bytes;
-	context->heap[index].text = (char *) AllocateResize(NULL, _bytes);
-	MemoryCopy(context->heap[index].text, _text, _bytes);
-	context->heap[index].externalReferenceCount = 1;
-	*_index = index;
-	return true;
+int32_t RegexParserAddClass(RegexParser *parser, const uint8_t *set) {
+	Regex *regex = parser->regex;
+	regex->classes = (uint8_t (*)[32]) AllocateResize(regex->classes, (regex->classCount + 1) * 32);
+	MemoryCopy(regex->classes[regex->classCount], set, 32);
+	int32_t node = RegexParserAddNode(parser, REGEX_NODE_BYTES);
+	parser->nodes[node].classIndex = regex->classCount++;
+	return node;
 }
 
-bool ScriptCreateStruct(ExecutionContext *context, int64_t *fields, bool *managedFields, size_t fieldCount, intptr_t *_index) {
-	uintptr_t index = HeapAllocate(context); // TODO Handle memory allocation failures here.
-	context->heap[index].type = T_STRUCT;
-	size_t fieldCountAligned = (fieldCount + 7) & ~7;
-	context->heap[index].fields = (Value *) ((uint8_t *) AllocateResize(NULL, fieldCountAligned + fieldCount * sizeof(Value)) + fieldCountAligned);
-	context->heap[index].fieldCount = fieldCount;
-	context->heap[index].externalReferenceCount = 1;
+bool RegexParseEscape(RegexParser *parser, uint8_t *set, bool *single) {
+	// Adds the bytes matched by the escape sequence after a backslash to the set.
+	// single is set if the escape sequence was for a single byte, so that it can be used in a range.
 
-	for (uintptr_t i = 0; i < fieldCount; i++) {
-		context->heap[index].fields[i].i = fields ? fields[i] : 0;
-		((uint8_t *) context->heap[index].fields)[-1 - i] = managedFields ? managedFields[i] : false;
+	if (parser->position == parser->bytes) {
+		parser->error = "The pattern ends with a backslash.";
+		return false;
 	}
 
-	*_index = index;
-	return true;
-}
+	char c = parser->pattern[parser->position++];
+	uint8_t other[32] = { 0 };
+	*single = false;
+
+	if (c == 'd' || c == 'D') {
+		RegexClassAdd(other, '0', '9');
+	} else if (c == 'w' || c == 'W') {
+		RegexClassAdd(other, '0', '9');
+		RegexClassAdd(other, 'a', 'z');
+		RegexClassAdd(other, 'A', 'Z');
+		RegexClassAdd(other, '_', '_');
+	} else if (c == 's' || c == 'S') {
+		RegexClassAdd(other, ' ', ' ');
+		RegexClassAdd(other, '\t', '\r'); // Tab, newline, vertical tab, form feed and carriage return.
+	} else {
+		uint8_t byte = c;
+
+		if (c == 'n') {
+			byte = '\n';
+		} else if (c == 'r') {
+			byte = '\r';
+		} else if (c == 't') {
+			byte = '\t';
+		} else if (c == 'x') {
+			if (parser->position + 2 > parser->bytes
+					|| !HexIsDigit(parser->pattern[parser->position]) || !HexIsDigit(parser->pattern[parser->position + 1])) {
+				parser->error = "The \\x escape sequence must be followed by two hexadecimal digits.";
+				return false;
+			}
 
-bool ScriptReturnStruct(ExecutionContext *context, int64_t *fields, bool *managedFields, size_t fieldCount) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
-	intptr_t index;
-	if (!ScriptCreateStruct(context, fields, managedFields, fieldCount, &index)) return false;
-	context->c->returnValue.i = index;
+			byte = (HexValueOf(parser->pattern[parser->position]) << 4) | HexValueOf(parser->pattern[parser->position + 1]);
+			parser->position += 2;
+		} else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+			parser->error = "The pattern contains an unsupported escape sequence.";
+			return false;
+		}
+
+		RegexClassAdd(set, byte, byte);
+		*single = true;
+		return true;
+	}
+
+	bool negate = c == 'D' || c == 'W' || c == 'S';
+	for (uintptr_t i = 0; i < 32; i++) set[i] |= negate ? ~other[i] : other[i];
 	return true;
 }
 
-bool ScriptReturnStructInl(struct ExecutionContext *context, size_t fieldCount, ...) {
-	va_list arguments;
-	va_start(arguments, fieldCount);
+bool RegexParseClassByte(RegexParser *parser, uint8_t *set, uint8_t *byte, bool *single) {
+	// Parses one item in a character class, either a byte or an escape sequence.
+	// Escape sequences for several bytes, like \d, are added to the set straight away.
 
-	Assert(fieldCount < FUNCTION_MAX_ARGUMENTS);
-	int64_t fields[FUNCTION_MAX_ARGUMENTS];
-	bool managedFields[FUNCTION_MAX_ARGUMENTS];
+	char c = parser->pattern[parser->position++];
+	*byte = c, *single = true;
+	if (c != '\\') return true;
+	uint8_t escaped[32] = { 0 };
+	if (!RegexParseEscape(parser, escaped, single)) return false;
 
-	for (uintptr_t i = 0; i < fieldCount; i++) {
-		fields[i] = va_arg(arguments, int64_t);
-		managedFields[i] = va_arg(arguments, int);
+	for (uintptr_t i = 0; i < 256; i++) {
+		if (RegexClassHas(escaped, i)) {
+			*byte = i;
+		}
 	}
 
-	va_end(arguments);
-	return ScriptReturnStruct(context, fields, managedFields, fieldCount);
+	if (!*single) {
+		for (uintptr_t i = 0; i < 32; i++) set[i] |= escaped[i];
+	}
+
+	return true;
 }
 
-bool ScriptParameterScan(struct ExecutionContext *context, const char *cFormat, ...) {
-	va_list arguments;
-	va_start(arguments, cFormat);
+int32_t RegexParseAlternation(RegexParser *parser, uint32_t depth);
 
-	while (*cFormat) {
-		if (*cFormat == '(') {
-			cFormat++;
-			uintptr_t fieldIndex = 0;
-			intptr_t structIndex;
-			bool success = true;
+int32_t RegexParseAtom(RegexParser *parser, uint32_t depth) {
+	char c = parser->pattern[parser->position++];
+	uint8_t set[32] = { 0 };
+
+	if (c == '(') {
+		uint32_t group = 0;
+
+		if (parser->position + 1 < parser->bytes && parser->pattern[parser->position] == '?' && parser->pattern[parser->position + 1] == ':') {
+			parser->position += 2;
+		} else {
+			group = parser->regex->groupCount++;
+		}
+
+		int32_t child = RegexParseAlternation(parser, depth + 1);
+		if (child == -1) return -1;
+
+		if (parser->position == parser->bytes) {
+			parser->error = "A group is missing its closing parenthesis.";
+			return -1;
+		}
+
+		parser->position++;
+		int32_t node = RegexParserAddNode(parser, REGEX_NODE_GROUP);
+		parser->nodes[node].firstChild = child;
+		parser->nodes[node].group = group;
+		return node;
+	} else if (c == '[') {
+		bool negate = parser->position < parser->bytes && parser->pattern[parser->position] == '^';
+		if (negate) parser->position++;
+		bool first = true;
 
-			if (!ScriptParameterHeapRef(context, &structIndex)) {
-				return false;
+		while (true) {
+			if (parser->position == parser->bytes) {
+				parser->error = "A character class is missing its closing bracket.";
+				return -1;
 			}
 
-			if (structIndex == 0) {
-				// TODO If 'n' is not found, then the null value should be an error.
+			if (parser->pattern[parser->position] == ']' && !first) {
+				parser->position++;
+				break;
+			}
 
-				while (success && *cFormat != ')') {
-					if (*cFormat == 'i') { int32_t *i = va_arg(arguments, int32_t *); *i = 0; }
-					else if (*cFormat == 'u') { uint32_t *i = va_arg(arguments, uint32_t *); *i = 0; }
-					else if (*cFormat == 'n') { bool *b = va_arg(arguments, bool *); if (b) *b = true; }
-					else if (*cFormat == '-') {}
-					else { success = false; }
+			uint8_t from, to;
+			bool single;
+			first = false;
+			if (!RegexParseClassByte(parser, set, &from, &single)) return -1;
+			if (!single) continue;
+			to = from;
 
-					cFormat++;
-					fieldIndex++;
-				}
-			} else {
-				while (success && *cFormat != ')') {
-					if (*cFormat == 'i') { success = ScriptStructReadInt32(context, structIndex, fieldIndex, va_arg(arguments, int32_t *)); }
-					else if (*cFormat == 'u') { success = ScriptStructReadUint32(context, structIndex, fieldIndex, va_arg(arguments, uint32_t *)); }
-					else if (*cFormat == 'n') { bool *b = va_arg(arguments, bool *); *b = false; }
-					else if (*cFormat == '-') {}
-					else { success = false; }
+			if (parser->position + 1 < parser->bytes && parser->pattern[parser->position] == '-' && parser->pattern[parser->position + 1] != ']') {
+				parser->position++;
+				if (!RegexParseClassByte(parser, set, &to, &single)) return -1;
 
-					cFormat++;
-					fieldIndex++;
+				if (!single) {
+					parser->error = "A range in a character class must end with a single character.";
+					return -1;
+				} else if (to < from) {
+					parser->error = "A range in a character class is backwards.";
+					return -1;
 				}
 			}
 
-			ScriptHeapRefClose(context, structIndex);
-
-			if (!success) {
-				return false;
-			}
+			RegexClassAdd(set, from, to);
 		}
 
-		else if (*cFormat == 'S') { 
-			const void **output = va_arg(arguments, const void **);
-			size_t *outputBytes = va_arg(arguments, size_t *);
-
-			if (!ScriptParameterString(context, output, outputBytes)) {
-				return false; 
-			}
+		if (negate) {
+			for (uintptr_t i = 0; i < 32; i++) set[i] = ~set[i];
 		}
-
-		else if (*cFormat == 'b') { if (!ScriptParameterBool(context, va_arg(arguments, bool *))) return false; }
-		else if (*cFormat == 'i') { if (!ScriptParameterInt32(context, va_arg(arguments, int32_t *))) return false; }
-		else if (*cFormat == 'I') { if (!ScriptParameterInt64(context, va_arg(arguments, int64_t *))) return false; }
-		else if (*cFormat == 'u') { if (!ScriptParameterUint32(context, va_arg(arguments, uint32_t *))) return false; }
-		else if (*cFormat == 'U') { if (!ScriptParameterUint64(context, va_arg(arguments, uint64_t *))) return false; }
-		else if (*cFormat == 'F') { if (!ScriptParameterDouble(context, va_arg(arguments, double *))) return false; }
-		else if (*cFormat == 'h') { if (!ScriptParameterHandle(context, va_arg(arguments, void **))) return false; }
-		else { return false; }
-
-		cFormat++;
+	} else if (c == '.') {
+		RegexClassAdd(set, 0, '\n' - 1);
+		RegexClassAdd(set, '\n' + 1, 255);
+	} else if (c == '^') {
+		return RegexParserAddNode(parser, REGEX_NODE_BEGIN);
+	} else if (c == '$') {
+		return RegexParserAddNode(parser, REGEX_NODE_END);
+	} else if (c == '\\') {
+		bool single;
+		if (!RegexParseEscape(parser, set, &single)) return -1;
+	} else if (c == '*' || c == '+' || c == '?' || c == '{') {
+		parser->error = "A repetition operator doesn't follow anything it could repeat.";
+		return -1;
+	} else {
+		RegexClassAdd(set, c, c);
 	}
 
-	va_end(arguments);
-	return true;
+	return RegexParserAddClass(parser, set);
 }
 
-bool ScriptCreateHandle(ExecutionContext *context, void *handleData, ScriptCloseHandleFunction close, intptr_t *handle) {
-	if (handleData) {
-		intptr_t index = *handle = HeapAllocate(context); // TODO Handle memory allocation failures here.
-		context->heap[index].type = T_HANDLETYPE;
-		context->heap[index].close = close;
-		context->heap[index].handleData = handleData;
-		context->heap[index].externalReferenceCount = 1;
-	} else {
-		*handle = 0;
+bool RegexParseCount(RegexParser *parser, uint32_t *count) {
+	if (parser->position == parser->bytes || parser->pattern[parser->position] < '0' || parser->pattern[parser->position] > '9') return false;
+	*count = 0;
+
+	while (parser->position < parser->bytes && parser->pattern[parser->position] >= '0' && parser->pattern[parser->position] <= '9') {
+		*count = *count * 10 + parser->pattern[parser->position++] - '0';
+		if (*count > REGEX_MAXIMUM_REPEAT) return false;
 	}
 
 	return true;
 }
 
-bool ScriptReturnHandle(ExecutionContext *context, void *handleData, ScriptCloseHandleFunction close) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_MANAGED;
+int32_t RegexParseRepeat(RegexParser *parser, uint32_t depth) {
+	int32_t node = RegexParseAtom(parser, depth);
+	if (node == -1) return -1;
+
+	while (parser->position < parser->bytes) {
+		char c = parser->pattern[parser->position];
+		uint32_t minimum, maximum;
+
+		if (c == '*') {
+			minimum = 0, maximum = UINT32_MAX;
+			parser->position++;
+		} else if (c == '+') {
+			minimum = 1, maximum = UINT32_MAX;
+			parser->position++;
+		} else if (c == '?') {
+			minimum = 0, maximum = 1;
+			parser->position++;
+		} else if (c == '{') {
+			parser->position++;
+
+			if (!RegexParseCount(parser, &minimum)) {
+				parser->error = "A repetition count is invalid (it must be a number between 0 and 1000).";
+				return -1;
+			}
 
-	if (handleData) {
-		int64_t index = context->c->returnValue.i = HeapAllocate(context); // TODO Handle memory allocation failures here.
-		context->heap[index].type = T_HANDLETYPE;
-		context->heap[index].close = close;
-		context->heap[index].handleData = handleData;
-	} else {
-		context->c->returnValue.i = 0;
+			maximum = minimum;
+
+			if (parser->position < parser->bytes && parser->pattern[parser->position] == ',') {
+				parser->position++;
+				maximum = UINT32_MAX;
+
+				if (parser->position < parser->bytes && parser->pattern[parser->position] != '}' && !RegexParseCount(parser, &maximum)) {
+					parser->error = "A repetition count is invalid (it must be a number between 0 and 1000).";
+					return -1;
+				}
+			}
+
+			if (parser->position == parser->bytes || parser->pattern[parser->position] != '}') {
+				parser->error = "A repetition count is missing its closing brace.";
+				return -1;
+			} else if (maximum < minimum) {
+				parser->error = "A repetition has a maximum count smaller than its minimum count.";
+				return -1;
+			}
+
+			parser->position++;
+		} else {
+			break;
+		}
+
+		if (++depth >= REGEX_MAXIMUM_NESTING) {
+			parser->error = "The pattern is nested too deeply.";
+			return -1;
+		}
+
+		int32_t repeat = RegexParserAddNode(parser, REGEX_NODE_REPEAT);
+		parser->nodes[repeat].firstChild = node;
+		parser->nodes[repeat].minimum = minimum;
+		parser->nodes[repeat].maximum = maximum;
+
+		if (parser->position < parser->bytes && parser->pattern[parser->position] == '?') {
+			parser->nodes[repeat].greedy = false;
+			parser->position++;
+		}
+
+		node = repeat;
 	}
 
-	return true;
+	return node;
 }
 
-bool ScriptReturnBoxInError(ExecutionContext *context) {
-	Assert(context->c->returnValueType == EXTCALL_RETURN_MANAGED || context->c->returnValueType == EXTCALL_RETURN_UNMANAGED);
-	context->c->returnValueType = context->c->returnValueType == EXTCALL_RETURN_MANAGED ? EXTCALL_RETURN_ERR_MANAGED : EXTCALL_RETURN_ERR_UNMANAGED;
-	return true;
-}
+int32_t RegexParseAlternation(RegexParser *parser, uint32_t depth) {
+	if (depth >= REGEX_MAXIMUM_NESTING) {
+		parser->error = "The pattern is nested too deeply.";
+		return -1;
+	}
 
-bool ScriptReturnError(ExecutionContext *context, const char *message) {
-	Assert(context->c->returnValueType == EXTCALL_NO_RETURN);
-	context->c->returnValueType = EXTCALL_RETURN_ERR_ERROR;
-	Value *returnValue = &context->c->returnValue;
-	RETURN_STRING_COPY(message, StringLength(message));
-	return true;
-}
+	int32_t alternate = RegexParserAddNode(parser, REGEX_NODE_ALTERNATE);
+	int32_t lastOption = -1;
 
-bool ScriptRunCallback(ExecutionContext *context, intptr_t functionPointer, 
-		int64_t *parameters, bool *managedParameters, size_t parameterCount, int64_t *returnValue, bool managedReturnValue) {
-	// TODO Do this in a separate coroutine?
+	while (true) {
+		int32_t concat = RegexParserAddNode(parser, REGEX_NODE_CONCAT);
+		int32_t lastItem = -1;
 
-	for (intptr_t i = parameterCount - 1; i >= -1; i--) {
-		if (context->c->stackPointer == context->c->stackEntriesAllocated) {
-			PrintError4(context, 0, "Stack overflow.\n");
-			return false;
+		while (parser->position < parser->bytes && parser->pattern[parser->position] != '|' && parser->pattern[parser->position] != ')') {
+			int32_t item = RegexParseRepeat(parser, depth);
+			if (item == -1) return -1;
+			if (lastItem == -1) parser->nodes[concat].firstChild = item;
+			else parser->nodes[lastItem].sibling = item;
+			lastItem = item;
 		}
 
-		if (i == -1) {
-			context->c->stack[context->c->stackPointer].i = functionPointer;
-			context->c->stackIsManaged[context->c->stackPointer] = true;
+		if (lastOption == -1) parser->nodes[alternate].firstChild = concat;
+		else parser->nodes[lastOption].sibling = concat;
+		lastOption = concat;
+
+		if (parser->position < parser->bytes && parser->pattern[parser->position] == '|') {
+			parser->position++;
 		} else {
-			context->c->stack[context->c->stackPointer].i = parameters[i];
-			context->c->stackIsManaged[context->c->stackPointer] = managedParameters[i];
+			break;
 		}
-
-		context->c->stackPointer++;
 	}
 
-	uintptr_t previousParameterCount = context->c->parameterCount;
-	int previousReturnValueType = context->c->returnValueType;
+	return alternate;
+}
 
-	int result = ScriptExecuteFunction(2, context);
+bool RegexNodeCanBeEmpty(RegexParser *parser, int32_t index) {
+	RegexNode *node = &parser->nodes[index];
 
-	context->c->parameterCount = previousParameterCount;
-	context->c->returnValueType = previousReturnValueType;
+	if (node->type == REGEX_NODE_BYTES) {
+		return false;
+	} else if (node->type == REGEX_NODE_CONCAT || node->type == REGEX_NODE_ALTERNATE) {
+		bool any = false, all = true;
 
-	if (result == -1 || (returnValue && (context->c->stackPointer == 0 
-					|| context->c->stackIsManaged[context->c->stackPointer - 1] != managedReturnValue))) {
-		PrintError4(context, 0, "The script was malformed.\n");
-		wantCompletionConfirmation = false;
+		for (int32_t child = node->firstChild; child != -1; child = parser->nodes[child].sibling) {
+			if (RegexNodeCanBeEmpty(parser, child)) any = true;
+			else all = false;
+		}
+
+		return node->type == REGEX_NODE_CONCAT ? all : any;
+	} else if (node->type == REGEX_NODE_REPEAT) {
+		return !node->minimum || RegexNodeCanBeEmpty(parser, node->firstChild);
+	} else if (node->type == REGEX_NODE_GROUP) {
+		return RegexNodeCanBeEmpty(parser, node->firstChild);
+	} else {
+		return true; // Anchors don't consume anything.
 	}
+}
 
-	if (returnValue) {
-		*returnValue = context->c->stack[--context->c->stackPointer].i;
+uint32_t RegexEmit(Regex *regex, uint8_t op, uint32_t x, uint32_t y) {
+	if ((regex->instructionCount & (regex->instructionCount - 1)) == 0) {
+		// The count is a power of two, so the array is full.
+		regex->instructions = (RegexInstruction *) AllocateResize(regex->instructions,
+				(regex->instructionCount ? regex->instructionCount * 2 : 1) * sizeof(RegexInstruction));
 	}
 
-	return result > 0;
+	RegexInstruction *instruction = &regex->instructions[regex->instructionCount];
+	instruction->op = op;
+	instruction->x = x;
+	instruction->y = y;
+	return regex->instructionCount++;
 }
 
-const ScriptNativeInterface _scriptNativeInterface = {
-	.CreateHandle = ScriptCreateHandle,
-	.CreateString = ScriptCreateString,
-	.CreateStruct = ScriptCreateStruct,
-	.HeapRefClose = ScriptHeapRefClose,
-	.ListCount = ScriptListCount,
-	.ParameterBool = ScriptParameterBool,
-	.ParameterCString = ScriptParameterCString,
-	.ParameterDouble = ScriptParameterDouble,
-	.ParameterHandle = ScriptParameterHandle,
-	.ParameterHeapRef = ScriptParameterHeapRef,
-	.ParameterInt32 = ScriptParameterInt32,
-	.ParameterInt64 = ScriptParameterInt64,
-	.ParameterScan = ScriptParameterScan,
-	.ParameterString = ScriptParameterString,
-	.ParameterUint32 = ScriptParameterUint32,
-	.ParameterUint64 = ScriptParameterUint64,
-	.ReturnBoxInError = ScriptReturnBoxInError,
-	.ReturnDouble = ScriptReturnDouble,
-	.ReturnError = ScriptReturnError,
-	.ReturnHandle = ScriptReturnHandle,
-	.ReturnHeapRef = ScriptReturnHeapRef,
-	.ReturnInt = ScriptReturnInt,
-	.ReturnString = ScriptReturnString,
-	.ReturnStruct = ScriptReturnStruct,
-	.ReturnStructInl = ScriptReturnStructInl,
-	.RunCallback = ScriptRunCallback,
-	.StructReadBool = ScriptStructReadBool,
-	.StructReadDouble = ScriptStructReadDouble,
-	.StructReadHandle = ScriptStructReadHandle,
-	.StructReadHeapRef = ScriptStructReadHeapRef,
-	.StructReadInt32 = ScriptStructReadInt32,
-	.StructReadInt64 = ScriptStructReadInt64,
-	.StructReadString = ScriptStructReadString,
-	.StructReadUint32 = ScriptStructReadUint32,
-	.StructReadUint64 = ScriptStructReadUint64,
-	.StructWriteDouble = ScriptStructWriteDouble,
-	.StructWriteHandle = ScriptStructWriteHandle,
-	.StructWriteHeapRef = ScriptStructWriteHeapRef,
-	.StructWriteInt = ScriptStructWriteInt,
-	.StructWriteString = ScriptStructWriteString,
-};
+bool RegexCompileNode(RegexParser *parser, int32_t index) {
+	// Each node emits at most two instructions of its own after compiling its children,
+	// so checking the limit here bounds how far the program can go over it.
 
-void ScriptOutputOverview(ExecutionContext *context, ImportData *mainModule) {
-	Node *node = context->rootNode->firstChild;
+	Regex *regex = parser->regex;
+	RegexNode *node = &parser->nodes[index];
 
-	if (mainModule->parentImport) {
-		return;
+	if (regex->instructionCount > REGEX_MAXIMUM_INSTRUCTIONS) {
+		parser->error = "The pattern is too complex.";
+		return false;
 	}
 
-	while (node) {
-		if (node->type == T_FUNCTION || node->type == T_FUNCTYPE) {
-			PrintOutput("[%.*s]\ntype=%s\nreturn=", (int) node->token.textBytes, node->token.text, 
-					node->type == T_FUNCTION ? "function" : "functype");
-			PrintOutputType(node->expressionType->firstChild->sibling);
-			PrintOutput("\n");
+	if (node->type == REGEX_NODE_BYTES) {
+		RegexEmit(regex, REGEX_OP_BYTES, node->classIndex, 0);
+	} else if (node->type == REGEX_NODE_BEGIN) {
+		RegexEmit(regex, REGEX_OP_BEGIN, 0, 0);
+	} else if (node->type == REGEX_NODE_END) {
+		RegexEmit(regex, REGEX_OP_END, 0, 0);
+	} else if (node->type == REGEX_NODE_CONCAT) {
+		for (int32_t child = node->firstChild; child != -1; child = parser->nodes[child].sibling) {
+			if (!RegexCompileNode(parser, child)) return false;
+		}
+	} else if (node->type == REGEX_NODE_GROUP) {
+		uint32_t group = node->group;
+		if (group) RegexEmit(regex, REGEX_OP_SAVE, group * 2 + 0, 0);
+		if (!RegexCompileNode(parser, node->firstChild)) return false;
+		if (group) RegexEmit(regex, REGEX_OP_SAVE, group * 2 + 1, 0);
+	} else if (node->type == REGEX_NODE_ALTERNATE) {
+		// Each option but the last is: split option, next; option: ...; jump end; next:
+		// The jumps are chained together through their targets until the end is known.
+		uint32_t jumps = UINT32_MAX;
+
+		for (int32_t child = node->firstChild; child != -1; child = parser->nodes[child].sibling) {
+			if (parser->nodes[child].sibling == -1) {
+				if (!RegexCompileNode(parser, child)) return false;
+				break;
+			}
 
-			Node *argument = node->expressionType->firstChild->firstChild;
-			int index = 0;
+			uint32_t split = RegexEmit(regex, REGEX_OP_SPLIT, regex->instructionCount + 1, 0);
+			if (!RegexCompileNode(parser, child)) return false;
+			jumps = RegexEmit(regex, REGEX_OP_JUMP, jumps, 0);
+			regex->instructions[split].y = regex->instructionCount;
+		}
 
-			while (argument) {
-				PrintOutput("arg%d_type=", index);
-				PrintOutputType(argument->firstChild);
-				PrintOutput("\narg%d_name=%.*s\n", index, (int) argument->token.textBytes, argument->token.text);
-				index++;
-				argument = argument->sibling;
-			}
-		} else if (node->type == T_STRUCT) {
-			PrintOutput("[%.*s]\ntype=struct\n", (int) node->token.textBytes, node->token.text);
+		while (jumps != UINT32_MAX) {
+			uint32_t next = regex->instructions[jumps].x;
+			regex->instructions[jumps].x = regex->instructionCount;
+			jumps = next;
+		}
+	} else if (node->type == REGEX_NODE_REPEAT) {
+		int32_t child = node->firstChild;
+		uint32_t minimum = node->minimum, maximum = node->maximum;
+		bool greedy = node->greedy;
 
-			Node *field = node->firstChild;
-			int index = 0;
+		if (maximum == UINT32_MAX && !minimum && !RegexNodeCanBeEmpty(parser, child)) {
+			// loop: split body, end; body: ...; jump loop; end:
+			uint32_t split = RegexEmit(regex, REGEX_OP_SPLIT, 0, 0);
+			if (!RegexCompileNode(parser, child)) return false;
+			RegexEmit(regex, REGEX_OP_JUMP, split, 0);
+			regex->instructions[split].x = greedy ? split + 1 : regex->instructionCount;
+			regex->instructions[split].y = greedy ? regex->instructionCount : split + 1;
+		} else if (maximum == UINT32_MAX) {
+			// The last copy loops back to its start: body: ...; split body, end; end:
+			// If the body can match the empty string, this leaves the loop after an empty iteration, rather than dropping the thread.
+			// Without a minimum, the loop is made optional: split body, end; body: ...; split body, end; end:
+			uint32_t skip = minimum ? UINT32_MAX : RegexEmit(regex, REGEX_OP_SPLIT, 0, 0);
 
-			while (field) {
-				Assert(field->type == T_DECLARE);
-				PrintOutput("field%d_type=", index);
-				PrintOutputType(field->firstChild);
-				PrintOutput("\nfield%d_name=%.*s\n", index, (int) field->token.textBytes, field->token.text);
-				index++;
-				field = field->sibling;
+			for (uintptr_t i = 1; i < minimum; i++) {
+				if (!RegexCompileNode(parser, child)) return false;
 			}
-		} else if (node->type == T_INTTYPE) {
-			PrintOutput("[%.*s]\ntype=inttype\n", (int) node->token.textBytes, node->token.text);
-
-			Node *define = node->firstChild;
-			int index = 0;
 
-			while (define) {
-				if (define->type == T_INTTYPE_CONSTANT) {
-					PrintOutput("const%d_name=%.*s\n", index, (int) define->token.textBytes, define->token.text);
-					bool error = false;
-					int64_t value = ASTEvaluateIntConstant(NULL, define->firstChild, &error);
-					Assert(!error);
-					char buffer[32];
-					size_t bytes = PrintIntegerToBuffer(buffer, sizeof(buffer), value);
-					PrintOutput("const%d_value=%.*s\n", index, (int) bytes, buffer);
-					index++;
-				} else if (define->type == T_INTTYPE) {
-					PrintOutput("parent=%.*s\n", (int) define->token.textBytes, define->token.text);
-				}
+			uint32_t body = regex->instructionCount;
+			if (!RegexCompileNode(parser, child)) return false;
+			uint32_t end = regex->instructionCount + 1;
+			RegexEmit(regex, REGEX_OP_SPLIT, greedy ? body : end, greedy ? end : body);
 
-				define = define->sibling;
+			if (skip != UINT32_MAX) {
+				regex->instructions[skip].x = greedy ? body : end;
+				regex->instructions[skip].y = greedy ? end : body;
 			}
-		} else if (node->type == T_HANDLETYPE) {
-			PrintOutput("[%.*s]\ntype=handletype\n", (int) node->token.textBytes, node->token.text);
-
-			if (node->firstChild) {
-				PrintOutput("parent=%.*s\n", (int) node->firstChild->token.textBytes, node->firstChild->token.text);
+		} else {
+			for (uintptr_t i = 0; i < minimum; i++) {
+				if (!RegexCompileNode(parser, child)) return false;
 			}
-		} else if (node->type == T_DECLARE && node->isOptionVariable) {
-			PrintOutput("[%.*s]\ntype=option\n", (int) node->token.textBytes, node->token.text);
 
-			if (node->firstChild->sibling && node->firstChild->sibling->firstChild->sibling->firstChild->sibling) {
-				Node *arg = node->firstChild->sibling->firstChild->sibling->firstChild->sibling;
-				PrintOutput("description=");
-				for (uintptr_t i = 0; i < arg->token.textBytes; i++) PrintOutput("%c", arg->token.text[i] == '\n' ? ' ' : arg->token.text[i]);
-				PrintOutput("\n");
+			if (maximum > minimum) {
+				// Each optional copy is nested in the one before: split body1, end; body1: ...; split body2, end; body2: ...; end:
+				// The splits are chained together through their second targets until the end is known.
+				uint32_t splits = UINT32_MAX;
+
+				for (uintptr_t i = minimum; i < maximum; i++) {
+					splits = RegexEmit(regex, REGEX_OP_SPLIT, regex->instructionCount + 1, splits);
+					if (!RegexCompileNode(parser, child)) return false;
+				}
+
+				while (splits != UINT32_MAX) {
+					RegexInstruction *split = &regex->instructions[splits];
+					splits = split->y;
+					split->y = regex->instructionCount;
+
+					if (!greedy) {
+						uint32_t swap = split->x;
+						split->x = split->y;
+						split->y = swap;
+					}
+				}
 			}
 		}
-
-		node = node->sibling;
+	} else {
+		Assert(false);
 	}
-}
 
-bool ScriptLoad(Tokenizer tokenizer, ExecutionContext *context, ImportData *importData, bool replMode) {
-	Node *previousRootNode = context->rootNode;
-	ImportData *previousImportData = context->functionData->importData;
+	return true;
+}
 
-	context->rootNode = replMode ? ParseRootREPL(&tokenizer) : ParseRoot(&tokenizer); 
-	context->functionData->importData = tokenizer.module;
+uint32_t RegexNextGeneration(Regex *regex) {
+	if (++regex->visitedGeneration == UINT32_MAX) {
+		for (uintptr_t i = 0; i < regex->instructionCount; i++) regex->visited[i] = 0;
+		regex->visitedGeneration = 1;
+	}
 
-	uint8_t b = 0; // Make sure no function can start at 0.
-	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
-	b = T_AWAIT; // Put a T_AWAIT command at address 1.
-	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
-	b = T_CALL; // Put a T_CALL command at address 2 (for ScriptRunCallback).
-	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
-	b = T_END_CALLBACK; // Put a T_END_CALLBACK command at address 3 (for ScriptRunCallback).
-	FunctionBuilderAppend(context->functionData, &b, sizeof(b));
+	return regex->visitedGeneration;
+}
 
-	bool success = context->rootNode 
-		&& ASTSetScopes(&tokenizer, context, context->rootNode, NULL)
-		&& ASTLookupTypeIdentifiers(&tokenizer, context->rootNode)
-		&& ASTSetTypes(&tokenizer, context->rootNode)
-		&& ASTCheckForReturnStatements(&tokenizer, context->rootNode)
-		&& ASTGenerate(&tokenizer, context->rootNode, context)
-		&& ScriptParseOptions(context);
+void RegexClosure(Regex *regex, const uint32_t *seeds, uint32_t seedCount, bool atBegin, bool atEnd) {
+	// Puts the instructions reachable from the seeds without consuming a byte into regex->closure.
+	// The order of the threads doesn't matter here, since the DFA only needs to know whether there is a match.
+	// REGEX_OP_END instructions that can't be passed yet are kept, so that they can be followed if the text ends.
 
-	importData->globalVariableOffset = context->functionData->globalVariableOffset;
-	importData->rootNode = context->rootNode;
-	*importedModulesLink = importData;
-	importedModulesLink = &importData->nextImport;
+	uint32_t generation = RegexNextGeneration(regex);
+	uint32_t stackCount = 0;
+	regex->closureCount = 0;
 
-	if (outputOverview && success) ScriptOutputOverview(context, importData);
+	for (uintptr_t i = 0; i < seedCount; i++) {
+		regex->closureStack[stackCount++] = seeds[i];
 
-	context->rootNode = previousRootNode;
-	context->functionData->importData = previousImportData;
+		while (stackCount) {
+			uint32_t pc = regex->closureStack[--stackCount];
+			if (regex->visited[pc] == generation) continue;
+			regex->visited[pc] = generation;
+			RegexInstruction *instruction = &regex->instructions[pc];
 
-	return success;
+			if (instruction->op == REGEX_OP_JUMP) {
+				regex->closureStack[stackCount++] = instruction->x;
+			} else if (instruction->op == REGEX_OP_SPLIT) {
+				regex->closureStack[stackCount++] = instruction->y;
+				regex->closureStack[stackCount++] = instruction->x;
+			} else if (instruction->op == REGEX_OP_SAVE || (instruction->op == REGEX_OP_BEGIN && atBegin)
+					|| (instruction->op == REGEX_OP_END && atEnd)) {
+				regex->closureStack[stackCount++] = pc + 1;
+			} else if (instruction->op != REGEX_OP_BEGIN) {
+				regex->closure[regex->closureCount++] = pc;
+			}
+		}
+	}
 }
 
-int ScriptExecute(ExecutionContext *context, ImportData *mainModule) {
-#ifndef NO_SCRIPT_EXECUTE
-	bool optionMatchingError = false;
-
-	for (uintptr_t i = 0; i < optionCount; i++) {
-		if (!optionsMatched[i]) {
-			PrintError3("Script option passed on command line '%s' does not match any #option variable.\n", options[i]);
-			optionMatchingError = true;
+bool RegexClosureHasMatch(Regex *regex) {
+	for (uintptr_t i = 0; i < regex->closureCount; i++) {
+		if (regex->instructions[regex->closure[i]].op == REGEX_OP_MATCH) {
+			return true;
 		}
 	}
 
-	if (optionMatchingError) {
-		return 1;
-	}
+	return false;
+}
 
-	Node n;
-	n.token.textBytes = startFunctionBytes;
-	n.token.text = startFunction;
-	intptr_t startIndex = ScopeLookupIndex(&n, mainModule->rootNode->scope, true, false);
+int32_t RegexDFAAddState(Regex *regex, const uint32_t *pcs, uint32_t pcCount, bool fixed) {
+	// Returns the state for the sorted set of instructions, creating it if needed.
+	// The fixed states have no instructions, and aren't put in the table.
 
-	if (startIndex == -1) {
-		PrintError3("The script does not have a start function '%.*s'.\n", startFunctionBytes, startFunction);
-		return 1;
+	uint64_t hash = 0xCBF29CE484222325;
+	for (uintptr_t i = 0; i < pcCount; i++) hash = (hash ^ pcs[i]) * 0x100000001B3;
+	uint32_t slot = hash & (REGEX_DFA_MAXIMUM_STATES * 2 - 1);
+
+	while (!fixed && regex->stateTable[slot] != -1) {
+		RegexDFAState *state = &regex->states[regex->stateTable[slot]];
+
+		if (state->hash == hash && state->pcCount == pcCount && 0 == MemoryCompare(state->pcs, pcs, pcCount * sizeof(uint32_t))) {
+			return regex->stateTable[slot];
+		}
+
+		slot = (slot + 1) & (REGEX_DFA_MAXIMUM_STATES * 2 - 1);
 	}
 
-	Node mainFunctionArguments = { 0 };
-	mainFunctionArguments.type = T_ARGUMENTS;
-	Node mainFunctionReturn = { 0 };
-	mainFunctionReturn.type = T_VOID;
-	Node mainFunctionType = { 0 };
-	mainFunctionType.type = T_FUNCPTR;
-	mainFunctionType.firstChild = &mainFunctionArguments;
-	mainFunctionArguments.sibling = &mainFunctionReturn;
+	Assert(regex->stateCount < REGEX_DFA_MAXIMUM_STATES);
+	int32_t index = regex->stateCount++;
+	if (!fixed) regex->stateTable[slot] = index;
+	RegexDFAState *state = &regex->states[index];
+	state->pcs = pcCount ? (uint32_t *) AllocateResize(NULL, pcCount * sizeof(uint32_t)) : NULL;
+	if (pcCount) MemoryCopy(state->pcs, pcs, pcCount * sizeof(uint32_t));
+	state->pcCount = pcCount;
+	state->hash = hash;
+	for (uintptr_t i = 0; i < 256; i++) state->next[i] = -1;
+	state->hasMatch = false;
 
-	if (!ASTMatching(&mainFunctionType, mainModule->rootNode->scope->entries[ScopeLookupIndex(&n, mainModule->rootNode->scope, false, true)]->expressionType)) {
-		PrintError3("The start function '%.*s' should take no arguments and return 'void'.\n", startFunctionBytes, startFunction);
-		return 1;
+	for (uintptr_t i = 0; i < pcCount; i++) {
+		if (regex->instructions[pcs[i]].op == REGEX_OP_MATCH) {
+			state->hasMatch = true;
+		}
 	}
 
-	ImportData *module = importedModules;
+	RegexClosure(regex, state->pcs, pcCount, false, true);
+	state->hasMatchAtEnd = RegexClosureHasMatch(regex);
+	return index;
+}
 
-	while (module) {
-		Node n;
-		n.token.textBytes = 10;
-		n.token.text = "Initialise";
-		intptr_t index = ScopeLookupIndex(&n, module->rootNode->scope, true, false);
+void RegexDFAReset(Regex *regex) {
+	for (uintptr_t i = 0; i < regex->stateCount; i++) AllocateResize(regex->states[i].pcs, 0);
+	for (uintptr_t i = 0; i < REGEX_DFA_MAXIMUM_STATES * 2; i++) regex->stateTable[i] = -1;
+	regex->stateCount = 0;
+	RegexDFAAddState(regex, NULL, 0, true); // REGEX_DFA_INITIAL.
+	RegexDFAAddState(regex, NULL, 0, true); // REGEX_DFA_EMPTY.
+}
 
-		if (index != -1) {
-			if (!ASTMatching(&mainFunctionType, module->rootNode->scope->entries[ScopeLookupIndex(&n, module->rootNode->scope, false, true)]->expressionType)) {
-				PrintError3("The 'Initialise' function in the module '%s' should take no arguments and return 'void'.\n", module->prettyName);
-				return 1;
-			}
+int32_t RegexDFATransition(Regex *regex, int32_t from, uint8_t byte) {
+	// The next state has the threads that were running, and the thread started at this position, after consuming the byte.
+	uint32_t start = 0;
+	RegexClosure(regex, &start, 1, from == REGEX_DFA_INITIAL, false);
+	uint32_t seedCount = 0;
 
-			int result = ScriptExecuteFunction(context->heap[context->globalVariables[index + module->globalVariableOffset].i].lambdaID, context);
+	for (uintptr_t i = 0; i < regex->closureCount + regex->states[from].pcCount; i++) {
+		uint32_t pc = i < regex->closureCount ? regex->closure[i] : regex->states[from].pcs[i - regex->closureCount];
+		RegexInstruction *instruction = &regex->instructions[pc];
 
-			if (result == 0) {
-				// A runtime error occurred.
-				return 1;
-			} else if (result == -1 || context->c->stackPointer != 0) {
-				PrintError4(context, 0, "The script was malformed.\n");
-				wantCompletionConfirmation = false;
-				return 1;
-			}
+		if (instruction->op == REGEX_OP_BYTES && RegexClassHas(regex->classes[instruction->x], byte)) {
+			regex->seeds[seedCount++] = pc + 1;
 		}
-
-		module = module->nextImport;
 	}
 
-	int result = ScriptExecuteFunction(context->heap[context->globalVariables[context->functionData->globalVariableOffset + startIndex].i].lambdaID, context);
+	RegexClosure(regex, regex->seeds, seedCount, false, false);
+	int32_t index;
 
-	if (result == 0) {
-		// A runtime error occurred.
-		return 1;
-	} else if (result == -1 || context->c->stackPointer != 0) {
-		PrintError4(context, 0, "The script was malformed.\n");
-		wantCompletionConfirmation = false;
-		return 1;
+	if (!regex->closureCount) {
+		index = REGEX_DFA_EMPTY;
+	} else {
+		// Sort the instructions so that each set has one representation. The sets are usually small.
+		for (uintptr_t i = 1; i < regex->closureCount; i++) {
+			uint32_t pc = regex->closure[i];
+			uintptr_t j = i;
+			for (; j && regex->closure[j - 1] > pc; j--) regex->closure[j] = regex->closure[j - 1];
+			regex->closure[j] = pc;
+		}
+
+		if (regex->stateCount == REGEX_DFA_MAXIMUM_STATES) {
+			// Throw away the cache, and start again with only the state that is needed now.
+			uint32_t pcCount = regex->closureCount;
+			MemoryCopy(regex->seeds, regex->closure, pcCount * sizeof(uint32_t));
+			RegexDFAReset(regex);
+			return RegexDFAAddState(regex, regex->seeds, pcCount, false);
+		}
+
+		index = RegexDFAAddState(regex, regex->closure, regex->closureCount, false);
 	}
 
-	return 0;
-#else
-	(void) mainModule;
-	(void) context;
-	return 0;
-#endif
+	regex->states[from].next[byte] = index;
+	return index;
 }
 
-void ScriptFreeCoroutine(CoroutineState *c) {
-	AllocateResize(c->waiters, 0);
-	AllocateResize(c->waitingOn, 0);
-	AllocateResize(c->localVariables, 0);
-	AllocateResize(c->localVariableIsManaged, 0);
-	AllocateResize(c, 0);
+void RegexSkipToFirstByte(Regex *regex, const char *text, size_t bytes, uintptr_t *position) {
+	if (regex->firstByte != -1) {
+		const char *next = (const char *) MemoryFindByte(text + *position, regex->firstByte, bytes - *position);
+		*position = next ? (uintptr_t) (next - text) : bytes;
+	} else {
+		while (*position < bytes && !RegexClassHas(regex->firstBytes, text[*position])) (*position)++;
+	}
 }
 
-void ScriptFree(ExecutionContext *context) {
-	ImportData *module = importedModules;
+bool RegexDFASearch(Regex *regex, const char *text, size_t bytes, uintptr_t startAt, uintptr_t *matchStartsAfter) {
+	// Returns whether there is a match that starts at or after startAt.
+	// If there is, then the leftmost one can't start before the last position where no threads were running.
 
-	while (module) {
-		if (!module->isBaseModule) {
-			AllocateResize(module->fileData, 0);
-		}
+	*matchStartsAfter = startAt;
 
-		ASTFreeScopes(module->rootNode);
-		module = module->nextImport;
+	if (startAt == 0 ? regex->initialMatches : regex->startMatches) {
+		return true;
+	} else if (startAt == bytes) {
+		return startAt == 0 ? regex->initialMatchesAtEnd : regex->startMatchesAtEnd;
 	}
 
-	for (uintptr_t i = 1; i < context->heapEntriesAllocated; i++) {
-		if (context->heap[i].type != T_ERROR) {
-			HeapFreeEntry(context, i);
-		}
-	}
+	int32_t state = startAt == 0 ? REGEX_DFA_INITIAL : REGEX_DFA_EMPTY;
+	uintptr_t position = startAt;
 
-	CoroutineState *coroutine = context->allCoroutines;
+	while (position < bytes) {
+		if (state == REGEX_DFA_EMPTY) {
+			RegexSkipToFirstByte(regex, text, bytes, &position);
+			*matchStartsAfter = position;
+			if (position == bytes) break;
+		}
 
-	while (coroutine) {
-		CoroutineState *next = coroutine->nextCoroutine;
-		ScriptFreeCoroutine(coroutine);
-		coroutine = next;
+		uint8_t byte = text[position++];
+		int32_t next = regex->states[state].next[byte];
+		state = next == -1 ? RegexDFATransition(regex, state, byte) : next;
+		if (regex->states[state].hasMatch) return true;
 	}
 
-	AllocateResize(context->heap, 0);
-	AllocateResize(context->globalVariables, 0);
-	AllocateResize(context->globalVariableIsManaged, 0);
-	AllocateResize(context->functionData->lineNumbers, 0);
-	AllocateResize(context->functionData->data, 0);
-	AllocateResize(context->scriptPersistFile, 0);
+	if (state == REGEX_DFA_EMPTY) *matchStartsAfter = position;
+	return regex->states[state].hasMatchAtEnd || regex->startMatchesAtEnd;
 }
 
-// --------------------------------- Helpers.
+void RegexPikeAddThread(Regex *regex, uintptr_t list, uint32_t *count, uint32_t pc, intptr_t *captures, uintptr_t position, size_t bytes) {
+	// Adds the threads reachable from pc to the list, in priority order.
+	// Following a REGEX_OP_SAVE pushes an entry to restore the capture slot afterwards, marked by a negative number.
 
-void LineNumberLookup(ExecutionContext *context, uint32_t instructionPointer, LineNumber *output) {
-	for (uintptr_t i = 0; i < context->functionData->lineNumberCount; i++) {
-		if (context->functionData->lineNumbers[i].instructionPointer == instructionPointer) {
-			*output = context->functionData->lineNumbers[i];
-			return;
+	uint32_t generation = regex->visitedGeneration;
+	uint32_t slotCount = regex->groupCount * 2;
+	uintptr_t stackCount = 0;
+	regex->stack[stackCount++] = pc;
+
+	while (stackCount) {
+		intptr_t item = regex->stack[--stackCount];
+
+		if (item < 0) {
+			captures[-item - 1] = regex->stack[--stackCount];
+			continue;
+		}
+
+		if (regex->visited[item] == generation) continue;
+		regex->visited[item] = generation;
+		RegexInstruction *instruction = &regex->instructions[item];
+
+		if (instruction->op == REGEX_OP_JUMP) {
+			regex->stack[stackCount++] = instruction->x;
+		} else if (instruction->op == REGEX_OP_SPLIT) {
+			regex->stack[stackCount++] = instruction->y;
+			regex->stack[stackCount++] = instruction->x;
+		} else if (instruction->op == REGEX_OP_SAVE) {
+			regex->stack[stackCount++] = captures[instruction->x];
+			regex->stack[stackCount++] = -1 - (intptr_t) instruction->x;
+			regex->stack[stackCount++] = item + 1;
+			captures[instruction->x] = position;
+		} else if (instruction->op == REGEX_OP_BEGIN) {
+			if (position == 0) regex->stack[stackCount++] = item + 1;
+		} else if (instruction->op == REGEX_OP_END) {
+			if (position == bytes) regex->stack[stackCount++] = item + 1;
+		} else {
+			regex->threads[list][*count] = item;
+			MemoryCopy(&regex->threadCaptures[list][*count * slotCount], captures, slotCount * sizeof(intptr_t));
+			(*count)++;
 		}
 	}
 }
 
-void PrintBackTrace(ExecutionContext *context, uint32_t instructionPointer, CoroutineState *c, const char *prefix) {
-	LineNumber lineNumber = { 0 };
-	LineNumberLookup(context, instructionPointer, &lineNumber);
+bool RegexPikeSearch(Regex *regex, const char *text, size_t bytes, uintptr_t position, intptr_t *output) {
+	// Finds the leftmost-first match starting at or after position, and puts its capture slots in output.
+	uint32_t slotCount = regex->groupCount * 2;
+	uint32_t counts[2] = { 0, 0 };
+	uintptr_t current = 0;
+	bool matched = false;
+	RegexNextGeneration(regex);
 
-	if (lineNumber.importData) {
-		PrintDebug("%s\t%s:%d %s %.*s\n", prefix, lineNumber.importData->prettyName, lineNumber.lineNumber, lineNumber.function ? "in" : "",
-				lineNumber.function ? (int) lineNumber.function->textBytes : 0, lineNumber.function ? lineNumber.function->text : "");
-	}
+	while (true) {
+		if (!matched && (!position || regex->startMatches || position == bytes || RegexClassHas(regex->firstBytes, text[position]))) {
+			// Start a new thread with the lowest priority. This is skipped if it would fail on the next byte.
+			for (uintptr_t i = 0; i < slotCount; i++) regex->captures[i] = -1;
+			RegexPikeAddThread(regex, current, &counts[current], 0, regex->captures, position, bytes);
+		} else if (!matched && !counts[current]) {
+			RegexSkipToFirstByte(regex, text, bytes, &position);
+			continue;
+		}
 
-	uintptr_t btp = c->backTracePointer;
-	uintptr_t minimum = c->startedByAsync ? 1 : 0;
+		if (!counts[current] && (matched || position == bytes)) {
+			break;
+		}
 
-	while (btp > minimum) {
-		BackTraceItem *link = &c->backTrace[--btp];
-		LineNumberLookup(context, link->instructionPointer - 1, &lineNumber);
-		PrintDebug("%s\t%s:%d %s %.*s\n", prefix, 
-				lineNumber.importData && lineNumber.importData->prettyName ? lineNumber.importData->prettyName : "??", 
-				lineNumber.lineNumber, lineNumber.function ? "in" : "",
-				lineNumber.function ? (int) lineNumber.function->textBytes : 0, lineNumber.function ? lineNumber.function->text : "");
-	}
-}
+		uintptr_t next = current ^ 1;
+		counts[next] = 0;
+		RegexNextGeneration(regex);
 
-void PrintLine(ImportData *importData, uintptr_t line) {
-	if (!importData) {
-		return;
-	}
-	
-	uintptr_t position = 0;
+		for (uintptr_t i = 0; i < counts[current]; i++) {
+			uint32_t pc = regex->threads[current][i];
+			intptr_t *captures = &regex->threadCaptures[current][i * slotCount];
 
-	for (uintptr_t i = 1; i < line; i++) {
-		while (position < importData->fileDataBytes) {
-			if (((char *) importData->fileData)[position] == '\n') {
-				position++;
+			if (regex->instructions[pc].op == REGEX_OP_MATCH) {
+				// The threads after this one have a lower priority, so they can be stopped.
+				MemoryCopy(output, captures, slotCount * sizeof(intptr_t));
+				matched = true;
 				break;
+			} else if (position < bytes && RegexClassHas(regex->classes[regex->instructions[pc].x], text[position])) {
+				MemoryCopy(regex->captures, captures, slotCount * sizeof(intptr_t));
+				RegexPikeAddThread(regex, next, &counts[next], pc + 1, regex->captures, position + 1, bytes);
 			}
+		}
 
-			position++;
+		if (position == bytes) {
+			break;
 		}
+
+		position++;
+		current = next;
 	}
 
-	uintptr_t length = 0;
+	return matched;
+}
 
-	for (uintptr_t i = position; i <= importData->fileDataBytes; i++) {
-		if (i == importData->fileDataBytes || ((char *) importData->fileData)[i] == '\n') {
-			length = i - position;
-			break;
-		}
+bool RegexSearch(Regex *regex, const char *text, size_t bytes, uintptr_t startAt, intptr_t *output) {
+	uintptr_t matchStartsAfter;
+	if (!RegexDFASearch(regex, text, bytes, startAt, &matchStartsAfter)) return false;
+	bool matched = RegexPikeSearch(regex, text, bytes, matchStartsAfter, output);
+	Assert(matched);
+	return matched;
+}
+
+void RegexDestroy(Regex *regex) {
+	for (uintptr_t i = 0; i < regex->stateCount; i++) AllocateResize(regex->states[i].pcs, 0);
+	AllocateResize(regex->states, 0);
+	AllocateResize(regex->stateTable, 0);
+	AllocateResize(regex->instructions, 0);
+	AllocateResize(regex->classes, 0);
+	AllocateResize(regex->visited, 0);
+	AllocateResize(regex->closure, 0);
+	AllocateResize(regex->closureStack, 0);
+	AllocateResize(regex->seeds, 0);
+	AllocateResize(regex->captures, 0);
+	AllocateResize(regex->stack, 0);
+
+	for (uintptr_t i = 0; i < 2; i++) {
+		AllocateResize(regex->threads[i], 0);
+		AllocateResize(regex->threadCaptures[i], 0);
 	}
 
-	PrintDebug("%s>> %.*s%s\n", IsColoredOutputEnabled() ? "\033[0;36m" : "", (int) length, 
-			&((char *) importData->fileData)[position], IsColoredOutputEnabled() ? "\033[0m" : "");
+	AllocateResize(regex, 0);
 }
 
-int ScriptExecuteFromFile(char *scriptPath, char *fileData, size_t fileDataBytes, bool replMode) {
-	Tokenizer tokenizer = { 0 };
-	ImportData importData = { 0 };
-	importData.path = PathToAbsolute(scriptPath, true);
-	importData.prettyName = PathToPrettyName(importData.path);
-	importData.baseDirectory = PathToBaseDirectory(importData.path);
-	importData.fileData = fileData;
-	importData.fileDataBytes = fileDataBytes;
-	tokenizer.module = &importData;
-	tokenizer.line = 1;
-	tokenizer.input = fileData;
-	tokenizer.inputBytes = fileDataBytes;
+Regex *RegexCreate(const char *pattern, size_t bytes, const char **error) {
+	Regex *regex = (Regex *) AllocateResize(NULL, sizeof(Regex));
+	Regex zero = { 0 };
+	*regex = zero;
+	regex->groupCount = 1;
 
-	FunctionBuilder builder = { 0 };
-	ExecutionContext context = { 0 };
-	context.functionData = &builder;
-	context.mainModule = &importData;
+	RegexParser parser = { .pattern = pattern, .bytes = bytes, .regex = regex };
+	int32_t root = RegexParseAlternation(&parser, 0);
 
-	context.heapEntriesAllocated = 2;
-	context.heap = (HeapEntry *) AllocateResize(NULL, sizeof(HeapEntry) * context.heapEntriesAllocated);
-	HeapEntry emptyHeapEntry = { 0 };
-	context.heap[0] = emptyHeapEntry;
-	context.heap[0].type = T_EOF;
-	context.heap[1] = emptyHeapEntry;
-	context.heapFirstUnusedEntry = 1;
-	context.c = (CoroutineState *) AllocateResize(0, sizeof(CoroutineState));
-	CoroutineState empty = { 0 };
-	*context.c = empty;
-	context.c->stackEntriesAllocated = sizeof(context.c->stack) / sizeof(context.c->stack[0]);
-	context.c->previousCoroutineLink = &context.allCoroutines;
-	context.allCoroutines = context.c;
+	if (root != -1 && parser.position != bytes) {
+		parser.error = "The pattern has a closing parenthesis without a matching opening parenthesis.";
+	} else if (root != -1) {
+		RegexEmit(regex, REGEX_OP_SAVE, 0, 0);
+
+		if (RegexCompileNode(&parser, root)) {
+			RegexEmit(regex, REGEX_OP_SAVE, 1, 0);
+			RegexEmit(regex, REGEX_OP_MATCH, 0, 0);
+
+			if (regex->instructionCount > REGEX_MAXIMUM_INSTRUCTIONS
+					|| (uint64_t) regex->instructionCount * regex->groupCount * 2 > REGEX_MAXIMUM_CAPTURE_SLOTS) {
+				parser.error = "The pattern is too complex.";
+			}
+		}
+	}
 
-	int result = 1;
+	AllocateResize(parser.nodes, 0);
 
-	if (ScriptLoad(tokenizer, &context, &importData, replMode)) {
-		if (outputOverview) {
-			result = 0;
-		} else {
-			result = ScriptExecute(&context, &importData);
-		}
+	if (parser.error) {
+		*error = parser.error;
+		RegexDestroy(regex);
+		return NULL;
 	}
 
-	ScriptFree(&context);
+	uint32_t count = regex->instructionCount, slotCount = regex->groupCount * 2;
+	regex->visited = (uint32_t *) AllocateResize(NULL, count * sizeof(uint32_t));
+	for (uintptr_t i = 0; i < count; i++) regex->visited[i] = 0;
+	regex->closure = (uint32_t *) AllocateResize(NULL, count * sizeof(uint32_t));
+	regex->closureStack = (uint32_t *) AllocateResize(NULL, (count * 2 + 1) * sizeof(uint32_t));
+	regex->seeds = (uint32_t *) AllocateResize(NULL, count * 2 * sizeof(uint32_t));
+	regex->captures = (intptr_t *) AllocateResize(NULL, slotCount * sizeof(intptr_t));
+	regex->stack = (intptr_t *) AllocateResize(NULL, (count * 3 + 1) * sizeof(intptr_t));
 
-	importedModules = NULL;
-	importedModulesLink = &importedModules;
+	for (uintptr_t i = 0; i < 2; i++) {
+		regex->threads[i] = (uint32_t *) AllocateResize(NULL, count * sizeof(uint32_t));
+		regex->threadCaptures[i] = (intptr_t *) AllocateResize(NULL, count * slotCount * sizeof(intptr_t));
+	}
 
-	return result;
-}
+	regex->states = (RegexDFAState *) AllocateResize(NULL, REGEX_DFA_MAXIMUM_STATES * sizeof(RegexDFAState));
+	regex->stateTable = (int32_t *) AllocateResize(NULL, REGEX_DFA_MAXIMUM_STATES * 2 * sizeof(int32_t));
+	RegexDFAReset(regex);
 
-int ExternalOpStringSlice(ExecutionContext *context, Value *returnValue) {
-	if (context->c->stackPointer < 3) return -1;
-	uint64_t start = context->c->stack[--context->c->stackPointer].i;
-	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
-	uint64_t end = context->c->stack[--context->c->stackPointer].i;
-	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
-	STACK_READ_STRING(string, bytes, 1);
+	// Work out whether an empty match is possible, and which bytes can start a match.
+	uint32_t start = 0;
+	RegexClosure(regex, &start, 1, true, false);
+	regex->initialMatches = RegexClosureHasMatch(regex);
+	RegexClosure(regex, &start, 1, true, true);
+	regex->initialMatchesAtEnd = RegexClosureHasMatch(regex);
+	RegexClosure(regex, &start, 1, false, true);
+	regex->startMatchesAtEnd = RegexClosureHasMatch(regex);
+	RegexClosure(regex, &start, 1, false, false);
+	regex->startMatches = RegexClosureHasMatch(regex);
+	uint32_t firstByteCount = 0;
 
-	if (start > bytes || end > bytes || end < start) {
-		PrintError4(context, 0, "The slice range (%ld..%ld) is invalid for the string of length %ld.\n",
-				start, end, bytes);
-		return 0;
+	for (uintptr_t i = 0; i < regex->closureCount; i++) {
+		RegexInstruction *instruction = &regex->instructions[regex->closure[i]];
+		if (instruction->op != REGEX_OP_BYTES) continue;
+		for (uintptr_t j = 0; j < 32; j++) regex->firstBytes[j] |= regex->classes[instruction->x][j];
 	}
 
-	RETURN_STRING_COPY(string + start, end - start);
-	context->c->stackPointer--; // Don't pop the string until it's been read by RETURN_STRING_COPY!
-	return EXTCALL_RETURN_MANAGED;
+	for (uintptr_t i = 0; i < 256; i++) {
+		if (RegexClassHas(regex->firstBytes, i)) {
+			regex->firstByte = i;
+			firstByteCount++;
+		}
+	}
+
+	if (firstByteCount != 1) regex->firstByte = -1;
+	return regex;
 }
 
-int ExternalOpCharacterToByte(ExecutionContext *context, Value *returnValue) {
-	if (context->c->stackPointer < 2) return -1;
-	uint64_t index = context->c->stack[--context->c->stackPointer].i;
-	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
-	STACK_POP_STRING(entryText, entryBytes);
-	returnValue->i = index < entryBytes ? ((uint8_t) entryText[index]) : -1;
+void RegexHandleClose(ExecutionContext *context, void *handleData) {
+	(void) context;
+	RegexDestroy((Regex *) handleData);
+}
+
+#define STACK_READ_REGEX(variable, stackIndex) \
+	if (context->c->stackPointer < stackIndex) return -1; \
+	if (!context->c->stackIsManaged[context->c->stackPointer - stackIndex]) return -1; \
+	uint64_t _regexIndex = context->c->stack[context->c->stackPointer - stackIndex].i; \
+	if (context->heapEntriesAllocated <= _regexIndex) return -1; \
+	HeapEntry *_regexEntry = &context->heap[_regexIndex]; \
+	if (_regexEntry->type != T_EOF && _regexEntry->type != T_HANDLETYPE) return -1; \
+	Regex *variable = _regexEntry->type == T_HANDLETYPE ? (Regex *) _regexEntry->handleData : NULL; \
+	if (variable && _regexEntry->close != RegexHandleClose) return -1; \
+	if (!variable) { PrintError4(context, 0, "The regular expression is null.\n"); return 0; }
+
+int ExternalRegexCompile(ExecutionContext *context, Value *returnValue) {
+	STACK_POP_STRING(pattern, patternBytes);
+	const char *error = NULL;
+	Regex *regex = RegexCreate(pattern, patternBytes, &error);
+
+	if (!regex) {
+		RETURN_STRING_COPY(error, StringLength(error));
+		return EXTCALL_RETURN_ERR_ERROR;
+	}
+
+	returnValue->i = HeapAllocate(context);
+	context->heap[returnValue->i].type = T_HANDLETYPE;
+	context->heap[returnValue->i].close = RegexHandleClose;
+	context->heap[returnValue->i].handleData = regex;
+	return EXTCALL_RETURN_ERR_MANAGED;
+}
+
+int ExternalRegexMatches(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	uintptr_t matchStartsAfter;
+	returnValue->i = RegexDFASearch(regex, text, bytes, 0, &matchStartsAfter);
+	context->c->stackPointer -= 2;
 	return EXTCALL_RETURN_UNMANAGED;
 }
 
-int ExternalOpStringFromByte(ExecutionContext *context, Value *returnValue) {
-	if (context->c->stackPointer < 1) return -1;
-	int64_t byte = context->c->stack[--context->c->stackPointer].i;
-	if (context->c->stackIsManaged[context->c->stackPointer]) return -1;
+int ExternalRegexFindPositions(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	if (context->c->stackPointer < 3 || context->c->stackIsManaged[context->c->stackPointer - 3]) return -1;
+	int64_t startAt = context->c->stack[context->c->stackPointer - 3].i;
+	uint32_t slotCount = regex->groupCount * 2;
+	intptr_t *slots = (intptr_t *) AllocateResize(NULL, slotCount * sizeof(intptr_t));
+	bool matched = startAt >= 0 && (uint64_t) startAt <= bytes && RegexSearch(regex, text, bytes, startAt, slots);
+	context->c->stackPointer -= 3;
 
-	if (byte < 0 || byte > 255) {
-		char buffer[64];
-		size_t count = PrintIntegerToBuffer(buffer, sizeof(buffer), byte);
-		PrintError4(context, 0, "The byte %.*s is not in the range (0..255).\n", count, buffer);
+	returnValue->i = HeapAllocate(context);
+	HeapEntry *list = &context->heap[returnValue->i];
+	list->type = T_LIST;
+	list->internalValuesAreManaged = false;
+	list->length = list->allocated = matched ? slotCount : 0;
+	list->list = matched ? (Value *) AllocateResize(NULL, slotCount * sizeof(Value)) : NULL;
+
+	for (uintptr_t i = 0; i < list->length; i++) {
+		// Groups that didn't take part in the match have both positions set to -1.
+		bool unmatched = slots[i & ~1] == -1 || slots[i | 1] == -1;
+		list->list[i].i = unmatched ? -1 : slots[i];
+	}
+
+	AllocateResize(slots, 0);
+	return EXTCALL_RETURN_MANAGED;
+}
+
+int RegexReturnSlices(ExecutionContext *context, Value *returnValue, uintptr_t stringIndex, intptr_t *spans, uintptr_t count, uintptr_t argumentCount) {
+	// Returns a list of slices of the string, giving "" for spans that are -1, and frees the spans.
+	// The arguments are popped once the slices have been allocated.
+
+	if (count > 1000000000) {
+		AllocateResize(spans, 0);
+		PrintError4(context, 0, "The regular expression matched more times than a list can hold.\n");
 		return 0;
 	}
 
-	uint8_t single = byte;
-	RETURN_STRING_COPY(&single, 1);
+	uintptr_t index = HeapAllocate(context);
+	HeapEntry *list = &context->heap[index];
+	list->type = T_LIST;
+	list->internalValuesAreManaged = true;
+	list->length = 0;
+	list->allocated = count;
+	list->list = count ? (Value *) AllocateResize(NULL, count * sizeof(Value)) : NULL;
+	list->externalReferenceCount++; // Keep the list alive while the slices are allocated.
+
+	for (uintptr_t i = 0; i < count; i++) {
+		Value piece;
+		bool unmatched = spans[i * 2] == -1 || spans[i * 2 + 1] == -1;
+		piece.i = unmatched ? 0 : HeapCreateSlice(context, stringIndex, spans[i * 2], spans[i * 2 + 1]);
+		list = &context->heap[index];
+		list->list[list->length++] = piece;
+	}
+
+	list->externalReferenceCount--;
+	context->c->stackPointer -= argumentCount; // Don't pop the string until the slices have been allocated!
+	AllocateResize(spans, 0);
+	returnValue->i = index;
 	return EXTCALL_RETURN_MANAGED;
 }
 
-void RandomSeed(uint64_t x) {
-	rngState.s[0] = rngState.s[1] = rngState.s[2] = rngState.s[3] = 0;
+int ExternalRegexFind(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	intptr_t *slots = (intptr_t *) AllocateResize(NULL, regex->groupCount * 2 * sizeof(intptr_t));
+	bool matched = RegexSearch(regex, text, bytes, 0, slots);
+	return RegexReturnSlices(context, returnValue, _index2, slots, matched ? regex->groupCount : 0, 2);
+}
 
-	for (uintptr_t i = 0; i < 4; i++) {
-		x += 0x9E3779B97F4A7C15;
+intptr_t *RegexFindAll(Regex *regex, const char *text, size_t bytes, uintptr_t *count) {
+	// Returns the start and end of each match, with each search starting where the previous match ended.
+	// After an empty match, the search continues from the next byte.
 
-		uint64_t result = x;
-		result = (result ^ (result >> 30)) * 0xBF58476D1CE4E5B9;
-		result = (result ^ (result >> 27)) * 0x94D049BB133111EB;
-		rngState.s[i] = result ^ (result >> 31);
+	intptr_t *spans = NULL;
+	uintptr_t allocated = 0, position = 0;
+	intptr_t *slots = (intptr_t *) AllocateResize(NULL, regex->groupCount * 2 * sizeof(intptr_t));
+	*count = 0;
+
+	while (position <= bytes && RegexSearch(regex, text, bytes, position, slots)) {
+		if (*count == allocated) {
+			allocated = allocated ? allocated * 2 : 16;
+			spans = (intptr_t *) AllocateResize(spans, allocated * 2 * sizeof(intptr_t));
+		}
+
+		spans[*count * 2 + 0] = slots[0];
+		spans[*count * 2 + 1] = slots[1];
+		(*count)++;
+		position = slots[1] + (slots[0] == slots[1]);
 	}
+
+	AllocateResize(slots, 0);
+	return spans;
 }
 
-uint64_t RandomU64() {
-	uint64_t result = rngState.s[1] * 5;
-	result = ((result << 7) | (result >> 57)) * 9;
+int ExternalRegexFindAll(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	uintptr_t count;
+	intptr_t *spans = RegexFindAll(regex, text, bytes, &count);
+	return RegexReturnSlices(context, returnValue, _index2, spans, count, 2);
+}
 
-	uint64_t t = rngState.s[1] << 17;
-	rngState.s[2] ^= rngState.s[0];
-	rngState.s[3] ^= rngState.s[1];
-	rngState.s[1] ^= rngState.s[2];
-	rngState.s[0] ^= rngState.s[3];
-	rngState.s[2] ^= t;
-	rngState.s[3] = (rngState.s[3] << 45) | (rngState.s[3] >> 19);
+int ExternalRegexSplit(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	uintptr_t count;
+	intptr_t *spans = RegexFindAll(regex, text, bytes, &count);
 
-	return result;
+	// Turn the matches into the pieces between them, in place. Empty matches don't split the string.
+	uintptr_t pieceCount = 0;
+	intptr_t pieceStart = 0;
+
+	for (uintptr_t i = 0; i < count; i++) {
+		intptr_t start = spans[i * 2], end = spans[i * 2 + 1];
+		if (start == end) continue;
+		spans[pieceCount * 2 + 0] = pieceStart;
+		spans[pieceCount * 2 + 1] = start;
+		pieceStart = end;
+		pieceCount++;
+	}
+
+	if (pieceCount == count) spans = (intptr_t *) AllocateResize(spans, (count + 1) * 2 * sizeof(intptr_t));
+	spans[pieceCount * 2 + 0] = pieceStart;
+	spans[pieceCount * 2 + 1] = bytes;
+	return RegexReturnSlices(context, returnValue, _index2, spans, pieceCount + 1, 2);
 }
 
-int ExternalRandomInt(ExecutionContext *context, Value *returnValue) {
-	if (context->c->stackPointer < 2) return -1;
-	int64_t min = context->c->stack[context->c->stackPointer - 1].i;
-	int64_t max = context->c->stack[context->c->stackPointer - 2].i;
-	if (max < min) { PrintError4(context, 0, "RandomInt() called with maximum limit (%ld) less than the minimum limit (%ld).\n", max, min); return 0; }
-	returnValue->i = (int64_t) (RandomU64() % (uint64_t) (max - min + 1)) + min;
-	context->c->stackPointer -= 2;
-	return EXTCALL_RETURN_UNMANAGED;
+void RegexAppend(char **output, size_t *outputBytes, size_t *outputAllocated, const char *text, size_t bytes) {
+	if (!bytes) return;
+
+	if (*outputBytes + bytes > *outputAllocated) {
+		*outputAllocated = (*outputBytes + bytes) * 2;
+		*output = (char *) AllocateResize(*output, *outputAllocated);
+	}
+
+	MemoryCopy(*output + *outputBytes, text, bytes);
+	*outputBytes += bytes;
 }
 
-int StringCompareRaw(const char *s1, size_t length1, const char *s2, size_t length2) {
-	if (s1 == s2 && length1 == length2) return 0;
+int ExternalRegexReplaceAll(ExecutionContext *context, Value *returnValue) {
+	STACK_READ_REGEX(regex, 1);
+	STACK_READ_STRING(text, bytes, 2);
+	STACK_READ_STRING(replacement, replacementBytes, 3);
 
-	while (length1 || length2) {
-		if (!length1) return -1;
-		if (!length2) return 1;
+	for (uintptr_t i = 0; i < replacementBytes; i++) {
+		if (replacement[i] != '$') continue;
+		char c = i + 1 < replacementBytes ? replacement[++i] : 0;
 
-		char c1 = *s1;
-		char c2 = *s2;
+		if (c != '$' && (c < '0' || c > '9' || (uint32_t) (c - '0') >= regex->groupCount)) {
+			PrintError4(context, 0, "The replacement string passed to RegexReplaceAll() has an invalid group reference. "
+					"Use $0 for the whole match, $1 to $9 for the groups in the pattern, and $$ for a dollar sign.\n");
+			return 0;
+		}
+	}
 
-		if (c1 != c2) {
-			return (int) c1 - (int) c2;
+	intptr_t *slots = (intptr_t *) AllocateResize(NULL, regex->groupCount * 2 * sizeof(intptr_t));
+	char *output = NULL;
+	size_t outputBytes = 0, outputAllocated = 0;
+	uintptr_t position = 0, copiedUpTo = 0;
+	bool matched = false;
+
+	while (position <= bytes && RegexSearch(regex, text, bytes, position, slots)) {
+		RegexAppend(&output, &outputBytes, &outputAllocated, text + copiedUpTo, slots[0] - copiedUpTo);
+
+		for (uintptr_t i = 0; i < replacementBytes; i++) {
+			if (replacement[i] != '$') {
+				uintptr_t end = i;
+				while (end < replacementBytes && replacement[end] != '$') end++;
+				RegexAppend(&output, &outputBytes, &outputAllocated, replacement + i, end - i);
+				i = end - 1;
+			} else if (replacement[++i] == '$') {
+				RegexAppend(&output, &outputBytes, &outputAllocated, "$", 1);
+			} else {
+				intptr_t *group = slots + (replacement[i] - '0') * 2;
+				if (group[0] == -1 || group[1] == -1) continue;
+				RegexAppend(&output, &outputBytes, &outputAllocated, text + group[0], group[1] - group[0]);
+			}
 		}
 
-		length1--;
-		length2--;
-		s1++;
-		s2++;
+		matched = true;
+		copiedUpTo = slots[1];
+		position = slots[1] + (slots[0] == slots[1]);
 	}
 
-	return 0;
+	RegexAppend(&output, &outputBytes, &outputAllocated, text + copiedUpTo, bytes - copiedUpTo);
+	AllocateResize(slots, 0);
+	context->c->stackPointer -= 3;
+
+	if (!matched || !outputBytes) {
+		// Strings are immutable, so if nothing was replaced the original string can be returned.
+		AllocateResize(output, 0);
+		returnValue->i = matched ? 0 : _index2;
+		return EXTCALL_RETURN_MANAGED;
+	}
+
+	RETURN_STRING_NO_COPY(output, outputBytes);
+	return EXTCALL_RETURN_MANAGED;
 }
 
 // --------------------------------- Platform layer.
@@ -9161,6 +14755,53 @@ int ExternalFileGetSize(ExecutionContext *context, Value *returnValue) {
 	}
 }
 
+int External_FileHashInternal(ExecutionContext *context, Value *returnValue) {
+	if (context->c->stackPointer < 2) return -1;
+	STACK_READ_STRING(entryText, entryBytes, 1);
+	if (context->c->stackIsManaged[context->c->stackPointer - 2]) return -1;
+	int64_t algorithm = context->c->stack[context->c->stackPointer - 2].i;
+	if (algorithm < HASH_CRC32 || algorithm > HASH_XXHASH64) return -1;
+	context->c->stackPointer -= 2;
+	if (!ActionBefore(context, ACTION_READ, "hash file", entryText, entryBytes, NULL, 0)) return 0;
+	returnValue->i = 0;
+	char *temporary = StringZeroTerminate(entryText, entryBytes);
+	if (!temporary) RETURN_ERROR(ENOMEM);
+	FILE *file = fopen(temporary, "rb");
+	free(temporary);
+	size_t bufferBytes = 1048576;
+	uint8_t *buffer = file ? (uint8_t *) malloc(bufferBytes) : NULL;
+	bool success = false;
+
+	if (buffer) {
+		// Read the file in chunks, so that it is never held in memory all at once.
+		HashState state;
+		HashStart(&state, algorithm);
+
+		while (true) {
+			size_t bytesRead = fread(buffer, 1, bufferBytes, file);
+			HashUpdate(&state, buffer, bytesRead);
+			if (bytesRead == bufferBytes) continue;
+			success = !ferror(file);
+			break;
+		}
+
+		returnValue->i = HashFinish(&state);
+	}
+
+	int error = errno;
+	free(buffer);
+	if (file) fclose(file);
+
+	if (success) {
+		return EXTCALL_RETURN_ERR_UNMANAGED;
+	} else {
+		if (file && !buffer) error = ENOMEM;
+		if (!error) error = EIO;
+		if (!ActionFailure(context, ACTION_READ, "hash file", ErrorStringFromErrno(error), entryText, entryBytes, NULL, 0)) return 0;
+		RETURN_ERROR(error);
+	}
+}
+
 int ExternalFileGetLastModificationTimeStamp(ExecutionContext *context, Value *returnValue) {
 	STACK_POP_STRING(entryText, entryBytes);
 	if (!ActionBefore(context, ACTION_PROPERTIES, "get file last modification time stamp", entryText, entryBytes, NULL, 0)) return 0;
@@ -9488,6 +15129,7 @@ int ExternalSystemExit(ExecutionContext *context, Value *returnValue) {
 	(void) returnValue;
 	if (context->c->stackPointer < 1) return -1;
 	int64_t i = context->c->stack[--context->c->stackPointer].i;
+	if (gcStats) HeapPrintStatistics(context);
 	exit(i);
 	return -1;
 }
@@ -9561,7 +15203,7 @@ void PrintREPLResult(ExecutionContext *context, Node *type, Value value) {
 
 			for (uintptr_t i = 0; i < entry->length; i++) {
 				if (i) printf(", ");
-				PrintREPLResult(context, type->firstChild, entry->list[i]);
+				PrintREPLResult(context, type->firstChild, ListGet(entry, i));
 			}
 
 			printf(" ]");
@@ -9634,6 +15276,7 @@ void *AllocateResize(void *old, size_t bytes) {
 	}
 
 	void *p = realloc(old, bytes);
+	allocatedBytes += bytes;
 
 	if (!p && bytes) {
 		fprintf(stderr, "Internal error: not enough memory to run the script.\n");
@@ -9656,24 +15299,27 @@ int MemoryCompare(const void *a, const void *b, size_t bytes) {
 	return memcmp(a, b, bytes);
 }
 
+const void *MemoryFindByte(const void *a, uint8_t byte, size_t bytes) {
+	return memchr(a, byte, bytes);
+}
+
 void MemoryCopy(void *a, const void *b, size_t bytes) {
 	memcpy(a, b, bytes);
 }
 
-size_t PrintIntegerToBuffer(char *buffer, size_t bufferBytes, int64_t i) {
-#if defined(__APPLE__) || defined(_WIN32)
-	snprintf(buffer, bufferBytes, "%lld", i);
-#else
-	snprintf(buffer, bufferBytes, "%ld", i);
-#endif
-	return strlen(buffer);
+void MemoryMove(void *a, const void *b, size_t bytes) {
+	memmove(a, b, bytes);
 }
 
-size_t PrintFloatToBuffer(char *buffer, size_t bufferBytes, double f) {
-	snprintf(buffer, bufferBytes, "%f", f);
+size_t PrintFloatToBufferWithPrecision(char *buffer, size_t bufferBytes, double f, int significantDigits) {
+	snprintf(buffer, bufferBytes, "%.*g", significantDigits, f);
 	return strlen(buffer);
 }
 
+double StringToDouble(const char *text) {
+	return strtod(text, NULL);
+}
+
 void PrintType(Node *type, FILE *file) {
 	if (type->type == T_INT) {
 		fprintf(file, "int");
@@ -9691,6 +15337,8 @@ void PrintType(Node *type, FILE *file) {
 		fprintf(file, "void");
 	} else if (type->type == T_ANYTYPE) {
 		fprintf(file, "anytype");
+	} else if (type->type == T_STRBUILDER) {
+		fprintf(file, "strbuilder");
 	} else if (type->type == T_LIST) {
 		PrintType(type->firstChild, file);
 		fprintf(file, "[]");
@@ -9823,6 +15471,332 @@ bool IsColoredOutputEnabled() {
 	return coloredOutput;
 }
 
+uint64_t TimeGetMicroseconds() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) counter.QuadPart * 1000000 / (uint64_t) frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#endif
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+
+__attribute__((target("pclmul,sse2")))
+size_t CRCFoldWithPCLMUL(const uint8_t *data, size_t bytes, uint64_t crc, const uint64_t *constants, uint8_t *remainder) {
+	const uint8_t *end = data + (bytes & ~(size_t) 63);
+	__m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (data + 0)), _mm_cvtsi64_si128(crc));
+	__m128i x1 = _mm_loadu_si128((const __m128i *) (data + 16));
+	__m128i x2 = _mm_loadu_si128((const __m128i *) (data + 32));
+	__m128i x3 = _mm_loadu_si128((const __m128i *) (data + 48));
+	__m128i k = _mm_set_epi64x(constants[1], constants[0]);
+
+#define CRC_FOLD(x, k) _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11))
+	for (data += 64; data < end; data += 64) {
+		x0 = _mm_xor_si128(CRC_FOLD(x0, k), _mm_loadu_si128((const __m128i *) (data + 0)));
+		x1 = _mm_xor_si128(CRC_FOLD(x1, k), _mm_loadu_si128((const __m128i *) (data + 16)));
+		x2 = _mm_xor_si128(CRC_FOLD(x2, k), _mm_loadu_si128((const __m128i *) (data + 32)));
+		x3 = _mm_xor_si128(CRC_FOLD(x3, k), _mm_loadu_si128((const __m128i *) (data + 48)));
+	}
+
+	k = _mm_set_epi64x(constants[3], constants[2]);
+	x1 = _mm_xor_si128(CRC_FOLD(x0, k), x1);
+	x2 = _mm_xor_si128(CRC_FOLD(x1, k), x2);
+	x3 = _mm_xor_si128(CRC_FOLD(x2, k), x3);
+#undef CRC_FOLD
+
+	_mm_storeu_si128((__m128i *) remainder, x3);
+	return bytes & ~(size_t) 63;
+}
+#endif
+
+size_t CRCFoldWithCarrylessMultiply(const void *data, size_t bytes, uint64_t crc, const uint64_t *constants, uint8_t *remainder) {
+	if (bytes < 64) return 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (__builtin_cpu_supports("pclmul")) return CRCFoldWithPCLMUL((const uint8_t *) data, bytes, crc, constants, remainder);
+#endif
+	(void) data;
+	(void) crc;
+	(void) constants;
+	(void) remainder;
+	return 0;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("ssse3")))
+bool UTF8ValidateWithSSSE3(const uint8_t *text, size_t bytes) {
+	// This is the lookup algorithm from Keiser and Lemire, "Validating UTF-8 in less than one instruction per byte".
+	// Each byte and the byte before it are classified by looking up three of their nibbles in tables, where each bit is a kind of error.
+	// A bit that is set in all three is an error, except 0x80, which marks two continuation bytes in a row; 
+	// this must happen exactly for the third and fourth bytes of a sequence.
+
+	const __m128i table1 = _mm_setr_epi8(0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 
+			0x80, 0x80, 0x80, 0x80, 0x21, 0x01, 0x15, 0x49); // High nibble of the previous byte.
+	const __m128i table2 = _mm_setr_epi8(0xE7, 0xA3, 0x83, 0x83, 0x8B, 0xCB, 0xCB, 0xCB, 
+			0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xDB, 0xCB, 0xCB); // Low nibble of the previous byte.
+	const __m128i table3 = _mm_setr_epi8(0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 
+			0xE6, 0xAE, 0xBA, 0xBA, 0x01, 0x01, 0x01, 0x01); // High nibble of the byte.
+	const __m128i lowNibbles = _mm_set1_epi8(0x0F);
+	__m128i previous = _mm_setzero_si128(), error = _mm_setzero_si128();
+
+	for (size_t i = 0; i < bytes; i += 16) {
+		__m128i input = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i previous1 = _mm_alignr_epi8(input, previous, 15);
+		__m128i previous2 = _mm_alignr_epi8(input, previous, 14);
+		__m128i previous3 = _mm_alignr_epi8(input, previous, 13);
+		__m128i byte1High = _mm_shuffle_epi8(table1, _mm_and_si128(_mm_srli_epi16(previous1, 4), lowNibbles));
+		__m128i byte1Low = _mm_shuffle_epi8(table2, _mm_and_si128(previous1, lowNibbles));
+		__m128i byte2High = _mm_shuffle_epi8(table3, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibbles));
+		__m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+		__m128i isThird = _mm_subs_epu8(previous2, _mm_set1_epi8(0xE0 - 0x80));
+		__m128i isFourth = _mm_subs_epu8(previous3, _mm_set1_epi8(0xF0 - 0x80));
+		__m128i mustBeContinuation = _mm_and_si128(_mm_or_si128(isThird, isFourth), _mm_set1_epi8(0x80));
+		error = _mm_or_si128(error, _mm_xor_si128(mustBeContinuation, special));
+		previous = input;
+
+		if ((i & 1023) == 1008 && _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+			return false;
+		}
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
+
+bool UTF8ValidateBlocks(const void *text, size_t bytes, size_t *checkedBytes) {
+	*checkedBytes = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (bytes >= 16 && __builtin_cpu_supports("ssse3")) {
+		*checkedBytes = bytes & ~(size_t) 15;
+		return UTF8ValidateWithSSSE3((const uint8_t *) text, *checkedBytes);
+	}
+#endif
+	(void) text;
+	return true;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+// These process the items of a list in blocks of 16, as 4 vectors of 4 items each.
+
+__attribute__((target("avx2")))
+uintptr_t ListSkipIntsWithAVX2(const Value *items, uintptr_t count, int64_t x, bool last) {
+	const __m256i target = _mm256_set1_epi64x(x);
+	uintptr_t skipped = 0;
+
+	for (; skipped + 16 <= count; skipped += 16) {
+		const __m256i *block = (const __m256i *) (items + (last ? count - skipped - 16 : skipped));
+		__m256i match = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256(block + 0), target), _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 1), target)),
+				_mm256_or_si256(_mm256_cmpeq_epi64(_mm256_loadu_si256(block + 2), target), _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 3), target)));
+		if (!_mm256_testz_si256(match, match)) break;
+	}
+
+	return skipped;
+}
+
+__attribute__((target("avx2")))
+uintptr_t ListCountIntsWithAVX2(const Value *items, uintptr_t count, int64_t x) {
+	// Each match subtracts -1 from its lane.
+	const __m256i target = _mm256_set1_epi64x(x);
+	__m256i total0 = _mm256_setzero_si256(), total1 = _mm256_setzero_si256();
+	__m256i total2 = _mm256_setzero_si256(), total3 = _mm256_setzero_si256();
+
+	for (uintptr_t i = 0; i < count; i += 16) {
+		const __m256i *block = (const __m256i *) (items + i);
+		total0 = _mm256_sub_epi64(total0, _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 0), target));
+		total1 = _mm256_sub_epi64(total1, _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 1), target));
+		total2 = _mm256_sub_epi64(total2, _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 2), target));
+		total3 = _mm256_sub_epi64(total3, _mm256_cmpeq_epi64(_mm256_loadu_si256(block + 3), target));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(_mm256_add_epi64(total0, total1), _mm256_add_epi64(total2, total3)));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+uint64_t ListSumIntsWithAVX2(const Value *items, uintptr_t count) {
+	__m256i total0 = _mm256_setzero_si256(), total1 = _mm256_setzero_si256();
+	__m256i total2 = _mm256_setzero_si256(), total3 = _mm256_setzero_si256();
+
+	for (uintptr_t i = 0; i < count; i += 16) {
+		const __m256i *block = (const __m256i *) (items + i);
+		total0 = _mm256_add_epi64(total0, _mm256_loadu_si256(block + 0));
+		total1 = _mm256_add_epi64(total1, _mm256_loadu_si256(block + 1));
+		total2 = _mm256_add_epi64(total2, _mm256_loadu_si256(block + 2));
+		total3 = _mm256_add_epi64(total3, _mm256_loadu_si256(block + 3));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(_mm256_add_epi64(total0, total1), _mm256_add_epi64(total2, total3)));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+void ListSumFloatsWithAVX2(const Value *items, uintptr_t count, double *lanes) {
+	__m256d total0 = _mm256_loadu_pd(lanes + 0), total1 = _mm256_loadu_pd(lanes + 4);
+	__m256d total2 = _mm256_loadu_pd(lanes + 8), total3 = _mm256_loadu_pd(lanes + 12);
+
+	for (uintptr_t i = 0; i < count; i += 16) {
+		const double *block = &items[i].f;
+		total0 = _mm256_add_pd(total0, _mm256_loadu_pd(block + 0));
+		total1 = _mm256_add_pd(total1, _mm256_loadu_pd(block + 4));
+		total2 = _mm256_add_pd(total2, _mm256_loadu_pd(block + 8));
+		total3 = _mm256_add_pd(total3, _mm256_loadu_pd(block + 12));
+	}
+
+	_mm256_storeu_pd(lanes + 0, total0);
+	_mm256_storeu_pd(lanes + 4, total1);
+	_mm256_storeu_pd(lanes + 8, total2);
+	_mm256_storeu_pd(lanes + 12, total3);
+}
+
+__attribute__((target("avx2")))
+int64_t ListMinMaxIntsWithAVX2(const Value *items, uintptr_t count, bool max, int64_t result) {
+	__m256i best0 = _mm256_set1_epi64x(result), best1 = best0, best2 = best0, best3 = best0;
+
+#define LIST_MIN_MAX_INTS(best, x) \
+	best = _mm256_blendv_epi8(best, x, max ? _mm256_cmpgt_epi64(x, best) : _mm256_cmpgt_epi64(best, x))
+	for (uintptr_t i = 0; i < count; i += 16) {
+		const __m256i *block = (const __m256i *) (items + i);
+		__m256i x0 = _mm256_loadu_si256(block + 0), x1 = _mm256_loadu_si256(block + 1);
+		__m256i x2 = _mm256_loadu_si256(block + 2), x3 = _mm256_loadu_si256(block + 3);
+		LIST_MIN_MAX_INTS(best0, x0);
+		LIST_MIN_MAX_INTS(best1, x1);
+		LIST_MIN_MAX_INTS(best2, x2);
+		LIST_MIN_MAX_INTS(best3, x3);
+	}
+
+	LIST_MIN_MAX_INTS(best0, best1);
+	LIST_MIN_MAX_INTS(best2, best3);
+	LIST_MIN_MAX_INTS(best0, best2);
+#undef LIST_MIN_MAX_INTS
+
+	int64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, best0);
+	for (uintptr_t i = 0; i < 4; i++) if (max ? lanes[i] > result : lanes[i] < result) result = lanes[i];
+	return result;
+}
+
+__attribute__((target("avx2")))
+double ListMinMaxFloatsWithAVX2(const Value *items, uintptr_t count, bool max, double result) {
+	// _mm256_min_pd(x, best) gives best unless x < best, including when either is NaN, so NaNs are tracked separately;
+	// if there are any, the result is the first of them, as the scalar loop gives.
+	__m256d best0 = _mm256_set1_pd(result), best1 = best0, best2 = best0, best3 = best0;
+	__m256d nans = _mm256_setzero_pd();
+
+#define LIST_MIN_MAX_FLOATS(best, x) best = max ? _mm256_max_pd(x, best) : _mm256_min_pd(x, best)
+#define LIST_MIN_MAX_FLOATS_NAN(best, x) do { __m256d y = x; nans = _mm256_or_pd(nans, _mm256_cmp_pd(y, y, _CMP_UNORD_Q)); \
+		LIST_MIN_MAX_FLOATS(best, y); } while (0)
+	for (uintptr_t i = 0; i < count; i += 16) {
+		const double *block = &items[i].f;
+		LIST_MIN_MAX_FLOATS_NAN(best0, _mm256_loadu_pd(block + 0));
+		LIST_MIN_MAX_FLOATS_NAN(best1, _mm256_loadu_pd(block + 4));
+		LIST_MIN_MAX_FLOATS_NAN(best2, _mm256_loadu_pd(block + 8));
+		LIST_MIN_MAX_FLOATS_NAN(best3, _mm256_loadu_pd(block + 12));
+	}
+
+	LIST_MIN_MAX_FLOATS(best0, best1);
+	LIST_MIN_MAX_FLOATS(best2, best3);
+	LIST_MIN_MAX_FLOATS(best0, best2);
+#undef LIST_MIN_MAX_FLOATS_NAN
+#undef LIST_MIN_MAX_FLOATS
+
+	if (result != result) return result;
+
+	if (_mm256_movemask_pd(nans)) {
+		for (uintptr_t i = 0; i < count; i++) if (items[i].f != items[i].f) return items[i].f;
+	}
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, best0);
+	for (uintptr_t i = 0; i < 4; i++) if (max ? lanes[i] > result : lanes[i] < result) result = lanes[i];
+	return result;
+}
+#endif
+
+uintptr_t ListSkipIntBlocks(const Value *items, uintptr_t count, int64_t x, bool last) {
+	// Returns how many items at the start of the list, or the end if last is set, are not equal to x. 
+	// This is a multiple of the block size, so the caller must check the items after these.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) return ListSkipIntsWithAVX2(items, count, x, last);
+#endif
+	(void) items;
+	(void) count;
+	(void) x;
+	(void) last;
+	return 0;
+}
+
+uintptr_t ListCountIntBlocks(const Value *items, uintptr_t count, int64_t x, uintptr_t *checked) {
+	*checked = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) {
+		*checked = count & ~(uintptr_t) 15;
+		return ListCountIntsWithAVX2(items, *checked, x);
+	}
+#endif
+	(void) items;
+	(void) x;
+	return 0;
+}
+
+uint64_t ListSumIntBlocks(const Value *items, uintptr_t count, uintptr_t *checked) {
+	*checked = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) {
+		*checked = count & ~(uintptr_t) 15;
+		return ListSumIntsWithAVX2(items, *checked);
+	}
+#endif
+	(void) items;
+	return 0;
+}
+
+void ListSumFloatBlocks(const Value *items, uintptr_t count, double *lanes, uintptr_t *checked) {
+	// Adds item i to lanes[i % 16].
+	*checked = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) {
+		*checked = count & ~(uintptr_t) 15;
+		ListSumFloatsWithAVX2(items, *checked, lanes);
+	}
+#endif
+	(void) items;
+	(void) lanes;
+}
+
+int64_t ListMinMaxIntBlocks(const Value *items, uintptr_t count, bool max, int64_t result, uintptr_t *checked) {
+	*checked = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) {
+		*checked = count & ~(uintptr_t) 15;
+		return ListMinMaxIntsWithAVX2(items, *checked, max, result);
+	}
+#endif
+	(void) items;
+	(void) max;
+	return result;
+}
+
+double ListMinMaxFloatBlocks(const Value *items, uintptr_t count, bool max, double result, uintptr_t *checked) {
+	*checked = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if (count >= 16 && __builtin_cpu_supports("avx2")) {
+		*checked = count & ~(uintptr_t) 15;
+		return ListMinMaxFloatsWithAVX2(items, *checked, max, result);
+	}
+#endif
+	(void) items;
+	(void) max;
+	return result;
+}
+
 void *LibraryLoad(const char *name) {
 	char *name2 = (char *) malloc(strlen(name) + strlen(engineDirectory) + 20);
 	void *result = NULL;
@@ -10062,6 +16036,23 @@ int main(int argc, char **argv) {
 			evaluateMode = true;
 		} else if (0 == strcmp(argv[i], "--do") || 0 == strcmp(argv[i], "-d")) {
 			doMode = true;
+		} else if (0 == strcmp(argv[i], "--gc-stats")) {
+			gcStats = true;
+		} else if (0 == memcmp(argv[i], "--heap-limit=", 13)) {
+			char *end;
+			heapLimitBytes = strtoull(argv[i] + 13, &end, 10);
+			int shift = 0;
+			if (*end == 'k' || *end == 'K') shift = 10, end++;
+			else if (*end == 'm' || *end == 'M') shift = 20, end++;
+			else if (*end == 'g' || *end == 'G') shift = 30, end++;
+
+			// strtoull gives UINT64_MAX if the number is out of range.
+			if (*end || !heapLimitBytes || heapLimitBytes == UINT64_MAX || heapLimitBytes > (UINT64_MAX >> shift)) {
+				fprintf(stderr, "Invalid heap limit '%s'. Give the number of bytes, optionally followed by K, M or G.\n", argv[i] + 13);
+				return 1;
+			}
+
+			heapLimitBytes <<= shift;
 		} else if (0 == strcmp(argv[i], "--no-base-module")) {
 			noBaseModule = true;
 		} else if (0 == strcmp(argv[i], "--output-overview")) {